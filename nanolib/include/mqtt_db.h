@@ -100,6 +100,13 @@ void free_node(struct db_node *node);
 /* Parsing topic from char* with '/' to char** */
 char **topic_parse(char *topic);
 
+/* Same, for len bytes of topic that need not be NUL terminated */
+char **topic_parse_len(const char *topic, size_t len);
+
+/* Same, with the offsets of the nsep '/' in topic already known */
+char **topic_split(const char *topic, size_t len, const uint16_t *sep,
+    size_t nsep);
+
 void free_topic_queue(char **topic_queue);
 
 void free_clients(struct clients *for_free);
@@ -30,6 +30,13 @@ void create_db_tree(struct db_tree **db)
 
 	struct db_node *node = new_db_node("\0");
 	(*db)->root = node;
+	/*
+	 ** $SYS and $share topics have no "" level (see topic_parse) and
+	 ** hang next to the root instead of below it.  Their first levels
+	 ** are made here, and never deleted, so a search always finds one.
+	 */
+	node->next = new_db_node("$SYS");
+	node->next->next = new_db_node("$share");
 	return;
 }
 
@@ -94,6 +101,8 @@ static void *iterate(struct db_node *root, void *(*fun_cb)(struct db_node *node)
 	struct retain_msg_node *res = NULL;
 	struct retain_msg_node *ret = NULL;
 	ret = (struct retain_msg_node*)zmalloc(sizeof(struct retain_msg_node));
+	ret->down = NULL;
+	ret->ret_msg = NULL;
 	res = ret;
 	/******************************************************/
 
@@ -128,6 +137,16 @@ static void *iterate(struct db_node *root, void *(*fun_cb)(struct db_node *node)
 					tmps_end->next = NULL;
 				}
 
+				/*
+				 ** A retained search takes in the node it
+				 ** starts from and what is below it, not the
+				 ** nodes next to it: for "#" those are $SYS
+				 ** and $share (MQTT-4.7.2-1).
+				 */
+				if (WORK == SEARCH_RET && tmp == root) {
+					break;
+				}
+
 				if (tmp) {
 					tmp = tmp->next;
 				}
@@ -194,7 +213,7 @@ bool check_hashtag(char *topic_data)
 	if (topic_data == NULL) {
 		return false;
 	}
-	return !strcmp(topic_data, "#");
+	return topic_data[0] == '#' && topic_data[1] == '\0';
 }
 
 /*
@@ -206,7 +225,7 @@ bool check_plus(char *topic_data)
 	if (topic_data == NULL) {
 		return false;
 	}
-	return !strcmp(topic_data, "+");
+	return topic_data[0] == '+' && topic_data[1] == '\0';
 }
 
 struct db_node *new_db_node(char *topic)
@@ -385,12 +404,18 @@ void del_node(struct db_node *node)
 {
 	assert(node);
 	log_info("DEL_NODE_START");
-	if (node->sub_client || node->down || node->hashtag || node->retain) {
+	if (node->sub_client || node->down || node->hashtag || node->retain ||
+	    node->up == NULL) {
 		log("Node can't be deleted!");
 		return;
 	}
 
-	if (node->next) {
+	if (node->next && node->up->next == node) {
+		log("DELETE # NEXT TO THE ROOT!");
+		node->up->hashtag = false;
+		node->up->next = node->next;
+		delete_db_node(node);
+	} else if (node->next) {
 		log("DELETE NODE AND NEXT!");
 		struct db_node *first = node->up->down;
 		if (first == node) {
@@ -1100,14 +1125,24 @@ char **topic_parse(char *topic)
 {
 	assert(topic != NULL);
 
+	return topic_parse_len(topic, strlen(topic));
+}
+
+// As topic_parse, for a topic of len bytes that need not be NUL terminated,
+// such as one still in the packet it came in.
+char **topic_parse_len(const char *topic, size_t tlen)
+{
+	assert(topic != NULL || tlen == 0);
+
 	int row = 1;
 	int len = 2;
 	char **topic_queue = NULL;
-	char *before_pos = topic;
-	char *pos = NULL;
+	const char *before_pos = topic;
+	const char *end = topic + tlen;
+	const char *pos = NULL;
 
-	if ((strncmp("$share", before_pos, 6) != 0 && strncmp("$SYS", before_pos, 4)
-				!= 0)) {
+	if (!((tlen >= 6 && strncmp("$share", before_pos, 6) == 0) ||
+	      (tlen >= 4 && strncmp("$SYS", before_pos, 4) == 0))) {
 		topic_queue = (char**)zmalloc(sizeof(char*)*row);
 		topic_queue[row-1] = (char*)zmalloc(sizeof(char)*len);
 		memcpy(topic_queue[row-1], "\0", (len));
@@ -1117,7 +1152,7 @@ char **topic_parse(char *topic)
 
 	}
 
-	while ((pos = strchr(before_pos, '/')) != NULL) {
+	while ((pos = memchr(before_pos, '/', end - before_pos)) != NULL) {
 
 		if (topic_queue != NULL) {
 			topic_queue = (char**)zrealloc(topic_queue, sizeof(char*)*(++row));
@@ -1133,7 +1168,7 @@ char **topic_parse(char *topic)
 		before_pos = pos+1;
 	}
 
-	len = strlen(before_pos);
+	len = end - before_pos;
 
 	if (topic_queue != NULL) {
 		topic_queue = (char**)zrealloc(topic_queue, sizeof(char*)*(++row));
@@ -1151,6 +1186,39 @@ char **topic_parse(char *topic)
 	return topic_queue;
 }
 
+// As topic_parse_len, when the offsets of the nsep '/' in topic are
+// already known: one allocation for the queue, none to find the levels.
+char **topic_split(const char *topic, size_t tlen, const uint16_t *sep,
+    size_t nsep)
+{
+	assert(topic != NULL || tlen == 0);
+
+	size_t row = 0;
+	size_t start = 0;
+	size_t end, i;
+	bool root = !((tlen >= 6 && strncmp("$share", topic, 6) == 0) ||
+	              (tlen >= 4 && strncmp("$SYS", topic, 4) == 0));
+	char **topic_queue = (char**)zmalloc(sizeof(char*)*(root+nsep+2));
+
+	if (root) {
+		topic_queue[row] = (char*)zmalloc(sizeof(char)*2);
+		memcpy(topic_queue[row], "\0", 2);
+		row++;
+	}
+
+	for (i = 0; i <= nsep; i++) {
+		end = i < nsep ? sep[i] : tlen;
+		topic_queue[row] = (char*)zmalloc(sizeof(char)*(end-start+1));
+		memcpy(topic_queue[row], topic+start, end-start);
+		topic_queue[row][end-start] = '\0';
+		row++;
+		start = end+1;
+	}
+	topic_queue[row] = NULL;
+
+	return topic_queue;
+}
+
 void free_topic_queue(char **topic_queue)
 {
 	char *t = NULL;
@@ -8,6 +8,7 @@
 //
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <nng.h>
 #include <mqtt_db.h>
@@ -15,11 +16,16 @@
 #include <zmalloc.h>
 #include <protocol/mqtt/nano_tcp.h>
 #include <protocol/mqtt/mqtt_parser.h>
+#include <nng/supplemental/util/metrics.h>
+#include <nng/supplemental/util/probe.h>
 
 #include "include/nanomq.h"
 #include "include/pub_handler.h"
 #include "include/sub_handler.h"
 #include "include/unsub_handler.h"
+#include "include/metrics_server.h"
+#include "include/embed.h"
+#include "include/sys_topics.h"
 
 // Parallel is the maximum number of outstanding requests we can handle.
 // This is *NOT* the number of threads in use, but instead represents
@@ -32,6 +38,40 @@
 #define PARALLEL 8
 #endif
 
+// Admission control for reconnect storms, see NANO_OPT_CONN_RATE and
+// NANO_OPT_NEGO_MAX.  New connections per second per listener (0 means
+// unlimited) and how many may be negotiating CONNECT at the same time.
+#ifndef CONN_RATE
+#define CONN_RATE 0
+#endif
+#ifndef NEGO_MAX
+#define NEGO_MAX 1024
+#endif
+
+// Per subscriber send queues, see NANO_OPT_SQ_*: limits in messages and
+// bytes, what to do with QoS 0 messages when full (NANO_SQ_*) and, for
+// NANO_SQ_DISCONNECT, how long (ms) a subscriber may stay that far behind.
+#ifndef SQ_MAX_MSGS
+#define SQ_MAX_MSGS 1024
+#endif
+#ifndef SQ_MAX_BYTES
+#define SQ_MAX_BYTES (4 * 1024 * 1024)
+#endif
+#ifndef SQ_POLICY
+#define SQ_POLICY NANO_SQ_DROP_OLDEST
+#endif
+#ifndef SQ_GRACE
+#define SQ_GRACE 10000
+#endif
+
+// Outbound QoS 1/2, see NANO_OPT_INFLIGHT and NANO_OPT_RETRY_TIME.
+#ifndef INFLIGHT
+#define INFLIGHT 32
+#endif
+#ifndef RETRY_TIME
+#define RETRY_TIME 10000
+#endif
+
 // The server keeps a list of work items, sorted by expiration time,
 // so that we can use this to set the timeout to the correct value for
 // use in poll.
@@ -43,6 +83,69 @@ fatal(const char *func, int rv)
 	exit(1);
 }
 
+// Send the next message of a PUBLISH fan-out.  Subscribers that follow in
+// pipe_info and would get the very same bytes (same packet type, and the
+// same QoS once capped by the PUBLISH's own) are served by the same send,
+// one multicast instead of one ctx send each.
+static void
+pub_send(emq_work *work, nng_msg *smsg)
+{
+	struct pipe_content *pipe_ct = work->pipe_ct;
+	struct pipe_info     p_info  = pipe_ct->pipe_info[pipe_ct->current_index];
+	struct pipe_info *   next;
+	uint32_t             n = 0;
+	uint8_t              pub_qos, qos;
+
+	pipe_ct->encode_msg(smsg, p_info.work, p_info.cmd, p_info.qos, 0);
+	NANO_PROBE3(encode, p_info.pipe, *(uint8_t *) nng_msg_header(smsg),
+	    nng_msg_header_len(smsg) + nng_msg_len(smsg));
+	// A PUBLISH is timed to the subscriber, see tcptran_pipe_send_cb().
+	nng_msg_set_timestamp(
+	    smsg, p_info.cmd == PUBLISH ? p_info.work->rxtime : 0);
+	nng_aio_set_msg(work->aio, smsg);
+	pipe_ct->current_index++;
+
+	if (p_info.pipe != 0 /*&& p_info.pipe != work->pid.id*/) {
+		if (work->pipes_cap < pipe_ct->total) {
+			nng_free(work->pipes, sizeof(uint32_t) * work->pipes_cap);
+			if ((work->pipes = nng_alloc(
+			         sizeof(uint32_t) * pipe_ct->total)) == NULL) {
+				fatal("nng_alloc", NNG_ENOMEM);
+			}
+			work->pipes_cap = pipe_ct->total;
+		}
+		work->pipes[n++] = p_info.pipe;
+		// The QoS p_info was encoded at
+		pub_qos = p_info.work->pub_packet->fixed_header.qos;
+		qos     = p_info.qos < pub_qos ? p_info.qos : pub_qos;
+		while ((p_info.cmd == PUBLISH) &&
+		    (pipe_ct->current_index < pipe_ct->total)) {
+			next = &pipe_ct->pipe_info[pipe_ct->current_index];
+			if ((next->pipe == 0) || (next->cmd != p_info.cmd) ||
+			    (next->work != p_info.work) ||
+			    ((next->qos < pub_qos ? next->qos : pub_qos) != qos)) {
+				break;
+			}
+			work->pipes[n++] = next->pipe;
+			pipe_ct->current_index++;
+		}
+		if (n == 1) {
+			nng_aio_set_pipeline(work->aio, p_info.pipe);
+		} else {
+			nng_aio_set_pipes(work->aio, work->pipes, n);
+		}
+	}
+
+	if (pipe_ct->total <= pipe_ct->current_index) {
+		free_pub_packet(work->pub_packet);
+		free_pipes_info(pipe_ct->pipe_info);
+		init_pipe_content(pipe_ct);
+	}
+
+	work->state = SEND;
+	nng_ctx_send(work->ctx, work->aio);
+}
+
 void
 server_cb(void *arg)
 {
@@ -55,8 +158,7 @@ server_cb(void *arg)
 	reason_code reason;
 	uint8_t     buf[2];
 
-	struct pipe_info p_info;
-
+	NANO_PROBE3(work, work->ctx.id, work->state, nng_aio_result(work->aio));
 	switch (work->state) {
 		case INIT:
 			debug_msg("INIT ^^^^^^^^^^^^^^^^^^^^^ \n");
@@ -100,6 +202,7 @@ server_cb(void *arg)
 							}
 						}
 						if (cli) {
+							nano_metric_add(NANO_METRIC_SUBSCRIPTIONS, -1);
 							del_node(tan.node);
 							debug_msg("destroy ctx: [%p] clientid: [%s]", cli->ctxt, cli->id);
 							// TODO free client_ctx rather than work->sub_ctx / pub_pkt?
@@ -126,8 +229,9 @@ server_cb(void *arg)
 			work->state = WAIT;
 			debug_msg("RECV ********************* msg: %s %x******************************************\n",
 			          (char *) nng_msg_body(work->msg), nng_msg_cmd_type(work->msg));
-			nng_sleep_aio(200, work->aio);
-			break;
+			// The message stays on the aio for WAIT to take it
+			// from; there is nothing to wait for, so go straight on.
+			// FALLTHROUGH
 		case WAIT:
 			debug_msg("WAIT ^^^^^^^^^^^^^^^^^^^^^ %d ^^^^", work->ctx.id);
 			// We could add more data to the message here.
@@ -165,6 +269,10 @@ server_cb(void *arg)
 				if (work->sub_pkt == NULL) {
 					debug_msg("ERROR: nng_alloc");
 				}
+				// destroy_sub_ctx() needs these if decoding fails
+				cli_ctx->pid     = work->pid;
+				cli_ctx->cparam  = work->cparam;
+				cli_ctx->sub_pkt = work->sub_pkt;
 				if ((reason = decode_sub_message(work))          != SUCCESS ||
 				    (reason = sub_ctx_handle(work, cli_ctx))     != SUCCESS ||
 				    (reason = encode_suback_message(smsg, work)) != SUCCESS) {
@@ -195,6 +303,9 @@ server_cb(void *arg)
 						*((uint8_t *) nng_msg_body(smsg)),
 						*((uint8_t *) nng_msg_body(smsg) + 1));
 				}
+				NANO_PROBE3(encode, nng_msg_get_pipe(work->msg).id,
+				    *(uint8_t *) nng_msg_header(smsg),
+				    nng_msg_header_len(smsg) + nng_msg_len(smsg));
 				nng_msg_free(work->msg);
 
 				work->msg = smsg;
@@ -236,6 +347,9 @@ server_cb(void *arg)
 				}
 				// free unsub_pkt
 				destroy_unsub_ctx(work->unsub_pkt);
+				NANO_PROBE3(encode, nng_msg_get_pipe(work->msg).id,
+				    *(uint8_t *) nng_msg_header(smsg),
+				    nng_msg_header_len(smsg) + nng_msg_len(smsg));
 				nng_msg_free(work->msg);
 
 				work->msg = smsg;
@@ -259,32 +373,14 @@ server_cb(void *arg)
 //				nng_mtx_lock(work->mutex);
 				work->pid = nng_msg_get_pipe(work->msg);
 				handle_pub(work, work->pipe_ct);
-				nng_msg_free(work->msg);
 //				nng_mtx_unlock(work->mutex);
 
-				if (work->pipe_ct->total > 0) {
-					p_info = work->pipe_ct->pipe_info[work->pipe_ct->current_index];
+				nng_msg_free(work->msg);
+				work->msg = NULL;
 
+				if (work->pipe_ct->total > 0) {
 					if (smsg == NULL) nng_msg_alloc(&smsg, 0);
-
-					work->pipe_ct->encode_msg(smsg, p_info.work, p_info.cmd, p_info.qos, 0);
-					work->msg = smsg;
-					nng_aio_set_msg(work->aio, work->msg);
-					work->msg = NULL;
-
-					if (p_info.pipe != 0 /*&& p_info.pipe != work->pid.id*/) {
-						nng_aio_set_pipeline(work->aio, p_info.pipe);
-					}
-
-					work->pipe_ct->current_index++;
-					if (work->pipe_ct->total <= work->pipe_ct->current_index) {
-						free_pub_packet(work->pub_packet);
-						free_pipes_info(work->pipe_ct->pipe_info);
-						init_pipe_content(work->pipe_ct);
-					}
-
-					work->state = SEND;
-					nng_ctx_send(work->ctx, work->aio);
+					pub_send(work, smsg);
 				} else {
 					free_pub_packet(work->pub_packet);
 					free_pipes_info(work->pipe_ct->pipe_info);
@@ -319,29 +415,8 @@ server_cb(void *arg)
 			}
 
 			if (work->pipe_ct->total > work->pipe_ct->current_index) {
-				p_info = work->pipe_ct->pipe_info[work->pipe_ct->current_index];
-
 				if (smsg == NULL) nng_msg_alloc(&smsg, 0);
-
-				work->pipe_ct->encode_msg(smsg, p_info.work, p_info.cmd, p_info.qos, 0);
-				work->msg = smsg;
-				nng_aio_set_msg(work->aio, work->msg);
-				work->msg = NULL;
-
-				if (p_info.pipe != 0 /*&& p_info.pipe != work->pid.id*/) {
-					nng_aio_set_pipeline(work->aio, p_info.pipe);
-				}
-
-				work->pipe_ct->current_index++;
-				if (work->pipe_ct->total == work->pipe_ct->current_index) {
-					free_pub_packet(work->pub_packet);
-					free_pipes_info(work->pipe_ct->pipe_info);
-					init_pipe_content(work->pipe_ct);
-				}
-
-				work->state = SEND;
-
-				nng_ctx_send(work->ctx, work->aio);
+				pub_send(work, smsg);
 			} else {
 				work->msg   = NULL;
 				work->state = RECV;
@@ -376,17 +451,25 @@ alloc_work(nng_socket sock)
 	}
 	w->pipe_ct = nng_alloc(sizeof(struct pipe_content));
 	init_pipe_content(w->pipe_ct);
+	w->pipes     = NULL;
+	w->pipes_cap = 0;
 
 	w->state = INIT;
 	return (w);
 }
 
-// The server runs forever.
+// Open the broker socket, hand it PARALLEL work contexts, listen on each
+// url and start the work state machines.  Returns once the broker is
+// running; it is served from nng's own threads from then on.
+// Each url gets its own listener on the same socket, e.g. plain MQTT on
+// tcp:// next to MQTT over WebSocket on mqtt+ws://, sharing every work ctx.
+// An http:// url serves the broker metrics instead (include/metrics_server.h).
+// Statistics are published under $SYS by a client of our own, over
+// NANOMQ_INPROC_URL, listened on for it if not already.
 int
-server(const char *url)
+broker_open(nng_socket *sockp, int nurl, char **urls)
 {
 	nng_socket     sock;
-	nng_pipe       pipe_id;
 	struct work    *works[PARALLEL];
 	int            rv;
 	int            i;
@@ -405,17 +488,91 @@ server(const char *url)
 		works[i] = alloc_work(sock);
 		works[i]->db = db;
 		nng_aio_set_dbtree(works[i]->aio, db);
-//		works[i]->pid = pipe_id;
 	}
 
-	if ((rv = nng_listen(sock, url, NULL, 0)) != 0) {
-		fatal("nng_listen", rv);
+	// Set on the socket, these apply to every listener opened below.
+	if (((rv = nng_socket_set_int(sock, NANO_OPT_CONN_RATE, CONN_RATE)) !=
+	        0) ||
+	    ((rv = nng_socket_set_int(sock, NANO_OPT_NEGO_MAX, NEGO_MAX)) != 0)) {
+		debug_msg("ERROR: admission control options: %d", rv);
+		nng_close(sock);
+		return rv;
+	}
+	if (((rv = nng_socket_set_int(sock, NANO_OPT_SQ_MAX_MSGS,
+	          SQ_MAX_MSGS)) != 0) ||
+	    ((rv = nng_socket_set_size(sock, NANO_OPT_SQ_MAX_BYTES,
+	          SQ_MAX_BYTES)) != 0) ||
+	    ((rv = nng_socket_set_int(sock, NANO_OPT_SQ_POLICY, SQ_POLICY)) !=
+	        0) ||
+	    ((rv = nng_socket_set_ms(sock, NANO_OPT_SQ_GRACE, SQ_GRACE)) != 0)) {
+		debug_msg("ERROR: send queue options: %d", rv);
+		nng_close(sock);
+		return rv;
+	}
+	if (((rv = nng_socket_set_int(sock, NANO_OPT_INFLIGHT, INFLIGHT)) !=
+	        0) ||
+	    ((rv = nng_socket_set_ms(sock, NANO_OPT_RETRY_TIME, RETRY_TIME)) !=
+	        0)) {
+		debug_msg("ERROR: inflight options: %d", rv);
+		nng_close(sock);
+		return rv;
+	}
+
+	for (i = 0; i < nurl; i++) {
+		if (strncmp(urls[i], "http://", 7) == 0) {
+			if ((rv = metrics_server_start(urls[i])) != 0) {
+				debug_msg("ERROR: metrics %s: %d", urls[i], rv);
+				nng_close(sock);
+				return rv;
+			}
+			continue;
+		}
+		if ((rv = nng_listen(sock, urls[i], NULL, 0)) != 0) {
+			debug_msg("ERROR: nng_listen %s: %d", urls[i], rv);
+			nng_close(sock);
+			return rv;
+		}
 	}
 
 	for (i = 0; i < PARALLEL; i++) {
 		server_cb(works[i]); // this starts them going (INIT state)
 	}
 
+	if (SYS_INTERVAL > 0) {
+		for (i = 0; i < nurl; i++) {
+			if (strcmp(urls[i], NANOMQ_INPROC_URL) == 0) {
+				break;
+			}
+		}
+		if ((i == nurl) &&
+		    ((rv = nng_listen(sock, NANOMQ_INPROC_URL, NULL, 0)) != 0)) {
+			debug_msg("ERROR: nng_listen %s: %d", NANOMQ_INPROC_URL,
+			    rv);
+			nng_close(sock);
+			return rv;
+		}
+		if ((rv = sys_topics_start(db, SYS_INTERVAL)) != 0) {
+			debug_msg("ERROR: $SYS topics: %d", rv);
+			nng_close(sock);
+			return rv;
+		}
+	}
+
+	*sockp = sock;
+	return 0;
+}
+
+// The server runs forever.
+int
+server(int nurl, char **urls)
+{
+	nng_socket sock;
+	int        rv;
+
+	if ((rv = broker_open(&sock, nurl, urls)) != 0) {
+		fatal("nng_listen", rv);
+	}
+
 	for (;;) {
 		nng_msleep(3600000); // neither pause() nor sleep() portable
 	}
@@ -424,11 +581,11 @@ server(const char *url)
 int broker_start(int argc, char **argv)
 {
 	int rc;
-	if (argc != 1) {
-		fprintf(stderr, "Usage: broker start <url>\n");
+	if (argc < 1) {
+		fprintf(stderr, "Usage: broker start <url> [<url> ...]\n");
 		exit(EXIT_FAILURE);
 	}
-	rc = server(argv[0]);
+	rc = server(argc, argv);
 	exit(rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
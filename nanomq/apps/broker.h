@@ -19,10 +19,13 @@ struct work {
 	struct db_tree *db;
 
 	struct pipe_content       *pipe_ct;
+	uint32_t                  *pipes; // one multicast send, see pub_send
+	uint32_t                   pipes_cap;
 	conn_param                *cparam;
 	struct pub_packet_struct  *pub_packet;
 	struct packet_subscribe   *sub_pkt;
 	struct packet_unsubscribe *unsub_pkt;
+	uint64_t                   rxtime; // of a PUBLISH timed for latency
 
 };
 
@@ -36,6 +39,8 @@ typedef struct client_ctx client_ctx;
 
 typedef struct work emq_work;
 
+int broker_open(nng_socket *sockp, int nurl, char **urls);
+
 int broker_start(int argc, char **argv);
 
 int broker_dflt(int argc, char **argv);
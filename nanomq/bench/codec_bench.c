@@ -0,0 +1,328 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// Packet codec benchmark.
+//
+//	codec_bench [milliseconds per case]
+//
+// Decodes (and for PUBLISH, encodes) the same packet over and over on one
+// thread, for each packet type the broker parses, from a 3.1.1 and from a
+// 5 client.  The MQTT 5 packets carry the properties a typical client
+// sends.  Nothing touches the network.  Build with -DNOLOG=ON, or the
+// debug logging is what gets measured.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nng/nng.h>
+#include <nng/protocol/mqtt/mqtt.h>
+#include <nng/protocol/mqtt/mqtt_codec.h>
+#include <nng/protocol/mqtt/mqtt_parser.h>
+#include <nng/supplemental/util/platform.h>
+
+#include "include/pub_handler.h"
+#include "include/sub_handler.h"
+#include "include/unsub_handler.h"
+
+static const uint8_t vers[] = { PROTOCOL_VERSION_v311, PROTOCOL_VERSION_v5 };
+
+struct bench {
+	uint8_t  ver;
+	uint8_t  pkt[256]; // CONNECT, fixed header included
+	emq_work work;
+	nng_msg *dest;
+};
+
+static void
+fatal(const char *what, int rv)
+{
+	fprintf(stderr, "%s: %s\n", what, nng_strerror(rv));
+	exit(1);
+}
+
+static void
+put_str(mqtt_cursor *c, const char *s)
+{
+	mqtt_buf b = { (uint8_t *) s, (uint32_t) strlen(s) };
+
+	mqtt_put_bin(c, b);
+}
+
+// A received packet, set up as the tcp transport sets it up.
+static nng_msg *
+packet_msg(uint8_t header, const uint8_t *body, size_t len)
+{
+	nng_msg *msg;
+	uint8_t  fixed[5];
+	int      rv;
+
+	if ((rv = nng_msg_alloc(&msg, len)) != 0) {
+		fatal("nng_msg_alloc", rv);
+	}
+	memcpy(nng_msg_body(msg), body, len);
+	fixed[0] = header;
+	if ((rv = nng_msg_header_append(
+	         msg, fixed, 1 + put_var_integer(fixed + 1, len))) != 0) {
+		fatal("nng_msg_header_append", rv);
+	}
+	nng_msg_set_cmd_type(msg, header & 0xf0);
+	nng_msg_set_remaining_len(msg, len);
+	return (msg);
+}
+
+static void
+build_connect(struct bench *b)
+{
+	mqtt_cursor c;
+	uint8_t     body[200];
+	mqtt_props  props;
+
+	mqtt_cursor_init(&c, body, sizeof(body));
+	put_str(&c, "MQTT");
+	mqtt_put_u8(&c, b->ver);
+	mqtt_put_u8(&c, 0xc2); // username, password, clean session
+	mqtt_put_u16(&c, 60);
+	if (b->ver == PROTOCOL_VERSION_v5) {
+		mqtt_props_init(&props);
+		mqtt_props_set_num(&props, SESSION_EXPIRY_INTERVAL, 3600);
+		mqtt_props_set_num(&props, RECEIVE_MAXIMUM, 32);
+		mqtt_props_set_num(&props, TOPIC_ALIAS_MAXIMUM, 16);
+		mqtt_props_encode(&c, &props);
+	}
+	put_str(&c, "codec-bench-client-0001");
+	put_str(&c, "user");
+	put_str(&c, "password");
+
+	b->pkt[0] = CMD_CONNECT;
+	memcpy(b->pkt + 1 + put_var_integer(b->pkt + 1, c.pos), body, c.pos);
+}
+
+static nng_msg *
+build_publish(uint8_t ver, uint8_t qos)
+{
+	mqtt_cursor c;
+	uint8_t     body[512];
+	uint8_t     hdr[64];
+	mqtt_props  props;
+	mqtt_cursor u;
+
+	mqtt_cursor_init(&c, body, sizeof(body));
+	put_str(&c, "sensors/building-7/floor-3/temperature");
+	if (qos > 0) {
+		mqtt_put_u16(&c, 0x1234);
+	}
+	if (ver == PROTOCOL_VERSION_v5) {
+		mqtt_props_init(&props);
+		mqtt_props_set_num(&props, PAYLOAD_FORMAT_INDICATOR, 1);
+		mqtt_props_set_num(&props, MESSAGE_EXPIRY_INTERVAL, 300);
+		mqtt_props_set_buf(
+		    &props, CONTENT_TYPE, (char *) "application/json", 16);
+		// user properties live in a received block
+		mqtt_cursor_init(&u, hdr, sizeof(hdr));
+		mqtt_put_u8(&u, USER_PROPERTY);
+		put_str(&u, "site");
+		put_str(&u, "b7");
+		mqtt_put_u8(&u, USER_PROPERTY);
+		put_str(&u, "unit");
+		put_str(&u, "celsius");
+		props.block.buf = hdr;
+		props.block.len = u.pos;
+		props.nuser     = 2;
+		mqtt_props_encode(&c, &props);
+	}
+	mqtt_put_bytes(&c, "{\"t\":21.5,\"h\":40,\"ts\":1602000000}", 33);
+	return (packet_msg(CMD_PUBLISH | (qos << 1), body, c.pos));
+}
+
+static nng_msg *
+build_puback(uint8_t ver)
+{
+	uint8_t body[4] = { 0x12, 0x34, SUCCESS, 0 };
+
+	return (packet_msg(CMD_PUBACK, body, ver == PROTOCOL_VERSION_v5 ? 4 : 2));
+}
+
+static nng_msg *
+build_subscribe(uint8_t ver, uint8_t cmd)
+{
+	mqtt_cursor c;
+	uint8_t     body[256];
+	mqtt_props  props;
+
+	mqtt_cursor_init(&c, body, sizeof(body));
+	mqtt_put_u16(&c, 7);
+	if (ver == PROTOCOL_VERSION_v5) {
+		mqtt_props_init(&props);
+		if (cmd == CMD_SUBSCRIBE) {
+			mqtt_props_set_num(&props, SUBSCRIPTION_IDENTIFIER, 42);
+		}
+		mqtt_props_encode(&c, &props);
+	}
+	put_str(&c, "sensors/+/floor-3/temperature");
+	if (cmd == CMD_SUBSCRIBE) {
+		mqtt_put_u8(&c, 1);
+	}
+	put_str(&c, "alerts/#");
+	if (cmd == CMD_SUBSCRIBE) {
+		mqtt_put_u8(&c, 2);
+	}
+	return (packet_msg(cmd | 0x02, body, c.pos));
+}
+
+static void
+free_topics(topic_node *node, bool owned)
+{
+	topic_node *next;
+
+	for (; node != NULL; node = next) {
+		next = node->next;
+		if (owned) {
+			nng_free(node->it->topic_filter.body,
+			    node->it->topic_filter.len + 1);
+		}
+		nng_free(node->it, sizeof(topic_with_option));
+		nng_free(node, sizeof(topic_node));
+	}
+}
+
+static void
+do_connect(struct bench *b)
+{
+	conn_param *cparam;
+
+	if (conn_param_alloc(&cparam) != 0) {
+		fatal("conn_param_alloc", NNG_ENOMEM);
+	}
+	if (conn_handler(b->pkt, cparam) <= 0) {
+		fatal("conn_handler", NNG_EPROTO);
+	}
+	destroy_conn_param(cparam);
+}
+
+static void
+do_pub_decode(struct bench *b)
+{
+	if (decode_pub_message(&b->work) != SUCCESS) {
+		fatal("decode_pub_message", NNG_EPROTO);
+	}
+	nng_msg_free(b->work.pub_packet->msg);
+}
+
+static void
+do_pub_encode(struct bench *b)
+{
+	encode_pub_message(b->dest, &b->work, PUBLISH, 1, false);
+}
+
+static void
+do_sub(struct bench *b)
+{
+	if (decode_sub_message(&b->work) != SUCCESS) {
+		fatal("decode_sub_message", NNG_EPROTO);
+	}
+	free_topics(b->work.sub_pkt->node, true);
+}
+
+static void
+do_unsub(struct bench *b)
+{
+	if (decode_unsub_message(&b->work) != SUCCESS) {
+		fatal("decode_unsub_message", NNG_EPROTO);
+	}
+	free_topics(b->work.unsub_pkt->node, false);
+}
+
+static void
+measure(const char *name, struct bench *b, void (*fn)(struct bench *),
+    int ms)
+{
+	nng_time start, end;
+	uint64_t n = 0;
+
+	start = nng_clock();
+	do {
+		for (int i = 0; i < 1000; i++) {
+			fn(b);
+		}
+		n += 1000;
+		end = nng_clock();
+	} while (end - start < (nng_time) ms);
+
+	printf("%-16s %-6s %12.0f packets/s %8.1f ns/packet\n", name,
+	    b->ver == PROTOCOL_VERSION_v5 ? "5" : "3.1.1",
+	    n * 1000.0 / (double) (end - start),
+	    (end - start) * 1e6 / (double) n);
+}
+
+int
+main(int argc, char **argv)
+{
+	int                      ms = argc > 1 ? atoi(argv[1]) : 1000;
+	struct bench             b;
+	struct pub_packet_struct pub;
+	packet_subscribe         sub;
+	packet_unsubscribe       unsub;
+	int                      rv;
+
+	if (ms < 1) {
+		fprintf(stderr, "usage: %s [milliseconds per case]\n", argv[0]);
+		return (1);
+	}
+	for (size_t v = 0; v < sizeof(vers); v++) {
+		memset(&b, 0, sizeof(b));
+		b.ver = vers[v];
+		build_connect(&b);
+		measure("CONNECT", &b, do_connect, ms);
+
+		// The session the other packets arrive on
+		if ((rv = conn_param_alloc(&b.work.cparam)) != 0) {
+			fatal("conn_param_alloc", rv);
+		}
+		if (conn_handler(b.pkt, b.work.cparam) <= 0) {
+			fatal("conn_handler", NNG_EPROTO);
+		}
+		b.work.pub_packet = &pub;
+		b.work.sub_pkt    = &sub;
+		b.work.unsub_pkt  = &unsub;
+
+		b.work.msg = build_publish(b.ver, 0);
+		measure("PUBLISH QoS 0", &b, do_pub_decode, ms);
+		nng_msg_free(b.work.msg);
+
+		b.work.msg = build_publish(b.ver, 1);
+		measure("PUBLISH QoS 1", &b, do_pub_decode, ms);
+
+		// Encoding for a subscriber, from the decoded PUBLISH
+		if ((rv = nng_msg_alloc(&b.dest, 0)) != 0) {
+			fatal("nng_msg_alloc", rv);
+		}
+		decode_pub_message(&b.work);
+		measure("PUBLISH encode", &b, do_pub_encode, ms);
+		nng_msg_free(b.dest);
+		nng_msg_free(pub.msg);
+		nng_msg_free(b.work.msg);
+
+		b.work.msg = build_puback(b.ver);
+		measure("PUBACK", &b, do_pub_decode, ms);
+		nng_msg_free(b.work.msg);
+
+		memset(&sub, 0, sizeof(sub));
+		b.work.msg = build_subscribe(b.ver, CMD_SUBSCRIBE);
+		measure("SUBSCRIBE", &b, do_sub, ms);
+		nng_msg_free(b.work.msg);
+
+		b.work.msg = build_subscribe(b.ver, CMD_UNSUBSCRIBE);
+		measure("UNSUBSCRIBE", &b, do_unsub, ms);
+		nng_msg_free(b.work.msg);
+
+		destroy_conn_param(b.work.cparam);
+	}
+	return (0);
+}
@@ -0,0 +1,260 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// Lock contention benchmark for the nano_tcp protocol.
+//
+//	nano_tcp_bench [workers [clients [seconds [window]]]]
+//
+// A nano_tcp socket listens on mqtt+inproc://, so no network is involved
+// and the time goes to the protocol itself.  Each worker thread owns a
+// context and echoes whatever it receives back to the sending pipe, like
+// a broker replying to PINGREQ; each client thread keeps `window`
+// PUBLISHes outstanding on its own pipe.  All workers hand off through the
+// same recvq and send through the same pipe map, which is what the
+// socket's locks have to arbitrate.
+//
+// With NNG_ENABLE_STATS, the message pool counters are reported too:
+// allocations served from a pool and those that went to the heap, per
+// round trip.  Build with NNG_MSG_POOL_CACHE=0 to compare against no
+// pooling at all.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nng/nng.h>
+#include <nng/protocol/mqtt/mqtt.h>
+#include <nng/protocol/mqtt/nano_tcp.h>
+#include <nng/supplemental/util/platform.h>
+
+#define BENCH_URL "mqtt+inproc://nano_tcp_bench"
+
+struct worker {
+	nng_socket sock;
+	nng_thread *thr;
+	uint64_t    count;
+};
+
+struct client {
+	nng_socket  sock;
+	nng_thread *thr;
+	int         window;
+	uint64_t    count;
+};
+
+static volatile int stop;
+
+static void
+fatal(const char *what, int rv)
+{
+	fprintf(stderr, "%s: %s\n", what, nng_strerror(rv));
+	exit(1);
+}
+
+// Message pool counters, 0 if nng keeps no stats.
+static void
+pool_stats(uint64_t *hit, uint64_t *miss)
+{
+	nng_stat *st;
+	nng_stat *pool;
+	nng_stat *s;
+
+	*hit  = 0;
+	*miss = 0;
+	if (nng_stats_get(&st) != 0) {
+		return;
+	}
+	if ((pool = nng_stat_find(st, "msgpool")) != NULL) {
+		if ((s = nng_stat_find(pool, "hit")) != NULL) {
+			*hit = nng_stat_value(s);
+		}
+		if ((s = nng_stat_find(pool, "miss")) != NULL) {
+			*miss = nng_stat_value(s);
+		}
+	}
+	nng_stats_free(st);
+}
+
+static void
+worker_run(void *arg)
+{
+	struct worker *w = arg;
+	nng_ctx        ctx;
+	nng_aio *      aio;
+	nng_msg *      msg;
+	int            rv;
+
+	if (((rv = nng_ctx_open(&ctx, w->sock)) != 0) ||
+	    ((rv = nng_aio_alloc(&aio, NULL, NULL)) != 0)) {
+		fatal("worker", rv);
+	}
+	for (;;) {
+		nng_ctx_recv(ctx, aio);
+		nng_aio_wait(aio);
+		if (nng_aio_result(aio) != 0) {
+			break;
+		}
+		msg = nng_aio_get_msg(aio);
+		nng_aio_set_msg(aio, msg);
+		nng_ctx_send(ctx, aio);
+		nng_aio_wait(aio);
+		if (nng_aio_result(aio) != 0) {
+			nng_msg_free(msg);
+			break;
+		}
+		w->count++;
+	}
+	nng_aio_free(aio);
+	nng_ctx_close(ctx);
+}
+
+static int
+client_send(struct client *c)
+{
+	nng_msg *msg;
+	uint8_t  hdr[2] = { CMD_PUBLISH | 0x02, 16 }; // QoS 1, never dropped
+	int      rv;
+
+	if ((rv = nng_msg_alloc(&msg, 16)) != 0) {
+		return (rv);
+	}
+	memset(nng_msg_body(msg), 0, 16);
+	if ((rv = nng_msg_header_append(msg, hdr, sizeof(hdr))) != 0) {
+		nng_msg_free(msg);
+		return (rv);
+	}
+	nng_msg_set_cmd_type(msg, CMD_PUBLISH);
+	nng_msg_set_remaining_len(msg, 16);
+	if ((rv = nng_sendmsg(c->sock, msg, 0)) != 0) {
+		nng_msg_free(msg);
+	}
+	return (rv);
+}
+
+static void
+client_run(void *arg)
+{
+	struct client *c = arg;
+	nng_msg *      msg;
+	int            i;
+
+	for (i = 0; i < c->window; i++) {
+		if (client_send(c) != 0) {
+			return;
+		}
+	}
+	while (!stop) {
+		if (nng_recvmsg(c->sock, &msg, 0) != 0) {
+			return;
+		}
+		nng_msg_free(msg);
+		c->count++;
+		if (client_send(c) != 0) {
+			return;
+		}
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	int            nworkers = argc > 1 ? atoi(argv[1]) : 16;
+	int            nclients = argc > 2 ? atoi(argv[2]) : 32;
+	int            secs     = argc > 3 ? atoi(argv[3]) : 5;
+	int            window   = argc > 4 ? atoi(argv[4]) : 4;
+	struct worker *workers;
+	struct client *clients;
+	nng_socket     sock;
+	nng_time       start, end;
+	uint64_t       served = 0, echoed = 0;
+	uint64_t       hit0, miss0, hit, miss;
+	int            i, rv;
+
+	if ((nworkers < 1) || (nclients < 1) || (secs < 1) || (window < 1)) {
+		fprintf(stderr,
+		    "usage: %s [workers [clients [seconds [window]]]]\n",
+		    argv[0]);
+		return (1);
+	}
+	workers = calloc(nworkers, sizeof(*workers));
+	clients = calloc(nclients, sizeof(*clients));
+	if ((workers == NULL) || (clients == NULL)) {
+		fatal("calloc", NNG_ENOMEM);
+	}
+
+	// The clients never acknowledge the QoS 1 echoes.
+	if (((rv = nng_nano_tcp0_open(&sock)) != 0) ||
+	    ((rv = nng_socket_set_int(sock, NANO_OPT_INFLIGHT, 0)) != 0) ||
+	    ((rv = nng_listen(sock, BENCH_URL, NULL, 0)) != 0)) {
+		fatal("listen", rv);
+	}
+	for (i = 0; i < nclients; i++) {
+		clients[i].window = window;
+		if (((rv = nng_nano_client0_open(&clients[i].sock)) != 0) ||
+		    ((rv = nng_socket_set_ms(
+		          clients[i].sock, NNG_OPT_RECVTIMEO, 1000)) != 0) ||
+		    ((rv = nng_dial(clients[i].sock, BENCH_URL, NULL, 0)) !=
+		        0)) {
+			fatal("dial", rv);
+		}
+	}
+	for (i = 0; i < nworkers; i++) {
+		workers[i].sock = sock;
+		if ((rv = nng_thread_create(
+		         &workers[i].thr, worker_run, &workers[i])) != 0) {
+			fatal("thread", rv);
+		}
+	}
+
+	pool_stats(&hit0, &miss0);
+	start = nng_clock();
+	for (i = 0; i < nclients; i++) {
+		if ((rv = nng_thread_create(
+		         &clients[i].thr, client_run, &clients[i])) != 0) {
+			fatal("thread", rv);
+		}
+	}
+	nng_msleep(secs * 1000);
+	stop = 1;
+	for (i = 0; i < nclients; i++) {
+		nng_thread_destroy(clients[i].thr);
+		echoed += clients[i].count;
+	}
+	end = nng_clock();
+	pool_stats(&hit, &miss);
+	hit -= hit0;
+	miss -= miss0;
+
+	for (i = 0; i < nclients; i++) {
+		nng_close(clients[i].sock);
+	}
+	nng_close(sock);
+	for (i = 0; i < nworkers; i++) {
+		nng_thread_destroy(workers[i].thr);
+		served += workers[i].count;
+	}
+
+	printf("%d workers, %d clients, window %d: %llu round trips in "
+	       "%llu ms, %.0f/s, %.2f us each (%llu sends)\n",
+	    nworkers, nclients, window, (unsigned long long) echoed,
+	    (unsigned long long) (end - start),
+	    echoed * 1000.0 / (double) (end - start),
+	    (end - start) * 1000.0 / (double) (echoed ? echoed : 1),
+	    (unsigned long long) served);
+	if (hit + miss > 0) {
+		printf("msg pool: %.1f%% hits, %.3f heap allocations per round "
+		       "trip\n",
+		    hit * 100.0 / (double) (hit + miss),
+		    miss / (double) (echoed ? echoed : 1));
+	}
+
+	free(workers);
+	free(clients);
+	return (0);
+}
@@ -0,0 +1,200 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// Topic checking benchmark.
+//
+//	topic_bench [milliseconds per case]
+//
+// What a PUBLISH topic goes through before the subscription tree is
+// searched, for topics of 16 to 256 bytes: checked for UTF-8 and
+// wildcards, then split into levels.  "byte loop" is how that was done
+// before mqtt_topic_scan(): a UTF-8 decoder walking every byte, a memchr
+// per wildcard and topic_parse_len().  Every kernel this CPU runs is
+// measured against it, scanning alone and scanning and splitting.  Build
+// without sanitizers, -DNOLOG=ON.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nng/nng.h>
+#include <nng/protocol/mqtt/mqtt.h>
+#include <nng/protocol/mqtt/mqtt_codec.h>
+#include <nng/supplemental/util/platform.h>
+
+#include "mqtt_db.h"
+
+// As many '/' as handle_pub() splits at from the scan; deeper topics go
+// through topic_parse_len() again.
+#define NSEP 15
+
+static const char *kernels[] = { "scalar", "sse2", "avx2", "neon" };
+static const int   sizes[]   = { 16, 32, 64, 128, 256 };
+
+static volatile uint32_t sink;
+
+// The UTF-8 check as it was.
+static int
+byte_loop_utf8(const uint8_t *s, size_t len)
+{
+	size_t   n;
+	uint32_t cp;
+
+	for (size_t i = 0; i < len; i++) {
+		if (s[i] == 0) {
+			return (-1);
+		} else if (s[i] <= 0x7f) {
+			n  = 1;
+			cp = s[i];
+		} else if ((s[i] & 0xe0) == 0xc0) {
+			if (s[i] == 0xc0 || s[i] == 0xc1) {
+				return (-1);
+			}
+			n  = 2;
+			cp = s[i] & 0x1f;
+		} else if ((s[i] & 0xf0) == 0xe0) {
+			n  = 3;
+			cp = s[i] & 0x0f;
+		} else if ((s[i] & 0xf8) == 0xf0 && s[i] <= 0xf4) {
+			n  = 4;
+			cp = s[i] & 0x07;
+		} else {
+			return (-1);
+		}
+		if (i + n > len) {
+			return (-1);
+		}
+		for (size_t j = 1; j < n; j++) {
+			if ((s[++i] & 0xc0) != 0x80) {
+				return (-1);
+			}
+			cp = (cp << 6) | (s[i] & 0x3f);
+		}
+		if ((cp >= 0xd800 && cp <= 0xdfff) || (n == 3 && cp < 0x800) ||
+		    (n == 4 && (cp < 0x10000 || cp > 0x10ffff)) ||
+		    (cp >= 0xfdd0 && cp <= 0xfdef) || (cp & 0xfffe) == 0xfffe ||
+		    cp <= 0x1f || (cp >= 0x7f && cp <= 0x9f)) {
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+static void
+byte_loop_check(const uint8_t *topic, size_t len)
+{
+	if (byte_loop_utf8(topic, len) != 0 ||
+	    memchr(topic, '+', len) != NULL || memchr(topic, '#', len) != NULL) {
+		abort();
+	}
+}
+
+static void
+scan_check(const uint8_t *topic, size_t len, uint16_t *sep,
+    mqtt_topic_info *info)
+{
+	mqtt_topic_scan(topic, len, sep, NSEP, info);
+	if (info->flags != 0) {
+		abort();
+	}
+}
+
+// A topic of len bytes with a level every eight or so, like
+// "sensors/b7f3/temp/..." in a real deployment.
+static void
+make_topic(uint8_t *buf, size_t len)
+{
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789-_";
+
+	for (size_t i = 0; i < len; i++) {
+		buf[i] = (i % 8 == 7 && i != len - 1)
+		    ? '/'
+		    : chars[(i * 7 + len) % (sizeof(chars) - 1)];
+	}
+}
+
+static double
+measure(const uint8_t *topic, size_t len, int which, bool split, int ms)
+{
+	nng_time        start, end;
+	uint64_t        n = 0;
+	uint16_t        sep[NSEP];
+	mqtt_topic_info info;
+	char **         levels;
+
+	start = nng_clock();
+	do {
+		for (int i = 0; i < 1000; i++) {
+			if (which < 0) {
+				byte_loop_check(topic, len);
+			} else {
+				scan_check(topic, len, sep, &info);
+			}
+			if (!split) {
+				continue;
+			}
+			if (which >= 0 && info.levels <= NSEP + 1) {
+				levels = topic_split(
+				    (const char *) topic, len, sep, info.levels - 1);
+			} else {
+				levels = topic_parse_len((const char *) topic, len);
+			}
+			sink += levels[1][0];
+			free_topic_queue(levels);
+		}
+		n += 1000;
+		end = nng_clock();
+	} while (end - start < (nng_time) ms);
+
+	return ((end - start) * 1e6 / (double) n);
+}
+
+int
+main(int argc, char **argv)
+{
+	int     ms = argc > 1 ? atoi(argv[1]) : 500;
+	uint8_t topic[256];
+	bool    runs[sizeof(kernels) / sizeof(kernels[0])];
+
+	if (ms < 1) {
+		fprintf(stderr, "usage: %s [milliseconds per case]\n", argv[0]);
+		return (1);
+	}
+	for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+		runs[k] = mqtt_topic_kernel_set(kernels[k]) == 0;
+	}
+
+	printf("ns per topic, check only / check and split\n");
+	printf("%-6s %17s", "bytes", "byte loop");
+	for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+		if (runs[k]) {
+			printf(" %17s", kernels[k]);
+		}
+	}
+	printf("\n");
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		make_topic(topic, sizes[s]);
+		printf("%-6d %8.1f /%7.1f", sizes[s],
+		    measure(topic, sizes[s], -1, false, ms),
+		    measure(topic, sizes[s], -1, true, ms));
+		for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]);
+		     k++) {
+			if (!runs[k]) {
+				continue;
+			}
+			mqtt_topic_kernel_set(kernels[k]);
+			printf(" %8.1f /%7.1f",
+			    measure(topic, sizes[s], (int) k, false, ms),
+			    measure(topic, sizes[s], (int) k, true, ms));
+		}
+		printf("\n");
+	}
+	return (0);
+}
@@ -0,0 +1,394 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <nng.h>
+#include <supplemental/util/platform.h>
+#include <protocol/mqtt/nano_tcp.h>
+#include <protocol/mqtt/mqtt_parser.h>
+
+#include "include/nanomq.h"
+#include "include/embed.h"
+#include "apps/broker.h"
+
+#define NANOMQ_EMBED_MAX_URLS 16
+
+struct nanomq_client {
+	nng_socket  sock;
+	conn_param *cparam;
+	nng_mtx *   mtx;
+	uint16_t    packet_id;
+};
+
+static nng_socket embed_sock;
+
+int
+nanomq_embed_start(int nurl, char **urls)
+{
+	char *all[NANOMQ_EMBED_MAX_URLS + 1];
+	int   i;
+
+	if ((nurl < 0) || (nurl > NANOMQ_EMBED_MAX_URLS)) {
+		return NNG_EINVAL;
+	}
+	all[0] = NANOMQ_INPROC_URL;
+	for (i = 0; i < nurl; i++) {
+		all[i + 1] = urls[i];
+	}
+	return broker_open(&embed_sock, nurl + 1, all);
+}
+
+static uint16_t
+client_next_packet_id(nanomq_client *client)
+{
+	uint16_t id;
+
+	nng_mtx_lock(client->mtx);
+	if (++client->packet_id == 0) {
+		client->packet_id = 1;
+	}
+	id = client->packet_id;
+	nng_mtx_unlock(client->mtx);
+	return id;
+}
+
+// Stamp the fixed header and the fields a transport would have decoded
+// from the wire, then hand the message (and our reference) to the broker.
+static int
+client_send(nanomq_client *client, nng_msg *msg, uint8_t fixed)
+{
+	uint8_t  hdr[5];
+	uint32_t len = nng_msg_len(msg);
+	int      rv;
+
+	hdr[0] = fixed;
+	if (len == 0) {
+		hdr[1] = 0;
+		rv     = nng_msg_header_append(msg, hdr, 2);
+	} else {
+		rv = nng_msg_header_append(
+		    msg, hdr, 1 + put_var_integer(hdr + 1, len));
+	}
+	if (rv != 0) {
+		nng_msg_free(msg);
+		return rv;
+	}
+	nng_msg_set_cmd_type(msg, fixed & 0xF0);
+	nng_msg_set_remaining_len(msg, len);
+	nng_msg_set_conn_param(msg, client->cparam);
+
+	if ((rv = nng_sendmsg(client->sock, msg, 0)) != 0) {
+		nng_msg_free(msg);
+	}
+	return rv;
+}
+
+static int
+append_utf8_str(nng_msg *msg, const char *str)
+{
+	uint8_t len[2];
+	size_t  n = strlen(str);
+	int     rv;
+
+	if (n > 0xFFFF) {
+		return NNG_EINVAL;
+	}
+	NNI_PUT16(len, n);
+	if ((rv = nng_msg_append(msg, len, 2)) != 0) {
+		return rv;
+	}
+	return nng_msg_append(msg, str, n);
+}
+
+// The CONNECT handshake is local: build the packet a network client would
+// send and let the parser fill in the conn_param the broker keys on.
+static int
+client_conn_param(conn_param **cparamp, const char *clientid)
+{
+	conn_param *cparam;
+	uint8_t *   pkt;
+	size_t      idlen = strlen(clientid);
+	size_t      remain, sz;
+	int         pos, rv;
+
+	if (idlen > 0xFFFF) {
+		return NNG_EINVAL;
+	}
+	remain = 10 + 2 + idlen;
+	sz     = 1 + 4 + remain;
+	if ((pkt = nng_alloc(sz)) == NULL) {
+		return NNG_ENOMEM;
+	}
+	pos        = 0;
+	pkt[pos++] = CMD_CONNECT;
+	pos += put_var_integer(pkt + pos, remain);
+	NNI_PUT16(pkt + pos, 4);
+	memcpy(pkt + pos + 2, "MQTT", 4);
+	pos += 6;
+	pkt[pos++] = PROTOCOL_VERSION_v311;
+	pkt[pos++] = 0x02; // clean session
+	NNI_PUT16(pkt + pos, 0); // no keepalive, we never go silent
+	pos += 2;
+	NNI_PUT16(pkt + pos, idlen);
+	memcpy(pkt + pos + 2, clientid, idlen);
+
+	if ((rv = conn_param_alloc(&cparam)) != 0) {
+		nng_free(pkt, sz);
+		return rv;
+	}
+	if (conn_handler(pkt, cparam) <= 0) {
+		destroy_conn_param(cparam);
+		nng_free(pkt, sz);
+		return NNG_EPROTO;
+	}
+	nng_free(pkt, sz);
+	*cparamp = cparam;
+	return 0;
+}
+
+int
+nanomq_client_open(nanomq_client **clientp, const char *clientid)
+{
+	nanomq_client *client;
+	int            rv;
+
+	if ((client = nng_alloc(sizeof(*client))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	client->packet_id = 0;
+	client->cparam    = NULL;
+	if ((rv = nng_mtx_alloc(&client->mtx)) != 0) {
+		nng_free(client, sizeof(*client));
+		return rv;
+	}
+	if ((rv = client_conn_param(&client->cparam, clientid)) != 0) {
+		goto error;
+	}
+	if ((rv = nng_nano_client0_open(&client->sock)) != 0) {
+		goto error;
+	}
+	if ((rv = nng_dial(client->sock, NANOMQ_INPROC_URL, NULL, 0)) != 0) {
+		nng_close(client->sock);
+		goto error;
+	}
+	*clientp = client;
+	return 0;
+
+error:
+	if (client->cparam != NULL) {
+		destroy_conn_param(client->cparam);
+	}
+	nng_mtx_free(client->mtx);
+	nng_free(client, sizeof(*client));
+	return rv;
+}
+
+void
+nanomq_client_close(nanomq_client *client)
+{
+	nng_msg *msg;
+
+	if (nng_msg_alloc(&msg, 0) == 0) {
+		(void) client_send(client, msg, CMD_DISCONNECT);
+	}
+	nng_close(client->sock);
+	// Like the conn_param of a TCP connection, ours stays with the
+	// broker, which may still reference it from queued packets.
+	nng_mtx_free(client->mtx);
+	nng_free(client, sizeof(*client));
+}
+
+int
+nanomq_client_subscribe(nanomq_client *client, const char *topic, uint8_t qos)
+{
+	nng_msg *msg;
+	uint8_t  buf[2];
+	int      rv;
+
+	if ((rv = nng_msg_alloc(&msg, 0)) != 0) {
+		return rv;
+	}
+	NNI_PUT16(buf, client_next_packet_id(client));
+	if (((rv = nng_msg_append(msg, buf, 2)) != 0) ||
+	    ((rv = append_utf8_str(msg, topic)) != 0) ||
+	    ((rv = nng_msg_append(msg, &qos, 1)) != 0)) {
+		nng_msg_free(msg);
+		return rv;
+	}
+	nng_msg_set_payload_ptr(msg, (uint8_t *) nng_msg_body(msg) + 2);
+	return client_send(client, msg, CMD_SUBSCRIBE | 0x02);
+}
+
+int
+nanomq_client_unsubscribe(nanomq_client *client, const char *topic)
+{
+	nng_msg *msg;
+	uint8_t  buf[2];
+	int      rv;
+
+	if ((rv = nng_msg_alloc(&msg, 0)) != 0) {
+		return rv;
+	}
+	NNI_PUT16(buf, client_next_packet_id(client));
+	if (((rv = nng_msg_append(msg, buf, 2)) != 0) ||
+	    ((rv = append_utf8_str(msg, topic)) != 0)) {
+		nng_msg_free(msg);
+		return rv;
+	}
+	nng_msg_set_payload_ptr(msg, (uint8_t *) nng_msg_body(msg) + 2);
+	return client_send(client, msg, CMD_UNSUBSCRIBE | 0x02);
+}
+
+int
+nanomq_client_publish(nanomq_client *client, const char *topic,
+    const void *payload, size_t len, uint8_t qos, bool retain)
+{
+	nng_msg *msg;
+	uint8_t  buf[2];
+	int      rv;
+
+	if (qos > 2) {
+		return NNG_EINVAL;
+	}
+	if ((rv = nng_msg_alloc(&msg, 0)) != 0) {
+		return rv;
+	}
+	if ((rv = append_utf8_str(msg, topic)) != 0) {
+		goto error;
+	}
+	if (qos > 0) {
+		NNI_PUT16(buf, client_next_packet_id(client));
+		if ((rv = nng_msg_append(msg, buf, 2)) != 0) {
+			goto error;
+		}
+	}
+	if ((rv = nng_msg_append(msg, payload, len)) != 0) {
+		goto error;
+	}
+	return client_send(
+	    client, msg, CMD_PUBLISH | (qos << 1) | (retain ? 0x01 : 0x00));
+
+error:
+	nng_msg_free(msg);
+	return rv;
+}
+
+static int
+client_ack(nanomq_client *client, const uint8_t *id, uint8_t fixed)
+{
+	nng_msg *msg;
+	int      rv;
+
+	if ((rv = nng_msg_alloc(&msg, 0)) != 0) {
+		return rv;
+	}
+	if ((rv = nng_msg_append(msg, id, 2)) != 0) {
+		nng_msg_free(msg);
+		return rv;
+	}
+	return client_send(client, msg, fixed);
+}
+
+// The broker keeps QoS 1/2 messages in flight until they are acknowledged,
+// so we do that here, and finish the QoS 2 exchange it starts in return.
+int
+nanomq_client_recv(nanomq_client *client, nng_msg **msgp)
+{
+	nng_msg *msg;
+	uint8_t *hdr;
+	uint8_t *body;
+	uint16_t tlen;
+	int      rv;
+
+	for (;;) {
+		if ((rv = nng_recvmsg(client->sock, &msg, 0)) != 0) {
+			return rv;
+		}
+		hdr  = nng_msg_header(msg);
+		body = nng_msg_body(msg);
+		if ((nng_msg_header_len(msg) == 0) || (nng_msg_len(msg) < 2)) {
+			break;
+		}
+		if ((hdr[0] & 0xF0) == CMD_PUBREL) {
+			(void) client_ack(client, body, CMD_PUBCOMP);
+			nng_msg_free(msg);
+			continue;
+		}
+		if (((hdr[0] & 0xF0) != CMD_PUBLISH) ||
+		    (((hdr[0] >> 1) & 0x03) == 0)) {
+			break;
+		}
+		NNI_GET16(body, tlen);
+		if (nng_msg_len(msg) >= (size_t) tlen + 4) {
+			(void) client_ack(client, body + 2 + tlen,
+			    ((hdr[0] >> 1) & 0x03) == 1 ? CMD_PUBACK
+			                                : CMD_PUBREC);
+		}
+		break;
+	}
+	*msgp = msg;
+	return 0;
+}
+
+// Offset of the payload in a PUBLISH body, after topic and packet id.
+static int
+publish_payload_pos(nng_msg *msg, size_t *posp)
+{
+	uint8_t *hdr  = nng_msg_header(msg);
+	uint8_t *body = nng_msg_body(msg);
+	size_t   len  = nng_msg_len(msg);
+	size_t   pos;
+	uint16_t tlen;
+
+	if ((nng_msg_header_len(msg) < 2) ||
+	    ((hdr[0] & 0xF0) != CMD_PUBLISH) || (len < 2)) {
+		return NNG_EINVAL;
+	}
+	NNI_GET16(body, tlen);
+	pos = 2 + tlen;
+	if (((hdr[0] >> 1) & 0x03) > 0) {
+		pos += 2;
+	}
+	if (pos > len) {
+		return NNG_EINVAL;
+	}
+	*posp = pos;
+	return 0;
+}
+
+int
+nanomq_publish_topic(nng_msg *msg, const char **topicp, size_t *lenp)
+{
+	uint8_t *body = nng_msg_body(msg);
+	size_t   pos;
+	int      rv;
+
+	if ((rv = publish_payload_pos(msg, &pos)) != 0) {
+		return rv;
+	}
+	NNI_GET16(body, *lenp);
+	*topicp = (const char *) body + 2;
+	return 0;
+}
+
+int
+nanomq_publish_payload(nng_msg *msg, const void **datap, size_t *lenp)
+{
+	size_t pos;
+	int    rv;
+
+	if ((rv = publish_payload_pos(msg, &pos)) != 0) {
+		return rv;
+	}
+	*datap = (const uint8_t *) nng_msg_body(msg) + pos;
+	*lenp  = nng_msg_len(msg) - pos;
+	return 0;
+}
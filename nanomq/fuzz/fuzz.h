@@ -0,0 +1,33 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANOMQ_FUZZ_H
+#define NANOMQ_FUZZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <nng/nng.h>
+
+// Every harness is a libFuzzer entry point.  Inputs to the PUBLISH,
+// SUBSCRIBE and UNSUBSCRIBE harnesses start with one byte of flags:
+// FUZZ_V5 picks MQTT 5 over 3.1.1, and for PUBLISH the low nibble is the
+// fixed header flags.  The rest is the packet after its fixed header.
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+#define FUZZ_V5 0x10
+
+// A conn_param for protocol version 4 or 5, as conn_handler leaves it.
+// It is shared by every input and must not be freed.
+conn_param *fuzz_cparam(uint8_t proto_ver);
+// A received packet: fixed header, cmd type and remaining length set as
+// the tcp transport sets them, body copied from buf.
+nng_msg *fuzz_msg(uint8_t header, const uint8_t *buf, size_t len);
+
+#endif // NANOMQ_FUZZ_H
@@ -0,0 +1,88 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <string.h>
+
+#include <nng/nng.h>
+#include <nng/protocol/mqtt/mqtt.h>
+#include <nng/protocol/mqtt/mqtt_parser.h>
+
+#include "fuzz.h"
+
+static conn_param *
+cparam_alloc(uint8_t proto_ver)
+{
+	conn_param *cparam;
+	uint8_t     pkt[32];
+	uint32_t    len = 0;
+
+	pkt[len++] = CMD_CONNECT;
+	pkt[len++] = 0; // remaining length, below
+	pkt[len++] = 0;
+	pkt[len++] = 4;
+	memcpy(pkt + len, "MQTT", 4);
+	len += 4;
+	pkt[len++] = proto_ver;
+	pkt[len++] = 0x02; // clean session
+	pkt[len++] = 0;
+	pkt[len++] = 60;
+	if (proto_ver == PROTOCOL_VERSION_v5) {
+		pkt[len++] = 0; // no properties
+	}
+	pkt[len++] = 0;
+	pkt[len++] = 4;
+	memcpy(pkt + len, "fuzz", 4);
+	len += 4;
+	pkt[1] = len - 2;
+
+	if (conn_param_alloc(&cparam) != 0) {
+		return (NULL);
+	}
+	if (conn_handler(pkt, cparam) <= 0) {
+		destroy_conn_param(cparam);
+		return (NULL);
+	}
+	return (cparam);
+}
+
+conn_param *
+fuzz_cparam(uint8_t proto_ver)
+{
+	static conn_param *v311;
+	static conn_param *v5;
+
+	if (proto_ver == PROTOCOL_VERSION_v5) {
+		return (v5 != NULL ? v5 : (v5 = cparam_alloc(proto_ver)));
+	}
+	return (v311 != NULL ? v311 : (v311 = cparam_alloc(proto_ver)));
+}
+
+nng_msg *
+fuzz_msg(uint8_t header, const uint8_t *buf, size_t len)
+{
+	nng_msg *msg;
+	uint8_t  fixed[5];
+	uint8_t  n;
+
+	if (len > 0x0fffffff || nng_msg_alloc(&msg, len) != 0) {
+		return (NULL);
+	}
+	if (len > 0) {
+		memcpy(nng_msg_body(msg), buf, len);
+	}
+	fixed[0] = header;
+	n        = put_var_integer(fixed + 1, (uint32_t) len);
+	if (nng_msg_header_append(msg, fixed, 1 + n) != 0) {
+		nng_msg_free(msg);
+		return (NULL);
+	}
+	nng_msg_set_cmd_type(msg, header & 0xf0);
+	nng_msg_set_remaining_len(msg, len);
+	return (msg);
+}
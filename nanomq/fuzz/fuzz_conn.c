@@ -0,0 +1,48 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// conn_handler on a CONNECT the way the tcp transport hands it over: the
+// fixed header and as many bytes as the remaining length says, no more.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <nng/nng.h>
+#include <nng/protocol/mqtt/mqtt_codec.h>
+#include <nng/protocol/mqtt/mqtt_parser.h>
+
+#include "fuzz.h"
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	mqtt_cursor c;
+	conn_param *cparam;
+	uint8_t *   pkt;
+	uint32_t    len;
+
+	mqtt_cursor_init(&c, (uint8_t *) data, size);
+	mqtt_get_u8(&c);
+	len = mqtt_get_varint(&c);
+	if (c.err || mqtt_cursor_left(&c) < len) {
+		return (0);
+	}
+	// A copy of exactly the packet, so reading past it is caught
+	size = c.pos + len;
+	if ((pkt = malloc(size)) == NULL) {
+		return (0);
+	}
+	memcpy(pkt, data, size);
+	if (conn_param_alloc(&cparam) == 0) {
+		conn_handler(pkt, cparam);
+		destroy_conn_param(cparam);
+	}
+	free(pkt);
+	return (0);
+}
@@ -0,0 +1,69 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// Stands in for libFuzzer when the compiler has none: runs each file
+// named on the command line, or standard input, through the harness once.
+// That is enough to replay a corpus or a crash under any sanitizer.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fuzz.h"
+
+static int
+run(FILE *f, const char *name)
+{
+	uint8_t *buf = NULL;
+	size_t   len = 0;
+	size_t   cap = 0;
+	size_t   n;
+
+	do {
+		if (len == cap) {
+			uint8_t *nbuf;
+
+			cap  = cap ? cap * 2 : 4096;
+			nbuf = realloc(buf, cap);
+			if (nbuf == NULL) {
+				free(buf);
+				fprintf(stderr, "%s: out of memory\n", name);
+				return (1);
+			}
+			buf = nbuf;
+		}
+		n = fread(buf + len, 1, cap - len, f);
+		len += n;
+	} while (n > 0);
+
+	LLVMFuzzerTestOneInput(buf, len);
+	free(buf);
+	return (0);
+}
+
+int
+main(int argc, char **argv)
+{
+	FILE *f;
+	int   rv = 0;
+
+	if (argc < 2) {
+		return (run(stdin, "stdin"));
+	}
+	for (int i = 1; i < argc; i++) {
+		if ((f = fopen(argv[i], "rb")) == NULL) {
+			perror(argv[i]);
+			rv = 1;
+			continue;
+		}
+		rv |= run(f, argv[i]);
+		fclose(f);
+	}
+	printf("%d inputs\n", argc - 1);
+	return (rv);
+}
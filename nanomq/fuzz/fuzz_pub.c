@@ -0,0 +1,69 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// decode_pub_message on a PUBLISH or one of its acknowledgements, from a
+// 3.1.1 or 5 client.  The top three bits of the flags byte pick the
+// packet type.  A PUBLISH that decodes is encoded again, as it would be
+// for a QoS 2 subscriber.
+
+#include <string.h>
+
+#include <nng/nng.h>
+#include <nng/protocol/mqtt/mqtt.h>
+
+#include "include/pub_handler.h"
+#include "fuzz.h"
+
+static const uint8_t types[] = {
+	CMD_PUBLISH,
+	CMD_PUBACK,
+	CMD_PUBREC,
+	CMD_PUBREL | 0x02,
+	CMD_PUBCOMP,
+};
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	emq_work work;
+	nng_msg *dest;
+	uint8_t  header;
+	size_t   t;
+
+	if (size < 1) {
+		return (0);
+	}
+	memset(&work, 0, sizeof(work));
+	work.cparam = fuzz_cparam((data[0] & FUZZ_V5) ? PROTOCOL_VERSION_v5
+	                                              : PROTOCOL_VERSION_v311);
+	t      = data[0] >> 5;
+	header = t < sizeof(types) ? types[t] : CMD_PUBLISH;
+	if (header == CMD_PUBLISH) {
+		header |= data[0] & 0x0f;
+	}
+	if (work.cparam == NULL ||
+	    (work.msg = fuzz_msg(header, data + 1, size - 1)) == NULL) {
+		return (0);
+	}
+	if ((work.pub_packet = nng_alloc(sizeof(struct pub_packet_struct))) ==
+	    NULL) {
+		nng_msg_free(work.msg);
+		return (0);
+	}
+
+	if (decode_pub_message(&work) == SUCCESS &&
+	    work.pub_packet->fixed_header.packet_type == PUBLISH &&
+	    nng_msg_alloc(&dest, 0) == 0) {
+		encode_pub_message(dest, &work, PUBLISH, 2, false);
+		nng_msg_free(dest);
+	}
+	free_pub_packet(work.pub_packet);
+	nng_msg_free(work.msg);
+	return (0);
+}
@@ -0,0 +1,61 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// decode_sub_message on a SUBSCRIBE from a 3.1.1 or 5 client.
+
+#include <string.h>
+
+#include <nng/nng.h>
+#include <nng/protocol/mqtt/mqtt.h>
+
+#include "include/sub_handler.h"
+#include "fuzz.h"
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	emq_work          work;
+	packet_subscribe *sub_pkt;
+	topic_node *      node;
+	topic_node *      next;
+
+	if (size < 1) {
+		return (0);
+	}
+	memset(&work, 0, sizeof(work));
+	work.cparam = fuzz_cparam((data[0] & FUZZ_V5) ? PROTOCOL_VERSION_v5
+	                                              : PROTOCOL_VERSION_v311);
+	if ((work.cparam == NULL) ||
+	    ((sub_pkt = nng_alloc(sizeof(*sub_pkt))) == NULL)) {
+		return (0);
+	}
+	memset(sub_pkt, 0, sizeof(*sub_pkt));
+	work.sub_pkt = sub_pkt;
+	if ((work.msg = fuzz_msg(CMD_SUBSCRIBE | 0x02, data + 1, size - 1)) !=
+	    NULL) {
+		decode_sub_message(&work);
+		nng_msg_free(work.msg);
+	}
+
+	for (node = sub_pkt->node; node != NULL; node = next) {
+		next = node->next;
+		if (node->it != NULL) {
+			nng_free(node->it->topic_filter.body,
+			    node->it->topic_filter.len + 1);
+			nng_free(node->it, sizeof(topic_with_option));
+		}
+		nng_free(node, sizeof(topic_node));
+	}
+	nng_free(sub_pkt->user_property.strpair.key,
+	    sub_pkt->user_property.strpair.len_key + 1);
+	nng_free(sub_pkt->user_property.strpair.val,
+	    sub_pkt->user_property.strpair.len_val + 1);
+	nng_free(sub_pkt, sizeof(*sub_pkt));
+	return (0);
+}
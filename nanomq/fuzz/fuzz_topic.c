@@ -0,0 +1,98 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// Topic scanning: every kernel this CPU runs finds what the scalar one
+// finds, and levels and wildcards agree with a plain walk over the bytes.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <nng/nng.h>
+#include <nng/protocol/mqtt/mqtt_codec.h>
+
+#include "fuzz.h"
+
+#define NSEP 8
+
+static const char *names[] = { "avx2", "sse2", "neon" };
+
+struct scan {
+	mqtt_topic_info info;
+	uint16_t        sep[NSEP];
+};
+
+static void
+scan(const char *kernel, const uint8_t *data, size_t size, struct scan *s)
+{
+	memset(s, 0, sizeof(*s));
+	if (mqtt_topic_kernel_set(kernel) == 0) {
+		mqtt_topic_scan(data, size, s->sep, NSEP, &s->info);
+	}
+}
+
+// Levels and wildcards the slow way.
+static void
+check(const uint8_t *data, size_t size, const struct scan *s)
+{
+	uint32_t levels = 1;
+	uint32_t flags  = 0;
+
+	for (size_t i = 0; i < size; i++) {
+		bool starts = i == 0 || data[i - 1] == '/';
+		bool ends   = i == size - 1 || data[i + 1] == '/';
+
+		switch (data[i]) {
+		case '/':
+			if (levels <= NSEP && s->sep[levels - 1] != i) {
+				abort();
+			}
+			levels++;
+			break;
+		case '+':
+			flags |= MQTT_TOPIC_PLUS;
+			if (!starts || !ends) {
+				flags |= MQTT_TOPIC_BADWILD;
+			}
+			break;
+		case '#':
+			flags |= MQTT_TOPIC_HASH;
+			if (!starts || i != size - 1) {
+				flags |= MQTT_TOPIC_BADWILD;
+			}
+			break;
+		}
+	}
+	if (s->info.levels != levels || s->info.flags != flags) {
+		abort();
+	}
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	struct scan want, got;
+
+	if (size > 65535) {
+		return (0);
+	}
+	scan("scalar", data, size, &want);
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (mqtt_topic_kernel_set(names[i]) != 0) {
+			continue;
+		}
+		scan(names[i], data, size, &got);
+		if (memcmp(&want, &got, sizeof(want)) != 0) {
+			abort();
+		}
+	}
+	if ((want.info.flags & MQTT_TOPIC_BADUTF8) == 0) {
+		check(data, size, &want);
+	}
+	return (0);
+}
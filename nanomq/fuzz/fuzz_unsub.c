@@ -0,0 +1,54 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// decode_unsub_message on an UNSUBSCRIBE from a 3.1.1 or 5 client.
+
+#include <string.h>
+
+#include <nng/nng.h>
+#include <nng/protocol/mqtt/mqtt.h>
+
+#include "include/unsub_handler.h"
+#include "fuzz.h"
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	emq_work            work;
+	packet_unsubscribe *unsub_pkt;
+	topic_node *        node;
+	topic_node *        next;
+
+	if (size < 1) {
+		return (0);
+	}
+	memset(&work, 0, sizeof(work));
+	work.cparam = fuzz_cparam((data[0] & FUZZ_V5) ? PROTOCOL_VERSION_v5
+	                                              : PROTOCOL_VERSION_v311);
+	if ((work.cparam == NULL) ||
+	    ((unsub_pkt = nng_alloc(sizeof(*unsub_pkt))) == NULL)) {
+		return (0);
+	}
+	memset(unsub_pkt, 0, sizeof(*unsub_pkt));
+	work.unsub_pkt = unsub_pkt;
+	if ((work.msg = fuzz_msg(CMD_UNSUBSCRIBE | 0x02, data + 1, size - 1)) !=
+	    NULL) {
+		decode_unsub_message(&work);
+		nng_msg_free(work.msg);
+	}
+
+	// The topic filters point into the message
+	for (node = unsub_pkt->node; node != NULL; node = next) {
+		next = node->next;
+		nng_free(node->it, sizeof(topic_with_option));
+		nng_free(node, sizeof(topic_node));
+	}
+	nng_free(unsub_pkt, sizeof(*unsub_pkt));
+	return (0);
+}
@@ -0,0 +1,51 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// Variable byte integers: get_var_integer agrees with the cursor decoder
+// on every well formed input, and put_var_integer encodes what was
+// decoded so that it decodes to the same value.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <nng/nng.h>
+#include <nng/protocol/mqtt/mqtt_codec.h>
+#include <nng/protocol/mqtt/mqtt_parser.h>
+
+#include "fuzz.h"
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	mqtt_cursor c;
+	uint8_t     buf[4] = { 0 };
+	uint32_t    val, pos = 0;
+	uint8_t     n;
+
+	mqtt_cursor_init(&c, (uint8_t *) data, size);
+	val = mqtt_get_varint(&c);
+	if (c.err) {
+		return (0);
+	}
+	// get_var_integer trusts its caller to have the bytes
+	memcpy(buf, data, c.pos);
+	if (get_var_integer(buf, &pos) != val || pos != c.pos) {
+		abort();
+	}
+
+	n = put_var_integer(buf, val);
+	if (n != mqtt_varint_len(val) || n > c.pos) {
+		abort();
+	}
+	pos = 0;
+	if (get_var_integer(buf, &pos) != val || pos != n) {
+		abort();
+	}
+	return (0);
+}
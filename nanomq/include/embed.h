@@ -0,0 +1,56 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANOMQ_EMBED_H
+#define NANOMQ_EMBED_H
+
+// Embedded broker.  Link libnanomq_embed into the application, start the
+// broker with nanomq_embed_start() and attach local clients with
+// nanomq_client_open().  Local clients talk to the broker over
+// mqtt+inproc://: nng_msg objects are handed to the broker by reference,
+// already carrying their decoded MQTT fields, so there is no socket and no
+// frame encode/decode on the way in, while topic matching, retained
+// messages and QoS handling are the same as for network clients.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <nng/nng.h>
+
+#define NANOMQ_INPROC_URL "mqtt+inproc://nanomq"
+
+typedef struct nanomq_client nanomq_client;
+
+// Start the broker inside this process.  It always listens on
+// NANOMQ_INPROC_URL, plus any of the nurl network urls given (may be 0).
+int nanomq_embed_start(int nurl, char **urls);
+
+// Attach an in-process client.  Behaves like a clean session MQTT 3.1.1
+// client with the given client id.
+int  nanomq_client_open(nanomq_client **clientp, const char *clientid);
+void nanomq_client_close(nanomq_client *client);
+
+int nanomq_client_subscribe(
+    nanomq_client *client, const char *topic, uint8_t qos);
+int nanomq_client_unsubscribe(nanomq_client *client, const char *topic);
+int nanomq_client_publish(nanomq_client *client, const char *topic,
+    const void *payload, size_t len, uint8_t qos, bool retain);
+
+// Receive the next packet for this client (PUBLISH, SUBACK, PUBACK, ...).
+// The caller owns the message and frees it with nng_msg_free().  QoS 1/2
+// PUBLISHes are acknowledged to the broker on receipt.
+int nanomq_client_recv(nanomq_client *client, nng_msg **msgp);
+
+// Views into a received PUBLISH.  Nothing is copied; the pointers are
+// valid until the message is freed.  The topic is not NUL terminated.
+int nanomq_publish_topic(nng_msg *msg, const char **topicp, size_t *lenp);
+int nanomq_publish_payload(nng_msg *msg, const void **datap, size_t *lenp);
+
+#endif // NANOMQ_EMBED_H
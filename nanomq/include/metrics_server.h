@@ -0,0 +1,18 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANOMQ_METRICS_SERVER_H
+#define NANOMQ_METRICS_SERVER_H
+
+// Serves the broker metrics (nng/supplemental/util/metrics.h) over HTTP
+// for Prometheus to scrape, at the path of the url, or /metrics if it
+// has none: http://0.0.0.0:8081 serves http://host:8081/metrics.
+int metrics_server_start(const char *url);
+
+#endif // NANOMQ_METRICS_SERVER_H
@@ -8,10 +8,15 @@
 #include <nng/nng.h>
 #include <apps/broker.h>
 #include "nng/protocol/mqtt/mqtt.h"
+#include "nng/protocol/mqtt/mqtt_codec.h"
 #include "include/packet.h"
 
 typedef uint32_t variable_integer;
 
+// Levels of a PUBLISH topic split up from the offsets found when decoding
+// it; deeper topics are split up again.
+#define PUB_TOPIC_SEPS 15
+
 //MQTT Fixed header
 struct fixed_header {
 	//flag_bits
@@ -24,58 +29,20 @@ struct fixed_header {
 	uint32_t                  remain_len;
 };
 
-struct property_u8 {
-	bool    has_value; //false: no value;
-	uint8_t value;
-};
-
-struct property_u16 {
-	bool     has_value; //false: no value;
-	uint16_t value;
-};
-
-struct property_u32 {
-	bool     has_value; //false: no value;
-	uint32_t value;
-};
-
-
-//Special for publish message data structure
-union property_content {
-	struct {
-		struct property_u8   payload_fmt_indicator;
-		struct property_u32  msg_expiry_interval;
-		struct property_u16  topic_alias;
-		struct mqtt_string   response_topic;
-		struct mqtt_binary   correlation_data;
-		struct mqtt_str_pair user_property;
-		struct property_u32  subscription_identifier;
-		struct mqtt_string   content_type;
-	} publish;
-	struct {
-		struct mqtt_string   reason_string;
-		struct mqtt_str_pair user_property;
-	} pub_arrc, puback, pubrec, pubrel, pubcomp;
-};
-
-//Properties
-struct properties {
-	uint32_t               len; //property length, exclude itself,variable byte integer;
-	union property_content content;
-};
-
 //MQTT Variable header
 union variable_header {
 	struct {
 		uint16_t           packet_identifier;
 		struct mqtt_string topic_name;
-		struct properties  properties;
+		uint32_t           topic_levels;
+		uint16_t           topic_sep[PUB_TOPIC_SEPS]; // of the first '/'
+		mqtt_props         properties;
 	} publish;
 
 	struct {
 		uint16_t          packet_identifier;
 		reason_code       reason_code: 8;
-		struct properties properties;
+		mqtt_props        properties;
 	} pub_arrc, puback, pubrec, pubrel, pubcomp;
 };
 
@@ -85,10 +52,14 @@ struct mqtt_payload {
 	uint32_t payload_len;
 };
 
+// A decoded packet does not own its strings, properties and payload: they
+// point into the body of msg, which the packet holds a reference to.  The
+// topic name in particular is not NUL terminated.
 struct pub_packet_struct {
 	struct fixed_header   fixed_header;
 	union variable_header variable_header;
 	struct mqtt_payload   payload_body;
+	nng_msg *             msg;
 };
 
 struct pipe_info {
@@ -107,6 +78,10 @@ struct pipe_content {
 	struct pipe_info *pipe_info;
 };
 
+// From mqtt_db.h, which the handlers include themselves.
+struct client;
+struct clients;
+
 typedef void (*handle_client)(struct client *sub_client, emq_work *pub_work, struct pipe_content *pipe_ct);
 
 bool
@@ -121,6 +96,5 @@ void free_pipes_info(struct pipe_info *p_info);
 void init_pipe_content(struct pipe_content *pipe_ct);
 void handle_pub(emq_work *work, struct pipe_content *pipe_ct);
 struct pub_packet_struct *copy_pub_packet(struct pub_packet_struct *src_pub_packet);
-void init_pub_packet_property(struct pub_packet_struct *pub_packet);
 
 #endif //NNG_PUB_HANDLER_H
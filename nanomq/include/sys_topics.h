@@ -0,0 +1,22 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANOMQ_SYS_TOPICS_H
+#define NANOMQ_SYS_TOPICS_H
+
+#include <mqtt_db.h>
+
+// Broker statistics under $SYS/broker/, with the names mosquitto uses:
+// $SYS/broker/clients/connected, $SYS/broker/load/messages/received/1min
+// and so on.  Every interval seconds the values that changed and that
+// someone has subscribed to are published, retained, by a client of the
+// broker's own over NANOMQ_INPROC_URL, which must be listened on.
+int sys_topics_start(struct db_tree *db, int interval);
+
+#endif // NANOMQ_SYS_TOPICS_H
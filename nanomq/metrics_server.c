@@ -0,0 +1,101 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <string.h>
+
+#include <nng/nng.h>
+#include <nng/supplemental/http/http.h>
+#include <nng/supplemental/util/metrics.h>
+
+#include "include/metrics_server.h"
+#include "include/nanomq.h"
+
+#define METRICS_PATH "/metrics"
+#define METRICS_TYPE "text/plain; version=0.0.4; charset=utf-8"
+
+// Formats the metrics for one scrape.  The output grows with the number
+// of metrics only, so the first guess is nearly always enough.
+static void
+metrics_serve(nng_aio *aio)
+{
+	nng_http_res *res;
+	char *        buf;
+	size_t        size = 8192;
+	size_t        len;
+	int           rv;
+
+	for (;;) {
+		if ((buf = nng_alloc(size)) == NULL) {
+			nng_aio_finish(aio, NNG_ENOMEM);
+			return;
+		}
+		if ((len = nano_metrics_format(buf, size)) < size) {
+			break;
+		}
+		nng_free(buf, size);
+		size = len + 1;
+	}
+
+	if ((rv = nng_http_res_alloc(&res)) != 0) {
+		nng_free(buf, size);
+		nng_aio_finish(aio, rv);
+		return;
+	}
+	if (((rv = nng_http_res_set_header(res, "Content-Type", METRICS_TYPE)) !=
+	        0) ||
+	    ((rv = nng_http_res_copy_data(res, buf, len)) != 0)) {
+		nng_free(buf, size);
+		nng_http_res_free(res);
+		nng_aio_finish(aio, rv);
+		return;
+	}
+	nng_free(buf, size);
+	nng_aio_set_output(aio, 0, res);
+	nng_aio_finish(aio, 0);
+}
+
+int
+metrics_server_start(const char *url)
+{
+	nng_url *         u;
+	nng_http_server * srv = NULL;
+	nng_http_handler *h   = NULL;
+	const char *      path;
+	int               rv;
+
+	if ((rv = nng_url_parse(&u, url)) != 0) {
+		return (rv);
+	}
+	path = METRICS_PATH;
+	if (u->u_path[0] != '\0' && strcmp(u->u_path, "/") != 0) {
+		path = u->u_path;
+	}
+
+	if (((rv = nng_http_server_hold(&srv, u)) != 0) ||
+	    ((rv = nng_http_handler_alloc(&h, path, metrics_serve)) != 0)) {
+		goto error;
+	}
+	if ((rv = nng_http_server_add_handler(srv, h)) != 0) {
+		nng_http_handler_free(h);
+		goto error;
+	}
+	if ((rv = nng_http_server_start(srv)) != 0) {
+		goto error;
+	}
+	debug_msg("serving metrics on %s at %s", url, path);
+	nng_url_free(u);
+	return (0);
+
+error:
+	if (srv != NULL) {
+		nng_http_server_release(srv);
+	}
+	nng_url_free(u);
+	return (rv);
+}
@@ -16,6 +16,8 @@
 #include <protocol/mqtt/mqtt_parser.h>
 #include <include/nanomq.h>
 #include <zmalloc.h>
+#include <nng/supplemental/util/metrics.h>
+#include <nng/supplemental/util/probe.h>
 
 #include "include/pub_handler.h"
 #include "include/sub_handler.h"
@@ -25,9 +27,9 @@
 
 static char *bytes_to_str(const unsigned char *src, char *dest, int src_len);
 static void print_hex(const char *prefix, const unsigned char *src, int src_len);
-static uint32_t append_bytes_with_type(nng_msg *msg, uint8_t type, uint8_t *content, uint32_t len);
 static void handle_client_pipe_msgs(struct client *sub_client, emq_work *pub_work, struct pipe_content *pipe_ct);
 static void handle_pub_retain(const emq_work *work, const char **topic_queue);
+static int64_t retain_size(const struct pub_packet_struct *packet);
 
 void
 init_pipe_content(struct pipe_content *pipe_ct)
@@ -132,6 +134,10 @@ handle_pub(emq_work *work, struct pipe_content *pipe_ct)
 {
 	char **topic_queue = NULL;
 
+	if ((work->rxtime = nng_msg_get_timestamp(work->msg)) != 0) {
+		nano_metric_observe(NANO_HIST_LAT_DISPATCH,
+		    nano_metric_clock() - work->rxtime);
+	}
 	work->pub_packet = (struct pub_packet_struct *) nng_alloc(sizeof(struct pub_packet_struct));
 
 	reason_code result = decode_pub_message(work);
@@ -141,7 +147,15 @@ handle_pub(emq_work *work, struct pipe_content *pipe_ct)
 		switch (work->pub_packet->fixed_header.packet_type) {
 			case PUBLISH:
 				debug_msg("handling PUBLISH (qos %d)", work->pub_packet->fixed_header.qos);
-				topic_queue = topic_parse(work->pub_packet->variable_header.publish.topic_name.body);
+				if (work->pub_packet->variable_header.publish.topic_levels <= PUB_TOPIC_SEPS + 1) {
+					topic_queue = topic_split(work->pub_packet->variable_header.publish.topic_name.body,
+					    work->pub_packet->variable_header.publish.topic_name.len,
+					    work->pub_packet->variable_header.publish.topic_sep,
+					    work->pub_packet->variable_header.publish.topic_levels - 1);
+				} else {
+					topic_queue = topic_parse_len(work->pub_packet->variable_header.publish.topic_name.body,
+					    work->pub_packet->variable_header.publish.topic_name.len);
+				}
 
 				switch (work->pub_packet->fixed_header.qos) {
 					case 0:
@@ -157,12 +171,25 @@ handle_pub(emq_work *work, struct pipe_content *pipe_ct)
 						break;
 				}
 
+				uint32_t acks = pipe_ct->total;
+				NANO_PROBE3(match_start, work->pid.id,
+				    work->pub_packet->variable_header.publish.topic_name.body,
+				    work->pub_packet->variable_header.publish.topic_name.len);
 				struct clients *client_list = search_client(work->db->root, topic_queue);
 
 				if (client_list != NULL) {
 					foreach_client(client_list, work, pipe_ct, handle_client_pipe_msgs);
 					free_clients(client_list);
 				}
+				nano_metric_observe(NANO_HIST_FANOUT, pipe_ct->total - acks);
+				NANO_PROBE4(match_done, work->pid.id,
+				    work->pub_packet->variable_header.publish.topic_name.body,
+				    work->pub_packet->variable_header.publish.topic_name.len,
+				    pipe_ct->total - acks);
+				if (work->rxtime != 0) {
+					nano_metric_observe(NANO_HIST_LAT_MATCH,
+					    nano_metric_clock() - work->rxtime);
+				}
 
 				debug_msg("pipe_info size: [%d]", pipe_ct->total);
 
@@ -174,8 +201,9 @@ handle_pub(emq_work *work, struct pipe_content *pipe_ct)
 				break;
 
 			case PUBACK:
+				// Acks of what we sent are settled by the
+				// protocol, against its inflight window.
 				debug_msg("handling PUBACK");
-				//TODO
 				break;
 
 			case PUBREC:
@@ -190,7 +218,6 @@ handle_pub(emq_work *work, struct pipe_content *pipe_ct)
 
 			case PUBCOMP:
 				debug_msg("handling PUBCOMP");
-				//TODO
 				break;
 
 			default:
@@ -217,6 +244,9 @@ static void handle_pub_retain(const emq_work *work, const char **topic_queue)
 
 			if (retain != NULL) {
 				if (retain->message != NULL) {
+					nano_metric_add(NANO_METRIC_RETAINED, -1);
+					nano_metric_add(NANO_METRIC_MEM_RETAINED,
+					    -retain_size(retain->message));
 					free_pub_packet(retain->message);
 				}
 				nng_free(retain, sizeof(struct retain_msg));
@@ -234,10 +264,11 @@ static void handle_pub_retain(const emq_work *work, const char **topic_queue)
 
 			retain->message = packet;
 			retain->exist   = true;
+			nano_metric_add(NANO_METRIC_RETAINED, 1);
+			nano_metric_add(NANO_METRIC_MEM_RETAINED, retain_size(packet));
 			debug_msg("update/add retain message");
 		} else {
-			retain->exist   = false;
-			retain->message = NULL;
+			// An empty payload deletes what was retained.
 			retain = NULL;
 			debug_msg("delete retain message");
 		}
@@ -252,49 +283,36 @@ static void handle_pub_retain(const emq_work *work, const char **topic_queue)
 	}
 }
 
+// What a retained message holds on to: the message its topic and payload
+// were decoded from, and the packet pointing into it.
+static int64_t
+retain_size(const struct pub_packet_struct *packet)
+{
+	int64_t size = sizeof(struct pub_packet_struct);
+
+	if (packet->msg != NULL) {
+		size += nng_msg_len(packet->msg) + nng_msg_header_len(packet->msg);
+	}
+	return (size);
+}
 
+// The copy shares the decoded bytes, and so takes a reference of its own
+// to the message they are in.
 struct pub_packet_struct *copy_pub_packet(struct pub_packet_struct *src_pub_packet)
 {
 	struct pub_packet_struct *packet = nng_alloc(sizeof(struct pub_packet_struct));
-	packet->variable_header.publish.topic_name.body = nng_alloc(
-			src_pub_packet->variable_header.publish.topic_name.len + 1);
-	memset(packet->variable_header.publish.topic_name.body, 0,
-	       src_pub_packet->variable_header.publish.topic_name.len + 1);
-	memcpy(packet->variable_header.publish.topic_name.body,
-	       src_pub_packet->variable_header.publish.topic_name.body,
-	       src_pub_packet->variable_header.publish.topic_name.len);
-	packet->variable_header.publish.topic_name.len = src_pub_packet->variable_header.publish.topic_name.len;
-
-	packet->payload_body.payload = nng_alloc(src_pub_packet->payload_body.payload_len);
-	memset(packet->payload_body.payload, 0, src_pub_packet->payload_body.payload_len + 1);
-	memcpy(packet->payload_body.payload, src_pub_packet->payload_body.payload,
-	       src_pub_packet->payload_body.payload_len);
-	packet->payload_body.payload_len = src_pub_packet->payload_body.payload_len;
+
+	*packet = *src_pub_packet;
+	if (packet->msg != NULL) {
+		nng_msg_clone(packet->msg);
+	}
 	return packet;
 }
 
 void free_pub_packet(struct pub_packet_struct *pub_packet)
 {
 	if (pub_packet != NULL) {
-		if (pub_packet->fixed_header.packet_type == PUBLISH) {
-			if (pub_packet->variable_header.publish.topic_name.body != NULL &&
-			    pub_packet->variable_header.publish.topic_name.len > 0) {
-				nng_free(pub_packet->variable_header.publish.topic_name.body,
-				         pub_packet->variable_header.publish.topic_name.len + 1);
-				pub_packet->variable_header.publish.topic_name.body = NULL;
-				pub_packet->variable_header.publish.topic_name.len  = 0;
-				debug_msg("free memory topic");
-			}
-
-			if (pub_packet->payload_body.payload != NULL &&
-			    pub_packet->payload_body.payload_len > 0) {
-				nng_free(pub_packet->payload_body.payload, pub_packet->payload_body.payload_len + 1);
-				pub_packet->payload_body.payload     = NULL;
-				pub_packet->payload_body.payload_len = 0;
-				debug_msg("free memory payload");
-			}
-		}
-
+		nng_msg_free(pub_packet->msg);
 		nng_free(pub_packet, sizeof(struct pub_packet_struct));
 		pub_packet = NULL;
 		debug_msg("free pub_packet");
@@ -310,27 +328,18 @@ void free_pipes_info(struct pipe_info *p_info)
 	}
 }
 
-static uint32_t
-append_bytes_with_type(nng_msg *msg, uint8_t type, uint8_t *content, uint32_t len)
-{
-	if (len > 0) {
-		nng_msg_append(msg, &type, 1);
-		nng_msg_append_u16(msg, len);
-		nng_msg_append(msg, content, len);
-		return 0;
-	}
-
-	return 1;
-}
-
 bool
 encode_pub_message(nng_msg *dest_msg, const emq_work *work, mqtt_control_packet_types cmd, uint8_t sub_qos, bool dup)
 {
-	uint8_t  tmp[4]     = {0};
-	uint32_t arr_len    = 0;
-	int      append_res = 0;
+	uint8_t     tmp[4]     = {0};
+	uint32_t    arr_len    = 0;
+	uint32_t    len        = 0;
+	uint32_t    props_len  = 0;
+	int         append_res = 0;
+	mqtt_cursor c;
+	mqtt_props  props;
 
-	properties_type prop_type;
+	struct fixed_header fixed;
 
 	const uint8_t proto_ver = conn_param_get_protover(work->cparam);
 
@@ -340,122 +349,60 @@ encode_pub_message(nng_msg *dest_msg, const emq_work *work, mqtt_control_packet_
 
 	switch (cmd) {
 		case PUBLISH:
-			/*fixed header*/
-			work->pub_packet->fixed_header.packet_type = cmd;
-			work->pub_packet->fixed_header.qos = work->pub_packet->fixed_header.qos < sub_qos ?
-				work->pub_packet->fixed_header.qos : sub_qos;
-			work->pub_packet->fixed_header.dup = dup;
-			append_res = nng_msg_header_append(dest_msg, (uint8_t *) &work->pub_packet->fixed_header, 1);
-
-			arr_len    = put_var_integer(tmp, work->pub_packet->fixed_header.remain_len);
-			append_res = nng_msg_header_append(dest_msg, tmp, arr_len);
-			debug_msg("header len [%ld] remain len [%d]", nng_msg_header_len(dest_msg), work->pub_packet->fixed_header.remain_len);
+			//a copy, the packet keeps its QoS for the next subscriber
+			fixed             = work->pub_packet->fixed_header;
+			fixed.packet_type = cmd;
+			fixed.qos         = fixed.qos < sub_qos ? fixed.qos : sub_qos;
+			fixed.dup         = dup;
 
 			/*variable header*/
-			//topic name
-			if (work->pub_packet->variable_header.publish.topic_name.len > 0) {
-				append_res = nng_msg_append_u16(dest_msg,
-				    work->pub_packet->variable_header.publish.topic_name.len);
-
-				append_res = nng_msg_append(dest_msg,
-					work->pub_packet->variable_header.publish.topic_name.body,
-				    work->pub_packet->variable_header.publish.topic_name.len);
+			//the length is known up front, so it is written in one pass
+			len = 2 + work->pub_packet->variable_header.publish.topic_name.len;
+			if (fixed.qos > 0) {
+				len += 2;
 			}
-
+#if SUPPORT_MQTT5_0
+			if (PROTOCOL_VERSION_v5 == proto_ver) {
+				//a topic alias belongs to the publisher's connection
+				props = work->pub_packet->variable_header.publish.properties;
+				mqtt_props_clear(&props, TOPIC_ALIAS);
+				props_len = mqtt_props_len(&props);
+				len += (uint32_t) mqtt_varint_len(props_len) + props_len;
+			}
+#endif
+			if ((append_res = nng_msg_realloc(dest_msg, len)) != 0) {
+				return false;
+			}
+			mqtt_cursor_init(&c, nng_msg_body(dest_msg), len);
+			//topic name
+			mqtt_put_u16(&c, (uint16_t) work->pub_packet->variable_header.publish.topic_name.len);
+			mqtt_put_bytes(&c, work->pub_packet->variable_header.publish.topic_name.body,
+			    work->pub_packet->variable_header.publish.topic_name.len);
 			//identifier
-			if (work->pub_packet->fixed_header.qos > 0) {
-				append_res = nng_msg_append_u16(dest_msg, work->pub_packet->variable_header.publish.packet_identifier);
+			if (fixed.qos > 0) {
+				mqtt_put_u16(&c, work->pub_packet->variable_header.publish.packet_identifier);
 			}
-			debug_msg("after topic and id len in msg already [%ld]", nng_msg_len(dest_msg));
-
 #if SUPPORT_MQTT5_0
+			//properties
 			if (PROTOCOL_VERSION_v5 == proto_ver) {
-				//properties
-				//properties length
-				memset(tmp, 0, sizeof(tmp));
-				arr_len = put_var_integer(tmp, work->pub_packet->variable_header.publish.properties.len);
-				nng_msg_append(dest_msg, tmp, arr_len);
-				debug_msg("arr_len [%d]", arr_len);
-
-				//Payload Format Indicator
-				if (work->pub_packet->variable_header.publish.properties.content.publish.payload_fmt_indicator.has_value){
-					prop_type = PAYLOAD_FORMAT_INDICATOR;
-					nng_msg_append(dest_msg, &prop_type, 1);
-					nng_msg_append(dest_msg,
-						&work->pub_packet->variable_header.publish.properties.content.publish.payload_fmt_indicator.value,
-						sizeof(work->pub_packet->variable_header.publish.properties.content.publish.payload_fmt_indicator));
-				}
-
-				//Message Expiry Interval
-				if (work->pub_packet->variable_header.publish.properties.content.publish.msg_expiry_interval.has_value) {
-					prop_type = MESSAGE_EXPIRY_INTERVAL;
-					nng_msg_append(dest_msg, &prop_type, 1);
-					nng_msg_append_u32(dest_msg, work->pub_packet->variable_header.publish.properties.content.publish.msg_expiry_interval.value);
-				}
-
-				//Topic Alias
-				if (work->pub_packet->variable_header.publish.properties.content.publish.topic_alias.has_value) {
-					prop_type = TOPIC_ALIAS;
-					nng_msg_append(dest_msg, &prop_type, 1);
-					nng_msg_append_u16(dest_msg, work->pub_packet->variable_header.publish.properties.content.publish.topic_alias.value);
-				}
-
-				//Response Topic 
-				if (work->pub_packet->variable_header.publish.properties.content.publish.response_topic.len > 0) {
-					append_bytes_with_type(dest_msg, RESPONSE_TOPIC,
-						(uint8_t *) work->pub_packet->variable_header.publish.properties.content.publish.response_topic.body,
-						work->pub_packet->variable_header.publish.properties.content.publish.response_topic.len);
-				}
-
-				//Correlation Data
-				if (work->pub_packet->variable_header.publish.properties.content.publish.correlation_data.len > 0) {
-					append_bytes_with_type(dest_msg, CORRELATION_DATA,
-						work->pub_packet->variable_header.publish.properties.content.publish.correlation_data.body,
-						work->pub_packet->variable_header.publish.properties.content.publish.correlation_data.len);
-				}
-
-				//User Property
-				if (work->pub_packet->variable_header.publish.properties.content.publish.user_property.len_key > 0) {
-					append_bytes_with_type(dest_msg, USER_PROPERTY,
-						(uint8_t *) work->pub_packet->variable_header.publish.properties.content.publish.user_property.key,
-						work->pub_packet->variable_header.publish.properties.content.publish.user_property.len_key);
-					nng_msg_append(dest_msg,
-						(uint8_t *) work->pub_packet->variable_header.publish.properties.content.publish.user_property.val,
-						work->pub_packet->variable_header.publish.properties.content.publish.user_property.len_val);
-				}
-
-				//Subscription Identifier
-				if (work->pub_packet->variable_header.publish.properties.content.publish.subscription_identifier.has_value) {
-					prop_type = SUBSCRIPTION_IDENTIFIER;
-					nng_msg_append(dest_msg, &prop_type, 1);
-					memset(tmp, 0, sizeof(tmp));
-					arr_len = put_var_integer(tmp, work->pub_packet->variable_header.publish.properties.content.publish.subscription_identifier.value);
-					nng_msg_append(dest_msg, tmp, arr_len);
-				}
-
-				//CONTENT TYPE
-				if (work->pub_packet->variable_header.publish.properties.content.publish.content_type.len > 0) {
-					append_bytes_with_type(dest_msg, CONTENT_TYPE,
-					    (uint8_t *) work->pub_packet->variable_header.publish.properties.content.publish.content_type.body,
-					    work->pub_packet->variable_header.publish.properties.content.publish.content_type.len);
-				}
-			}
-			/* check */
-			else {
-				debug_msg("pro_ver [%d]", proto_ver);
+				mqtt_props_encode(&c, &props);
 			}
 #endif
-			debug_msg("property len in msg already [%ld]", nng_msg_len(dest_msg));
-			
-			//payload
+			debug_msg("variable header len [%ld]", c.pos);
+
+			//payload, sent from the received packet without a copy
 			if (work->pub_packet->payload_body.payload_len > 0) {
-				append_res = nng_msg_append(dest_msg,
-					work->pub_packet->payload_body.payload,
-					work->pub_packet->payload_body.payload_len);
-//				debug_msg("payload [%s] len [%d]", (char *)work->pub_packet->payload_body.payload, work->pub_packet->payload_body.payload_len);
+				nng_msg_set_tail(dest_msg, work->pub_packet->msg,
+				    work->pub_packet->payload_body.payload -
+				        (uint8_t *) nng_msg_body(work->pub_packet->msg));
 			}
+			len += work->pub_packet->payload_body.payload_len;
 
-			debug_msg("after payload len in msg already [%ld]", nng_msg_len(dest_msg));
+			/*fixed header*/
+			append_res = nng_msg_header_append(dest_msg, (uint8_t *) &fixed, 1);
+			arr_len    = put_var_integer(tmp, len);
+			append_res = nng_msg_header_append(dest_msg, tmp, arr_len);
+			debug_msg("header len [%ld] remain len [%d]", nng_msg_header_len(dest_msg), len);
 			break;
 
 		case PUBREL:
@@ -490,23 +437,13 @@ encode_pub_message(nng_msg *dest_msg, const emq_work *work, mqtt_control_packet_
 				if (PROTOCOL_VERSION_v5 == proto_ver) {
 					//properties
 					if (pub_response.fixed_header.remain_len >= 4) {
-
-						memset(tmp, 0, sizeof(tmp));
-						arr_len = put_var_integer(tmp, pub_response.variable_header.pub_arrc.properties.len);
-						nng_msg_append(dest_msg, tmp, arr_len);
-
-						//reason string
-						append_bytes_with_type(dest_msg, REASON_STRING,
-							(uint8_t *) pub_response.variable_header.pub_arrc.properties.content.pub_arrc.reason_string.body,
-							pub_response.variable_header.pub_arrc.properties.content.pub_arrc.reason_string.len);
-
-						//user properties
-						append_bytes_with_type(dest_msg, USER_PROPERTY,
-						    (uint8_t *) pub_response.variable_header.pub_arrc.properties.content.pub_arrc.user_property.key,
-						    pub_response.variable_header.pub_arrc.properties.content.pub_arrc.user_property.len_key);
-						nng_msg_append(dest_msg,
-						    (uint8_t *) pub_response.variable_header.pub_arrc.properties.content.pub_arrc.user_property.val,
-						    pub_response.variable_header.pub_arrc.properties.content.pub_arrc.user_property.len_val);
+						props_len = mqtt_props_len(&pub_response.variable_header.pub_arrc.properties);
+						len = (uint32_t) mqtt_varint_len(props_len) + props_len;
+						if (nng_msg_realloc(dest_msg, nng_msg_len(dest_msg) + len) != 0) {
+							return false;
+						}
+						mqtt_cursor_init(&c, (uint8_t *) nng_msg_body(dest_msg) + nng_msg_len(dest_msg) - len, len);
+						mqtt_props_encode(&c, &pub_response.variable_header.pub_arrc.properties);
 					}
 				}
 #endif
@@ -527,10 +464,11 @@ encode_pub_message(nng_msg *dest_msg, const emq_work *work, mqtt_control_packet_
 reason_code
 decode_pub_message(emq_work *work)
 {
-	int     pos       = 0;
-	int     used_pos  = 0;
-	int     len, len_of_varint;
-	uint8_t proto_ver = conn_param_get_protover(work->cparam);
+	mqtt_cursor     c;
+	mqtt_buf        topic;
+	mqtt_topic_info topic_info;
+	int             rv;
+	uint8_t         proto_ver = conn_param_get_protover(work->cparam);
 
 	nng_msg *msg      = work->msg;
 	struct pub_packet_struct *pub_packet = work->pub_packet;
@@ -538,6 +476,8 @@ decode_pub_message(emq_work *work)
 	uint8_t *msg_body = nng_msg_body(msg);
 	size_t  msg_len   = nng_msg_len(msg);
 
+	nng_msg_clone(msg);
+	pub_packet->msg                     = msg;
 	pub_packet->fixed_header            = *(struct fixed_header *) nng_msg_header(msg);
 	pub_packet->fixed_header.remain_len = nng_msg_remaining_len(msg);
 
@@ -552,206 +492,100 @@ decode_pub_message(emq_work *work)
 		debug_msg("ERROR: remainlen > msg_len");
 		return PROTOCOL_ERROR;
 	}
+	mqtt_cursor_init(&c, msg_body, msg_len);
 
 	switch (pub_packet->fixed_header.packet_type) {
 		case PUBLISH:
 			//variable header
-			//topic length
-			NNI_GET16(msg_body + pos, pub_packet->variable_header.publish.topic_name.len);
-			pub_packet->variable_header.publish.topic_name.body = (char *) nng_alloc(
-				pub_packet->variable_header.publish.topic_name.len + 1);
-
-			memset((char *) pub_packet->variable_header.publish.topic_name.body, '\0',
-			       pub_packet->variable_header.publish.topic_name.len + 1);
-
-			pub_packet->variable_header.publish.topic_name.body = copy_utf8_str(msg_body, &pos, &len);
-
-			if (pub_packet->variable_header.publish.topic_name.len > 0) {
-				if (strchr(pub_packet->variable_header.publish.topic_name.body, '+') != NULL ||
-				    strchr(pub_packet->variable_header.publish.topic_name.body, '#') != NULL) {
+			//topic name
+			topic = mqtt_get_bin(&c);
+			if (c.err) {
+				return PROTOCOL_ERROR;
+			}
+			pub_packet->variable_header.publish.topic_name.body = (char *) topic.buf;
+			pub_packet->variable_header.publish.topic_name.len  = topic.len;
+
+			// UTF-8, wildcards and levels in one go
+			mqtt_topic_scan(topic.buf, topic.len,
+			    pub_packet->variable_header.publish.topic_sep, PUB_TOPIC_SEPS, &topic_info);
+			if (topic_info.flags & MQTT_TOPIC_BADUTF8) {
+				debug_msg("ERROR: not utf-8 format string.");
+				return PROTOCOL_ERROR;
+			}
+			if (topic_info.flags & (MQTT_TOPIC_PLUS | MQTT_TOPIC_HASH)) {
 
-					//TODO search topic alias if mqtt version = 5.0
+				//TODO search topic alias if mqtt version = 5.0
 
-					//protocol error
-					debug_msg("protocol error in topic:[%s], len: [%d]",
-					          pub_packet->variable_header.publish.topic_name.body,
-					          pub_packet->variable_header.publish.topic_name.len);
+				//protocol error
+				debug_msg("protocol error in topic:[%.*s], len: [%d]",
+				          (int) topic.len, topic.buf, topic.len);
 
-					return PROTOCOL_ERROR;
-				}
+				return PROTOCOL_ERROR;
 			}
+			pub_packet->variable_header.publish.topic_levels = topic_info.levels;
 
-			debug_msg("topic: [%s]", pub_packet->variable_header.publish.topic_name.body);
+			debug_msg("topic: [%.*s]", (int) topic.len, topic.buf);
 
 			if (pub_packet->fixed_header.qos > 0) { //extract packet_identifier while qos > 0
-				NNI_GET16(msg_body + pos, pub_packet->variable_header.publish.packet_identifier);
+				pub_packet->variable_header.publish.packet_identifier = mqtt_get_u16(&c);
 				debug_msg("identifier: [%d]", pub_packet->variable_header.publish.packet_identifier);
-				pos += 2;
 			}
 
-			used_pos = pos;
-			pub_packet->variable_header.publish.properties.len = 0;
-
+			mqtt_props_init(&pub_packet->variable_header.publish.properties);
 #if SUPPORT_MQTT5_0
 			if (PROTOCOL_VERSION_v5 == proto_ver) {
-				len_of_varint = 0;
-				pub_packet->variable_header.publish.properties.len = get_var_integer(msg_body, &len_of_varint);
-				pos += len_of_varint;
-				debug_msg("property len [%d]", pub_packet->variable_header.publish.properties.len);
-				init_pub_packet_property(pub_packet);
-				if (pub_packet->variable_header.publish.properties.len > 0) {
-					for (uint32_t i = 0; i < pub_packet->variable_header.publish.properties.len;) {
-						properties_type prop_type = get_var_integer(msg_body, &pos);
-						//TODO the same property cannot appear twice
-						switch (prop_type) {
-							case PAYLOAD_FORMAT_INDICATOR:
-								if (pub_packet->variable_header.publish.properties.content.publish.payload_fmt_indicator.has_value == false) {
-									pub_packet->variable_header.publish.properties.content.publish.payload_fmt_indicator.value = *(msg_body + pos);
-									pub_packet->variable_header.publish.properties.content.publish.payload_fmt_indicator.has_value = true;
-									++pos;
-									++i;
-								}
-								break;
-
-							case MESSAGE_EXPIRY_INTERVAL:
-								if (pub_packet->variable_header.publish.properties.content.publish.msg_expiry_interval.has_value == false) {
-									NNI_GET32(msg_body + pos, pub_packet->variable_header.publish.properties.content.publish.msg_expiry_interval.value);
-									pub_packet->variable_header.publish.properties.content.publish.msg_expiry_interval.has_value = true;
-									pos += 4;
-									i += 4;
-								}
-								break;
-
-							case CONTENT_TYPE:
-								if (pub_packet->variable_header.publish.properties.content.publish.content_type.len == 0) {
-									pub_packet->variable_header.publish.properties.content.publish.content_type.len =
-										get_utf8_str(&pub_packet->variable_header.publish.properties.content.publish.content_type.body, msg_body, &pos);
-									i = i + pub_packet->variable_header.publish.properties.content.publish.content_type.len + 2;
-								}
-								break;
-
-							case TOPIC_ALIAS:
-								if (pub_packet->variable_header.publish.properties.content.publish.topic_alias.has_value == false) {
-									NNI_GET16(msg_body + pos, pub_packet->variable_header.publish.properties.content.publish.topic_alias.value);
-									pub_packet->variable_header.publish.properties.content.publish.topic_alias.has_value = true;
-									pos += 2;
-									i += 2;
-								}
-								break;
-
-							case RESPONSE_TOPIC:
-								if (pub_packet->variable_header.publish.properties.content.publish.response_topic.len == 0) {
-									pub_packet->variable_header.publish.properties.content.publish.response_topic.len =
-										get_utf8_str(&pub_packet->variable_header.publish.properties.content.publish.response_topic.body, msg_body, &pos);
-									i = i + pub_packet->variable_header.publish.properties.content.publish.content_type.len + 2;
-								}
-								break;
-
-							case CORRELATION_DATA:
-								if (pub_packet->variable_header.publish.properties.content.publish.correlation_data.len == 0) {
-									pub_packet->variable_header.publish.properties.content.publish.correlation_data.len =
-										get_variable_binary(&pub_packet->variable_header.publish.properties.content.publish.correlation_data.body, msg_body + pos);
-									pos += pub_packet->variable_header.publish.properties.content.publish.correlation_data.len + 2;
-									i += pub_packet->variable_header.publish.properties.content.publish.correlation_data.len + 2;
-								}
-								break;
-
-							case USER_PROPERTY:
-								if (pub_packet->variable_header.publish.properties.content.publish.user_property.len_key == 0) {
-									pub_packet->variable_header.publish.properties.content.publish.user_property.len_key =
-										get_utf8_str(&pub_packet->variable_header.publish.properties.content.publish.user_property.key, msg_body, &pos);
-									i += pub_packet->variable_header.publish.properties.content.publish.user_property.len_key + 2;
-									pub_packet->variable_header.publish.properties.content.publish.user_property.len_val =
-										get_utf8_str(&pub_packet->variable_header.publish.properties.content.publish.user_property.val, msg_body, &pos);
-									i += pub_packet->variable_header.publish.properties.content.publish.user_property.len_val + 2;
-								}
-								break;
-
-							case SUBSCRIPTION_IDENTIFIER:
-								if (pub_packet->variable_header.publish.properties.content.publish.subscription_identifier.has_value == false) {
-									len_of_varint = 0;
-									pub_packet->variable_header.publish.properties.content.publish.subscription_identifier.value =
-										get_var_integer(msg_body, &len_of_varint);
-									i += len_of_varint;
-									pub_packet->variable_header.publish.properties.content.publish.subscription_identifier.has_value = true;
-									//Protocol error while Subscription Identifier = 0
-									if (pub_packet->variable_header.publish.properties.content.publish.subscription_identifier.value == 0) {
-										return false;
-									}
-								}
-								break;
-
-							default:
-								i++;
-								break;
-						}
-					}
+				rv = mqtt_props_decode(&c, &pub_packet->variable_header.publish.properties, PUBLISH);
+				if (rv != SUCCESS) {
+					return rv;
 				}
-				used_pos += pub_packet->variable_header.publish.properties.len + 1;
+				//only a server may send a Subscription Identifier
+				if (mqtt_props_has(&pub_packet->variable_header.publish.properties, SUBSCRIPTION_IDENTIFIER)) {
+					return PROTOCOL_ERROR;
+				}
+				debug_msg("property len [%d]", pub_packet->variable_header.publish.properties.block.len);
 			}
 			/* check */
 			else {
 				debug_msg("NOMQTT5ERR [%d] [%d]", proto_ver, PROTOCOL_VERSION_v5);
 			}
 #endif
+			if (c.err) {
+				return PROTOCOL_ERROR;
+			}
 
-			debug_msg("used pos: [%d]", used_pos);
+			debug_msg("used pos: [%ld]", c.pos);
 			//payload
-			pub_packet->payload_body.payload_len = (uint32_t) (msg_len - (size_t) used_pos);
-
-			if (pub_packet->payload_body.payload_len > 0) {
-				pub_packet->payload_body.payload = nng_alloc(pub_packet->payload_body.payload_len + 1);
-				memset(pub_packet->payload_body.payload, 0, pub_packet->payload_body.payload_len + 1);
-				memcpy(pub_packet->payload_body.payload, (uint8_t *) (msg_body + pos),
-				       pub_packet->payload_body.payload_len);
-				debug_msg("payload: [%s], len = %u", pub_packet->payload_body.payload,
-				          pub_packet->payload_body.payload_len);
-			}
+			pub_packet->payload_body.payload_len = (uint32_t) mqtt_cursor_left(&c);
+			pub_packet->payload_body.payload     = msg_body + c.pos;
+			debug_msg("payload: [%.*s], len = %u", (int) pub_packet->payload_body.payload_len,
+			          pub_packet->payload_body.payload, pub_packet->payload_body.payload_len);
 			break;
 
 		case PUBACK:
 		case PUBREC:
 		case PUBREL:
 		case PUBCOMP:
-			NNI_GET16(msg_body + pos, pub_packet->variable_header.pub_arrc.packet_identifier);
-			pos += 2;
+			pub_packet->variable_header.pub_arrc.packet_identifier = mqtt_get_u16(&c);
+			mqtt_props_init(&pub_packet->variable_header.pub_arrc.properties);
 			if (pub_packet->fixed_header.remain_len == 2) {
 				//Reason code can be ignored when remaining length = 2 and reason code = 0x00(Success)
 				pub_packet->variable_header.pub_arrc.reason_code = SUCCESS;
 				break;
 			}
-			pub_packet->variable_header.pub_arrc.reason_code = *(msg_body + pos);
-			++pos;
+			pub_packet->variable_header.pub_arrc.reason_code = mqtt_get_u8(&c);
 #if SUPPORT_MQTT5_0
-			if (pub_packet->fixed_header.remain_len > 4) {
-				pub_packet->variable_header.pub_arrc.properties.len = get_var_integer(msg_body, &pos);
-				for (uint32_t i = 0; i < pub_packet->variable_header.pub_arrc.properties.len;) {
-					properties_type prop_type = get_var_integer(msg_body, &pos);
-					switch (prop_type) {
-						case REASON_STRING:
-							pub_packet->variable_header.pub_arrc.properties.content.pub_arrc.reason_string.len =
-								get_utf8_str(&pub_packet->variable_header.pub_arrc.properties.content.pub_arrc.reason_string.body, msg_body, &pos);
-							i += pub_packet->variable_header.pub_arrc.properties.content.pub_arrc.reason_string.len + 2;
-							break;
-
-						case USER_PROPERTY:
-							if (pub_packet->variable_header.pub_arrc.properties.content.pub_arrc.user_property.len_key != 0) {
-								pub_packet->variable_header.pub_arrc.properties.content.pub_arrc.user_property.len_key =
-									get_utf8_str(&pub_packet->variable_header.pub_arrc.properties.content.pub_arrc.user_property.key, msg_body, &pos);
-								i += pub_packet->variable_header.pub_arrc.properties.content.pub_arrc.user_property.len_key + 2;
-								pub_packet->variable_header.pub_arrc.properties.content.pub_arrc.user_property.len_val =
-									get_utf8_str(&pub_packet->variable_header.pub_arrc.properties.content.pub_arrc.user_property.val, msg_body, &pos);
-								i += pub_packet->variable_header.pub_arrc.properties.content.pub_arrc.user_property.len_val + 2;
-							}
-							break;
-
-						default:
-							i++;
-							break;
-					}
+			//no properties when remaining length < 4
+			if (pub_packet->fixed_header.remain_len >= 4) {
+				rv = mqtt_props_decode(&c, &pub_packet->variable_header.pub_arrc.properties,
+				    pub_packet->fixed_header.packet_type);
+				if (rv != SUCCESS) {
+					return rv;
 				}
 			}
 #endif
+			if (c.err) {
+				return PROTOCOL_ERROR;
+			}
 			break;
 
 		default:
@@ -798,16 +632,3 @@ print_hex(const char *prefix, const unsigned char *src, int src_len)
 		nng_free(dest, src_len * 2);
 	}
 }
-
-void init_pub_packet_property(struct pub_packet_struct *pub_packet)
-{
-	pub_packet->variable_header.publish.properties.content.publish.payload_fmt_indicator.has_value = false;
-	pub_packet->variable_header.publish.properties.content.publish.msg_expiry_interval.has_value = false;
-	pub_packet->variable_header.publish.properties.content.publish.response_topic.len = 0;
-	pub_packet->variable_header.publish.properties.content.publish.topic_alias.has_value = 0;
-	pub_packet->variable_header.publish.properties.content.publish.content_type.len = 0;
-	pub_packet->variable_header.publish.properties.content.publish.correlation_data.len = 0;
-	pub_packet->variable_header.publish.properties.content.publish.user_property.len_key = 0;
-	pub_packet->variable_header.publish.properties.content.publish.user_property.len_val = 0;
-	pub_packet->variable_header.publish.properties.content.publish.subscription_identifier.has_value = false;
-}
@@ -10,6 +10,7 @@
 #include <nanolib.h>
 #include <protocol/mqtt/mqtt_parser.h>
 #include <protocol/mqtt/mqtt.h>
+#include <nng/supplemental/util/metrics.h>
 #include <include/pub_handler.h>
 #include "include/nanomq.h"
 #include "include/sub_handler.h"
@@ -25,96 +26,67 @@ void init_sub_property(packet_subscribe * sub_pkt)
 
 uint8_t decode_sub_message(emq_work * work)
 {
-	uint8_t    *variable_ptr;
-	uint8_t    *payload_ptr;
-	int        vpos = 0; // pos in variable
-	int        bpos = 0; // pos in payload
-
-	int        len_of_varint = 0, len_of_property = 0, len_of_properties = 0;
-	uint32_t   len_of_str, len_of_topic;
-	nng_msg    *msg = work->msg;
-	size_t     remaining_len = nng_msg_remaining_len(msg);
+	mqtt_cursor     c;
+	mqtt_props      props;
+	mqtt_buf        key, val, topic;
+	mqtt_topic_info topic_info;
+	uint8_t        *options;
+	size_t          iter = 0;
+	int             rv;
+	nng_msg        *msg = work->msg;
+	size_t          remaining_len = nng_msg_remaining_len(msg);
 
 	const uint8_t proto_ver = conn_param_get_protover(work->cparam);
-	uint8_t property_id;
 
 	topic_node * topic_node_t, * _topic_node;
 	topic_with_option * topic_option;
 
 	// handle variable header
-	variable_ptr = nng_msg_variable_ptr(msg);
+	mqtt_cursor_init(&c, nng_msg_body(msg), nng_msg_len(msg));
 
 	packet_subscribe * sub_pkt = work->sub_pkt;
-	NNI_GET16(variable_ptr + vpos, sub_pkt->packet_id);
-	vpos += 2;
+	sub_pkt->node      = NULL;
+	sub_pkt->packet_id = mqtt_get_u16(&c);
 
 #if SUPPORT_MQTT5_0
 	// Only Mqtt_v5 include property. 
 	if (PROTOCOL_VERSION_v5 == proto_ver) {
 		init_sub_property(sub_pkt);
-		// length of property in varibale
-		len_of_properties = get_var_integer(variable_ptr + vpos, &len_of_varint);
-		vpos += len_of_varint;
-		int target_pos = vpos + len_of_properties;
-
-		// parse property in variable
-		if (len_of_properties > 0) {
-			while (1) {
-				property_id = variable_ptr[vpos++];
-				switch (property_id) {
-					case SUBSCRIPTION_IDENTIFIER:
-						sub_pkt->sub_id.varint = get_var_integer(variable_ptr + vpos, &len_of_varint);
-						vpos += len_of_varint;
-						break;
-					case USER_PROPERTY:
-						// key
-						NNI_GET16(variable_ptr + vpos, len_of_str);
-						if ((sub_pkt->user_property.strpair.key = nng_alloc(len_of_str)) == 0) {
-							debug_msg("ERROR: nng_alloc");
-							return NNG_ENOMEM;
-						}
-						sub_pkt->user_property.strpair.len_key = len_of_str;
-						vpos += (len_of_str + 2);
-						len_of_str = 0;
-
-						// value
-						NNI_GET16(variable_ptr + vpos, len_of_str);
-						if ((sub_pkt->user_property.strpair.val = nng_alloc(len_of_str)) == 0) {
-							debug_msg("ERROR: nng_alloc");
-							return NNG_ENOMEM;
-						}
-						sub_pkt->user_property.strpair.len_val = len_of_str;
-						vpos += (len_of_str + 2);
-						len_of_str = 0;
-
-						break;
-					default:
-						break;
-				}
-				if (vpos >= target_pos) {
-					break;
-				}else if (vpos > target_pos) {
-					debug_msg("ERROR: protocol error");
-					return PROTOCOL_ERROR;
-				}
+		if ((rv = mqtt_props_decode(&c, &props, SUBSCRIBE)) != SUCCESS) {
+			debug_msg("ERROR: bad SUBSCRIBE properties");
+			return rv;
+		}
+		sub_pkt->sub_id.varint = mqtt_props_num(&props, SUBSCRIPTION_IDENTIFIER);
+		// packet_subscribe keeps the first user property only
+		if (mqtt_props_user(&props, &iter, &key, &val)) {
+			if ((sub_pkt->user_property.strpair.key = nng_alloc(key.len + 1)) == NULL ||
+			    (sub_pkt->user_property.strpair.val = nng_alloc(val.len + 1)) == NULL) {
+				debug_msg("ERROR: nng_alloc");
+				return NNG_ENOMEM;
 			}
+			memcpy(sub_pkt->user_property.strpair.key, key.buf, key.len);
+			sub_pkt->user_property.strpair.key[key.len] = '\0';
+			sub_pkt->user_property.strpair.len_key = key.len;
+			memcpy(sub_pkt->user_property.strpair.val, val.buf, val.len);
+			sub_pkt->user_property.strpair.val[val.len] = '\0';
+			sub_pkt->user_property.strpair.len_val = val.len;
 		}
 	}
 #endif
 
 	debug_msg("remainLen: [%ld] packetid : [%d]", remaining_len, sub_pkt->packet_id);
-	// handle payload
-	payload_ptr = nng_msg_payload_ptr(msg);
-
-	debug_msg("V:[%x %x %x %x] P:[%x %x %x %x].",
-		variable_ptr[0], variable_ptr[1], variable_ptr[2], variable_ptr[3],
-		payload_ptr[0], payload_ptr[1], payload_ptr[2], payload_ptr[3]);
+	// handle payload, it starts where the properties end
+	if (c.err || mqtt_cursor_left(&c) == 0) {
+		debug_msg("ERROR: no topic filter");
+		return PROTOCOL_ERROR;
+	}
 
 	if ((topic_node_t = nng_alloc(sizeof(topic_node))) == NULL) {
 		debug_msg("ERROR: nng_alloc");
 		return NNG_ENOMEM;
 	}
 	topic_node_t->next = NULL;
+	topic_node_t->it   = NULL;
 	sub_pkt->node      = topic_node_t;
 
 	while (1) {
@@ -122,40 +94,49 @@ uint8_t decode_sub_message(emq_work * work)
 			debug_msg("ERROR: nng_alloc");
 			return NNG_ENOMEM;
 		}
+		topic_option->topic_filter.body = NULL;
+		topic_option->topic_filter.len  = 0;
 		topic_node_t->it = topic_option;
 		_topic_node = topic_node_t;
 
-		NNI_GET16(payload_ptr + bpos, len_of_topic);
-		bpos += 2;
-
-		if (len_of_topic != 0) {
-			topic_option->topic_filter.len = len_of_topic;
-			topic_option->topic_filter.body = nng_alloc(len_of_topic);
-			if (topic_option->topic_filter.body == NULL) {
-				debug_msg("ERROR: nng_alloc");
-				return NNG_ENOMEM;
-			}
-			strncpy(topic_option->topic_filter.body, payload_ptr + bpos, len_of_topic);
-			bpos += len_of_topic;
-		} else {
+		topic = mqtt_get_bin(&c);
+		if (c.err || topic.len == 0) {
 			debug_msg("ERROR : topic length error.");
 			return PROTOCOL_ERROR;
 		}
+		mqtt_topic_scan(topic.buf, topic.len, NULL, 0, &topic_info);
+		if (topic_info.flags & (MQTT_TOPIC_BADUTF8 | MQTT_TOPIC_BADWILD)) {
+			debug_msg("ERROR: invalid topic filter [%.*s]", (int) topic.len, topic.buf);
+			return PROTOCOL_ERROR;
+		}
+		topic_option->topic_filter.len = topic.len;
+		topic_option->topic_filter.body = nng_alloc(topic.len + 1);
+		if (topic_option->topic_filter.body == NULL) {
+			debug_msg("ERROR: nng_alloc");
+			return NNG_ENOMEM;
+		}
+		memcpy(topic_option->topic_filter.body, topic.buf, topic.len);
+		topic_option->topic_filter.body[topic.len] = '\0';
 
-		memcpy(topic_option, payload_ptr + bpos, 1);
+		if ((options = mqtt_get_bytes(&c, 1)) == NULL) {
+			debug_msg("ERROR: no subscription options");
+			return PROTOCOL_ERROR;
+		}
+		memcpy(topic_option, options, 1);
 		if (topic_option->retain_handling > 2) {
 			debug_msg("ERROR: error inretain_handling flag setting");
 			return PROTOCOL_ERROR;
 		}
 		// TODO sub action when retain_handling equal 0 or 1 or 2
 
-		debug_msg("bpos+vpos: [%d] remainLen: [%ld].", bpos+vpos, remaining_len);
-		if (++bpos < remaining_len - vpos) {
+		debug_msg("pos: [%ld] remainLen: [%ld].", c.pos, remaining_len);
+		if (mqtt_cursor_left(&c) > 0) {
 			if ((topic_node_t = nng_alloc(sizeof(topic_node))) == NULL) {
 				debug_msg("ERROR: nng_alloc");
 				return NNG_ENOMEM;
 			}
 			topic_node_t->next = NULL;
+			topic_node_t->it   = NULL;
 			_topic_node->next = topic_node_t;
 		} else {
 			break;
@@ -282,6 +263,7 @@ uint8_t sub_ctx_handle(emq_work * work, client_ctx * cli_ctx)
 
 		if (tan.topic) { // not contain the node
 			add_node(&tan, client);
+			nano_metric_add(NANO_METRIC_SUBSCRIPTIONS, 1);
 			add_topic(client->id, topic_str);
 			add_pipe_id(work->pid.id, client->id);
 			// check
@@ -294,6 +276,7 @@ uint8_t sub_ctx_handle(emq_work * work, client_ctx * cli_ctx)
 				add_topic(client->id, topic_str);
 				add_pipe_id(work->pid.id, client->id);
 				add_client(&tan, client);
+				nano_metric_add(NANO_METRIC_SUBSCRIPTIONS, 1);
 			} else { // clientid already in hash
 				work->sub_pkt->node->it->reason_code = 0x80;
 			}
@@ -316,9 +299,6 @@ uint8_t sub_ctx_handle(emq_work * work, client_ctx * cli_ctx)
 			debug_msg("found retain [%p], message: [%p]", i->ret_msg, i->ret_msg->message);
 			work->pub_packet = copy_pub_packet(i->ret_msg->message);
 			work->pub_packet->fixed_header.retain = 1;
-			work->pub_packet->fixed_header.remain_len = work->pub_packet->payload_body.payload_len
-				+ work->pub_packet->variable_header.publish.topic_name.len+2
-				+ (work->pub_packet->fixed_header.qos == 0 ? 0 : 2);
 			put_pipe_msgs(cli_ctx, work, work->pipe_ct, PUBLISH);
 			// TODO WARNING!!!! remainlen is same only in pub
 			/* check info in pub_packet
@@ -431,8 +411,10 @@ void destroy_sub_ctx(void * ctxt)
 	topic_node * next_topic_node = NULL;
 	while (topic_node_t) {
 		next_topic_node = topic_node_t->next;
-		nng_free(topic_node_t->it->topic_filter.body, topic_node_t->it->topic_filter.len);
-		nng_free(topic_node_t->it, sizeof(topic_with_option));
+		if (topic_node_t->it) {
+			nng_free(topic_node_t->it->topic_filter.body, topic_node_t->it->topic_filter.len);
+			nng_free(topic_node_t->it, sizeof(topic_with_option));
+		}
 		nng_free(topic_node_t, sizeof(topic_node));
 		topic_node_t = next_topic_node;
 	}
@@ -0,0 +1,287 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <nng.h>
+#include <mqtt_db.h>
+#include <protocol/mqtt/mqtt.h>
+#include <protocol/mqtt/mqtt_codec.h>
+#include <nng/supplemental/util/metrics.h>
+#include <supplemental/util/platform.h>
+
+#include "include/embed.h"
+#include "include/nanomq.h"
+#include "include/sys_topics.h"
+
+#define SYS_CLIENT_ID "$SYS"
+#define SYS_VALUE_MAX 32
+
+enum {
+	SYS_CONNECTED,
+	SYS_CONNECTS,
+	SYS_MSGS_IN,
+	SYS_MSGS_OUT,
+	SYS_PUB_IN,
+	SYS_PUB_OUT,
+	SYS_PUB_DROPPED,
+	SYS_BYTES_IN,
+	SYS_BYTES_OUT,
+	SYS_SUBS,
+	SYS_RETAINED,
+	SYS_HEAP,
+	SYS_NVAL,
+};
+
+static const struct {
+	const char *topic;
+	int         val;
+} counts[] = {
+	{ "$SYS/broker/clients/connected", SYS_CONNECTED },
+	{ "$SYS/broker/messages/received", SYS_MSGS_IN },
+	{ "$SYS/broker/messages/sent", SYS_MSGS_OUT },
+	{ "$SYS/broker/publish/messages/received", SYS_PUB_IN },
+	{ "$SYS/broker/publish/messages/sent", SYS_PUB_OUT },
+	{ "$SYS/broker/publish/messages/dropped", SYS_PUB_DROPPED },
+	{ "$SYS/broker/bytes/received", SYS_BYTES_IN },
+	{ "$SYS/broker/bytes/sent", SYS_BYTES_OUT },
+	{ "$SYS/broker/subscriptions/count", SYS_SUBS },
+	{ "$SYS/broker/retained messages/count", SYS_RETAINED },
+	{ "$SYS/broker/heap/current", SYS_HEAP },
+};
+
+// Per minute, averaged exponentially over each window, as uptime(1) does.
+static const struct {
+	const char *name;
+	int         val;
+} loads[] = {
+	{ "messages/received", SYS_MSGS_IN },
+	{ "messages/sent", SYS_MSGS_OUT },
+	{ "publish/received", SYS_PUB_IN },
+	{ "publish/sent", SYS_PUB_OUT },
+	{ "publish/dropped", SYS_PUB_DROPPED },
+	{ "bytes/received", SYS_BYTES_IN },
+	{ "bytes/sent", SYS_BYTES_OUT },
+	{ "connections", SYS_CONNECTS },
+};
+
+static const struct {
+	const char *name;
+	double      minutes;
+} windows[] = { { "1min", 1 }, { "5min", 5 }, { "15min", 15 } };
+
+#define NCOUNTS (sizeof(counts) / sizeof(counts[0]))
+#define NLOADS (sizeof(loads) / sizeof(loads[0]))
+#define NWINDOWS (sizeof(windows) / sizeof(windows[0]))
+// The counts, uptime and the loads.
+#define NTOPICS (NCOUNTS + 1 + NLOADS * NWINDOWS)
+
+typedef struct {
+	int64_t v[SYS_NVAL];
+} sys_sample;
+
+typedef struct {
+	struct db_tree *db;
+	nanomq_client * client;
+	nng_thread *    thr;
+	int             interval;
+	nng_time        start;
+	nng_time        then; // of last
+	sys_sample      last;
+	sys_sample      own; // what the broker counted of our publishes
+	double          load[NLOADS][NWINDOWS];
+	char            sent[NTOPICS][SYS_VALUE_MAX]; // as last published
+} sys_topics;
+
+static sys_topics sys;
+
+static void
+sys_sample_take(const sys_topics *st, sys_sample *s)
+{
+	memset(s, 0, sizeof(*s));
+	// Less the broker's own client, which publishes these.
+	s->v[SYS_CONNECTED] = nano_metric_get(NANO_METRIC_CONNECTIONS) - 1;
+	s->v[SYS_CONNECTS]  = nano_metric_get(NANO_METRIC_CONNECTS);
+	for (int t = 1; t < 16; t++) {
+		s->v[SYS_MSGS_IN] += nano_metric_get(NANO_METRIC_PACKETS_IN + t);
+		s->v[SYS_MSGS_OUT] +=
+		    nano_metric_get(NANO_METRIC_PACKETS_OUT + t);
+	}
+	s->v[SYS_PUB_IN] =
+	    nano_metric_get(NANO_METRIC_PACKETS_IN + (CMD_PUBLISH >> 4));
+	s->v[SYS_PUB_OUT] =
+	    nano_metric_get(NANO_METRIC_PACKETS_OUT + (CMD_PUBLISH >> 4));
+	s->v[SYS_PUB_DROPPED] = nano_metric_get(NANO_METRIC_DROP_SQ_FULL) +
+	    nano_metric_get(NANO_METRIC_DROP_CONFLATED);
+	s->v[SYS_BYTES_IN]  = nano_metric_get(NANO_METRIC_BYTES_IN);
+	s->v[SYS_BYTES_OUT] = nano_metric_get(NANO_METRIC_BYTES_OUT);
+	s->v[SYS_SUBS]      = nano_metric_get(NANO_METRIC_SUBSCRIPTIONS);
+	s->v[SYS_RETAINED]  = nano_metric_get(NANO_METRIC_RETAINED);
+	s->v[SYS_HEAP]      = nano_metric_get(NANO_METRIC_MEM_MSG) +
+	    nano_metric_get(NANO_METRIC_MEM_POOL) +
+	    nano_metric_get(NANO_METRIC_MEM_RETAINED);
+	// And the PUBLISHes it received from us.  Its CONNECT comes over
+	// inproc and is not counted, nor is anything sent to us: we do
+	// not subscribe and publish at QoS 0.
+	for (int v = 0; v < SYS_NVAL; v++) {
+		s->v[v] -= st->own.v[v];
+	}
+}
+
+static void
+sys_load_update(sys_topics *s, const sys_sample *now, nng_time t)
+{
+	double minutes = (double) (t - s->then) / 60000;
+
+	if (minutes <= 0) {
+		return;
+	}
+	for (size_t i = 0; i < NLOADS; i++) {
+		double rate =
+		    (double) (now->v[loads[i].val] - s->last.v[loads[i].val]) /
+		    minutes;
+
+		for (size_t w = 0; w < NWINDOWS; w++) {
+			double keep = exp(-minutes / windows[w].minutes);
+
+			s->load[i][w] = s->load[i][w] * keep + rate * (1 - keep);
+		}
+	}
+}
+
+// Whether a subscription matches topic.  Wildcards at the start of a
+// filter do not match $ topics, so this is false for most brokers.
+static bool
+sys_subscribed(struct db_tree *db, const char *topic)
+{
+	char **         tq = topic_parse((char *) topic);
+	struct clients *cl = search_client(db->root, tq);
+	bool            found = false;
+
+	for (struct clients *c = cl; c != NULL; c = c->down) {
+		if (c->sub_client != NULL) {
+			found = true;
+			break;
+		}
+	}
+	free_clients(cl);
+	free_topic_queue(tq);
+	return (found);
+}
+
+// Publishes value to the i-th topic if it differs from what was there.
+static void
+sys_publish(sys_topics *s, size_t i, const char *topic, const char *value)
+{
+	size_t len = 2 + strlen(topic) + strlen(value); // remaining length
+	int    rv;
+
+	if (strcmp(s->sent[i], value) == 0) {
+		return;
+	}
+	if ((rv = nanomq_client_publish(s->client, topic, value,
+	         strlen(value), 0, true)) != 0) {
+		debug_msg("ERROR: publish %s: %d", topic, rv);
+		return;
+	}
+	snprintf(s->sent[i], SYS_VALUE_MAX, "%s", value);
+	s->own.v[SYS_MSGS_IN]++;
+	s->own.v[SYS_PUB_IN]++;
+	s->own.v[SYS_BYTES_IN] += 1 + mqtt_varint_len(len) + len;
+}
+
+// Values are only looked at, and messages only built, for topics that
+// someone subscribes to; the rest of a tick is a few counter reads.
+static void
+sys_tick(sys_topics *s, nng_time t)
+{
+	sys_sample now;
+	char       topic[64];
+	char       value[SYS_VALUE_MAX];
+	size_t     i = 0;
+
+	sys_sample_take(s, &now);
+	sys_load_update(s, &now, t);
+	s->last = now;
+	s->then = t;
+
+	for (size_t c = 0; c < NCOUNTS; c++, i++) {
+		if (sys_subscribed(s->db, counts[c].topic)) {
+			snprintf(value, sizeof(value), "%lld",
+			    (long long) now.v[counts[c].val]);
+			sys_publish(s, i, counts[c].topic, value);
+		}
+	}
+	if (sys_subscribed(s->db, "$SYS/broker/uptime")) {
+		snprintf(value, sizeof(value), "%llu seconds",
+		    (unsigned long long) (t - s->start) / 1000);
+		sys_publish(s, i, "$SYS/broker/uptime", value);
+	}
+	i++;
+	for (size_t l = 0; l < NLOADS; l++) {
+		for (size_t w = 0; w < NWINDOWS; w++, i++) {
+			snprintf(topic, sizeof(topic), "$SYS/broker/load/%s/%s",
+			    loads[l].name, windows[w].name);
+			if (sys_subscribed(s->db, topic)) {
+				snprintf(value, sizeof(value), "%.2f",
+				    s->load[l][w]);
+				sys_publish(s, i, topic, value);
+			}
+		}
+	}
+}
+
+// The ticks have a thread of their own: publishing blocks until the
+// broker takes the message, which on a taskq thread could wait on the
+// very threads the broker needs to take it.
+static void
+sys_thr(void *arg)
+{
+	sys_topics *s    = arg;
+	nng_time    next = s->start;
+	nng_time    now;
+
+	for (;;) {
+		next += (nng_time) s->interval * 1000;
+		if ((now = nng_clock()) < next) {
+			nng_msleep((nng_duration) (next - now));
+		} else {
+			next = now; // fell behind, do not catch up
+		}
+		sys_tick(s, nng_clock());
+	}
+}
+
+int
+sys_topics_start(struct db_tree *db, int interval)
+{
+	sys_topics *s = &sys;
+	int         rv;
+
+	if (interval <= 0) {
+		return (0);
+	}
+	s->db       = db;
+	s->interval = interval;
+	s->start    = nng_clock();
+	s->then     = s->start;
+	sys_sample_take(s, &s->last);
+
+	if ((rv = nanomq_client_open(&s->client, SYS_CLIENT_ID)) != 0) {
+		return (rv);
+	}
+	if ((rv = nng_thread_create(&s->thr, sys_thr, s)) != 0) {
+		nanomq_client_close(s->client);
+		return (rv);
+	}
+	nng_thread_set_name(s->thr, "nanomq:sys");
+	return (0);
+}
@@ -10,70 +10,47 @@
 #include <nanolib.h>
 #include <protocol/mqtt/mqtt_parser.h>
 #include <protocol/mqtt/mqtt.h>
+#include <protocol/mqtt/mqtt_codec.h>
+#include <nng/supplemental/util/metrics.h>
 #include "include/nanomq.h"
 #include "include/sub_handler.h"
 #include "include/unsub_handler.h"
 
 uint8_t decode_unsub_message(emq_work * work)
 {
-	uint8_t    *variable_ptr;
-	uint8_t    *payload_ptr;
-	int        vpos = 0; // pos in variable
-	int        bpos = 0; // pos in payload
-
-	int        len_of_varint = 0, len_of_property = 0, len_of_properties = 0;
-	int        len_of_str, len_of_topic;
+	mqtt_cursor c;
+	mqtt_props  props;
+	mqtt_buf    topic;
+	int         rv;
 
 	packet_unsubscribe * unsub_pkt = work->unsub_pkt;
 	nng_msg    *msg = work->msg;
 	size_t     remaining_len = nng_msg_remaining_len(msg);
 
-	uint8_t    property_id;
-
 	topic_node * topic_node_t, * _topic_node;
 	const uint8_t proto_ver = conn_param_get_protover(work->cparam);
 
 	// handle varibale header
-	variable_ptr = nng_msg_variable_ptr(msg);
-	NNI_GET16(variable_ptr, unsub_pkt->packet_id);
-	vpos += 2;
+	mqtt_cursor_init(&c, nng_msg_body(msg), nng_msg_len(msg));
+	unsub_pkt->node      = NULL;
+	unsub_pkt->packet_id = mqtt_get_u16(&c);
 
 	// Mqtt_v5 include property
-#if SUPPORT_MQTT5_0
 	if (PROTOCOL_VERSION_v5 == proto_ver) {
-		// length of property in variable
-		len_of_properties = get_var_integer(variable_ptr, &len_of_varint);
-		vpos += len_of_varint;
-
-		if (len_of_properties > 0) {
-			while (1) {
-				property_id = variable_ptr[vpos];
-				switch (property_id) {
-					case USER_PROPERTY:
-						// key
-						len_of_str = get_utf8_str(&(unsub_pkt->user_property.strpair.key), variable_ptr, &vpos);
-						unsub_pkt->user_property.strpair.len_key = len_of_str;
-						// value
-						len_of_str = get_utf8_str(&(unsub_pkt->user_property.strpair.val), variable_ptr, &vpos);
-						unsub_pkt->user_property.strpair.len_val = len_of_str;
-					default:
-						if (vpos > remaining_len) {
-							debug_msg("ERROR_IN_LEN_VPOS");
-						}
-				}
-			}
+		// the user properties are not kept
+		if ((rv = mqtt_props_decode(&c, &props, UNSUBSCRIBE)) != SUCCESS) {
+			debug_msg("ERROR: bad UNSUBSCRIBE properties");
+			return rv;
 		}
 	}
-#endif
 
 	debug_msg("remain_len: [%ld] packet_id : [%d]", remaining_len, unsub_pkt->packet_id);
 
-	// handle payload
-	payload_ptr = nng_msg_payload_ptr(msg);
-
-	debug_msg("V:[%x %x %x %x] P:[%x %x %x %x].",
-			variable_ptr[0], variable_ptr[1], variable_ptr[2], variable_ptr[3],
-			payload_ptr[0], payload_ptr[1], payload_ptr[2], payload_ptr[3]);
+	// handle payload, it starts where the properties end
+	if (c.err || mqtt_cursor_left(&c) == 0) {
+		debug_msg("ERROR: no topic filter");
+		return PROTOCOL_ERROR;
+	}
 
 	if ((topic_node_t = nng_alloc(sizeof(topic_node))) == NULL) {
 		debug_msg("ERROR: nng_alloc");
@@ -81,6 +58,7 @@ uint8_t decode_unsub_message(emq_work * work)
 	}
 	unsub_pkt->node = topic_node_t;
 	topic_node_t->next = NULL;
+	topic_node_t->it   = NULL;
 
 	while(1){
 		topic_with_option * topic_option;
@@ -91,21 +69,25 @@ uint8_t decode_unsub_message(emq_work * work)
 		topic_node_t->it = topic_option;
 		_topic_node = topic_node_t;
 
-		len_of_topic = get_utf8_str(&(topic_option->topic_filter.body), payload_ptr, &bpos); // len of topic filter
-		if (len_of_topic != -1) {
-			topic_option->topic_filter.len = len_of_topic;
-		} else {
+		// the topic filter points into msg
+		topic = mqtt_get_str(&c);
+		if (c.err) {
 			debug_msg("ERROR: not utf-8 format string.");
+			topic_option->topic_filter.body = NULL;
+			topic_option->topic_filter.len  = 0;
 			return PROTOCOL_ERROR;
 		}
+		topic_option->topic_filter.body = (char *) topic.buf;
+		topic_option->topic_filter.len  = topic.len;
 
-		debug_msg("bpos+vpos: [%d] remain_len: [%ld]", bpos+vpos, remaining_len);
-		if (bpos < remaining_len - vpos) {
+		debug_msg("pos: [%ld] remain_len: [%ld]", c.pos, remaining_len);
+		if (mqtt_cursor_left(&c) > 0) {
 			if ((topic_node_t = nng_alloc(sizeof(topic_node))) == NULL) {
 				debug_msg("ERROR: nng_alloc");
 				return NNG_ENOMEM;
 			}
 			topic_node_t->next = NULL;
+			topic_node_t->it   = NULL;
 			_topic_node->next = topic_node_t;
 		} else {
 			break;
@@ -208,6 +190,7 @@ uint8_t unsub_ctx_handle(emq_work * work)
 		if (tan.topic == NULL) { // find the topic
 			cli = del_client(&tan, clientid);
 			if (cli != NULL) {
+				nano_metric_add(NANO_METRIC_SUBSCRIPTIONS, -1);
 				// FREE clientinfo in dbtree and hashtable
 				del_sub_ctx(cli->ctxt, topic_str);
 				del_topic_one(clientid, topic_str);
@@ -243,7 +226,7 @@ void destroy_unsub_ctx(packet_unsubscribe * unsub_pkt)
 		debug_msg("ERROR : ctx->sub is nil");
 		return;
 	}
-	if (!(unsub_pkt->node->it)) {
+	if (!unsub_pkt->node || !(unsub_pkt->node->it)) {
 		debug_msg("ERROR : not find topic");
 		return;
 	}
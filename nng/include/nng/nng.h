@@ -1303,11 +1303,25 @@ NNG_DECL uint8_t * nng_msg_variable_ptr(nng_msg *msg);
 NNG_DECL uint8_t * nng_msg_payload_ptr(nng_msg *msg);
 NNG_DECL void nng_msg_set_payload_ptr(nng_msg *msg, uint8_t *ptr);
 NNG_DECL void nng_msg_set_remaining_len(nng_msg *msg, size_t len);
+NNG_DECL void nng_msg_set_cmd_type(nng_msg *msg, uint8_t cmd);
+NNG_DECL void nng_msg_set_conn_param(nng_msg *msg, void *cparam);
+// Receive time of a PUBLISH sampled for latency metrics, 0 if not sampled
+// (see nng/supplemental/util/metrics.h).  Copies and replies carry it on.
+NNG_DECL uint64_t nng_msg_get_timestamp(nng_msg *msg);
+NNG_DECL void nng_msg_set_timestamp(nng_msg *msg, uint64_t ns);
 NNG_DECL void nng_msg_clone(nng_msg *msg);
+// Send the body of src, from offset off on, after the body of msg without
+// copying it.  src is shared by reference, so neither message may be
+// modified afterwards; src may be freed by the caller.
+NNG_DECL void nng_msg_set_tail(nng_msg *msg, nng_msg *src, size_t off);
 NNG_DECL void nng_aio_set_pipeline(nng_aio *aio, uint32_t id);
+// Send the aio's message to every pipe in ids, in one operation.  The
+// array must stay valid until the send completes and may be reordered.
+NNG_DECL void nng_aio_set_pipes(nng_aio *aio, uint32_t *ids, size_t n);
 NNG_DECL void nng_aio_set_dbtree(nng_aio *aio, void *db);
 NNG_DECL void * nng_msg_get_conn_param(nng_msg *msg);
 
+NNG_DECL int conn_param_alloc(conn_param **cparamp);
 NNG_DECL const uint8_t * conn_param_get_clentid(conn_param *cparam);
 NNG_DECL const uint8_t * conn_param_get_pro_name(conn_param *cparam);
 NNG_DECL const void    * conn_param_get_will_topic(conn_param *cparam);
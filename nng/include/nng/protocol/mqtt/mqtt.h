@@ -26,6 +26,39 @@
 #define EMQ_MIN_HEADER_LEN sizeof(uint8_t)*8
 #define NANO_CONNECT_PACKET_LEN sizeof(uint8_t)*12
 
+/* Listener options, also settable on the socket before listening */
+// CONNECTs admitted per second, beyond that CONNACK CONNECTION_RATE_EXCEEDED
+#define NANO_OPT_CONN_RATE "mqtt:conn-rate"
+// Connections negotiating CONNECT at once, beyond that CONNACK SERVER_BUSY
+#define NANO_OPT_NEGO_MAX "mqtt:nego-max"
+
+/* Socket options, per subscriber send queues */
+// Limits of each pipe's queue of messages not yet sent, in messages (int)
+// and bytes (size); set them before the pipes they should apply to connect
+#define NANO_OPT_SQ_MAX_MSGS "mqtt:sq-max-msgs"
+#define NANO_OPT_SQ_MAX_BYTES "mqtt:sq-max-bytes"
+// What a full queue does with a new QoS 0 PUBLISH (int, NANO_SQ_*).  Other
+// packets are always queued.
+#define NANO_OPT_SQ_POLICY "mqtt:sq-policy"
+// How long a queue may stay full under NANO_SQ_DISCONNECT (ms)
+#define NANO_OPT_SQ_GRACE "mqtt:sq-grace"
+
+#define NANO_SQ_DROP_NEWEST 0 // discard the new message
+#define NANO_SQ_DROP_OLDEST 1 // discard the oldest QoS 0 message queued
+#define NANO_SQ_DISCONNECT 2  // drop newest, close the pipe after the grace
+#define NANO_SQ_CONFLATE 3    // replace one on the same topic, else oldest
+
+// Answer PUBREL with PUBCOMP in the protocol, without the application
+// seeing it (bool, default true).  PINGREQ is always answered there.
+#define NANO_OPT_FAST_PUBREL "mqtt:fast-pubrel"
+
+/* Socket options, outbound QoS 1/2 */
+// PUBLISHes each pipe may have unacknowledged (int, 0 disables tracking),
+// further bounded by a v5 client's Receive Maximum; applies to new pipes
+#define NANO_OPT_INFLIGHT "mqtt:inflight"
+// Retransmit, with DUP, what is not acknowledged after this (ms, 0 never)
+#define NANO_OPT_RETRY_TIME "mqtt:retry-time"
+
 /* Message types */
 #define CMD_CONNECT 0x10
 #define CMD_CONNACK 0x20
@@ -0,0 +1,115 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NNG_MQTT_CODEC_H
+#define NNG_MQTT_CODEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <nng/nng.h>
+
+// A cursor over a buffer of known length.  Reading or writing past the
+// end never touches memory outside the buffer: it sets err, reads yield
+// zero and writes are dropped.  err stays set, so a decoder can run to
+// the end of a packet and check once whether everything was there.
+typedef struct mqtt_cursor {
+	uint8_t *buf;
+	size_t   len;
+	size_t   pos;
+	bool     err;
+} mqtt_cursor;
+
+// Bytes inside a packet, neither copied nor NUL terminated.
+typedef struct mqtt_buf {
+	uint8_t *buf;
+	uint32_t len;
+} mqtt_buf;
+
+NNG_DECL void     mqtt_cursor_init(mqtt_cursor *, void *, size_t);
+NNG_DECL size_t   mqtt_cursor_left(const mqtt_cursor *);
+NNG_DECL uint8_t  mqtt_get_u8(mqtt_cursor *);
+NNG_DECL uint16_t mqtt_get_u16(mqtt_cursor *);
+NNG_DECL uint32_t mqtt_get_u32(mqtt_cursor *);
+NNG_DECL uint32_t mqtt_get_varint(mqtt_cursor *);
+NNG_DECL uint8_t *mqtt_get_bytes(mqtt_cursor *, size_t);
+// Two byte length prefixed data; a string must also be valid UTF-8.
+NNG_DECL mqtt_buf mqtt_get_bin(mqtt_cursor *);
+NNG_DECL mqtt_buf mqtt_get_str(mqtt_cursor *);
+
+NNG_DECL void   mqtt_put_u8(mqtt_cursor *, uint8_t);
+NNG_DECL void   mqtt_put_u16(mqtt_cursor *, uint16_t);
+NNG_DECL void   mqtt_put_u32(mqtt_cursor *, uint32_t);
+NNG_DECL void   mqtt_put_varint(mqtt_cursor *, uint32_t);
+NNG_DECL void   mqtt_put_bytes(mqtt_cursor *, const void *, size_t);
+NNG_DECL void   mqtt_put_bin(mqtt_cursor *, mqtt_buf);
+NNG_DECL size_t mqtt_varint_len(uint32_t);
+
+#define MQTT_PROP_NUMS 17
+#define MQTT_PROP_BUFS 9
+
+// MQTT 5 properties of one packet.  Every property but USER_PROPERTY may
+// appear at most once and has a slot of its own: numbers in num[],
+// strings and binary data in buf[] as views into the packet.  User
+// properties repeat and keep their order, so they are left in the
+// received block and walked with mqtt_props_user().
+typedef struct mqtt_props {
+	uint64_t present; // 1 << identifier, for every property set
+	uint32_t num[MQTT_PROP_NUMS];
+	mqtt_buf buf[MQTT_PROP_BUFS];
+	mqtt_buf block; // the property block as received
+	uint32_t nuser; // user properties in block
+} mqtt_props;
+
+// Packet type for the will properties in the payload of a CONNECT.
+#define MQTT_PROPS_WILL 0
+
+NNG_DECL void mqtt_props_init(mqtt_props *);
+// Decodes a property length and block for a packet of the given type.
+// Returns SUCCESS, MALFORMED_PACKET or PROTOCOL_ERROR; the views in props
+// point into the cursor's buffer.
+NNG_DECL int mqtt_props_decode(mqtt_cursor *, mqtt_props *, uint8_t);
+// Length of the encoded properties, not counting the length itself.
+NNG_DECL uint32_t mqtt_props_len(const mqtt_props *);
+NNG_DECL void     mqtt_props_encode(mqtt_cursor *, const mqtt_props *);
+
+NNG_DECL bool     mqtt_props_has(const mqtt_props *, uint8_t);
+NNG_DECL uint32_t mqtt_props_num(const mqtt_props *, uint8_t);
+NNG_DECL mqtt_buf mqtt_props_buf(const mqtt_props *, uint8_t);
+NNG_DECL void     mqtt_props_set_num(mqtt_props *, uint8_t, uint32_t);
+NNG_DECL void mqtt_props_set_buf(mqtt_props *, uint8_t, void *, uint32_t);
+NNG_DECL void mqtt_props_clear(mqtt_props *, uint8_t);
+// Next user property after *iter, which starts at 0.
+NNG_DECL bool mqtt_props_user(
+    const mqtt_props *, size_t *, mqtt_buf *, mqtt_buf *);
+
+// What mqtt_topic_scan() found in a topic name or filter.
+typedef struct mqtt_topic_info {
+	uint32_t flags;  // MQTT_TOPIC_*
+	uint32_t levels; // number of '/', plus one
+} mqtt_topic_info;
+
+#define MQTT_TOPIC_PLUS 0x01u    // has a '+'
+#define MQTT_TOPIC_HASH 0x02u    // has a '#'
+#define MQTT_TOPIC_BADWILD 0x04u // a wildcard shares its level, or '#' not last
+#define MQTT_TOPIC_BADUTF8 0x08u // not UTF-8 as MQTT allows, NUL included
+
+// Checks len bytes of a string in one pass: UTF-8 and, for a topic, where
+// its levels and wildcards are.  The offsets of the first nsep '/' go to
+// sep.  Nothing else is meaningful once MQTT_TOPIC_BADUTF8 is set.
+NNG_DECL void mqtt_topic_scan(
+    const uint8_t *, size_t, uint16_t *, size_t, mqtt_topic_info *);
+// Name of the kernel the scan runs on: "avx2", "sse2", "neon" or
+// "scalar".  Benchmarks may pick another one; NNG_ENOTSUP if this build
+// or CPU does not have it.
+NNG_DECL const char *mqtt_topic_kernel(void);
+NNG_DECL int         mqtt_topic_kernel_set(const char *);
+
+#endif // NNG_MQTT_CODEC_H
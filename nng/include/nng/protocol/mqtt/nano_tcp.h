@@ -16,6 +16,9 @@ extern "C" {
 
 NNG_DECL int nng_nano_tcp0_open(nng_socket *);
 
+// Client end of nano_tcp, used by in-process clients (mqtt+inproc://).
+NNG_DECL int nng_nano_client0_open(nng_socket *);
+
 #ifndef nng_nano_tcp_open
 #define nng_nano_tcp_open nng_nano_tcp0_open
 #endif
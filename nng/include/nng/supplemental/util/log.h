@@ -0,0 +1,85 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NNG_SUPPLEMENTAL_UTIL_LOG_H
+#define NNG_SUPPLEMENTAL_UTIL_LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <nng/nng.h>
+
+// Asynchronous logging.
+//
+// A call site costs a level check while its level is off.  When it is
+// on, the arguments are copied into a ring buffer of the calling thread,
+// without locks or formatting; a writer thread formats them and writes
+// them out.  Levels are set per module, a module being the source file
+// a message comes from without directory or extension ("pub_handler",
+// "tcp").  Each call site logs at most a set number of messages per
+// second; the others are counted and the count reported.
+//
+// The NANOMQ_LOG environment variable configures logging at start up:
+//
+//	NANOMQ_LOG=warn,pub_handler=debug,tcp=trace
+//
+// NANOMQ_LOG_FILE names a file to append to besides stderr, and
+// NANOMQ_LOG_SYSLOG=1 sends messages to syslog as well, on POSIX systems.
+// NANOMQ_LOG_RATE sets the messages per second per call site, 0 for no
+// limit.
+
+typedef enum {
+	NANO_LOG_OFF,
+	NANO_LOG_ERROR,
+	NANO_LOG_WARN,
+	NANO_LOG_INFO,
+	NANO_LOG_DEBUG,
+	NANO_LOG_TRACE,
+} nano_log_level;
+
+// A place that logs, one per macro expansion.
+typedef struct nano_log_site {
+	const char *file;
+	const char *func;
+	const char *fmt;
+	int         line;
+	int         level;
+} nano_log_site;
+
+NNG_DECL bool nano_log_enabled(const nano_log_site *);
+NNG_DECL void nano_log_write(const nano_log_site *, ...);
+
+// Sets the level of a module, or of every module for NULL or "*".
+NNG_DECL void nano_log_set_level(const char *, nano_log_level);
+NNG_DECL nano_log_level nano_log_get_level(const char *);
+// Parses a level name: "off", "error", "warn", "info", "debug", "trace".
+NNG_DECL int nano_log_parse_level(const char *, nano_log_level *);
+// Sets module levels from a NANOMQ_LOG style list.
+NNG_DECL int nano_log_configure(const char *);
+// Writes out everything logged so far.
+NNG_DECL void nano_log_flush(void);
+// Gives up the calling thread's buffer once it is written out.  nng's
+// own threads do this as they exit; other threads that log and then
+// exit should, or their buffer stays until the process exits.
+NNG_DECL void nano_log_thr_fini(void);
+
+#define nano_log(lvl, fmt, arg...)                                          \
+	do {                                                                \
+		static const nano_log_site nano_log_site_ = { __FILE__,     \
+			__func__, fmt, __LINE__, lvl };                     \
+		if (0) {                                                    \
+			printf(fmt, ##arg); /* format checking only */      \
+		}                                                           \
+		if (nano_log_enabled(&nano_log_site_)) {                    \
+			nano_log_write(&nano_log_site_, ##arg);             \
+		}                                                           \
+	} while (0)
+
+#endif // NNG_SUPPLEMENTAL_UTIL_LOG_H
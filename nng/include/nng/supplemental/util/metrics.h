@@ -0,0 +1,90 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NNG_SUPPLEMENTAL_UTIL_METRICS_H
+#define NNG_SUPPLEMENTAL_UTIL_METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <nng/nng.h>
+
+// Broker metrics.
+//
+// Every thread that counts has a set of counters of its own, so that
+// counting is an uncontended add to memory no other thread writes.  Reading adds
+// up the threads' sets; what a thread counted stays counted after it
+// exits.  Gauges are counters too, raised and lowered by the threads that
+// change what they measure, so a thread's share of one can be negative.
+//
+// nano_metrics_format() writes them all out in the Prometheus text
+// format, which is what the broker's /metrics endpoint serves.
+//
+// Latency is measured on a sample of PUBLISHes, one in 16 by default or
+// one in NANOMQ_LATENCY_SAMPLE (0 for none): the transport stamps the
+// message when it has come in, and each stage records the time since.
+
+typedef enum {
+	NANO_METRIC_CONNECTIONS,  // gauge: client connections open
+	NANO_METRIC_CONNECTS,     // CONNECTs accepted
+	NANO_METRIC_REFUSED_BUSY, // CONNECTs refused by admission control
+	NANO_METRIC_REFUSED_BAD,  // CONNECTs that did not parse
+	// packets by MQTT packet type, (cmd >> 4) added to these
+	NANO_METRIC_PACKETS_IN,
+	NANO_METRIC_PACKETS_OUT = NANO_METRIC_PACKETS_IN + 16,
+	NANO_METRIC_BYTES_IN    = NANO_METRIC_PACKETS_OUT + 16,
+	NANO_METRIC_BYTES_OUT,
+	NANO_METRIC_SUBSCRIPTIONS, // gauge: client and filter pairs
+	NANO_METRIC_RETAINED,      // gauge: retained messages
+	NANO_METRIC_SQ_MSGS,       // gauge: messages in send queues
+	NANO_METRIC_SQ_BYTES,      // gauge: bytes in send queues
+	NANO_METRIC_INFLIGHT,      // gauge: QoS 1/2 unacknowledged
+	NANO_METRIC_DROP_SQ_FULL,  // QoS 0 dropped for a full send queue
+	NANO_METRIC_DROP_CONFLATED, // QoS 0 replaced by a newer one
+	NANO_METRIC_SLOW_CLOSED,   // subscribers closed for being too slow
+	NANO_METRIC_RETRIES,       // QoS 1/2 sent again
+	NANO_METRIC_MEM_MSG,       // gauge: bytes in messages
+	NANO_METRIC_MEM_POOL,      // gauge: bytes cached by message pools
+	NANO_METRIC_MEM_RETAINED,  // gauge: bytes in retained messages
+	NANO_METRIC_COUNT,
+} nano_metric;
+
+// Histograms have buckets for 0 and for values up to base times each
+// power of two, and one for the rest.  Quantiles come from finer buckets,
+// eight to each power of two, so they are within 1/8 of the value.
+typedef enum {
+	NANO_HIST_FANOUT,       // subscribers a PUBLISH goes to
+	NANO_HIST_LAT_DISPATCH, // ns from receive to the broker taking it
+	NANO_HIST_LAT_MATCH,    // ns from receive to subscribers found
+	NANO_HIST_LAT_DELIVER,  // ns from receive to written to a subscriber
+	NANO_HIST_COUNT,
+} nano_histogram;
+
+NNG_DECL void nano_metric_add(nano_metric, int64_t);
+NNG_DECL void nano_metric_observe(nano_histogram, uint64_t);
+NNG_DECL int64_t nano_metric_get(nano_metric);
+// Folds the calling thread's counters into the totals and frees them.
+// nng threads call this as they exit; a thread of the application that
+// counted may, or its counters are kept until the process exits.
+NNG_DECL void nano_metric_thr_fini(void);
+// The value q (0 to 1) of the observations are at or below, 0 if none.
+NNG_DECL uint64_t nano_metric_quantile(nano_histogram, double q);
+
+// Whether to time this PUBLISH, true once every so many calls.
+NNG_DECL bool nano_metric_sample(void);
+// Monotonic nanoseconds, never 0.
+NNG_DECL uint64_t nano_metric_clock(void);
+
+// Writes the metrics to buf, NUL terminated, and returns the length of
+// all of them, like snprintf: a result of size or more means buf was
+// too small.
+NNG_DECL size_t nano_metrics_format(char *, size_t);
+
+#endif // NNG_SUPPLEMENTAL_UTIL_METRICS_H
@@ -0,0 +1,56 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NNG_SUPPLEMENTAL_UTIL_PROBE_H
+#define NNG_SUPPLEMENTAL_UTIL_PROBE_H
+
+// Static tracepoints (USDT) along the path of a packet, for perf and
+// bpftrace to attach to in a running broker, as usdt:<binary>:nanomq:<name>.
+//
+// Built with -DNNG_ENABLE_USDT=ON where <sys/sdt.h> is found (systemtap's
+// headers), each probe is a single nop in the code and a note in the
+// binary; its arguments are only read when something is attached.  Built
+// without, the probes and their arguments are compiled out.
+//
+// The probes and their arguments (see nanomq/trace/ for scripts):
+//
+//	recv(pipe, type, len)           transport has read a whole packet
+//	handoff(pipe, type, len, held)  protocol hands it to a work ctx;
+//	                                held is 1 if it had to wait for one
+//	work(ctx, state, rv)            broker work ctx callback, by state
+//	                                (0 INIT, 1 RECV, 3 SEND; a packet
+//	                                received is handled in the same
+//	                                callback, WAIT has none of its own)
+//	match_start(pipe, topic, len)   subscribers of a PUBLISH searched
+//	match_done(pipe, topic, len, n) ... and n found
+//	encode(pipe, type, len)         reply or PUBLISH encoded for pipe
+//	send_start(pipe, type, len)     transport starts writing a packet
+//	send_done(pipe, type, len, rv)  ... and has written it, or failed
+//	pipe_open(pipe)                 client connection starts
+//	pipe_close(pipe)                ... and ends
+//
+// pipe is the pipe id, type the MQTT packet type in the high nibble as
+// on the wire (0x30 is PUBLISH), len in bytes; topic is not terminated.
+
+#ifdef NNG_HAVE_USDT
+#include <sys/sdt.h>
+
+#define NANO_PROBE1(name, a) DTRACE_PROBE1(nanomq, name, a)
+#define NANO_PROBE2(name, a, b) DTRACE_PROBE2(nanomq, name, a, b)
+#define NANO_PROBE3(name, a, b, c) DTRACE_PROBE3(nanomq, name, a, b, c)
+#define NANO_PROBE4(name, a, b, c, d) \
+	DTRACE_PROBE4(nanomq, name, a, b, c, d)
+#else
+#define NANO_PROBE1(name, a) ((void) 0)
+#define NANO_PROBE2(name, a, b) ((void) 0)
+#define NANO_PROBE3(name, a, b, c) ((void) 0)
+#define NANO_PROBE4(name, a, b, c, d) ((void) 0)
+#endif
+
+#endif // NNG_SUPPLEMENTAL_UTIL_PROBE_H
@@ -699,6 +699,20 @@ nni_aio_get_pipeline(nni_aio *aio)
        return aio->pipe;
 }
 
+void
+nni_aio_set_pipes(nni_aio *aio, uint32_t *ids, size_t n)
+{
+	aio->pipes  = ids;
+	aio->npipes = n;
+}
+
+uint32_t *
+nni_aio_get_pipes(nni_aio *aio, size_t *np)
+{
+	*np = aio->npipes;
+	return (aio->pipes);
+}
+
 void nni_aio_set_dbtree(nni_aio *aio, void *db)
 {
        debug_msg("set dbtree address: %p", db);
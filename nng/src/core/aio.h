@@ -167,6 +167,10 @@ extern void nni_aio_set_pipeline(nni_aio *aio, uint32_t id);
 extern void nni_aio_set_dbtree(nni_aio *aio, void *db);
 extern void* nni_aio_get_dbtree(nni_aio *aio);
 extern uint32_t nni_aio_get_pipeline(nni_aio *aio);
+// Multicast: send the one message to each of n pipes.  The array must
+// stay valid until the send completes; the protocol may reorder it.
+extern void      nni_aio_set_pipes(nni_aio *aio, uint32_t *ids, size_t n);
+extern uint32_t *nni_aio_get_pipes(nni_aio *aio, size_t *np);
 
 
 // An nni_aio is an async I/O handle.  The details of this aio structure
@@ -208,7 +212,8 @@ struct nng_aio {
 	nni_list_node a_expire_node;
 
 	// NanoMQ var
-        //uint32_t      *pipes;
+        uint32_t *       pipes;
+        size_t           npipes;
         void *           db;
         uint32_t        pipe;
 };
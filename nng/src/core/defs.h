@@ -86,6 +86,12 @@ typedef struct {
 #define NNI_FREE_STRUCTS(s, n) nni_free(s, sizeof(*s) * n)
 #define NNI_ARRAY_SIZE(x) (sizeof(x)/sizeof(uint32_t))
 
+#if defined(_MSC_VER)
+#define NNI_THREAD_LOCAL __declspec(thread)
+#else
+#define NNI_THREAD_LOCAL __thread
+#endif
+
 #define NNI_PUT16(ptr, u)                                    \
 	do {                                                 \
 		(ptr)[0] = (uint8_t)(((uint16_t)(u)) >> 8u); \
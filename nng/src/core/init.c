@@ -20,6 +20,8 @@ static bool     nni_inited = false;
 
 extern int nni_tls_sys_init(void);
 extern void nni_tls_sys_fini(void);
+extern int  nano_log_sys_init(void);
+extern void nano_log_sys_fini(void);
 
 static int
 nni_init_helper(void)
@@ -30,7 +32,9 @@ nni_init_helper(void)
 	NNI_LIST_INIT(&nni_init_list, nni_initializer, i_node);
 	nni_inited = true;
 
-	if (((rv = nni_stat_sys_init()) != 0) ||
+	if (((rv = nano_log_sys_init()) != 0) ||
+	    ((rv = nni_stat_sys_init()) != 0) ||
+	    ((rv = nni_msg_sys_init()) != 0) ||
 	    ((rv = nni_taskq_sys_init()) != 0) ||
 	    ((rv = nni_reap_sys_init()) != 0) ||
 	    ((rv = nni_timer_sys_init()) != 0) ||
@@ -85,7 +89,9 @@ nni_fini(void)
 	nni_timer_sys_fini();
 	nni_taskq_sys_fini();
 	nni_reap_sys_fini(); // must be before timer and aio (expire)
+	nni_msg_sys_fini();  // after every thread has left its cache
 	nni_stat_sys_fini();
+	nano_log_sys_fini(); // last, what was logged on the way is written
 
 	nni_mtx_fini(&nni_init_mtx);
 	nni_plat_fini();
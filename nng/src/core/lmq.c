@@ -156,3 +156,50 @@ nni_lmq_resize(nni_lmq *lmq, size_t cap)
 
 	return (0);
 }
+
+nng_msg *
+nni_lmq_peek(nni_lmq *lmq, size_t i)
+{
+	NNI_ASSERT(i < lmq->lmq_len);
+	return (lmq->lmq_msgs[(lmq->lmq_get + i) & lmq->lmq_mask]);
+}
+
+nng_msg *
+nni_lmq_set(nni_lmq *lmq, size_t i, nng_msg *msg)
+{
+	size_t   pos;
+	nng_msg *old;
+
+	NNI_ASSERT(i < lmq->lmq_len);
+	pos                = (lmq->lmq_get + i) & lmq->lmq_mask;
+	old                = lmq->lmq_msgs[pos];
+	lmq->lmq_msgs[pos] = msg;
+	return (old);
+}
+
+nng_msg *
+nni_lmq_remove(nni_lmq *lmq, size_t i)
+{
+	size_t   mask = lmq->lmq_mask;
+	nng_msg *msg;
+
+	NNI_ASSERT(i < lmq->lmq_len);
+	msg = lmq->lmq_msgs[(lmq->lmq_get + i) & mask];
+	if (i < lmq->lmq_len / 2) {
+		// Close the gap from the front.
+		for (; i > 0; i--) {
+			lmq->lmq_msgs[(lmq->lmq_get + i) & mask] =
+			    lmq->lmq_msgs[(lmq->lmq_get + i - 1) & mask];
+		}
+		lmq->lmq_get = (lmq->lmq_get + 1) & mask;
+	} else {
+		// Close it from the back.
+		for (; i + 1 < lmq->lmq_len; i++) {
+			lmq->lmq_msgs[(lmq->lmq_get + i) & mask] =
+			    lmq->lmq_msgs[(lmq->lmq_get + i + 1) & mask];
+		}
+		lmq->lmq_put = (lmq->lmq_put - 1) & mask;
+	}
+	lmq->lmq_len--;
+	return (msg);
+}
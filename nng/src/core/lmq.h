@@ -36,4 +36,11 @@ extern int    nni_lmq_resize(nni_lmq *, size_t);
 extern bool   nni_lmq_full(nni_lmq *);
 extern bool   nni_lmq_empty(nni_lmq *);
 
+// Access by position, 0 being the oldest message; i must be < len.
+// nni_lmq_set replaces the i-th message, returning the one it held.
+// nni_lmq_remove takes it out, moving whichever side of it is shorter.
+extern nng_msg *nni_lmq_peek(nni_lmq *, size_t);
+extern nng_msg *nni_lmq_set(nni_lmq *, size_t, nng_msg *);
+extern nng_msg *nni_lmq_remove(nni_lmq *, size_t);
+
 #endif // CORE_LMQ_H
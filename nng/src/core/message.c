@@ -13,6 +13,7 @@
 #include "core/nng_impl.h"
 #include "nng/protocol/mqtt/mqtt_parser.h"
 #include "include/nng_debug.h"
+#include "nng/supplemental/util/metrics.h"
 
 // Message API.
 
@@ -39,7 +40,11 @@ struct nng_msg {
        //uint8_t          *variable_ptr;         //equal to m_body
        uint8_t          *payload_ptr;          //payload
        nano_conn_param  *cparam;
-
+	// Shared, read-only body tail: the bytes of m_tail from m_tail_off
+	// on follow m_body on the wire, without being copied into it.
+	nni_msg *m_tail;
+	size_t   m_tail_off;
+	uint64_t m_time; // receive time of a timed PUBLISH, else 0
 };
 
 #if 0
@@ -92,6 +97,352 @@ nni_msg_dump(const char *banner, const nni_msg *msg)
 }
 #endif
 
+// Message pools.  Message structures and small body buffers come from
+// freelists, by size class, instead of the heap.  Each nng thread keeps
+// lists of its own, so that a steady flow of messages costs no locks and
+// no malloc; a thread that frees more than it allocates (the receive side
+// of a pipe, say) hands half of its list back to the global one once it
+// has NNG_MSG_POOL_CACHE, and one that runs dry takes a batch from there.
+// Anything beyond the global cap goes back to the heap.  Other threads use
+// the global lists directly.
+#ifndef NNG_MSG_POOL_CACHE
+#define NNG_MSG_POOL_CACHE 256
+#endif
+
+#define NNI_MSG_POOL_CLASSES 4
+#define NNI_MSG_POOL_STRUCT NNI_MSG_POOL_CLASSES // the nng_msg list
+#define NNI_MSG_POOL_GLOBAL 8 // global cap, in thread caches
+
+static const size_t nni_msg_pool_sizes[NNI_MSG_POOL_CLASSES] = {
+	128,
+	512,
+	2048,
+	8192,
+};
+
+typedef struct nni_msg_pool_node {
+	struct nni_msg_pool_node *next;
+} nni_msg_pool_node;
+
+typedef struct {
+	nni_msg_pool_node *head;
+	size_t             count;
+} nni_msg_pool_list;
+
+typedef struct {
+	bool              on;
+	nni_msg_pool_list lists[NNI_MSG_POOL_CLASSES + 1];
+	uint64_t          hits;
+	uint64_t          misses;
+} nni_msg_cache;
+
+static NNI_THREAD_LOCAL nni_msg_cache nni_msg_tcache;
+
+static bool              nni_msg_pool_on = false;
+static nni_mtx           nni_msg_pool_lk;
+static nni_msg_pool_list nni_msg_pool[NNI_MSG_POOL_CLASSES + 1];
+static nni_stat_item     nni_msg_pool_stat_root;
+static nni_stat_item     nni_msg_pool_stat_hit;
+static nni_stat_item     nni_msg_pool_stat_miss;
+static nni_stat_item     nni_msg_pool_stat_spill;
+
+static size_t
+nni_msg_pool_size(int cls)
+{
+	return (cls == NNI_MSG_POOL_STRUCT ? sizeof(nni_msg)
+	                                   : nni_msg_pool_sizes[cls]);
+}
+
+// Per thread caps shrink with the size class, so a cache stays around
+// NNG_MSG_POOL_CACHE * 1 KiB at most.
+static size_t
+nni_msg_pool_cap(int cls)
+{
+	if (cls == NNI_MSG_POOL_STRUCT) {
+		return (NNG_MSG_POOL_CACHE * 2);
+	}
+	return (NNG_MSG_POOL_CACHE >> (cls * 2) > 8
+	        ? NNG_MSG_POOL_CACHE >> (cls * 2)
+	        : 8);
+}
+
+static void *
+nni_msg_pool_pop(nni_msg_pool_list *l)
+{
+	nni_msg_pool_node *n;
+
+	if ((n = l->head) != NULL) {
+		l->head = n->next;
+		l->count--;
+	}
+	return (n);
+}
+
+static void
+nni_msg_pool_push(nni_msg_pool_list *l, void *p)
+{
+	nni_msg_pool_node *n = p;
+
+	n->next = l->head;
+	l->head = n;
+	l->count++;
+}
+
+// Move up to n entries from one list to another.
+static void
+nni_msg_pool_move(nni_msg_pool_list *dst, nni_msg_pool_list *src, size_t n)
+{
+	void *p;
+
+	while ((n-- > 0) && ((p = nni_msg_pool_pop(src)) != NULL)) {
+		nni_msg_pool_push(dst, p);
+	}
+}
+
+static void
+nni_msg_cache_count(nni_msg_cache *c)
+{
+	if (!nni_msg_pool_on) {
+		return; // no stats yet, keep counting
+	}
+	nni_stat_inc(&nni_msg_pool_stat_hit, c->hits);
+	nni_stat_inc(&nni_msg_pool_stat_miss, c->misses);
+	c->hits   = 0;
+	c->misses = 0;
+}
+
+// Returns a zeroed block of the class size.
+static void *
+nni_msg_pool_get(int cls)
+{
+	nni_msg_cache *c = &nni_msg_tcache;
+	void *         p = NULL;
+
+	nano_metric_add(NANO_METRIC_MEM_MSG, nni_msg_pool_size(cls));
+	if (NNG_MSG_POOL_CACHE == 0) {
+		// Every allocation is a miss, for comparison.
+		if (nni_msg_pool_on) {
+			nni_stat_inc(&nni_msg_pool_stat_miss, 1);
+		}
+		return (nni_zalloc(nni_msg_pool_size(cls)));
+	}
+	if (c->on) {
+		nni_msg_pool_list *l = &c->lists[cls];
+
+		if ((l->head == NULL) && nni_msg_pool_on) {
+			nni_mtx_lock(&nni_msg_pool_lk);
+			nni_msg_pool_move(
+			    l, &nni_msg_pool[cls], nni_msg_pool_cap(cls) / 2);
+			nni_mtx_unlock(&nni_msg_pool_lk);
+		}
+		if ((p = nni_msg_pool_pop(l)) != NULL) {
+			c->hits++;
+		} else {
+			c->misses++;
+		}
+		if (c->hits + c->misses >= 1024) {
+			nni_msg_cache_count(c);
+		}
+	} else if (nni_msg_pool_on) {
+		nni_mtx_lock(&nni_msg_pool_lk);
+		p = nni_msg_pool_pop(&nni_msg_pool[cls]);
+		nni_mtx_unlock(&nni_msg_pool_lk);
+		nni_stat_inc(p != NULL ? &nni_msg_pool_stat_hit
+		                       : &nni_msg_pool_stat_miss,
+		    1);
+	}
+	if (p == NULL) {
+		return (nni_zalloc(nni_msg_pool_size(cls)));
+	}
+	nano_metric_add(NANO_METRIC_MEM_POOL, -(int64_t) nni_msg_pool_size(cls));
+	memset(p, 0, nni_msg_pool_size(cls));
+	return (p);
+}
+
+// Keeps p in a pool if there is room, frees it otherwise.
+static void
+nni_msg_pool_keep(int cls, void *p)
+{
+	nni_msg_cache *    c      = &nni_msg_tcache;
+	size_t             gcap   = nni_msg_pool_cap(cls) * NNI_MSG_POOL_GLOBAL;
+	nni_msg_pool_list  excess = { NULL, 0 };
+	nni_msg_pool_list *g      = &nni_msg_pool[cls];
+
+	if (NNG_MSG_POOL_CACHE == 0) {
+		nni_free(p, nni_msg_pool_size(cls));
+		return;
+	}
+	nano_metric_add(NANO_METRIC_MEM_POOL, nni_msg_pool_size(cls));
+	if (c->on) {
+		nni_msg_pool_push(&c->lists[cls], p);
+		if (c->lists[cls].count <= nni_msg_pool_cap(cls)) {
+			return;
+		}
+		nni_msg_pool_move(
+		    &excess, &c->lists[cls], nni_msg_pool_cap(cls) / 2);
+		if (nni_msg_pool_on) {
+			nni_stat_inc(&nni_msg_pool_stat_spill, excess.count);
+		}
+	} else if (nni_msg_pool_on) {
+		nni_msg_pool_push(&excess, p);
+	} else {
+		nano_metric_add(
+		    NANO_METRIC_MEM_POOL, -(int64_t) nni_msg_pool_size(cls));
+		nni_free(p, nni_msg_pool_size(cls));
+		return;
+	}
+	if (nni_msg_pool_on) {
+		nni_mtx_lock(&nni_msg_pool_lk);
+		nni_msg_pool_move(
+		    g, &excess, g->count < gcap ? gcap - g->count : 0);
+		nni_mtx_unlock(&nni_msg_pool_lk);
+	}
+	while ((p = nni_msg_pool_pop(&excess)) != NULL) {
+		nano_metric_add(
+		    NANO_METRIC_MEM_POOL, -(int64_t) nni_msg_pool_size(cls));
+		nni_free(p, nni_msg_pool_size(cls));
+	}
+}
+
+static void
+nni_msg_pool_put(int cls, void *p)
+{
+	nano_metric_add(NANO_METRIC_MEM_MSG, -(int64_t) nni_msg_pool_size(cls));
+	nni_msg_pool_keep(cls, p);
+}
+
+// Which size class a buffer of this capacity belongs to, if any.
+static int
+nni_msg_pool_class(size_t sz)
+{
+	for (int i = 0; i < NNI_MSG_POOL_CLASSES; i++) {
+		if (sz <= nni_msg_pool_sizes[i]) {
+			return (i);
+		}
+	}
+	return (-1);
+}
+
+// nni_msg_thr_init and nni_msg_thr_fini bracket the life of an nng
+// thread, which is what may keep a cache.  Pollers start before
+// nni_msg_sys_init, their caches just do without the global lists then.
+void
+nni_msg_thr_init(void)
+{
+	nni_msg_tcache.on = (NNG_MSG_POOL_CACHE > 0);
+}
+
+void
+nni_msg_thr_fini(void)
+{
+	nni_msg_cache *c = &nni_msg_tcache;
+
+	if (!c->on) {
+		return;
+	}
+	c->on = false;
+	for (int cls = 0; cls <= NNI_MSG_POOL_CLASSES; cls++) {
+		void *p;
+
+		while ((p = nni_msg_pool_pop(&c->lists[cls])) != NULL) {
+			nano_metric_add(NANO_METRIC_MEM_POOL,
+			    -(int64_t) nni_msg_pool_size(cls));
+			nni_msg_pool_keep(cls, p);
+		}
+	}
+	nni_msg_cache_count(c);
+}
+
+int
+nni_msg_sys_init(void)
+{
+	static const nni_stat_info root_info = {
+		.si_name = "msgpool",
+		.si_desc = "message allocation pools",
+		.si_type = NNG_STAT_SCOPE,
+	};
+	static const nni_stat_info hit_info = {
+		.si_name   = "hit",
+		.si_desc   = "allocations served from a pool",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_atomic = true,
+	};
+	static const nni_stat_info miss_info = {
+		.si_name   = "miss",
+		.si_desc   = "pooled allocations that went to the heap",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_atomic = true,
+	};
+	static const nni_stat_info spill_info = {
+		.si_name   = "spill",
+		.si_desc   = "buffers returned from a thread to the global pool",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_atomic = true,
+	};
+
+	nni_mtx_init(&nni_msg_pool_lk);
+	nni_stat_init(&nni_msg_pool_stat_root, &root_info);
+	nni_stat_init(&nni_msg_pool_stat_hit, &hit_info);
+	nni_stat_init(&nni_msg_pool_stat_miss, &miss_info);
+	nni_stat_init(&nni_msg_pool_stat_spill, &spill_info);
+	nni_stat_add(&nni_msg_pool_stat_root, &nni_msg_pool_stat_hit);
+	nni_stat_add(&nni_msg_pool_stat_root, &nni_msg_pool_stat_miss);
+	nni_stat_add(&nni_msg_pool_stat_root, &nni_msg_pool_stat_spill);
+	nni_stat_register(&nni_msg_pool_stat_root);
+	nni_msg_pool_on = true;
+	return (0);
+}
+
+// Called last, once the nng threads are gone and have emptied their
+// caches into the global lists.
+void
+nni_msg_sys_fini(void)
+{
+	nni_msg_pool_on = false;
+	nni_stat_unregister(&nni_msg_pool_stat_root);
+	for (int cls = 0; cls <= NNI_MSG_POOL_CLASSES; cls++) {
+		void *p;
+
+		while ((p = nni_msg_pool_pop(&nni_msg_pool[cls])) != NULL) {
+			nni_free(p, nni_msg_pool_size(cls));
+		}
+	}
+	nni_mtx_fini(&nni_msg_pool_lk);
+}
+
+// Body buffers: sizes up to the largest class are rounded up to it and
+// pooled; *szp is updated to the capacity actually allocated.
+static uint8_t *
+nni_chunk_buf_alloc(size_t *szp)
+{
+	int cls;
+
+	if ((cls = nni_msg_pool_class(*szp)) < 0) {
+		uint8_t *buf;
+
+		if ((buf = nni_zalloc(*szp)) != NULL) {
+			nano_metric_add(NANO_METRIC_MEM_MSG, *szp);
+		}
+		return (buf);
+	}
+	*szp = nni_msg_pool_sizes[cls];
+	return (nni_msg_pool_get(cls));
+}
+
+static void
+nni_chunk_buf_free(uint8_t *buf, size_t sz)
+{
+	int cls;
+
+	if (((cls = nni_msg_pool_class(sz)) >= 0) &&
+	    (nni_msg_pool_sizes[cls] == sz)) {
+		nni_msg_pool_put(cls, buf);
+	} else {
+		nano_metric_add(NANO_METRIC_MEM_MSG, -(int64_t) sz);
+		nni_free(buf, sz);
+	}
+}
+
 // nni_chunk_grow increases the underlying space for a chunk.  It ensures
 // that the desired amount of trailing space (including the length)
 // and headroom (excluding the length) are available.  It also copies
@@ -139,17 +490,19 @@ nni_chunk_grow(nni_chunk *ch, size_t newsz, size_t headwanted)
 			newsz = ch->ch_cap - headroom;
 		}
 
-		if ((newbuf = nni_zalloc(newsz + headwanted)) == NULL) {
+		size_t cap = newsz + headwanted;
+
+		if ((newbuf = nni_chunk_buf_alloc(&cap)) == NULL) {
 			return (NNG_ENOMEM);
 		}
 		// Copy all the data, but not header or trailer.
 		if (ch->ch_len > 0) {
 			memcpy(newbuf + headwanted, ch->ch_ptr, ch->ch_len);
 		}
-		nni_free(ch->ch_buf, ch->ch_cap);
+		nni_chunk_buf_free(ch->ch_buf, ch->ch_cap);
 		ch->ch_buf = newbuf;
 		ch->ch_ptr = newbuf + headwanted;
-		ch->ch_cap = newsz + headwanted;
+		ch->ch_cap = cap;
 		return (0);
 	}
 
@@ -157,11 +510,15 @@ nni_chunk_grow(nni_chunk *ch, size_t newsz, size_t headwanted)
 	// the backing store.  In this case, we just check against the
 	// allocated capacity and grow, or don't grow.
 	if ((newsz + headwanted) >= ch->ch_cap) {
-		if ((newbuf = nni_zalloc(newsz + headwanted)) == NULL) {
+		size_t cap = newsz + headwanted;
+
+		if ((newbuf = nni_chunk_buf_alloc(&cap)) == NULL) {
 			return (NNG_ENOMEM);
 		}
-		nni_free(ch->ch_buf, ch->ch_cap);
-		ch->ch_cap = newsz + headwanted;
+		if (ch->ch_buf != NULL) {
+			nni_chunk_buf_free(ch->ch_buf, ch->ch_cap);
+		}
+		ch->ch_cap = cap;
 		ch->ch_buf = newbuf;
 	}
 
@@ -173,7 +530,7 @@ static void
 nni_chunk_free(nni_chunk *ch)
 {
 	if ((ch->ch_cap != 0) && (ch->ch_buf != NULL)) {
-		nni_free(ch->ch_buf, ch->ch_cap);
+		nni_chunk_buf_free(ch->ch_buf, ch->ch_cap);
 	}
 	ch->ch_ptr = NULL;
 	ch->ch_buf = NULL;
@@ -220,10 +577,12 @@ nni_chunk_trim(nni_chunk *ch, size_t len)
 static int
 nni_chunk_dup(nni_chunk *dst, const nni_chunk *src)
 {
-	if ((dst->ch_buf = nni_zalloc(src->ch_cap)) == NULL) {
+	size_t cap = src->ch_cap;
+
+	if ((dst->ch_buf = nni_chunk_buf_alloc(&cap)) == NULL) {
 		return (NNG_ENOMEM);
 	}
-	dst->ch_cap = src->ch_cap;
+	dst->ch_cap = cap;
 	dst->ch_len = src->ch_len;
 	dst->ch_ptr = dst->ch_buf + (src->ch_ptr - src->ch_buf);
 	if (dst->ch_len > 0) {
@@ -317,6 +676,12 @@ nni_msg_clone(nni_msg *m)
 	nni_atomic_inc(&m->m_refcnt);
 }
 
+bool
+nni_msg_shared(nni_msg *m)
+{
+	return (nni_atomic_get(&m->m_refcnt) > 1);
+}
+
 // This returns either the original message or a new message on success.
 // If it fails, then NULL is returned.  Either way the original message
 // has its reference count dropped (and freed if zero).
@@ -349,11 +714,12 @@ nni_msg_pull_up(nni_msg *m)
 	// will not copy the message more than once, and it will not
 	// allocate unless there is no other option.
 	if (((nni_chunk_room(&m->m_body) < nni_msg_header_len(m))) ||
-	    (nni_atomic_get(&m->m_refcnt) != 1)) {
+	    (nni_atomic_get(&m->m_refcnt) != 1) || (m->m_tail != NULL)) {
 		// We have to duplicate the message.
 		nni_msg *m2;
 		uint8_t *dst;
-		size_t   len = nni_msg_len(m) + nni_msg_header_len(m);
+		size_t   len = nni_msg_len(m) + nni_msg_header_len(m) +
+		    nni_msg_tail_len(m);
 		if (nni_msg_alloc(&m2, len) != 0) {
 			return (NULL);
 		}
@@ -362,6 +728,10 @@ nni_msg_pull_up(nni_msg *m)
 		memcpy(dst, nni_msg_header(m), len);
 		dst += len;
 		memcpy(dst, nni_msg_body(m), nni_msg_len(m));
+		dst += nni_msg_len(m);
+		if (m->m_tail != NULL) {
+			memcpy(dst, nni_msg_tail(m), nni_msg_tail_len(m));
+		}
 		nni_msg_free(m);
 		return (m2);
 	}
@@ -374,13 +744,96 @@ nni_msg_pull_up(nni_msg *m)
 	return (m);
 }
 
+// nni_msg_unique_head is nni_msg_unique for callers that only modify the
+// header and the first len bytes of the body.  A shared message is not
+// copied whole: the new message gets its own copy of those bytes, and
+// takes over the reference to the original as its tail for the rest.
+nni_msg *
+nni_msg_unique_head(nni_msg *m, size_t len)
+{
+	nni_msg *m2;
+
+	if (nni_atomic_get(&m->m_refcnt) == 1) {
+		return (m);
+	}
+	if ((m->m_tail != NULL) || (len >= nni_msg_len(m))) {
+		return (nni_msg_unique(m));
+	}
+	if (nni_msg_alloc(&m2, len) != 0) {
+		nni_msg_free(m);
+		return (NULL);
+	}
+	memcpy(m2->m_header_buf, m->m_header_buf, m->m_header_len);
+	m2->m_header_len = m->m_header_len;
+	memcpy(m2->m_body.ch_ptr, m->m_body.ch_ptr, len);
+	m2->m_pipe        = m->m_pipe;
+	m2->remaining_len = m->remaining_len;
+	m2->CMD_TYPE      = m->CMD_TYPE;
+	m2->cparam        = m->cparam;
+	m2->m_time        = m->m_time;
+	m2->m_tail        = m;
+	m2->m_tail_off    = len;
+	return (m2);
+}
+
+// nni_msg_set_tail makes the body of src, from off on, the tail of m.
+// src is shared, not copied, so neither may be modified afterwards.
+void
+nni_msg_set_tail(nni_msg *m, nni_msg *src, size_t off)
+{
+	nni_msg *old = m->m_tail;
+
+	if (src != NULL) {
+		nni_msg_clone(src);
+	}
+	m->m_tail     = src;
+	m->m_tail_off = off;
+	nni_msg_free(old);
+}
+
+void *
+nni_msg_tail(nni_msg *m)
+{
+	if (m->m_tail == NULL) {
+		return (NULL);
+	}
+	return (m->m_tail->m_body.ch_ptr + m->m_tail_off);
+}
+
+size_t
+nni_msg_tail_len(const nni_msg *m)
+{
+	if (m->m_tail == NULL) {
+		return (0);
+	}
+	return (m->m_tail->m_body.ch_len - m->m_tail_off);
+}
+
+// nni_msg_tail_join copies the tail into the body, for consumers that
+// want the whole message in one piece.  The message must be unique.
+int
+nni_msg_tail_join(nni_msg *m)
+{
+	int rv;
+
+	if (m->m_tail == NULL) {
+		return (0);
+	}
+	if ((rv = nni_chunk_append(
+	         &m->m_body, nni_msg_tail(m), nni_msg_tail_len(m))) != 0) {
+		return (rv);
+	}
+	nni_msg_set_tail(m, NULL, 0);
+	return (0);
+}
+
 int
 nni_msg_alloc(nni_msg **mp, size_t sz)
 {
 	nni_msg *m;
 	int      rv;
 
-	if ((m = NNI_ALLOC_STRUCT(m)) == NULL) {
+	if ((m = nni_msg_pool_get(NNI_MSG_POOL_STRUCT)) == NULL) {
 		return (NNG_ENOMEM);
 	}
 
@@ -396,7 +849,7 @@ nni_msg_alloc(nni_msg **mp, size_t sz)
 		rv = nni_chunk_grow(&m->m_body, sz, 0);
 	}
 	if (rv != 0) {
-		NNI_FREE_STRUCT(m);
+		nni_msg_pool_put(NNI_MSG_POOL_STRUCT, m);
 		return (rv);
 	}
 	if (nni_chunk_append(&m->m_body, NULL, sz) != 0) {
@@ -417,7 +870,7 @@ nni_msg_dup(nni_msg **dup, const nni_msg *src)
 	nni_msg *m;
 	int      rv;
 
-	if ((m = NNI_ALLOC_STRUCT(m)) == NULL) {
+	if ((m = nni_msg_pool_get(NNI_MSG_POOL_STRUCT)) == NULL) {
 		return (NNG_ENOMEM);
 	}
 
@@ -425,7 +878,7 @@ nni_msg_dup(nni_msg **dup, const nni_msg *src)
 	m->m_header_len = src->m_header_len;
 
 	if ((rv = nni_chunk_dup(&m->m_body, &src->m_body)) != 0) {
-		NNI_FREE_STRUCT(m);
+		nni_msg_pool_put(NNI_MSG_POOL_STRUCT, m);
 		return (rv);
 	}
 
@@ -433,6 +886,21 @@ nni_msg_dup(nni_msg **dup, const nni_msg *src)
 	nni_atomic_init(&m->m_refcnt);
 	nni_atomic_set(&m->m_refcnt, 1);
 
+	m->remaining_len = src->remaining_len;
+	m->CMD_TYPE      = src->CMD_TYPE;
+	m->cparam        = src->cparam;
+	m->m_time        = src->m_time;
+	if ((m->m_tail = src->m_tail) != NULL) {
+		nni_msg_clone(m->m_tail);
+		m->m_tail_off = src->m_tail_off;
+	}
+	if ((src->payload_ptr != NULL) &&
+	    (src->payload_ptr >= src->m_body.ch_ptr) &&
+	    (src->payload_ptr <= src->m_body.ch_ptr + src->m_body.ch_len)) {
+		m->payload_ptr =
+		    m->m_body.ch_ptr + (src->payload_ptr - src->m_body.ch_ptr);
+	}
+
 	*dup = m;
 	return (0);
 }
@@ -441,8 +909,9 @@ void
 nni_msg_free(nni_msg *m)
 {
 	if ((m != NULL) && (nni_atomic_dec_nv(&m->m_refcnt) == 0)) {
+		nni_msg_free(m->m_tail);
 		nni_chunk_free(&m->m_body);
-		NNI_FREE_STRUCT(m);
+		nni_msg_pool_put(NNI_MSG_POOL_STRUCT, m);
 	}
 }
 
@@ -592,6 +1061,7 @@ nni_msg_clear(nni_msg *m)
 {
 	m->m_header_len = 0;
 	nni_chunk_clear(&m->m_body);
+	nni_msg_set_tail(m, NULL, 0);
 }
 
 void
@@ -679,4 +1149,16 @@ nni_msg_set_cmd_type(nni_msg *m, uint8_t cmd)
        m->CMD_TYPE = cmd;
 }
 
+uint64_t
+nni_msg_timestamp(const nni_msg *m)
+{
+	return (m->m_time);
+}
+
+void
+nni_msg_set_timestamp(nni_msg *m, uint64_t ns)
+{
+	m->m_time = ns;
+}
+
 
@@ -14,6 +14,10 @@
 // Internally used message API.  Again, this is not part of our public API.
 // "trim" operations work from the front, and "chop" work from the end.
 
+extern int      nni_msg_sys_init(void);
+extern void     nni_msg_sys_fini(void);
+extern void     nni_msg_thr_init(void);
+extern void     nni_msg_thr_fini(void);
 extern int      nni_msg_alloc(nni_msg **, size_t);
 extern void     nni_msg_free(nni_msg *);
 extern int      nni_msg_realloc(nni_msg *, size_t);
@@ -46,12 +50,27 @@ extern uint32_t nni_msg_get_pipe(const nni_msg *);
 // Failure to do so will likely result in corruption.
 extern void     nni_msg_clone(nni_msg *);
 extern nni_msg *nni_msg_unique(nni_msg *);
+// nni_msg_shared is true while a reference other than the caller's is held.
+extern bool     nni_msg_shared(nni_msg *);
 // nni_msg_pull_up ensures that the message is unique, and that any
 // header present is "pulled up" into the message body.  If the function
 // cannot do this for any reason (out of space in the body), then NULL
 // is returned.  It is the responsibility of the caller to free the
 // original message in that case (same semantics as realloc).
 extern nni_msg *nni_msg_pull_up(nni_msg *);
+// nni_msg_unique_head is like nni_msg_unique, but a shared message keeps
+// sharing everything after the first given number of body bytes, as the
+// tail of the copy.  Only those bytes and the header may be modified.
+extern nni_msg *nni_msg_unique_head(nni_msg *, size_t);
+
+// A message tail is a read-only run of bytes borrowed from another,
+// refcounted message, and sent after the body.  Transports that can send
+// it directly say so with p_msg_tail; for the others nni_pipe_send joins
+// the tail into the body first.
+extern void   nni_msg_set_tail(nni_msg *, nni_msg *, size_t);
+extern void * nni_msg_tail(nni_msg *);
+extern size_t nni_msg_tail_len(const nni_msg *);
+extern int    nni_msg_tail_join(nni_msg *);
 
 
 //NANOMQ MQTT
@@ -65,6 +84,10 @@ extern void     nni_msg_set_payload_ptr(nni_msg *m, uint8_t * ptr);
 extern void     nni_msg_set_remaining_len(nni_msg *m, size_t len);
 extern void     nni_msg_set_cmd_type(nni_msg *m, uint8_t cmd);
 extern void     nni_msg_set_conn_param(nni_msg *m, void *ptr);
+// When the transport received a PUBLISH timed for latency, in
+// nano_metric_clock() nanoseconds; 0 for other messages.
+extern uint64_t nni_msg_timestamp(const nni_msg *m);
+extern void     nni_msg_set_timestamp(nni_msg *m, uint64_t ns);
 
 extern conn_param *   nni_msg_get_conn_param(nni_msg *m);
 
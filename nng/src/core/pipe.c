@@ -131,6 +131,19 @@ nni_pipe_recv(nni_pipe *p, nni_aio *aio)
 void
 nni_pipe_send(nni_pipe *p, nni_aio *aio)
 {
+	nni_msg *msg = nni_aio_get_msg(aio);
+
+	if ((!p->p_tran_ops.p_msg_tail) && (msg != NULL) &&
+	    (nni_msg_tail_len(msg) > 0)) {
+		msg = nni_msg_unique(msg);
+		nni_aio_set_msg(aio, msg);
+		if ((msg == NULL) || (nni_msg_tail_join(msg) != 0)) {
+			if (nni_aio_begin(aio) == 0) {
+				nni_aio_finish_error(aio, NNG_ENOMEM);
+			}
+			return;
+		}
+	}
 	p->p_tran_ops.p_send(p->p_tran_data, aio);
 }
 
@@ -161,6 +161,10 @@ extern bool nni_plat_thr_is_self(nni_plat_thr *);
 // should be a short ASCII string.  It may or may not be supported --
 // this is intended to facilitate debugging.
 extern void nni_plat_thr_set_name(nni_plat_thr *, const char *);
+
+// nni_plat_thr_set_affinity binds the thread (the caller's own if NULL)
+// to the given CPU.  Returns NNG_ENOTSUP where that cannot be done.
+extern int nni_plat_thr_set_affinity(nni_plat_thr *, int);
 //
 // Atomics support.  This will evolve over time.
 //
@@ -23,10 +23,15 @@ struct nni_taskq {
 	nni_taskq_thr *tq_threads;
 	int            tq_nthreads;
 	bool           tq_run;
+	bool           tq_home;
+	int            tq_cpu;
 };
 
 static nni_taskq *nni_taskq_systq = NULL;
 
+// Where this thread's work for the system queue goes, if not there.
+static NNI_THREAD_LOCAL nni_taskq *nni_taskq_home = NULL;
+
 static void
 nni_taskq_thread(void *self)
 {
@@ -35,6 +40,12 @@ nni_taskq_thread(void *self)
 	nni_task *     task;
 
         nni_thr_set_name(NULL, "nng:task");
+	if (tq->tq_cpu >= 0) {
+		(void) nni_thr_set_affinity(NULL, tq->tq_cpu);
+	}
+	if (tq->tq_home) {
+		nni_taskq_home = tq;
+	}
 
         nni_mtx_lock(&tq->tq_mtx);
 	for (;;) {
@@ -66,8 +77,8 @@ nni_taskq_thread(void *self)
 	nni_mtx_unlock(&tq->tq_mtx);
 }
 
-int
-nni_taskq_init(nni_taskq **tqp, int nthr)
+static int
+nni_taskq_init_cpu(nni_taskq **tqp, int nthr, int cpu, bool home)
 {
 	nni_taskq *tq;
 
@@ -80,6 +91,8 @@ nni_taskq_init(nni_taskq **tqp, int nthr)
 		return (NNG_ENOMEM);
 	}
 	tq->tq_nthreads = nthr;
+	tq->tq_cpu      = cpu;
+	tq->tq_home     = home;
 	NNI_LIST_INIT(&tq->tq_tasks, nni_task, task_node);
 
 	nni_mtx_init(&tq->tq_mtx);
@@ -104,6 +117,24 @@ nni_taskq_init(nni_taskq **tqp, int nthr)
 	return (0);
 }
 
+int
+nni_taskq_init(nni_taskq **tqp, int nthr)
+{
+	return (nni_taskq_init_cpu(tqp, nthr, -1, false));
+}
+
+int
+nni_taskq_init_home(nni_taskq **tqp, int nthr, int cpu)
+{
+	return (nni_taskq_init_cpu(tqp, nthr, cpu, true));
+}
+
+void
+nni_taskq_set_home(nni_taskq *tq)
+{
+	nni_taskq_home = tq;
+}
+
 void
 nni_taskq_fini(nni_taskq *tq)
 {
@@ -154,6 +185,10 @@ nni_task_dispatch(nni_task *task)
 {
 	nni_taskq *tq = task->task_tq;
 
+	if ((tq == nni_taskq_systq) && (nni_taskq_home != NULL)) {
+		tq = nni_taskq_home;
+	}
+
 	// If there is no callback to perform, then do nothing!
 	// The user will be none the wiser.
 	if (task->task_cb == NULL) {
@@ -233,7 +268,7 @@ nni_task_fini(nni_task *task)
 }
 
 int
-nni_taskq_sys_init(void)
+nni_taskq_sys_nthreads(void)
 {
 	int nthrs;
 
@@ -247,8 +282,13 @@ nni_taskq_sys_init(void)
 		nthrs = NNG_MAX_TASKQ_THREADS;
 	}
 #endif
+	return (nthrs);
+}
 
-	return (nni_taskq_init(&nni_taskq_systq, nthrs));
+int
+nni_taskq_sys_init(void)
+{
+	return (nni_taskq_init(&nni_taskq_systq, nni_taskq_sys_nthreads()));
 }
 
 void
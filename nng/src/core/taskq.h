@@ -20,6 +20,15 @@ typedef struct nni_task  nni_task;
 extern int  nni_taskq_init(nni_taskq **, int);
 extern void nni_taskq_fini(nni_taskq *);
 
+// Home queues keep related work on one core.  A thread that adopts a home
+// queue with nni_taskq_set_home() has the tasks it dispatches to the
+// system queue run on its home queue instead.  nni_taskq_init_home()
+// creates such a queue; its threads are pinned to the CPU given (unless
+// negative) and have the queue itself as their home, so whole chains of
+// callbacks stay put.
+extern int  nni_taskq_init_home(nni_taskq **, int, int);
+extern void nni_taskq_set_home(nni_taskq *);
+
 // nni_task_dispatch sends the task to the queue.  It is guaranteed to
 // succeed.  (If the queue is shutdown, then the behavior is undefined.)
 extern void nni_task_dispatch(nni_task *);
@@ -52,6 +61,9 @@ extern void  nni_task_init(nni_task *, nni_taskq *, nni_cb, void *);
 // it reschedules the task.)
 extern void nni_task_fini(nni_task *);
 
+// nni_taskq_sys_nthreads is how many threads the system queue runs
+// (NNG_NUM_TASKQ_THREADS, else two per CPU up to NNG_MAX_TASKQ_THREADS).
+extern int  nni_taskq_sys_nthreads(void);
 extern int  nni_taskq_sys_init(void);
 extern void nni_taskq_sys_fini(void);
 
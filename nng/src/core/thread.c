@@ -8,6 +8,8 @@
 //
 
 #include "core/nng_impl.h"
+#include "nng/supplemental/util/log.h"
+#include "nng/supplemental/util/metrics.h"
 
 void
 nni_mtx_init(nni_mtx *mtx)
@@ -91,7 +93,11 @@ nni_thr_wrap(void *arg)
 	}
 	nni_plat_mtx_unlock(&thr->mtx);
 	if ((start) && (thr->fn != NULL)) {
+		nni_msg_thr_init();
 		thr->fn(thr->arg);
+		nni_msg_thr_fini();
+		nano_metric_thr_fini(); // after the cache, which counts
+		nano_log_thr_fini();
 	}
 	nni_plat_mtx_lock(&thr->mtx);
 	thr->done = 1;
@@ -187,4 +193,10 @@ void
 nni_thr_set_name(nni_thr *thr, const char *name)
 {
 	nni_plat_thr_set_name(&thr->thr, name);
+}
+
+int
+nni_thr_set_affinity(nni_thr *thr, int cpu)
+{
+	return (nni_plat_thr_set_affinity(&thr->thr, cpu));
 }
\ No newline at end of file
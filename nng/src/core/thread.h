@@ -88,4 +88,7 @@ extern bool nni_thr_is_self(nni_thr *thr);
 // nni_thr_set_name is used to set a short name for the thread.
 extern void nni_thr_set_name(nni_thr *thr, const char *);
 
+// nni_thr_set_affinity pins the thread (or the caller, if NULL) to a CPU.
+extern int nni_thr_set_affinity(nni_thr *thr, int);
+
 #endif // CORE_THREAD_H
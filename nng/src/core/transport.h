@@ -154,6 +154,11 @@ struct nni_tran_pipe_ops {
 	// p_getopt is used to obtain an option.  Pipes don't implement
 	// option setting.
 	int (*p_getopt)(void *, const char *, void *, size_t *, nni_type);
+
+	// p_msg_tail is set by transports that send a message's tail
+	// (nni_msg_tail) themselves, after the body.  For the others
+	// the tail is joined into the body before p_send is called.
+	bool p_msg_tail;
 };
 
 // Transport implementation details.  Transports must implement the
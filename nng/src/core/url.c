@@ -245,6 +245,7 @@ static struct {
 	{ "gopher", "70" },
 	{ "http", "80" },
 	{ "https", "443" },
+	{ "mqtt+ws", "8083" },
 	{ "ssh", "22" },
 	{ "telnet", "23" },
 	{ "ws", "80" },
@@ -344,6 +345,8 @@ nni_url_parse(nni_url **urlp, const char *raw)
 	if ((strcmp(url->u_scheme, "ipc") == 0) ||
 	    (strcmp(url->u_scheme, "unix") == 0) ||
 	    (strcmp(url->u_scheme, "abstract") == 0) ||
+	    (strcmp(url->u_scheme, "mqtt+ipc") == 0) ||
+	    (strcmp(url->u_scheme, "mqtt+inproc") == 0) ||
 	    (strcmp(url->u_scheme, "inproc") == 0)) {
 		if ((url->u_path = nni_strdup(s)) == NULL) {
 			rv = NNG_ENOMEM;
@@ -531,6 +534,8 @@ nni_url_asprintf(char **str, const nni_url *url)
 
 	if ((strcmp(scheme, "ipc") == 0) || (strcmp(scheme, "inproc") == 0) ||
             (strcmp(scheme, "unix") == 0) ||
+            (strcmp(scheme, "mqtt+ipc") == 0) ||
+            (strcmp(scheme, "mqtt+inproc") == 0) ||
             (strcmp(scheme, "ipc+abstract") == 0) ||
 	    (strcmp(scheme, "unix+abstract") == 0)) {
 		return (nni_asprintf(str, "%s://%s", scheme, url->u_path));
@@ -1592,17 +1592,53 @@ nng_msg_set_remaining_len(nng_msg *msg, size_t len)
         nni_msg_set_remaining_len(msg, len);
 }
 
+void
+nng_msg_set_cmd_type(nng_msg *msg, uint8_t cmd)
+{
+        nni_msg_set_cmd_type(msg, cmd);
+}
+
+void
+nng_msg_set_conn_param(nng_msg *msg, void *cparam)
+{
+        nni_msg_set_conn_param(msg, cparam);
+}
+
+uint64_t
+nng_msg_get_timestamp(nng_msg *msg)
+{
+	return (nni_msg_timestamp(msg));
+}
+
+void
+nng_msg_set_timestamp(nng_msg *msg, uint64_t ns)
+{
+	nni_msg_set_timestamp(msg, ns);
+}
+
 void
 nng_msg_clone(nng_msg *msg)
 {
         nni_msg_clone(msg);
 }
 
+void
+nng_msg_set_tail(nng_msg *msg, nng_msg *src, size_t off)
+{
+	nni_msg_set_tail(msg, src, off);
+}
+
 void
 nng_aio_set_pipeline(nng_aio *aio, uint32_t id)
 {
         nni_aio_set_pipeline(aio, id);
 }
+
+void
+nng_aio_set_pipes(nng_aio *aio, uint32_t *ids, size_t n)
+{
+	nni_aio_set_pipes(aio, ids, n);
+}
 void
 nng_aio_set_dbtree(nng_aio *aio, void *db)
 {
@@ -1617,6 +1653,19 @@ nng_msg_get_conn_param(nng_msg *msg)
 	return p;
 }
 
+// Released with destroy_conn_param().
+int
+conn_param_alloc(conn_param **cparamp)
+{
+        conn_param *cparam;
+
+        if ((cparam = nni_zalloc(sizeof(conn_param))) == NULL) {
+                return (NNG_ENOMEM);
+        }
+        *cparamp = cparam;
+        return (0);
+}
+
 const uint8_t *
 conn_param_get_clentid(conn_param *cparam)
 {
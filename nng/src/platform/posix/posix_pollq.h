@@ -38,6 +38,48 @@ extern void nni_posix_pfd_set_cb(nni_posix_pfd *, nni_posix_pfd_cb, void *);
 #define NNI_POLL_ERR ((unsigned) POLLERR)
 #define NNI_POLL_INVAL ((unsigned) POLLNVAL)
 
+// Poller threads.  nni_posix_pollq_nthreads() is how many pollers to run
+// (NNG_NUM_POLLER_THREADS, else one per CPU up to NNG_MAX_POLLER_THREADS)
+// and nni_posix_pollq_cpu() the CPU to pin poller i to, or -1 unless built
+// with NNG_POLLER_AFFINITY.  Pinned pollers get a home taskq on the same
+// CPU for the callbacks they dispatch, see nni_taskq_init_home().  So that
+// one blocking callback does not stall every pipe on that CPU, the home
+// taskqs share out the system taskq's threads, with no fewer than
+// NNI_POLLQ_HOME_THREADS each (nni_posix_pollq_home_threads()).  These are
+// defined by the epoll pollq, which io_uring builds always include.
+extern int nni_posix_pollq_nthreads(void);
+extern int nni_posix_pollq_cpu(int);
+extern int nni_posix_pollq_home_threads(void);
+
+#define NNI_POLLQ_HOME_THREADS 2
+
+// Busy polling.  nni_posix_pollq_busy() is the number of microseconds a
+// poller spins looking for events before it blocks, from NNG_BUSY_POLL in
+// the environment, else NNG_BUSY_POLL_USEC; 0 (the default) disables it.
+// When enabled, TCP connections also set SO_BUSY_POLL and complete their
+// aios on the poller thread instead of handing them to the taskq.
+#ifndef NNG_BUSY_POLL_USEC
+#define NNG_BUSY_POLL_USEC 0
+#endif
+
+extern int      nni_posix_pollq_busy(void);
+extern uint64_t nni_posix_pollq_usec(void);
+
+#ifdef NNG_HAVE_IO_URING
+// The io_uring pollq (posix_pollq_uring.c) provides the functions above,
+// and falls back to the epoll pollq, built under these names, when the
+// kernel refuses io_uring or NNG_POLLQ=epoll is set in the environment.
+extern int  nni_posix_epoll_pfd_init(nni_posix_pfd **, int);
+extern void nni_posix_epoll_pfd_fini(nni_posix_pfd *);
+extern int  nni_posix_epoll_pfd_arm(nni_posix_pfd *, unsigned);
+extern int  nni_posix_epoll_pfd_fd(nni_posix_pfd *);
+extern void nni_posix_epoll_pfd_close(nni_posix_pfd *);
+extern void nni_posix_epoll_pfd_set_cb(
+    nni_posix_pfd *, nni_posix_pfd_cb, void *);
+extern int  nni_posix_epoll_sysinit(void);
+extern void nni_posix_epoll_sysfini(void);
+#endif
+
 #endif // NNG_PLATFORM_POSIX
 
 #endif // PLATFORM_POSIX_POLLQ_H
@@ -23,6 +23,17 @@
 #include "core/nng_impl.h"
 #include "platform/posix/posix_pollq.h"
 
+#ifdef NNG_HAVE_IO_URING
+#define nni_posix_pfd_init nni_posix_epoll_pfd_init
+#define nni_posix_pfd_fini nni_posix_epoll_pfd_fini
+#define nni_posix_pfd_arm nni_posix_epoll_pfd_arm
+#define nni_posix_pfd_fd nni_posix_epoll_pfd_fd
+#define nni_posix_pfd_close nni_posix_epoll_pfd_close
+#define nni_posix_pfd_set_cb nni_posix_epoll_pfd_set_cb
+#define nni_posix_pollq_sysinit nni_posix_epoll_sysinit
+#define nni_posix_pollq_sysfini nni_posix_epoll_sysfini
+#endif
+
 typedef struct nni_posix_pollq nni_posix_pollq;
 
 #ifndef EFD_CLOEXEC
@@ -52,12 +63,16 @@ typedef struct nni_posix_pollq nni_posix_pollq;
 // nni_posix_pollq is a work structure that manages state for the epoll-based
 // pollq implementation
 struct nni_posix_pollq {
-	nni_mtx  mtx;
-	int      epfd;  // epoll handle
-	int      evfd;  // event fd (to wake us for other stuff)
-	bool     close; // request for worker to exit
-	nni_thr  thr;   // worker thread
-	nni_list reapq;
+	nni_mtx        mtx;
+	int            epfd;  // epoll handle
+	int            evfd;  // event fd (to wake us for other stuff)
+	bool           close; // request for worker to exit
+	nni_thr        thr;   // worker thread
+	nni_list       reapq;
+	nni_atomic_int npfd; // load, for placing new descriptors
+	int            cpu;  // pinned to, or -1
+	nni_taskq *    home; // where our callbacks' work runs, if pinned
+	int            busy; // usec to busy poll before blocking
 };
 
 struct nni_posix_pfd {
@@ -74,8 +89,26 @@ struct nni_posix_pfd {
 	nni_cv           cv;
 };
 
-// single global instance for now.
-static nni_posix_pollq nni_posix_global_pollq;
+// Several pollers, each with its own epoll fd and thread, so readiness
+// for all connections does not funnel through a single core.  A new
+// descriptor goes to the least loaded one and stays there.
+static nni_posix_pollq *nni_posix_pollqs;
+static int              nni_posix_npollq; // running
+static int              nni_posix_pollq_sz;
+
+static nni_posix_pollq *
+nni_posix_pollq_pick(void)
+{
+	nni_posix_pollq *pq = &nni_posix_pollqs[0];
+
+	for (int i = 1; i < nni_posix_npollq; i++) {
+		if (nni_atomic_get(&nni_posix_pollqs[i].npfd) <
+		    nni_atomic_get(&pq->npfd)) {
+			pq = &nni_posix_pollqs[i];
+		}
+	}
+	return (pq);
+}
 
 int
 nni_posix_pfd_init(nni_posix_pfd **pfdp, int fd)
@@ -85,7 +118,7 @@ nni_posix_pfd_init(nni_posix_pfd **pfdp, int fd)
 	struct epoll_event ev;
 	int                rv;
 
-	pq = &nni_posix_global_pollq;
+	pq = nni_posix_pollq_pick();
 
 	(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
 	(void) fcntl(fd, F_SETFL, O_NONBLOCK);
@@ -117,6 +150,7 @@ nni_posix_pfd_init(nni_posix_pfd **pfdp, int fd)
 		NNI_FREE_STRUCT(pfd);
 		return (rv);
 	}
+	nni_atomic_inc(&pq->npfd);
 
 	*pfdp = pfd;
 	return (0);
@@ -216,6 +250,7 @@ nni_posix_pfd_fini(nni_posix_pfd *pfd)
 
 	// We're exclusive now.
 
+	nni_atomic_dec(&pq->npfd);
 	(void) close(pfd->fd);
 	nni_cv_fini(&pfd->cv);
 	nni_mtx_fini(&pfd->mtx);
@@ -238,17 +273,47 @@ nni_posix_pollq_reap(nni_posix_pollq *pq)
 	nni_mtx_unlock(&pq->mtx);
 }
 
+// Busy poll for up to pq->busy microseconds.  Returns what epoll_wait()
+// did, 0 if nothing showed up in time.
+static int
+nni_posix_pollq_spin(nni_posix_pollq *pq, struct epoll_event *events)
+{
+	uint64_t deadline;
+	int      n;
+
+	if (pq->busy == 0) {
+		return (0);
+	}
+	deadline = nni_posix_pollq_usec() + pq->busy;
+	do {
+		n = epoll_wait(pq->epfd, events, NNI_MAX_EPOLL_EVENTS, 0);
+		if (n != 0) {
+			return (n);
+		}
+	} while (nni_posix_pollq_usec() < deadline);
+	return (0);
+}
+
 static void
 nni_posix_poll_thr(void *arg)
 {
 	nni_posix_pollq *  pq = arg;
 	struct epoll_event events[NNI_MAX_EPOLL_EVENTS];
 
+	if (pq->cpu >= 0) {
+		(void) nni_thr_set_affinity(NULL, pq->cpu);
+		nni_taskq_set_home(pq->home);
+	}
+
 	for (;;) {
 		int  n;
 		bool reap = false;
 
-		n = epoll_wait(pq->epfd, events, NNI_MAX_EPOLL_EVENTS, -1);
+		n = nni_posix_pollq_spin(pq, events);
+		if (n == 0) {
+			n = epoll_wait(
+			    pq->epfd, events, NNI_MAX_EPOLL_EVENTS, -1);
+		}
 		if ((n < 0) && (errno == EBADF)) {
 			// Epoll fd closed, bail.
 			return;
@@ -323,6 +388,7 @@ nni_posix_pollq_destroy(nni_posix_pollq *pq)
 	close(pq->evfd);
 	close(pq->epfd);
 
+	nni_taskq_fini(pq->home);
 	nni_mtx_fini(&pq->mtx);
 }
 
@@ -353,8 +419,45 @@ nni_posix_pollq_add_eventfd(nni_posix_pollq *pq)
 	return (0);
 }
 
+int
+nni_posix_pollq_nthreads(void)
+{
+	int n;
+
+#ifdef NNG_NUM_POLLER_THREADS
+	n = NNG_NUM_POLLER_THREADS;
+#else
+	n = nni_plat_ncpu();
+#endif
+#if NNG_MAX_POLLER_THREADS > 0
+	if (n > NNG_MAX_POLLER_THREADS) {
+		n = NNG_MAX_POLLER_THREADS;
+	}
+#endif
+	return (n < 1 ? 1 : n);
+}
+
+int
+nni_posix_pollq_cpu(int i)
+{
+#ifdef NNG_POLLER_AFFINITY
+	return (i % nni_plat_ncpu());
+#else
+	NNI_ARG_UNUSED(i);
+	return (-1);
+#endif
+}
+
+int
+nni_posix_pollq_home_threads(void)
+{
+	int n = nni_taskq_sys_nthreads() / nni_posix_pollq_nthreads();
+
+	return (n < NNI_POLLQ_HOME_THREADS ? NNI_POLLQ_HOME_THREADS : n);
+}
+
 static int
-nni_posix_pollq_create(nni_posix_pollq *pq)
+nni_posix_pollq_create(nni_posix_pollq *pq, int cpu)
 {
 	int rv;
 
@@ -372,6 +475,10 @@ nni_posix_pollq_create(nni_posix_pollq *pq)
 #endif
 
 	pq->close = false;
+	pq->cpu   = cpu;
+	pq->home  = NULL;
+	pq->busy  = nni_posix_pollq_busy();
+	nni_atomic_init(&pq->npfd);
 
 	NNI_LIST_INIT(&pq->reapq, nni_posix_pfd, node);
 	nni_mtx_init(&pq->mtx);
@@ -381,7 +488,11 @@ nni_posix_pollq_create(nni_posix_pollq *pq)
 		nni_mtx_fini(&pq->mtx);
 		return (rv);
 	}
-	if ((rv = nni_thr_init(&pq->thr, nni_posix_poll_thr, pq)) != 0) {
+	if (((cpu >= 0) &&
+	        ((rv = nni_taskq_init_home(&pq->home,
+	              nni_posix_pollq_home_threads(), cpu)) != 0)) ||
+	    ((rv = nni_thr_init(&pq->thr, nni_posix_poll_thr, pq)) != 0)) {
+		nni_taskq_fini(pq->home);
 		(void) close(pq->epfd);
 		(void) close(pq->evfd);
 		nni_mtx_fini(&pq->mtx);
@@ -395,13 +506,37 @@ nni_posix_pollq_create(nni_posix_pollq *pq)
 int
 nni_posix_pollq_sysinit(void)
 {
-	return (nni_posix_pollq_create(&nni_posix_global_pollq));
+	int n = nni_posix_pollq_nthreads();
+	int rv;
+
+	if ((nni_posix_pollqs = NNI_ALLOC_STRUCTS(nni_posix_pollqs, n)) ==
+	    NULL) {
+		return (NNG_ENOMEM);
+	}
+	nni_posix_pollq_sz = n;
+	for (int i = 0; i < n; i++) {
+		if ((rv = nni_posix_pollq_create(
+		         &nni_posix_pollqs[i], nni_posix_pollq_cpu(i))) != 0) {
+			nni_posix_pollq_sysfini();
+			return (rv);
+		}
+		nni_posix_npollq++;
+	}
+	return (0);
 }
 
 void
 nni_posix_pollq_sysfini(void)
 {
-	nni_posix_pollq_destroy(&nni_posix_global_pollq);
+	for (int i = 0; i < nni_posix_npollq; i++) {
+		nni_posix_pollq_destroy(&nni_posix_pollqs[i]);
+	}
+	if (nni_posix_pollqs != NULL) {
+		NNI_FREE_STRUCTS(nni_posix_pollqs, nni_posix_pollq_sz);
+	}
+	nni_posix_pollqs   = NULL;
+	nni_posix_npollq   = 0;
+	nni_posix_pollq_sz = 0;
 }
 
 #endif // NNG_HAVE_EPOLL
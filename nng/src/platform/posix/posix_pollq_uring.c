@@ -0,0 +1,838 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifdef NNG_HAVE_IO_URING
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "core/nng_impl.h"
+#include "platform/posix/posix_pollq.h"
+
+// io_uring based pollq.  Arming a pfd queues an IORING_OP_POLL_ADD, which
+// is one shot just like the EPOLLONESHOT registrations of the epoll pollq,
+// so callers see exactly the same semantics.  What we gain is batching:
+// arms made from callbacks on the poller thread (by far the common case,
+// a callback re-arming after EAGAIN) are not a syscall each, they go to
+// the kernel together with the next wait in a single io_uring_enter().
+// Arms from other threads are submitted right away.
+//
+// Each pfd has at most one poll in flight per direction; the direction is
+// encoded in the low bits of the SQE user_data next to the pfd pointer.
+// Closing a pfd cancels its polls, and fini waits for their completions
+// before the pfd may be freed.
+//
+// Completions are moved off the CQ ring into a stash, and their callbacks
+// run from there by the poller thread.  When the CQ ring overflows the
+// kernel refuses submissions (EBUSY) until it is drained, and a submitter
+// may hold locks a callback wants, so it drains the ring into the stash
+// instead of running anything.
+//
+// We talk to the kernel with raw syscalls, there is no liburing dependency.
+// When io_uring cannot be set up (old kernel, seccomp) we run the epoll
+// pollq instead.
+
+typedef struct nni_posix_pollq nni_posix_pollq;
+
+#ifndef EFD_CLOEXEC
+#define EFD_CLOEXEC 0
+#endif
+#ifndef EFD_NONBLOCK
+#define EFD_NONBLOCK 0
+#endif
+
+#define NNI_URING_ENTRIES 1024
+#define NNI_URING_CQ_ENTRIES (NNI_URING_ENTRIES * 8)
+
+// SQE user_data tags.  Zero is for requests whose completion we ignore.
+#define NNI_URING_TAG_IN 1u
+#define NNI_URING_TAG_OUT 2u
+#define NNI_URING_TAG_MASK 3u
+#define NNI_URING_WAKE ((uint64_t) NNI_URING_TAG_MASK)
+
+typedef struct {
+	uint64_t ud;
+	int      res;
+} nni_uring_cqe;
+
+struct nni_posix_pollq {
+	nni_mtx  mtx;   // reapq and close
+	nni_mtx  sqmtx; // submission ring, and the stash
+	int      ringfd;
+	int      evfd;  // event fd (to wake us for other stuff)
+	bool     close; // request for worker to exit
+	nni_thr  thr;   // worker thread
+	nni_list reapq;
+
+	nni_atomic_int npfd; // load, for placing new descriptors
+	int            cpu;  // pinned to, or -1
+	nni_taskq *    home; // where our callbacks' work runs, if pinned
+	int            busy; // usec to busy poll before blocking
+
+	void *                sqring;
+	size_t                sqsize;
+	void *                cqring;
+	size_t                cqsize;
+	struct io_uring_sqe * sqes;
+	size_t                sqesize;
+	unsigned *            sqhead;
+	unsigned *            sqtail;
+	unsigned *            sqmask;
+	unsigned *            sqarray;
+	unsigned *            cqhead;
+	unsigned *            cqtail;
+	unsigned *            cqmask;
+	struct io_uring_cqe * cqes;
+
+	nni_uring_cqe *stash; // completions taken off the ring
+	unsigned       nstash;
+	unsigned       stashsz;
+	nni_uring_cqe *run; // ... and being run, by the poller only
+	unsigned       runsz;
+};
+
+struct nni_posix_pfd {
+	nni_list_node    node;
+	nni_posix_pollq *pq;
+	int              fd;
+	nni_posix_pfd_cb cb;
+	void *           arg;
+	bool             closed;
+	bool             closing;
+	unsigned         events;   // directions with a poll in flight
+	int              inflight; // polls the kernel still references
+	nni_mtx          mtx;
+	nni_cv           cv;
+};
+
+// One ring and thread per poller, like the epoll pollq.
+static nni_posix_pollq *nni_posix_pollqs;
+static int              nni_posix_npollq; // running
+static int              nni_posix_pollq_sz;
+
+// Decided once at init, every pfd then belongs to the same backend.
+static bool nni_posix_uring;
+
+static int
+nni_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return ((int) syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int
+nni_uring_enter(int fd, unsigned nsubmit, unsigned mincomplete, unsigned flags)
+{
+	return ((int) syscall(
+	    __NR_io_uring_enter, fd, nsubmit, mincomplete, flags, NULL, 0));
+}
+
+// SQEs queued but not yet consumed by the kernel.
+static unsigned
+nni_uring_pending(nni_posix_pollq *pq)
+{
+	return (*pq->sqtail - __atomic_load_n(pq->sqhead, __ATOMIC_ACQUIRE));
+}
+
+// Move what the CQ ring holds to the stash.  False if there was no
+// memory for it.  Called with sqmtx held.
+static bool
+nni_uring_stash(nni_posix_pollq *pq)
+{
+	unsigned head = *pq->cqhead;
+	unsigned tail = __atomic_load_n(pq->cqtail, __ATOMIC_ACQUIRE);
+	unsigned need = pq->nstash + (tail - head);
+
+	if (need > pq->stashsz) {
+		nni_uring_cqe *stash;
+		unsigned       sz = pq->stashsz * 2;
+
+		if (sz < need) {
+			sz = need;
+		}
+		if ((stash = nni_alloc(sz * sizeof(*stash))) == NULL) {
+			return (false);
+		}
+		if (pq->nstash > 0) {
+			memcpy(stash, pq->stash, pq->nstash * sizeof(*stash));
+		}
+		if (pq->stash != NULL) {
+			nni_free(pq->stash, pq->stashsz * sizeof(*stash));
+		}
+		pq->stash   = stash;
+		pq->stashsz = sz;
+	}
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &pq->cqes[head & *pq->cqmask];
+
+		if (cqe->user_data != 0) {
+			pq->stash[pq->nstash].ud  = cqe->user_data;
+			pq->stash[pq->nstash].res = cqe->res;
+			pq->nstash++;
+		}
+	}
+	__atomic_store_n(pq->cqhead, head, __ATOMIC_RELEASE);
+	return (true);
+}
+
+// Hand queued SQEs to the kernel.  If it has completions it could not
+// post (EBUSY), drain the CQ ring first; off the poller thread, wake the
+// poller to run them.  Called with sqmtx held.
+static void
+nni_uring_flush(nni_posix_pollq *pq)
+{
+	unsigned n;
+	bool     wake = false;
+
+	while ((n = nni_uring_pending(pq)) > 0) {
+		if ((nni_uring_enter(pq->ringfd, n, 0, 0) >= 0) ||
+		    (errno == EINTR) || (errno == EAGAIN)) {
+			continue;
+		}
+		if (errno != EBUSY) {
+			nni_panic("io_uring_enter: %s", strerror(errno));
+		}
+		if (!nni_uring_stash(pq)) {
+			nni_msleep(1);
+			continue;
+		}
+		wake = true;
+	}
+	if (wake && !nni_thr_is_self(&pq->thr)) {
+		uint64_t one = 1;
+
+		// The eventfd counter cannot overflow from this.
+		(void) write(pq->evfd, &one, sizeof(one));
+	}
+}
+
+// Queue a poll (or poll removal) SQE.  Called with sqmtx held.
+static void
+nni_uring_queue(
+    nni_posix_pollq *pq, uint8_t op, int fd, unsigned mask, uint64_t ud)
+{
+	struct io_uring_sqe *sqe;
+	unsigned             tail, idx;
+
+	if (nni_uring_pending(pq) > *pq->sqmask) {
+		nni_uring_flush(pq); // ring full
+	}
+	tail = *pq->sqtail;
+	idx  = tail & *pq->sqmask;
+	sqe = &pq->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd     = fd;
+	if (op == IORING_OP_POLL_REMOVE) {
+		sqe->addr = ud;
+		ud        = 0;
+	} else {
+		sqe->poll_events = (uint16_t) mask;
+	}
+	sqe->user_data   = ud;
+	pq->sqarray[idx] = idx;
+	__atomic_store_n(pq->sqtail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Done queueing.  The poller thread submits with its next wait, anyone
+// else has to enter the kernel now.  Called with sqmtx held.
+static void
+nni_uring_submit(nni_posix_pollq *pq)
+{
+	if (!nni_thr_is_self(&pq->thr)) {
+		nni_uring_flush(pq);
+	}
+}
+
+static nni_posix_pollq *
+nni_posix_pollq_pick(void)
+{
+	nni_posix_pollq *pq = &nni_posix_pollqs[0];
+
+	for (int i = 1; i < nni_posix_npollq; i++) {
+		if (nni_atomic_get(&nni_posix_pollqs[i].npfd) <
+		    nni_atomic_get(&pq->npfd)) {
+			pq = &nni_posix_pollqs[i];
+		}
+	}
+	return (pq);
+}
+
+static uint64_t
+nni_uring_data(nni_posix_pfd *pfd, unsigned tag)
+{
+	return ((uint64_t)(uintptr_t) pfd | tag);
+}
+
+int
+nni_posix_pfd_init(nni_posix_pfd **pfdp, int fd)
+{
+	nni_posix_pfd *  pfd;
+	nni_posix_pollq *pq;
+
+	if (!nni_posix_uring) {
+		return (nni_posix_epoll_pfd_init(pfdp, fd));
+	}
+	pq = nni_posix_pollq_pick();
+
+	(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+	(void) fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	if ((pfd = NNI_ALLOC_STRUCT(pfd)) == NULL) {
+		return (NNG_ENOMEM);
+	}
+	NNI_ASSERT(((uintptr_t) pfd & NNI_URING_TAG_MASK) == 0);
+	nni_mtx_init(&pfd->mtx);
+	nni_cv_init(&pfd->cv, &pq->mtx);
+
+	pfd->pq       = pq;
+	pfd->fd       = fd;
+	pfd->cb       = NULL;
+	pfd->arg      = NULL;
+	pfd->events   = 0;
+	pfd->inflight = 0;
+	pfd->closing  = false;
+	pfd->closed   = false;
+
+	NNI_LIST_NODE_INIT(&pfd->node);
+	nni_atomic_inc(&pq->npfd);
+
+	*pfdp = pfd;
+	return (0);
+}
+
+int
+nni_posix_pfd_arm(nni_posix_pfd *pfd, unsigned events)
+{
+	nni_posix_pollq *pq;
+	unsigned         want;
+
+	if (!nni_posix_uring) {
+		return (nni_posix_epoll_pfd_arm(pfd, events));
+	}
+	pq = pfd->pq;
+
+	nni_mtx_lock(&pfd->mtx);
+	want = events & ~pfd->events & (NNI_POLL_IN | NNI_POLL_OUT);
+	if ((!pfd->closing) && (want != 0)) {
+		nni_mtx_lock(&pq->sqmtx);
+		if ((want & NNI_POLL_IN) != 0) {
+			nni_uring_queue(pq, IORING_OP_POLL_ADD, pfd->fd,
+			    NNI_POLL_IN, nni_uring_data(pfd, NNI_URING_TAG_IN));
+			pfd->inflight++;
+		}
+		if ((want & NNI_POLL_OUT) != 0) {
+			nni_uring_queue(pq, IORING_OP_POLL_ADD, pfd->fd,
+			    NNI_POLL_OUT, nni_uring_data(pfd, NNI_URING_TAG_OUT));
+			pfd->inflight++;
+		}
+		nni_uring_submit(pq);
+		nni_mtx_unlock(&pq->sqmtx);
+		pfd->events |= want;
+	}
+	nni_mtx_unlock(&pfd->mtx);
+	return (0);
+}
+
+int
+nni_posix_pfd_fd(nni_posix_pfd *pfd)
+{
+	if (!nni_posix_uring) {
+		return (nni_posix_epoll_pfd_fd(pfd));
+	}
+	return (pfd->fd);
+}
+
+void
+nni_posix_pfd_set_cb(nni_posix_pfd *pfd, nni_posix_pfd_cb cb, void *arg)
+{
+	if (!nni_posix_uring) {
+		nni_posix_epoll_pfd_set_cb(pfd, cb, arg);
+		return;
+	}
+	nni_mtx_lock(&pfd->mtx);
+	pfd->cb  = cb;
+	pfd->arg = arg;
+	nni_mtx_unlock(&pfd->mtx);
+}
+
+void
+nni_posix_pfd_close(nni_posix_pfd *pfd)
+{
+	if (!nni_posix_uring) {
+		nni_posix_epoll_pfd_close(pfd);
+		return;
+	}
+	nni_mtx_lock(&pfd->mtx);
+	if (!pfd->closing) {
+		nni_posix_pollq *pq = pfd->pq;
+		pfd->closing        = true;
+
+		(void) shutdown(pfd->fd, SHUT_RDWR);
+		if (pfd->events != 0) {
+			nni_mtx_lock(&pq->sqmtx);
+			if ((pfd->events & NNI_POLL_IN) != 0) {
+				nni_uring_queue(pq, IORING_OP_POLL_REMOVE, -1,
+				    0, nni_uring_data(pfd, NNI_URING_TAG_IN));
+			}
+			if ((pfd->events & NNI_POLL_OUT) != 0) {
+				nni_uring_queue(pq, IORING_OP_POLL_REMOVE, -1,
+				    0, nni_uring_data(pfd, NNI_URING_TAG_OUT));
+			}
+			nni_uring_submit(pq);
+			nni_mtx_unlock(&pq->sqmtx);
+		}
+	}
+	nni_mtx_unlock(&pfd->mtx);
+}
+
+void
+nni_posix_pfd_fini(nni_posix_pfd *pfd)
+{
+	nni_posix_pollq *pq;
+	uint64_t         one = 1;
+
+	if (!nni_posix_uring) {
+		nni_posix_epoll_pfd_fini(pfd);
+		return;
+	}
+	pq = pfd->pq;
+
+	nni_posix_pfd_close(pfd);
+
+	// We have to synchronize with the pollq thread (unless we are
+	// on that thread!)
+	NNI_ASSERT(!nni_thr_is_self(&pq->thr));
+
+	nni_mtx_lock(&pq->mtx);
+	nni_list_append(&pq->reapq, pfd);
+
+	// Wake the poller, it lets us go once the kernel has completed
+	// (or cancelled) every poll it has for this pfd.
+	if (write(pq->evfd, &one, sizeof(one)) != sizeof(one)) {
+		nni_panic("BUG! write to uring evfd incorrect!");
+	}
+
+	while (!pfd->closed) {
+		nni_cv_wait(&pfd->cv);
+	}
+	nni_mtx_unlock(&pq->mtx);
+
+	// We're exclusive now.
+
+	nni_atomic_dec(&pq->npfd);
+	(void) close(pfd->fd);
+	nni_cv_fini(&pfd->cv);
+	nni_mtx_fini(&pfd->mtx);
+	NNI_FREE_STRUCT(pfd);
+}
+
+static void
+nni_posix_pollq_reap(nni_posix_pollq *pq)
+{
+	nni_posix_pfd *pfd;
+	nni_posix_pfd *next;
+
+	nni_mtx_lock(&pq->mtx);
+	pfd = nni_list_first(&pq->reapq);
+	while (pfd != NULL) {
+		bool idle;
+
+		next = nni_list_next(&pq->reapq, pfd);
+		nni_mtx_lock(&pfd->mtx);
+		idle = (pfd->inflight == 0);
+		nni_mtx_unlock(&pfd->mtx);
+		if (idle) {
+			nni_list_remove(&pq->reapq, pfd);
+
+			// Let fini know we're done with it, and it's safe to
+			// remove.
+			pfd->closed = true;
+			nni_cv_wake(&pfd->cv);
+		}
+		pfd = next;
+	}
+	nni_mtx_unlock(&pq->mtx);
+}
+
+static void
+nni_posix_pollq_complete(uint64_t ud, int res)
+{
+	nni_posix_pfd *  pfd;
+	nni_posix_pfd_cb cb;
+	void *           cbarg;
+	unsigned         dir;
+	unsigned         mask;
+	bool             closing;
+
+	pfd = (nni_posix_pfd *) (uintptr_t)(ud & ~(uint64_t) NNI_URING_TAG_MASK);
+	dir = ((ud & NNI_URING_TAG_MASK) == NNI_URING_TAG_IN) ? NNI_POLL_IN
+	                                                      : NNI_POLL_OUT;
+
+	nni_mtx_lock(&pfd->mtx);
+	pfd->events &= ~dir;
+	pfd->inflight--;
+	cb      = pfd->cb;
+	cbarg   = pfd->arg;
+	closing = pfd->closing;
+	nni_mtx_unlock(&pfd->mtx);
+
+	if (res == -ECANCELED) {
+		return;
+	}
+	if (res < 0) {
+		mask = NNI_POLL_ERR;
+	} else {
+		mask = (unsigned) res &
+		    (NNI_POLL_IN | NNI_POLL_OUT | NNI_POLL_ERR | NNI_POLL_HUP);
+	}
+
+	// Execute the callback with lock released
+	if ((cb != NULL) && (!closing)) {
+		cb(pfd, mask, cbarg);
+	}
+}
+
+// Busy poll: submit what is queued, then watch the completion ring for
+// up to pq->busy microseconds without entering the kernel.  True if
+// completions showed up.
+static bool
+nni_uring_spin(nni_posix_pollq *pq)
+{
+	uint64_t deadline;
+	bool     stashed;
+
+	if (pq->busy == 0) {
+		return (false);
+	}
+	nni_mtx_lock(&pq->sqmtx);
+	nni_uring_flush(pq);
+	stashed = (pq->nstash > 0);
+	nni_mtx_unlock(&pq->sqmtx);
+	if (stashed) {
+		return (true);
+	}
+
+	deadline = nni_posix_pollq_usec() + pq->busy;
+	do {
+		if (__atomic_load_n(pq->cqtail, __ATOMIC_ACQUIRE) !=
+		    *pq->cqhead) {
+			return (true);
+		}
+	} while (nni_posix_pollq_usec() < deadline);
+	return (false);
+}
+
+static void
+nni_posix_poll_thr(void *arg)
+{
+	nni_posix_pollq *pq = arg;
+
+	if (pq->cpu >= 0) {
+		(void) nni_thr_set_affinity(NULL, pq->cpu);
+		nni_taskq_set_home(pq->home);
+	}
+
+	for (;;) {
+		nni_uring_cqe *run;
+		unsigned       nrun, n;
+		int            rv;
+		bool           reap = false;
+
+		if (!nni_uring_spin(pq)) {
+			bool wait;
+
+			nni_mtx_lock(&pq->sqmtx);
+			n    = nni_uring_pending(pq);
+			wait = (pq->nstash == 0);
+			nni_mtx_unlock(&pq->sqmtx);
+
+			// Submit what our callbacks armed and wait, in one
+			// go.  Anything not consumed (e.g. interrupted or
+			// EBUSY) goes next time.
+			rv = nni_uring_enter(pq->ringfd, n, wait ? 1 : 0,
+			    IORING_ENTER_GETEVENTS);
+			if ((rv < 0) && (errno == EBADF)) {
+				return;
+			}
+		}
+
+		// Take the completions, and leave an empty stash.
+		nni_mtx_lock(&pq->sqmtx);
+		(void) nni_uring_stash(pq);
+		run         = pq->stash;
+		nrun        = pq->nstash;
+		pq->stash   = pq->run;
+		pq->run     = run;
+		n           = pq->stashsz;
+		pq->stashsz = pq->runsz;
+		pq->runsz   = n;
+		pq->nstash  = 0;
+		nni_mtx_unlock(&pq->sqmtx);
+
+		for (unsigned i = 0; i < nrun; i++) {
+			if (run[i].ud == NNI_URING_WAKE) {
+				uint64_t clear;
+				if (read(pq->evfd, &clear, sizeof(clear)) !=
+				    sizeof(clear)) {
+					nni_panic("read from evfd incorrect!");
+				}
+				nni_mtx_lock(&pq->sqmtx);
+				nni_uring_queue(pq, IORING_OP_POLL_ADD,
+				    pq->evfd, NNI_POLL_IN, NNI_URING_WAKE);
+				nni_mtx_unlock(&pq->sqmtx);
+				reap = true;
+				continue;
+			}
+			nni_posix_pollq_complete(run[i].ud, run[i].res);
+		}
+
+		nni_mtx_lock(&pq->mtx);
+		if (!nni_list_empty(&pq->reapq)) {
+			reap = true;
+		}
+		nni_mtx_unlock(&pq->mtx);
+		if (reap) {
+			nni_posix_pollq_reap(pq);
+			nni_mtx_lock(&pq->mtx);
+			if (pq->close) {
+				nni_mtx_unlock(&pq->mtx);
+				return;
+			}
+			nni_mtx_unlock(&pq->mtx);
+		}
+	}
+}
+
+static void
+nni_posix_pollq_unmap(nni_posix_pollq *pq)
+{
+	if (pq->sqes != NULL) {
+		(void) munmap(pq->sqes, pq->sqesize);
+	}
+	if ((pq->cqring != NULL) && (pq->cqring != pq->sqring)) {
+		(void) munmap(pq->cqring, pq->cqsize);
+	}
+	if (pq->sqring != NULL) {
+		(void) munmap(pq->sqring, pq->sqsize);
+	}
+}
+
+static void
+nni_posix_pollq_destroy(nni_posix_pollq *pq)
+{
+	uint64_t one = 1;
+
+	nni_mtx_lock(&pq->mtx);
+	pq->close = true;
+
+	if (write(pq->evfd, &one, sizeof(one)) != sizeof(one)) {
+		// This should never occur, and if it does it could
+		// lead to a hang.
+		nni_panic("BUG! unable to write to evfd!");
+	}
+	nni_mtx_unlock(&pq->mtx);
+
+	nni_thr_fini(&pq->thr);
+
+	nni_posix_pollq_unmap(pq);
+	close(pq->evfd);
+	close(pq->ringfd);
+	if (pq->stash != NULL) {
+		nni_free(pq->stash, pq->stashsz * sizeof(nni_uring_cqe));
+	}
+	if (pq->run != NULL) {
+		nni_free(pq->run, pq->runsz * sizeof(nni_uring_cqe));
+	}
+
+	nni_taskq_fini(pq->home);
+	nni_mtx_fini(&pq->sqmtx);
+	nni_mtx_fini(&pq->mtx);
+}
+
+static int
+nni_posix_pollq_map(nni_posix_pollq *pq, struct io_uring_params *p)
+{
+	pq->sqsize = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	pq->cqsize =
+	    p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	if ((p->features & IORING_FEAT_SINGLE_MMAP) != 0) {
+		if (pq->cqsize > pq->sqsize) {
+			pq->sqsize = pq->cqsize;
+		}
+		pq->cqsize = pq->sqsize;
+	}
+	pq->sqring = mmap(NULL, pq->sqsize, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, pq->ringfd, IORING_OFF_SQ_RING);
+	if (pq->sqring == MAP_FAILED) {
+		pq->sqring = NULL;
+		return (nni_plat_errno(errno));
+	}
+	if ((p->features & IORING_FEAT_SINGLE_MMAP) != 0) {
+		pq->cqring = pq->sqring;
+	} else {
+		pq->cqring = mmap(NULL, pq->cqsize, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, pq->ringfd, IORING_OFF_CQ_RING);
+		if (pq->cqring == MAP_FAILED) {
+			pq->cqring = NULL;
+			return (nni_plat_errno(errno));
+		}
+	}
+	pq->sqesize = p->sq_entries * sizeof(struct io_uring_sqe);
+	pq->sqes    = mmap(NULL, pq->sqesize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, pq->ringfd, IORING_OFF_SQES);
+	if (pq->sqes == MAP_FAILED) {
+		pq->sqes = NULL;
+		return (nni_plat_errno(errno));
+	}
+
+	pq->sqhead  = (unsigned *) ((char *) pq->sqring + p->sq_off.head);
+	pq->sqtail  = (unsigned *) ((char *) pq->sqring + p->sq_off.tail);
+	pq->sqmask  = (unsigned *) ((char *) pq->sqring + p->sq_off.ring_mask);
+	pq->sqarray = (unsigned *) ((char *) pq->sqring + p->sq_off.array);
+	pq->cqhead  = (unsigned *) ((char *) pq->cqring + p->cq_off.head);
+	pq->cqtail  = (unsigned *) ((char *) pq->cqring + p->cq_off.tail);
+	pq->cqmask  = (unsigned *) ((char *) pq->cqring + p->cq_off.ring_mask);
+	pq->cqes    = (struct io_uring_cqe *) ((char *) pq->cqring +
+            p->cq_off.cqes);
+	return (0);
+}
+
+static int
+nni_posix_pollq_create(nni_posix_pollq *pq, int cpu)
+{
+	struct io_uring_params p;
+	int                    rv;
+
+	memset(pq, 0, sizeof(*pq));
+	memset(&p, 0, sizeof(p));
+	p.flags      = IORING_SETUP_CQSIZE;
+	p.cq_entries = NNI_URING_CQ_ENTRIES;
+	if ((pq->ringfd = nni_uring_setup(NNI_URING_ENTRIES, &p)) < 0) {
+		return (nni_plat_errno(errno));
+	}
+	if ((p.features & IORING_FEAT_NODROP) == 0) {
+		// Completions lost on overflow would strand pfds.
+		(void) close(pq->ringfd);
+		return (NNG_ENOTSUP);
+	}
+	if ((rv = nni_posix_pollq_map(pq, &p)) != 0) {
+		nni_posix_pollq_unmap(pq);
+		(void) close(pq->ringfd);
+		return (rv);
+	}
+	if ((pq->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		rv = nni_plat_errno(errno);
+		nni_posix_pollq_unmap(pq);
+		(void) close(pq->ringfd);
+		return (rv);
+	}
+
+	pq->close = false;
+	pq->cpu   = cpu;
+	pq->busy  = nni_posix_pollq_busy();
+	nni_atomic_init(&pq->npfd);
+
+	NNI_LIST_INIT(&pq->reapq, nni_posix_pfd, node);
+	nni_mtx_init(&pq->mtx);
+	nni_mtx_init(&pq->sqmtx);
+
+	// This poll is re-armed after every wake.
+	nni_mtx_lock(&pq->sqmtx);
+	nni_uring_queue(pq, IORING_OP_POLL_ADD, pq->evfd, NNI_POLL_IN,
+	    NNI_URING_WAKE);
+	nni_mtx_unlock(&pq->sqmtx);
+
+	if (((cpu >= 0) &&
+	        ((rv = nni_taskq_init_home(&pq->home,
+	              nni_posix_pollq_home_threads(), cpu)) != 0)) ||
+	    ((rv = nni_thr_init(&pq->thr, nni_posix_poll_thr, pq)) != 0)) {
+		nni_taskq_fini(pq->home);
+		nni_posix_pollq_unmap(pq);
+		(void) close(pq->ringfd);
+		(void) close(pq->evfd);
+		nni_mtx_fini(&pq->sqmtx);
+		nni_mtx_fini(&pq->mtx);
+		return (rv);
+	}
+	nni_thr_set_name(&pq->thr, "nng:poll:uring");
+	nni_thr_run(&pq->thr);
+	return (0);
+}
+
+static void
+nni_posix_uring_sysfini(void)
+{
+	for (int i = 0; i < nni_posix_npollq; i++) {
+		nni_posix_pollq_destroy(&nni_posix_pollqs[i]);
+	}
+	if (nni_posix_pollqs != NULL) {
+		NNI_FREE_STRUCTS(nni_posix_pollqs, nni_posix_pollq_sz);
+	}
+	nni_posix_pollqs   = NULL;
+	nni_posix_npollq   = 0;
+	nni_posix_pollq_sz = 0;
+}
+
+static int
+nni_posix_uring_sysinit(void)
+{
+	int n = nni_posix_pollq_nthreads();
+	int rv;
+
+	if ((nni_posix_pollqs = NNI_ALLOC_STRUCTS(nni_posix_pollqs, n)) ==
+	    NULL) {
+		return (NNG_ENOMEM);
+	}
+	nni_posix_pollq_sz = n;
+	for (int i = 0; i < n; i++) {
+		if ((rv = nni_posix_pollq_create(
+		         &nni_posix_pollqs[i], nni_posix_pollq_cpu(i))) != 0) {
+			nni_posix_uring_sysfini();
+			return (rv);
+		}
+		nni_posix_npollq++;
+	}
+	return (0);
+}
+
+int
+nni_posix_pollq_sysinit(void)
+{
+	const char *env = getenv("NNG_POLLQ");
+
+	nni_posix_uring = false;
+	if ((env == NULL) || (strcmp(env, "epoll") != 0)) {
+		if (nni_posix_uring_sysinit() == 0) {
+			nni_posix_uring = true;
+			return (0);
+		}
+	}
+	return (nni_posix_epoll_sysinit());
+}
+
+void
+nni_posix_pollq_sysfini(void)
+{
+	if (nni_posix_uring) {
+		nni_posix_uring_sysfini();
+	} else {
+		nni_posix_epoll_sysfini();
+	}
+}
+
+#endif // NNG_HAVE_IO_URING
@@ -22,6 +22,7 @@ struct nni_tcp_conn {
 	nni_list        readq;
 	nni_list        writeq;
 	bool            closed;
+	bool            busy; // busy polling, complete on the poller
 	nni_mtx         mtx;
 	nni_aio *       dial_aio;
 	nni_tcp_dialer *dialer;
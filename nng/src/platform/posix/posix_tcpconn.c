@@ -27,8 +27,30 @@
 
 #include "posix_tcp.h"
 
+// With busy polling, completions found on the poller thread are not
+// dispatched but collected in a tcp_done, to be run by tcp_cb itself
+// once it has dropped the lock.  A collected aio is off the read/write
+// queue, so tcp_cancel leaves it alone.
+#define NNI_TCP_DONE_MAX 8
+
+typedef struct {
+	nni_aio *aios[NNI_TCP_DONE_MAX];
+	int      naio;
+} tcp_done;
+
+static void
+tcp_finish(nni_aio *aio, tcp_done *done)
+{
+	nni_aio_list_remove(aio);
+	if ((done != NULL) && (done->naio < NNI_TCP_DONE_MAX)) {
+		done->aios[done->naio++] = aio;
+	} else {
+		nni_aio_finish(aio, 0, nni_aio_count(aio));
+	}
+}
+
 static void
-tcp_dowrite(nni_tcp_conn *c)
+tcp_dowrite(nni_tcp_conn *c, tcp_done *done)
 {
 	nni_aio *aio;
 	int      fd;
@@ -88,8 +110,7 @@ tcp_dowrite(nni_tcp_conn *c)
 		nni_aio_bump_count(aio, n);
 		// We completed the entire operation on this aio.
 		// (Sendmsg never returns a partial result.)
-		nni_aio_list_remove(aio);
-		nni_aio_finish(aio, 0, nni_aio_count(aio));
+		tcp_finish(aio, done);
 
 		// Go back to start of loop to see if there is another
 		// aio ready for us to process.
@@ -97,7 +118,7 @@ tcp_dowrite(nni_tcp_conn *c)
 }
 
 static void
-tcp_doread(nni_tcp_conn *c)
+tcp_doread(nni_tcp_conn *c, tcp_done *done)
 {
 	nni_aio *aio;
 	int      fd;
@@ -153,8 +174,7 @@ tcp_doread(nni_tcp_conn *c)
 		nni_aio_bump_count(aio, n);
 
 		// We completed the entire operation on this aio.
-		nni_aio_list_remove(aio);
-		nni_aio_finish(aio, 0, nni_aio_count(aio));
+		tcp_finish(aio, done);
 
 		// Go back to start of loop to see if there is another
 		// aio ready for us to process.
@@ -228,17 +248,19 @@ static void
 tcp_cb(nni_posix_pfd *pfd, unsigned events, void *arg)
 {
 	nni_tcp_conn *c = arg;
+	tcp_done      done;
 
 	if (events & (NNI_POLL_HUP | NNI_POLL_ERR | NNI_POLL_INVAL)) {
 		tcp_error(c, NNG_ECONNSHUT);
 		return;
 	}
+	done.naio = 0;
 	nni_mtx_lock(&c->mtx);
 	if ((events & NNI_POLL_IN) != 0) {
-		tcp_doread(c);
+		tcp_doread(c, c->busy ? &done : NULL);
 	}
 	if ((events & NNI_POLL_OUT) != 0) {
-		tcp_dowrite(c);
+		tcp_dowrite(c, c->busy ? &done : NULL);
 	}
 	events = 0;
 	if (!nni_list_empty(&c->writeq)) {
@@ -251,6 +273,11 @@ tcp_cb(nni_posix_pfd *pfd, unsigned events, void *arg)
 		nni_posix_pfd_arm(pfd, events);
 	}
 	nni_mtx_unlock(&c->mtx);
+
+	for (int i = 0; i < done.naio; i++) {
+		nni_aio *aio = done.aios[i];
+		nni_aio_finish_sync(aio, 0, nni_aio_count(aio));
+	}
 }
 
 static void
@@ -285,7 +312,7 @@ tcp_send(void *arg, nni_aio *aio)
 	nni_aio_list_append(&c->writeq, aio);
 
 	if (nni_list_first(&c->writeq) == aio) {
-		tcp_dowrite(c);
+		tcp_dowrite(c, NULL);
 		// If we are still the first thing on the list, that
 		// means we didn't finish the job, so arm the poller to
 		// complete us.
@@ -319,7 +346,7 @@ tcp_recv(void *arg, nni_aio *aio)
 	// many cases.  We also need not arm a list if it was already
 	// armed.
 	if (nni_list_first(&c->readq) == aio) {
-		tcp_doread(c);
+		tcp_doread(c, NULL);
 		// If we are still the first thing on the list, that
 		// means we didn't finish the job, so arm the poller to
 		// complete us.
@@ -485,6 +512,7 @@ nni_posix_tcp_alloc(nni_tcp_conn **cp, nni_tcp_dialer *d)
 	}
 
 	c->closed = false;
+	c->busy   = nni_posix_pollq_busy() > 0;
 	c->dialer = d;
 
 	nni_mtx_init(&c->mtx);
@@ -516,6 +544,15 @@ nni_posix_tcp_start(nni_tcp_conn *c, int nodelay, int keepalive)
 	    &nodelay, sizeof(int));
 	(void) setsockopt(nni_posix_pfd_fd(c->pfd), SOL_SOCKET, SO_KEEPALIVE,
 	    &keepalive, sizeof(int));
+#ifdef SO_BUSY_POLL
+	if (c->busy) {
+		// Let the kernel spin on the device queue too.  Raising it
+		// past net.core.busy_read needs CAP_NET_ADMIN; best effort.
+		int usec = nni_posix_pollq_busy();
+		(void) setsockopt(nni_posix_pfd_fd(c->pfd), SOL_SOCKET,
+		    SO_BUSY_POLL, &usec, sizeof(int));
+	}
+#endif
 
 	nni_posix_pfd_set_cb(c->pfd, tcp_cb, c);
 }
@@ -29,9 +29,17 @@
 
 #include "posix_tcp.h"
 
+// Connections are accepted in batches: one poller wakeup drains the kernel
+// accept queue (until EAGAIN, or this many are waiting to be claimed), so a
+// reconnect storm costs a wakeup per batch rather than per connection.
+#define NNI_TCP_ACCEPT_BATCH 64
+
 struct nni_tcp_listener {
 	nni_posix_pfd *pfd;
 	nni_list       acceptq;
+	nni_tcp_conn * ready[NNI_TCP_ACCEPT_BATCH]; // accepted, unclaimed
+	int            readyhead;
+	int            nready;
 	bool           started;
 	bool           closed;
 	bool           nodelay;
@@ -68,6 +76,11 @@ tcp_listener_doclose(nni_tcp_listener *l)
 		nni_aio_list_remove(aio);
 		nni_aio_finish_error(aio, NNG_ECLOSED);
 	}
+	while (l->nready > 0) {
+		nng_stream_free(&l->ready[l->readyhead]->stream);
+		l->readyhead = (l->readyhead + 1) % NNI_TCP_ACCEPT_BATCH;
+		l->nready--;
+	}
 
 	if (l->pfd != NULL) {
 		nni_posix_pfd_close(l->pfd);
@@ -82,22 +95,21 @@ nni_tcp_listener_close(nni_tcp_listener *l)
 	nni_mtx_unlock(&l->mtx);
 }
 
-static void
-tcp_listener_doaccept(nni_tcp_listener *l)
+// Accept until the kernel queue is empty or the batch is full.  Returns
+// NNG_EAGAIN, with the poller armed, if nothing at all could be accepted.
+static int
+tcp_listener_fill(nni_tcp_listener *l)
 {
-	nni_aio *aio;
+	int fd = nni_posix_pfd_fd(l->pfd);
+	int rv;
 
-	while ((aio = nni_list_first(&l->acceptq)) != NULL) {
+	while (l->nready < NNI_TCP_ACCEPT_BATCH) {
 		int            newfd;
-		int            fd;
-		int            rv;
 		int            nd;
 		int            ka;
 		nni_posix_pfd *pfd;
 		nni_tcp_conn * c;
 
-		fd = nni_posix_pfd_fd(l->pfd);
-
 #ifdef NNG_USE_ACCEPT4
 		newfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
 		if ((newfd < 0) && ((errno == ENOSYS) || (errno == ENOTSUP))) {
@@ -114,49 +126,76 @@ tcp_listener_doaccept(nni_tcp_listener *l)
 			case EWOULDBLOCK:
 #endif
 #endif
-				rv = nni_posix_pfd_arm(l->pfd, NNI_POLL_IN);
-				if (rv != 0) {
-					nni_aio_list_remove(aio);
-					nni_aio_finish_error(aio, rv);
-					continue;
+				if (l->nready > 0) {
+					// Arm again once these are claimed.
+					return (0);
+				}
+				if ((rv = nni_posix_pfd_arm(l->pfd, NNI_POLL_IN)) !=
+				    0) {
+					return (rv);
 				}
 				// Come back later...
-				return;
+				return (NNG_EAGAIN);
 			case ECONNABORTED:
 			case ECONNRESET:
 				// Eat them, they aren't interesting.
 				continue;
 			default:
-				// Error this one, but keep moving to the next.
+				// Hand out what we have, report it after.
+				if (l->nready > 0) {
+					return (0);
+				}
 				rv = nni_plat_errno(errno);
 				NNI_ASSERT(rv != 0);
-				nni_aio_list_remove(aio);
-				nni_aio_finish_error(aio, rv);
-				continue;
+				return (rv);
 			}
 		}
 
 		if ((rv = nni_posix_tcp_alloc(&c, NULL)) != 0) {
 			close(newfd);
-			nni_aio_list_remove(aio);
-			nni_aio_finish_error(aio, rv);
-			continue;
+			return (l->nready > 0 ? 0 : rv);
 		}
 
 		if ((rv = nni_posix_pfd_init(&pfd, newfd)) != 0) {
 			close(newfd);
 			nng_stream_free(&c->stream);
-			nni_aio_list_remove(aio);
-			nni_aio_finish_error(aio, rv);
-			continue;
+			return (l->nready > 0 ? 0 : rv);
 		}
 
 		nni_posix_tcp_init(c, pfd);
 
 		ka = l->keepalive ? 1 : 0;
 		nd = l->nodelay ? 1 : 0;
-		nni_aio_list_remove(aio);
 		nni_posix_tcp_start(c, nd, ka);
+		l->ready[(l->readyhead + l->nready) % NNI_TCP_ACCEPT_BATCH] = c;
+		l->nready++;
+	}
+	return (0);
+}
+
+static void
+tcp_listener_doaccept(nni_tcp_listener *l)
+{
+	nni_aio *aio;
+
+	while ((aio = nni_list_first(&l->acceptq)) != NULL) {
+		int           rv;
+		nni_tcp_conn *c;
+
+		if ((l->nready == 0) && ((rv = tcp_listener_fill(l)) != 0)) {
+			if (rv == NNG_EAGAIN) {
+				return;
+			}
+			// Error this one, but keep moving to the next.
+			nni_aio_list_remove(aio);
+			nni_aio_finish_error(aio, rv);
+			continue;
+		}
+
+		c            = l->ready[l->readyhead];
+		l->readyhead = (l->readyhead + 1) % NNI_TCP_ACCEPT_BATCH;
+		l->nready--;
+		nni_aio_list_remove(aio);
 		nni_aio_set_output(aio, 0, c);
 		nni_aio_finish(aio, 0, 0);
 	}
@@ -11,6 +11,7 @@
 // POSIX threads.
 
 #include "core/nng_impl.h"
+#include "platform/posix/posix_pollq.h"
 
 #ifdef NNG_PLATFORM_POSIX
 
@@ -278,6 +279,25 @@ nni_plat_thr_set_name(nni_plat_thr *thr, const char *name)
 #endif
 }
 
+int
+nni_plat_thr_set_affinity(nni_plat_thr *thr, int cpu)
+{
+#if defined(NNG_HAVE_PTHREAD_SETAFFINITY_NP)
+	cpu_set_t set;
+	int       rv;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	rv = pthread_setaffinity_np(
+	    thr == NULL ? pthread_self() : thr->tid, sizeof(set), &set);
+	return (rv == 0 ? 0 : nni_plat_errno(rv));
+#else
+	NNI_ARG_UNUSED(thr);
+	NNI_ARG_UNUSED(cpu);
+	return (NNG_ENOTSUP);
+#endif
+}
+
 void
 nni_atfork_child(void)
 {
@@ -400,4 +420,30 @@ nni_plat_ncpu(void)
 #endif
 }
 
+int
+nni_posix_pollq_busy(void)
+{
+	static int busy = -1;
+
+	if (busy < 0) {
+		const char *env = getenv("NNG_BUSY_POLL");
+		int         usec;
+
+		usec = (env != NULL) ? atoi(env) : NNG_BUSY_POLL_USEC;
+		busy = (usec > 0) ? usec : 0;
+	}
+	return (busy);
+}
+
+uint64_t
+nni_posix_pollq_usec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		nni_panic("clock_gettime failed: %s", strerror(errno));
+	}
+	return ((uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000);
+}
+
 #endif // NNG_PLATFORM_POSIX
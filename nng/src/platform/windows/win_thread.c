@@ -327,6 +327,17 @@ nni_plat_thr_is_self(nni_plat_thr *thr)
 	return (GetCurrentThreadId() == thr->id);
 }
 
+int
+nni_plat_thr_set_affinity(nni_plat_thr *thr, int cpu)
+{
+	HANDLE h = thr == NULL ? GetCurrentThread() : thr->handle;
+
+	if (SetThreadAffinityMask(h, (DWORD_PTR) 1 << cpu) == 0) {
+		return (nni_win_error(GetLastError()));
+	}
+	return (0);
+}
+
 void
 nni_plat_thr_set_name(nni_plat_thr *thr, const char *name)
 {
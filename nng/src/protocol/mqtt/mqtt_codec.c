@@ -0,0 +1,539 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <string.h>
+
+#include "core/nng_impl.h"
+#include "nng/protocol/mqtt/mqtt.h"
+#include "nng/protocol/mqtt/mqtt_codec.h"
+#include "nng/protocol/mqtt/mqtt_parser.h"
+
+void
+mqtt_cursor_init(mqtt_cursor *c, void *buf, size_t len)
+{
+	c->buf = buf;
+	c->len = len;
+	c->pos = 0;
+	c->err = false;
+}
+
+size_t
+mqtt_cursor_left(const mqtt_cursor *c)
+{
+	return (c->err ? 0 : c->len - c->pos);
+}
+
+// Claims n bytes at the cursor, NULL if there are not that many left.
+static uint8_t *
+cursor_take(mqtt_cursor *c, size_t n)
+{
+	uint8_t *p;
+
+	if (c->err || (c->len - c->pos < n)) {
+		c->err = true;
+		return (NULL);
+	}
+	p = c->buf + c->pos;
+	c->pos += n;
+	return (p);
+}
+
+uint8_t
+mqtt_get_u8(mqtt_cursor *c)
+{
+	uint8_t *p = cursor_take(c, 1);
+
+	return (p == NULL ? 0 : p[0]);
+}
+
+uint16_t
+mqtt_get_u16(mqtt_cursor *c)
+{
+	uint8_t *p = cursor_take(c, 2);
+
+	return (p == NULL ? 0 : (uint16_t) ((p[0] << 8) | p[1]));
+}
+
+uint32_t
+mqtt_get_u32(mqtt_cursor *c)
+{
+	uint8_t *p = cursor_take(c, 4);
+
+	if (p == NULL) {
+		return (0);
+	}
+	return (((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+	    ((uint32_t) p[2] << 8) | p[3]);
+}
+
+// At most four bytes, seven bits each, least significant first.
+uint32_t
+mqtt_get_varint(mqtt_cursor *c)
+{
+	uint32_t val = 0;
+	uint8_t  b;
+
+	for (int i = 0; i < 4; i++) {
+		b = mqtt_get_u8(c);
+		val |= (uint32_t) (b & 0x7f) << (7 * i);
+		if ((b & 0x80) == 0) {
+			return (val);
+		}
+	}
+	c->err = true;
+	return (0);
+}
+
+uint8_t *
+mqtt_get_bytes(mqtt_cursor *c, size_t n)
+{
+	return (cursor_take(c, n));
+}
+
+mqtt_buf
+mqtt_get_bin(mqtt_cursor *c)
+{
+	mqtt_buf b;
+
+	b.len = mqtt_get_u16(c);
+	b.buf = cursor_take(c, b.len);
+	if (b.buf == NULL) {
+		b.len = 0;
+	}
+	return (b);
+}
+
+mqtt_buf
+mqtt_get_str(mqtt_cursor *c)
+{
+	mqtt_buf b = mqtt_get_bin(c);
+
+	if (b.len > 0 && utf8_check((const char *) b.buf, b.len) != 0) {
+		c->err = true;
+		b.buf  = NULL;
+		b.len  = 0;
+	}
+	return (b);
+}
+
+void
+mqtt_put_u8(mqtt_cursor *c, uint8_t v)
+{
+	uint8_t *p = cursor_take(c, 1);
+
+	if (p != NULL) {
+		p[0] = v;
+	}
+}
+
+void
+mqtt_put_u16(mqtt_cursor *c, uint16_t v)
+{
+	uint8_t *p = cursor_take(c, 2);
+
+	if (p != NULL) {
+		p[0] = (uint8_t) (v >> 8);
+		p[1] = (uint8_t) v;
+	}
+}
+
+void
+mqtt_put_u32(mqtt_cursor *c, uint32_t v)
+{
+	uint8_t *p = cursor_take(c, 4);
+
+	if (p != NULL) {
+		p[0] = (uint8_t) (v >> 24);
+		p[1] = (uint8_t) (v >> 16);
+		p[2] = (uint8_t) (v >> 8);
+		p[3] = (uint8_t) v;
+	}
+}
+
+void
+mqtt_put_varint(mqtt_cursor *c, uint32_t v)
+{
+	size_t n = mqtt_varint_len(v);
+
+	if (n == 0) {
+		c->err = true;
+		return;
+	}
+	while (--n > 0) {
+		mqtt_put_u8(c, (uint8_t) (v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	mqtt_put_u8(c, (uint8_t) v);
+}
+
+void
+mqtt_put_bytes(mqtt_cursor *c, const void *buf, size_t n)
+{
+	uint8_t *p = cursor_take(c, n);
+
+	if (p != NULL && n > 0) {
+		memcpy(p, buf, n);
+	}
+}
+
+void
+mqtt_put_bin(mqtt_cursor *c, mqtt_buf b)
+{
+	mqtt_put_u16(c, (uint16_t) b.len);
+	mqtt_put_bytes(c, b.buf, b.len);
+}
+
+// 0 for values too large to encode.
+size_t
+mqtt_varint_len(uint32_t v)
+{
+	return (v < 0x80 ? 1
+	        : v < 0x4000 ? 2
+	        : v < 0x200000 ? 3
+	        : v < 0x10000000 ? 4
+	                         : 0);
+}
+
+enum {
+	PROP_NONE = 0,
+	PROP_BYTE,
+	PROP_U16,
+	PROP_U32,
+	PROP_VARINT,
+	PROP_STR,
+	PROP_BIN,
+	PROP_PAIR,
+};
+
+#define W(t) (1u << (t))
+#define W_ACKS (W(PUBACK) | W(PUBREC) | W(PUBREL) | W(PUBCOMP))
+
+// Indexed by property identifier: its type, its slot in num[] or buf[],
+// the packets that may carry it and the range of a numeric value.
+static const struct {
+	uint8_t  type;
+	uint8_t  slot;
+	uint16_t where;
+	uint32_t min;
+	uint32_t max;
+} prop_defs[SHARED_SUBSCRIPTION_AVAILABLE + 1] = {
+	[PAYLOAD_FORMAT_INDICATOR] = { PROP_BYTE, 0,
+	    W(PUBLISH) | W(MQTT_PROPS_WILL), 0, 1 },
+	[MESSAGE_EXPIRY_INTERVAL]  = { PROP_U32, 1,
+	    W(PUBLISH) | W(MQTT_PROPS_WILL), 0, UINT32_MAX },
+	[CONTENT_TYPE] = { PROP_STR, 0, W(PUBLISH) | W(MQTT_PROPS_WILL) },
+	[RESPONSE_TOPIC] = { PROP_STR, 1, W(PUBLISH) | W(MQTT_PROPS_WILL) },
+	[CORRELATION_DATA] = { PROP_BIN, 2, W(PUBLISH) | W(MQTT_PROPS_WILL) },
+	[SUBSCRIPTION_IDENTIFIER] = { PROP_VARINT, 2,
+	    W(PUBLISH) | W(SUBSCRIBE), 1, 0x0fffffff },
+	[SESSION_EXPIRY_INTERVAL] = { PROP_U32, 3,
+	    W(CONNECT) | W(CONNACK) | W(DISCONNECT), 0, UINT32_MAX },
+	[ASSIGNED_CLIENT_IDENTIFIER] = { PROP_STR, 3, W(CONNACK) },
+	[SERVER_KEEP_ALIVE] = { PROP_U16, 4, W(CONNACK), 0, UINT16_MAX },
+	[AUTHENTICATION_METHOD] = { PROP_STR, 4,
+	    W(CONNECT) | W(CONNACK) | W(AUTH) },
+	[AUTHENTICATION_DATA] = { PROP_BIN, 5,
+	    W(CONNECT) | W(CONNACK) | W(AUTH) },
+	[REQUEST_PROBLEM_INFORMATION] = { PROP_BYTE, 5, W(CONNECT), 0, 1 },
+	[WILL_DELAY_INTERVAL] = { PROP_U32, 6, W(MQTT_PROPS_WILL), 0,
+	    UINT32_MAX },
+	[REQUEST_RESPONSE_INFORMATION] = { PROP_BYTE, 7, W(CONNECT), 0, 1 },
+	[RESPONSE_INFORMATION] = { PROP_STR, 6, W(CONNACK) },
+	[SERVER_REFERENCE] = { PROP_STR, 7, W(CONNACK) | W(DISCONNECT) },
+	[REASON_STRING] = { PROP_STR, 8,
+	    W(CONNACK) | W_ACKS | W(SUBACK) | W(UNSUBACK) | W(DISCONNECT) |
+	        W(AUTH) },
+	[RECEIVE_MAXIMUM] = { PROP_U16, 8, W(CONNECT) | W(CONNACK), 1,
+	    UINT16_MAX },
+	[TOPIC_ALIAS_MAXIMUM] = { PROP_U16, 9, W(CONNECT) | W(CONNACK), 0,
+	    UINT16_MAX },
+	[TOPIC_ALIAS] = { PROP_U16, 10, W(PUBLISH), 1, UINT16_MAX },
+	[PUBLISH_MAXIMUM_QOS] = { PROP_BYTE, 11, W(CONNACK), 0, 1 },
+	[RETAIN_AVAILABLE] = { PROP_BYTE, 12, W(CONNACK), 0, 1 },
+	[USER_PROPERTY] = { PROP_PAIR, 0, 0xffff },
+	[MAXIMUM_PACKET_SIZE] = { PROP_U32, 13, W(CONNECT) | W(CONNACK), 1,
+	    UINT32_MAX },
+	[WILDCARD_SUBSCRIPTION_AVAILABLE] = { PROP_BYTE, 14, W(CONNACK), 0,
+	    1 },
+	[SUBSCRIPTION_IDENTIFIER_AVAILABLE] = { PROP_BYTE, 15, W(CONNACK),
+	    0, 1 },
+	[SHARED_SUBSCRIPTION_AVAILABLE] = { PROP_BYTE, 16, W(CONNACK), 0,
+	    1 },
+};
+
+#define NPROPS (sizeof(prop_defs) / sizeof(prop_defs[0]))
+
+static bool
+prop_known(uint32_t id)
+{
+	return (id < NPROPS && prop_defs[id].type != PROP_NONE);
+}
+
+static bool
+prop_is_num(uint8_t type)
+{
+	return (type == PROP_BYTE || type == PROP_U16 || type == PROP_U32 ||
+	    type == PROP_VARINT);
+}
+
+void
+mqtt_props_init(mqtt_props *props)
+{
+	memset(props, 0, sizeof(*props));
+}
+
+int
+mqtt_props_decode(mqtt_cursor *c, mqtt_props *props, uint8_t type)
+{
+	mqtt_cursor b;
+	uint32_t    len;
+	uint32_t    id;
+	uint32_t    v;
+	uint8_t *   block;
+
+	mqtt_props_init(props);
+	len   = mqtt_get_varint(c);
+	block = mqtt_get_bytes(c, len);
+	if (c->err) {
+		return (MALFORMED_PACKET);
+	}
+	props->block.buf = block;
+	props->block.len = len;
+
+	mqtt_cursor_init(&b, block, len);
+	while (mqtt_cursor_left(&b) > 0) {
+		id = mqtt_get_varint(&b);
+		if (!prop_known(id)) {
+			return (MALFORMED_PACKET);
+		}
+		if ((prop_defs[id].where & W(type)) == 0) {
+			return (PROTOCOL_ERROR);
+		}
+		if (prop_defs[id].type == PROP_PAIR) {
+			mqtt_get_str(&b);
+			mqtt_get_str(&b);
+			props->nuser++;
+			continue;
+		}
+		if (props->present & ((uint64_t) 1 << id)) {
+			return (PROTOCOL_ERROR);
+		}
+		switch (prop_defs[id].type) {
+		case PROP_BYTE:
+			v = mqtt_get_u8(&b);
+			break;
+		case PROP_U16:
+			v = mqtt_get_u16(&b);
+			break;
+		case PROP_U32:
+			v = mqtt_get_u32(&b);
+			break;
+		case PROP_VARINT:
+			v = mqtt_get_varint(&b);
+			break;
+		case PROP_STR:
+			props->buf[prop_defs[id].slot] = mqtt_get_str(&b);
+			break;
+		default:
+			props->buf[prop_defs[id].slot] = mqtt_get_bin(&b);
+			break;
+		}
+		if (b.err) {
+			return (MALFORMED_PACKET);
+		}
+		if (prop_is_num(prop_defs[id].type)) {
+			if (v < prop_defs[id].min || v > prop_defs[id].max) {
+				return (PROTOCOL_ERROR);
+			}
+			props->num[prop_defs[id].slot] = v;
+		}
+		props->present |= (uint64_t) 1 << id;
+	}
+	return (b.err ? MALFORMED_PACKET : SUCCESS);
+}
+
+bool
+mqtt_props_user(const mqtt_props *props, size_t *iter, mqtt_buf *key,
+    mqtt_buf *val)
+{
+	mqtt_cursor b;
+	uint32_t    id;
+
+	if (props->nuser == 0) {
+		return (false);
+	}
+	mqtt_cursor_init(&b, props->block.buf, props->block.len);
+	b.pos = *iter;
+	// The block passed mqtt_props_decode, so only the types matter.
+	while (mqtt_cursor_left(&b) > 0) {
+		id = mqtt_get_varint(&b);
+		if (!prop_known(id)) {
+			break;
+		}
+		switch (prop_defs[id].type) {
+		case PROP_BYTE:
+			mqtt_get_u8(&b);
+			break;
+		case PROP_U16:
+			mqtt_get_u16(&b);
+			break;
+		case PROP_U32:
+			mqtt_get_u32(&b);
+			break;
+		case PROP_VARINT:
+			mqtt_get_varint(&b);
+			break;
+		case PROP_PAIR:
+			*key  = mqtt_get_bin(&b);
+			*val  = mqtt_get_bin(&b);
+			*iter = b.pos;
+			return (!b.err);
+		default:
+			mqtt_get_bin(&b);
+			break;
+		}
+	}
+	*iter = props->block.len;
+	return (false);
+}
+
+static uint32_t
+prop_len(const mqtt_props *props, uint32_t id)
+{
+	switch (prop_defs[id].type) {
+	case PROP_BYTE:
+		return (2);
+	case PROP_U16:
+		return (3);
+	case PROP_U32:
+		return (5);
+	case PROP_VARINT:
+		return (1 +
+		    (uint32_t) mqtt_varint_len(
+		        props->num[prop_defs[id].slot]));
+	default:
+		return (3 + props->buf[prop_defs[id].slot].len);
+	}
+}
+
+uint32_t
+mqtt_props_len(const mqtt_props *props)
+{
+	uint32_t len  = 0;
+	size_t   iter = 0;
+	mqtt_buf key, val;
+
+	for (uint32_t id = 1; id < NPROPS; id++) {
+		if (props->present & ((uint64_t) 1 << id)) {
+			len += prop_len(props, id);
+		}
+	}
+	while (mqtt_props_user(props, &iter, &key, &val)) {
+		len += 5 + key.len + val.len;
+	}
+	return (len);
+}
+
+void
+mqtt_props_encode(mqtt_cursor *c, const mqtt_props *props)
+{
+	size_t   iter = 0;
+	mqtt_buf key, val;
+	uint32_t v;
+
+	mqtt_put_varint(c, mqtt_props_len(props));
+	for (uint32_t id = 1; id < NPROPS; id++) {
+		if ((props->present & ((uint64_t) 1 << id)) == 0) {
+			continue;
+		}
+		// Every identifier is below 128, a one byte varint.
+		mqtt_put_u8(c, (uint8_t) id);
+		v = props->num[prop_defs[id].slot];
+		switch (prop_defs[id].type) {
+		case PROP_BYTE:
+			mqtt_put_u8(c, (uint8_t) v);
+			break;
+		case PROP_U16:
+			mqtt_put_u16(c, (uint16_t) v);
+			break;
+		case PROP_U32:
+			mqtt_put_u32(c, v);
+			break;
+		case PROP_VARINT:
+			mqtt_put_varint(c, v);
+			break;
+		default:
+			mqtt_put_bin(c, props->buf[prop_defs[id].slot]);
+			break;
+		}
+	}
+	while (mqtt_props_user(props, &iter, &key, &val)) {
+		mqtt_put_u8(c, USER_PROPERTY);
+		mqtt_put_bin(c, key);
+		mqtt_put_bin(c, val);
+	}
+}
+
+bool
+mqtt_props_has(const mqtt_props *props, uint8_t id)
+{
+	return (prop_known(id) && (props->present & ((uint64_t) 1 << id)));
+}
+
+uint32_t
+mqtt_props_num(const mqtt_props *props, uint8_t id)
+{
+	if (!mqtt_props_has(props, id) || !prop_is_num(prop_defs[id].type)) {
+		return (0);
+	}
+	return (props->num[prop_defs[id].slot]);
+}
+
+mqtt_buf
+mqtt_props_buf(const mqtt_props *props, uint8_t id)
+{
+	mqtt_buf none = { NULL, 0 };
+
+	if (!mqtt_props_has(props, id) || prop_is_num(prop_defs[id].type) ||
+	    prop_defs[id].type == PROP_PAIR) {
+		return (none);
+	}
+	return (props->buf[prop_defs[id].slot]);
+}
+
+void
+mqtt_props_set_num(mqtt_props *props, uint8_t id, uint32_t v)
+{
+	if (prop_known(id) && prop_is_num(prop_defs[id].type)) {
+		props->num[prop_defs[id].slot] = v;
+		props->present |= (uint64_t) 1 << id;
+	}
+}
+
+// The bytes are not copied and must outlive props.
+void
+mqtt_props_set_buf(mqtt_props *props, uint8_t id, void *buf, uint32_t len)
+{
+	if (prop_known(id) && (prop_defs[id].type == PROP_STR ||
+	                          prop_defs[id].type == PROP_BIN)) {
+		props->buf[prop_defs[id].slot].buf = buf;
+		props->buf[prop_defs[id].slot].len = len;
+		props->present |= (uint64_t) 1 << id;
+	}
+}
+
+void
+mqtt_props_clear(mqtt_props *props, uint8_t id)
+{
+	if (id == USER_PROPERTY) {
+		props->nuser = 0;
+	} else if (id < 64) {
+		props->present &= ~((uint64_t) 1 << id);
+	}
+}
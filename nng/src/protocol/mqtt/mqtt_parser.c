@@ -11,69 +11,25 @@
 #include <string.h>
 #include "core/nng_impl.h"
 #include "nng/protocol/mqtt/mqtt_parser.h"
+#include "nng/protocol/mqtt/mqtt_codec.h"
 #include "nng/protocol/mqtt/mqtt.h"
 #include "include/nng_debug.h"
 
-static uint8_t  get_value_size(uint64_t value);
-static uint64_t power(uint64_t x, uint32_t n);
 static void     init_conn_param(conn_param *);
 
-static uint64_t power(uint64_t x, uint32_t n)
-{
-	uint64_t val = 1;
-
-	for (uint32_t i = 0; i <= n; ++i) {
-		val = x * val;
-	}
-
-	return val / x;
-}
-
-/**
- * get size from value
- *
- * @param value
- * @return
- */
-static uint8_t get_value_size(uint64_t value)
-{
-	uint8_t  len = 1;
-	uint64_t pow;
-	for (int i   = 1; i <= 4; ++i) {
-		pow = power(0x100, i);
-		if (value >= pow) {
-			++len;
-		} else {
-			break;
-		}
-	}
-	return len;
-}
-
 /**
  * put a value to variable byte array
- * @param dest
+ * @param dest at least 4 bytes
  * @param value
  * @return data length
  */
 uint8_t put_var_integer(uint8_t *dest, uint32_t value)
 {
-	uint8_t  len        = 0;
-	uint32_t init_val   = 0x7F;
-	uint8_t  value_size = get_value_size(value);
-
-	for (uint32_t i = 0; i < value_size; ++i) {
+	mqtt_cursor c;
 
-		if (i > 0) {
-			init_val = (init_val * 0x80) | 0xFF;
-		}
-		dest[i] = value / (uint32_t) power(0x80, i);
-		if (value > init_val) {
-			dest[i] |= 0x80;
-		}
-		len++;
-	}
-	return len;
+	mqtt_cursor_init(&c, dest, 4);
+	mqtt_put_varint(&c, value);
+	return (uint8_t) c.pos;
 }
 
 /**
@@ -85,19 +41,13 @@ uint8_t put_var_integer(uint8_t *dest, uint32_t value)
  */
 uint32_t get_var_integer(const uint8_t *buf, uint32_t *pos)
 {
-	uint8_t  temp;
-	uint32_t result = 0;
+	mqtt_cursor c;
+	uint32_t    result;
 
-	uint32_t p = *pos;
-	int i = 0;
-
-	do {
-		temp   = *(buf + p);
-		result = result + (uint32_t) (temp & 0x7f) * (power(0x80, i));
-		p++;
-	}
-	while ((temp & 0x80) > 0 && i++ < 4);
-	*pos = p;
+	// Never reads past the first byte without the continuation bit.
+	mqtt_cursor_init(&c, (uint8_t *) buf + *pos, 4);
+	result = mqtt_get_varint(&c);
+	*pos += (uint32_t) c.pos;
 	return result;
 }
 
@@ -159,89 +109,14 @@ uint8_t * copy_utf8_str(const uint8_t *src, uint32_t *pos, int *str_len)
 
 int utf8_check(const char *str, size_t len)
 {
-	int i;
-	int j;
-	int codelen;
-	int codepoint;
-
-	const unsigned char *ustr = (const unsigned char *) str;
+	mqtt_topic_info info;
 
 	if (!str) return ERR_INVAL;
 	if (len > 65536) return ERR_INVAL;
 
-	for (i = 0; i < (int)len; i++) {
-		if (ustr[i] == 0) {
-			return ERR_MALFORMED_UTF8;
-		} else if (ustr[i] <= 0x7f) {
-			codelen   = 1;
-			codepoint = ustr[i];
-		} else if ((ustr[i] & 0xE0) == 0xC0) {
-			/* 110xxxxx - 2 byte sequence */
-			if (ustr[i] == 0xC0 || ustr[i] == 0xC1) {
-				/* Invalid bytes */
-				return ERR_MALFORMED_UTF8;
-			}
-			codelen   = 2;
-			codepoint = (ustr[i] & 0x1F);
-		} else if ((ustr[i] & 0xF0) == 0xE0) {
-			/* 1110xxxx - 3 byte sequence */
-			codelen   = 3;
-			codepoint = (ustr[i] & 0x0F);
-		} else if ((ustr[i] & 0xF8) == 0xF0) {
-			/* 11110xxx - 4 byte sequence */
-			if (ustr[i] > 0xF4) {
-				/* Invalid, this would produce values > 0x10FFFF. */
-				return ERR_MALFORMED_UTF8;
-			}
-			codelen   = 4;
-			codepoint = (ustr[i] & 0x07);
-		} else {
-			/* Unexpected continuation byte. */
-			return ERR_MALFORMED_UTF8;
-		}
-
-		/* Reconstruct full code point */
-		if (i == len - codelen + 1) {
-			/* Not enough data */
-			return ERR_MALFORMED_UTF8;
-		}
-		for (j = 0; j < codelen - 1; j++) {
-			if ((ustr[++i] & 0xC0) != 0x80) {
-				/* Not a continuation byte */
-				return ERR_MALFORMED_UTF8;
-			}
-			codepoint = (codepoint << 6) | (ustr[i] & 0x3F);
-		}
-
-		/* Check for UTF-16 high/low surrogates */
-		if (codepoint >= 0xD800 && codepoint <= 0xDFFF) {
-			return ERR_MALFORMED_UTF8;
-		}
-
-		/* Check for overlong or out of range encodings */
-		/* Checking codelen == 2 isn't necessary here, because it is already
-		 * covered above in the C0 and C1 checks.
-		 * if(codelen == 2 && codepoint < 0x0080){
-		 *	 return ERR_MALFORMED_UTF8;
-		 * }else
-		*/
-		if (codelen == 3 && codepoint < 0x0800) {
-			return ERR_MALFORMED_UTF8;
-		} else if (codelen == 4 && (codepoint < 0x10000 || codepoint > 0x10FFFF)) {
-			return ERR_MALFORMED_UTF8;
-		}
-
-		/* Check for non-characters */
-		if (codepoint >= 0xFDD0 && codepoint <= 0xFDEF) {
-			return ERR_MALFORMED_UTF8;
-		}
-		if ((codepoint & 0xFFFF) == 0xFFFE || (codepoint & 0xFFFF) == 0xFFFF) {
-			return ERR_MALFORMED_UTF8;
-		}
-		/* Check for control characters */
-		if (codepoint <= 0x001F || (codepoint >= 0x007F && codepoint <= 0x009F)) {
-			return ERR_MALFORMED_UTF8;
-		}
+	mqtt_topic_scan((const uint8_t *) str, len, NULL, 0, &info);
+	if (info.flags & MQTT_TOPIC_BADUTF8) {
+		return ERR_MALFORMED_UTF8;
 	}
 	return ERR_SUCCESS;
 }
@@ -292,222 +167,148 @@ conn_param * copy_conn_param(conn_param * des, conn_param * src){
  * only use in nego_cb !!!
  * 
  */
-int32_t conn_handler(uint8_t *packet, conn_param *cparam)
+// A NUL terminated copy of b, as conn_param keeps its strings.
+static void *copy_buf(mqtt_buf b, uint32_t *len)
 {
+	uint8_t *dest;
 
-	uint32_t	len, tmp, pos = 0, len_of_properties = 0;
-	int         len_of_str = 0;
-	int32_t		rv = 0;
-	uint8_t     property_id;
-
-	if (packet[pos] != CMD_CONNECT) {
-		rv = -1;
-		return rv;
-	} else {
-		pos++;
+	*len = 0;
+	if (b.len == 0 || (dest = nng_alloc(b.len + 1)) == NULL) {
+		return NULL;
 	}
+	memcpy(dest, b.buf, b.len);
+	dest[b.len] = '\0';
+	*len = b.len;
+	return dest;
+}
+
+/**
+ * Parse a CONNECT packet into cparam
+ *
+ * @param packet the whole packet, fixed header included
+ * @return bytes parsed, or -1 if the packet is malformed
+ */
+int32_t conn_handler(uint8_t *packet, conn_param *cparam)
+{
+	mqtt_cursor c;
+	mqtt_props  props;
+	mqtt_buf    key, val;
+	size_t      iter = 0;
+	uint32_t    len;
 
 	init_conn_param(cparam);
-	//remaining length
-	len = (uint32_t)get_var_integer(packet, &pos);
+	// The remaining length bounds everything after it
+	mqtt_cursor_init(&c, packet, EMQ_MAX_FIXED_HEADER_LEN);
+	if (mqtt_get_u8(&c) != CMD_CONNECT) {
+		return -1;
+	}
+	len = mqtt_get_varint(&c);
+	if (c.err) {
+		return -1;
+	}
+	c.len = c.pos + len;
 	//protocol name
-	cparam->pro_name.body = copy_utf8_str(packet, &pos, &len_of_str);
-	cparam->pro_name.len = len_of_str;
-	rv = rv | len_of_str;
+	cparam->pro_name.body = copy_buf(mqtt_get_str(&c), &cparam->pro_name.len);
 	debug_msg("pro_name: %s", cparam->pro_name.body);
 	//protocol ver
-	cparam->pro_ver = packet[pos];
-	pos ++;
+	cparam->pro_ver = mqtt_get_u8(&c);
 	//connect flag
-	cparam->con_flag = packet[pos];
+	cparam->con_flag = mqtt_get_u8(&c);
 	cparam->clean_start = (cparam->con_flag & 0x02) >> 1;
 	cparam->will_flag   = (cparam->con_flag & 0x04) >> 2;
 	cparam->will_qos    = (cparam->con_flag & 0x18) >> 3;
 	cparam->will_retain = (cparam->con_flag & 0x20) >> 5;
 	debug_msg("conn flag:%x", cparam->con_flag);
-	pos ++;
 	//keepalive
-	NNI_GET16(packet + pos, tmp);
-	cparam->keepalive_mqtt = tmp;
-	pos+=2;
+	cparam->keepalive_mqtt = mqtt_get_u16(&c);
 	//properties
 	if (cparam->pro_ver == PROTOCOL_VERSION_v5) {
-		debug_msg("MQTT 5 Properties");
-		len_of_properties = (uint32_t)get_var_integer(packet, &pos);
-		uint32_t target_pos = pos + len_of_properties;
-		debug_msg("propertyLen in variable [%d]", len_of_properties);
-
-		// parse property in variable header
-		if (len_of_properties > 0) {
-			while (1) {
-				property_id = packet[pos++];
-				switch (property_id) {
-					case SESSION_EXPIRY_INTERVAL:
-						debug_msg("SESSION_EXPIRY_INTERVAL");
-						NNI_GET32(packet+pos, cparam->session_expiry_interval);
-						pos += 4;
-						break;
-					case RECEIVE_MAXIMUM:
-						debug_msg("RECEIVE_MAXIMUM");
-						NNI_GET16(packet+pos, cparam->rx_max);
-						pos += 2;
-						break;
-					case MAXIMUM_PACKET_SIZE:
-						debug_msg("MAXIMUM_PACKET_SIZE");
-						NNI_GET32(packet+pos, cparam->max_packet_size);
-						pos += 4;
-						break;
-					case TOPIC_ALIAS_MAXIMUM:
-						debug_msg("TOPIC_ALIAS_MAXIMUM");
-						NNI_GET16(packet+pos, cparam->topic_alias_max);
-						pos += 2;
-						break;
-					case REQUEST_RESPONSE_INFORMATION:
-						debug_msg("REQUEST_RESPONSE_INFORMATION");
-						cparam->req_resp_info = packet[pos++];
-						break;
-					case REQUEST_PROBLEM_INFORMATION:
-						debug_msg("REQUEST_PROBLEM_INFORMATION");
-						cparam->req_problem_info = packet[pos++];
-						break;
-					case USER_PROPERTY:
-						debug_msg("USER_PROPERTY");
-						// key
-						cparam->user_property.key = (char *)copy_utf8_str(packet, &pos, &len_of_str);
-						cparam->user_property.len_key = len_of_str;
-						rv = rv | len_of_str;
-						// value
-						cparam->user_property.val = (char *)copy_utf8_str(packet, &pos, &len_of_str);
-						cparam->user_property.len_val = len_of_str;
-						rv = rv | len_of_str;
-						break;
-					case AUTHENTICATION_METHOD:
-						debug_msg("AUTHENTICATION_METHOD");
-						cparam->auth_method.body = (char *)copy_utf8_str(packet, &pos, &len_of_str);
-						rv = rv | len_of_str;
-						cparam->auth_method.len = len_of_str;
-						len_of_str = 0;
-						break;
-					case AUTHENTICATION_DATA:
-						debug_msg("AUTHENTICATION_DATA");
-						cparam->auth_data.body = (char *)copy_utf8_str(packet, &pos, &len_of_str);
-						rv = rv | len_of_str;
-						cparam->auth_data.len = len_of_str;
-						break;
-					default:
-						break;
-				}
-				if (pos == target_pos) {
-					break;
-				} else if (pos > target_pos) {
-					debug_msg("ERROR: protocol error");
-					return PROTOCOL_ERROR;
-				}
-			}
+		if (mqtt_props_decode(&c, &props, CONNECT) != SUCCESS) {
+			debug_msg("ERROR: bad CONNECT properties");
+			return -1;
+		}
+		cparam->session_expiry_interval =
+		    mqtt_props_num(&props, SESSION_EXPIRY_INTERVAL);
+		if (mqtt_props_has(&props, RECEIVE_MAXIMUM)) {
+			cparam->rx_max = mqtt_props_num(&props, RECEIVE_MAXIMUM);
+		}
+		cparam->max_packet_size =
+		    mqtt_props_num(&props, MAXIMUM_PACKET_SIZE);
+		cparam->topic_alias_max =
+		    mqtt_props_num(&props, TOPIC_ALIAS_MAXIMUM);
+		cparam->req_resp_info =
+		    mqtt_props_num(&props, REQUEST_RESPONSE_INFORMATION);
+		cparam->req_problem_info =
+		    mqtt_props_num(&props, REQUEST_PROBLEM_INFORMATION);
+		cparam->auth_method.body = copy_buf(
+		    mqtt_props_buf(&props, AUTHENTICATION_METHOD),
+		    &cparam->auth_method.len);
+		cparam->auth_data.body = copy_buf(
+		    mqtt_props_buf(&props, AUTHENTICATION_DATA),
+		    &cparam->auth_data.len);
+		// conn_param has room for the first user property only
+		if (mqtt_props_user(&props, &iter, &key, &val)) {
+			cparam->user_property.key =
+			    copy_buf(key, &cparam->user_property.len_key);
+			cparam->user_property.val =
+			    copy_buf(val, &cparam->user_property.len_val);
 		}
 	}
-	debug_msg("pos after property: [%d]", pos);
+	debug_msg("pos after property: [%ld]", c.pos);
 	//payload client_id
-	cparam->clientid.body = (char *)copy_utf8_str(packet, &pos, &len_of_str);
-	rv = rv | len_of_str;
-	cparam->clientid.len = len_of_str;
-	debug_msg("clientid: [%s] [%d]", cparam->clientid.body, len_of_str);
+	cparam->clientid.body = copy_buf(mqtt_get_str(&c), &cparam->clientid.len);
+	debug_msg("clientid: [%s] [%d]", cparam->clientid.body, cparam->clientid.len);
 	//will topic
 	if (cparam->will_flag != 0) {
 		if (cparam->pro_ver == PROTOCOL_VERSION_v5) {
-			len_of_properties = get_var_integer(packet, &pos);
-			uint32_t target_pos = pos + len_of_properties;
-			debug_msg("propertyLen in payload [%d]", len_of_properties);
-
-			// parse property in variable header
-			if (len_of_properties > 0) {
-				while (1) {
-					property_id = packet[pos++];
-					switch (property_id) {
-						case WILL_DELAY_INTERVAL:
-							debug_msg("WILL_DELAY_INTERVAL");
-							NNI_GET32(packet+pos, cparam->will_delay_interval);
-							pos += 4;
-							break;
-						case PAYLOAD_FORMAT_INDICATOR:
-							debug_msg("PAYLOAD_FORMAT_INDICATOR");
-							cparam->payload_format_indicator = packet[pos++];
-							break;
-						case MESSAGE_EXPIRY_INTERVAL:
-							debug_msg("MESSAGE_EXPIRY_INTERVAL");
-							NNI_GET32(packet+pos, cparam->msg_expiry_interval);
-							pos += 4;
-							break;
-						case CONTENT_TYPE:
-							debug_msg("CONTENT_TYPE");
-							cparam->content_type.body = (char *)copy_utf8_str(packet, &pos, &len_of_str);
-							cparam->content_type.len = len_of_str;
-							rv = rv | len_of_str;
-							debug_msg("content type: %s %d", cparam->content_type.body, rv);
-							break;
-						case RESPONSE_TOPIC:
-							debug_msg("RESPONSE_TOPIC");
-							cparam->resp_topic.body = (char *)copy_utf8_str(packet, &pos, &len_of_str);
-							cparam->resp_topic.len = len_of_str;
-							rv = rv | len_of_str;
-							debug_msg("resp topic: %s %d", cparam->resp_topic.body, rv);
-							break;
-						case CORRELATION_DATA:
-							debug_msg("CORRELATION_DATA");
-							cparam->corr_data.body = (char *)copy_utf8_str(packet, &pos, &len_of_str);
-							cparam->corr_data.len = len_of_str;
-							rv = rv | len_of_str;
-							debug_msg("corr_data: %s %d", cparam->corr_data.body, rv);
-							break;
-						case USER_PROPERTY:
-							debug_msg("USER_PROPERTY");
-							// key
-							cparam->payload_user_property.key = (char *)copy_utf8_str(packet, &pos, &len_of_str);
-							cparam->payload_user_property.len_key = len_of_str;
-							rv = rv | len_of_str;
-							// value
-							cparam->payload_user_property.val = (char *)copy_utf8_str(packet, &pos, &len_of_str);
-							cparam->payload_user_property.len_val = len_of_str;
-							rv = rv | len_of_str;
-							break;
-						default:
-							break;
-					}
-					if (pos == target_pos) {
-						break;
-					}else if (pos > target_pos) {
-						debug_msg("ERROR: protocol error");
-						return PROTOCOL_ERROR;
-					}
-				}
+			if (mqtt_props_decode(&c, &props, MQTT_PROPS_WILL) != SUCCESS) {
+				debug_msg("ERROR: bad will properties");
+				return -1;
+			}
+			cparam->will_delay_interval =
+			    mqtt_props_num(&props, WILL_DELAY_INTERVAL);
+			cparam->payload_format_indicator =
+			    mqtt_props_num(&props, PAYLOAD_FORMAT_INDICATOR);
+			cparam->msg_expiry_interval =
+			    mqtt_props_num(&props, MESSAGE_EXPIRY_INTERVAL);
+			cparam->content_type.body = copy_buf(
+			    mqtt_props_buf(&props, CONTENT_TYPE),
+			    &cparam->content_type.len);
+			cparam->resp_topic.body = copy_buf(
+			    mqtt_props_buf(&props, RESPONSE_TOPIC),
+			    &cparam->resp_topic.len);
+			cparam->corr_data.body = copy_buf(
+			    mqtt_props_buf(&props, CORRELATION_DATA),
+			    &cparam->corr_data.len);
+			iter = 0;
+			if (mqtt_props_user(&props, &iter, &key, &val)) {
+				cparam->payload_user_property.key = copy_buf(
+				    key, &cparam->payload_user_property.len_key);
+				cparam->payload_user_property.val = copy_buf(
+				    val, &cparam->payload_user_property.len_val);
 			}
 		}
-		cparam->will_topic.body = (char *)copy_utf8_str(packet, &pos, &len_of_str);
-		cparam->will_topic.len = len_of_str;
-		rv = rv | len_of_str;
-		debug_msg("will_topic: %s %d", cparam->will_topic.body, rv);
+		cparam->will_topic.body = copy_buf(mqtt_get_str(&c), &cparam->will_topic.len);
+		debug_msg("will_topic: %s", cparam->will_topic.body);
 		//will msg
-		cparam->will_msg.body = copy_utf8_str(packet, &pos, &len_of_str);
-		cparam->will_msg.len = len_of_str;
-		rv = rv | len_of_str;
-		debug_msg("will_msg: %s %d", cparam->will_msg.body, rv);
+		cparam->will_msg.body = copy_buf(mqtt_get_bin(&c), &cparam->will_msg.len);
+		debug_msg("will_msg: %s", cparam->will_msg.body);
 	}
 	//username
 	if ((cparam->con_flag & 0x80) > 0) {
-		cparam->username.body = (char *)copy_utf8_str(packet, &pos, &len_of_str);
-		cparam->username.len = len_of_str;
-		rv = rv | len_of_str;
-		debug_msg("username: %s %d %d", cparam->username.body, rv, 3 & 4);
+		cparam->username.body = copy_buf(mqtt_get_str(&c), &cparam->username.len);
+		debug_msg("username: %s", cparam->username.body);
 	}
 	//password
 	if ((cparam->con_flag & 0x40) > 0) {
-		cparam->password.body = (char *)copy_utf8_str(packet, &pos, &len_of_str);
-		cparam->password.len = len_of_str;
-		rv = rv | len_of_str;
-		debug_msg("password: %s %d", cparam->password.body, rv);
+		cparam->password.body = copy_buf(mqtt_get_bin(&c), &cparam->password.len);
+		debug_msg("password: %s", cparam->password.body);
 	}
-	//what if rv = 0?
-	return rv;
+	if (c.err) {
+		debug_msg("ERROR: malformed CONNECT");
+		return -1;
+	}
+	return (int32_t) c.pos;
 }
 
 void destroy_conn_param(conn_param * cparam)
@@ -564,5 +365,6 @@ static void init_conn_param(conn_param *cparam)
 	cparam->payload_user_property.len_key = 0;
 	cparam->payload_user_property.val = NULL;
 	cparam->payload_user_property.len_val = 0;
+	cparam->rx_max = 65535; // no Receive Maximum means no limit
 }
 
@@ -0,0 +1,411 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// Topic scanning.  The string is taken 64 bytes at a time; a kernel turns
+// each block into bit masks, one bit per byte, for the bytes that need a
+// closer look: non-ASCII, control characters, '/', '+' and '#'.  All the
+// checks then work on the masks, so a pure ASCII topic is never looked at
+// byte by byte.  Multi-byte UTF-8 sequences are rare in topics; they are
+// decoded one at a time where the non-ASCII mask points.
+//
+// The kernel is picked when first used, the widest this CPU runs: AVX2 or
+// SSE2 on x86, NEON on ARM, otherwise a byte loop.
+
+#include <string.h>
+
+#include "core/nng_impl.h"
+#include "nng/protocol/mqtt/mqtt.h"
+#include "nng/protocol/mqtt/mqtt_codec.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#define TOPIC_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__)
+#define TOPIC_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define TOPIC_NEON
+#include <arm_neon.h>
+#endif
+
+typedef struct {
+	uint64_t high;  // 0x80 and up, part of a multi-byte sequence
+	uint64_t ctrl;  // below 0x20 or 0x7f, NUL included
+	uint64_t slash; // '/'
+	uint64_t plus;  // '+'
+	uint64_t hash;  // '#'
+} topic_masks;
+
+typedef void (*topic_kernel)(const uint8_t *, topic_masks *);
+
+static void
+kernel_scalar(const uint8_t *p, topic_masks *m)
+{
+	memset(m, 0, sizeof(*m));
+	for (int i = 0; i < 64; i++) {
+		uint64_t bit = (uint64_t) 1 << i;
+
+		if (p[i] >= 0x80) {
+			m->high |= bit;
+		} else if (p[i] < 0x20 || p[i] == 0x7f) {
+			m->ctrl |= bit;
+		} else if (p[i] == '/') {
+			m->slash |= bit;
+		} else if (p[i] == '+') {
+			m->plus |= bit;
+		} else if (p[i] == '#') {
+			m->hash |= bit;
+		}
+	}
+}
+
+#ifdef TOPIC_SSE2
+static inline uint64_t
+sse2_eq(const __m128i *v, char c)
+{
+	__m128i  k = _mm_set1_epi8(c);
+	uint64_t m = 0;
+
+	for (int i = 0; i < 4; i++) {
+		m |= (uint64_t) (uint16_t) _mm_movemask_epi8(
+		         _mm_cmpeq_epi8(v[i], k))
+		    << (16 * i);
+	}
+	return (m);
+}
+
+static void
+kernel_sse2(const uint8_t *p, topic_masks *m)
+{
+	__m128i  v[4];
+	__m128i  space = _mm_set1_epi8(0x20);
+	uint64_t below = 0; // signed compare: also every byte from 0x80
+
+	m->high = 0;
+	for (int i = 0; i < 4; i++) {
+		v[i] = _mm_loadu_si128((const __m128i *) (p + 16 * i));
+		m->high |= (uint64_t) (uint16_t) _mm_movemask_epi8(v[i])
+		    << (16 * i);
+		below |= (uint64_t) (uint16_t) _mm_movemask_epi8(
+		             _mm_cmplt_epi8(v[i], space))
+		    << (16 * i);
+	}
+	m->ctrl  = (below & ~m->high) | sse2_eq(v, 0x7f);
+	m->slash = sse2_eq(v, '/');
+	m->plus  = sse2_eq(v, '+');
+	m->hash  = sse2_eq(v, '#');
+}
+#endif
+
+#ifdef TOPIC_AVX2
+__attribute__((target("avx2"))) static inline uint64_t
+avx2_eq(const __m256i *v, char c)
+{
+	__m256i k = _mm256_set1_epi8(c);
+
+	return ((uint64_t) (uint32_t) _mm256_movemask_epi8(
+	            _mm256_cmpeq_epi8(v[0], k)) |
+	    (uint64_t) (uint32_t) _mm256_movemask_epi8(
+	        _mm256_cmpeq_epi8(v[1], k))
+	        << 32);
+}
+
+__attribute__((target("avx2"))) static void
+kernel_avx2(const uint8_t *p, topic_masks *m)
+{
+	__m256i  v[2];
+	__m256i  space = _mm256_set1_epi8(0x20);
+	uint64_t below = 0; // signed compare: also every byte from 0x80
+
+	m->high = 0;
+	for (int i = 0; i < 2; i++) {
+		v[i] = _mm256_loadu_si256((const __m256i *) (p + 32 * i));
+		m->high |= (uint64_t) (uint32_t) _mm256_movemask_epi8(v[i])
+		    << (32 * i);
+		below |= (uint64_t) (uint32_t) _mm256_movemask_epi8(
+		             _mm256_cmpgt_epi8(space, v[i]))
+		    << (32 * i);
+	}
+	m->ctrl  = (below & ~m->high) | avx2_eq(v, 0x7f);
+	m->slash = avx2_eq(v, '/');
+	m->plus  = avx2_eq(v, '+');
+	m->hash  = avx2_eq(v, '#');
+}
+
+static bool
+have_avx2(void)
+{
+	__builtin_cpu_init();
+	return (__builtin_cpu_supports("avx2"));
+}
+#endif
+
+#ifdef TOPIC_NEON
+// NEON has no movemask: weigh each lane of a compare result by its bit
+// and add the lanes of each half up.
+static inline uint64_t
+neon_bits(uint8x16_t v)
+{
+	static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1,
+		2, 4, 8, 16, 32, 64, 128 };
+	uint8x16_t           w = vandq_u8(v, vld1q_u8(weights));
+	uint8x8_t            s = vpadd_u8(vget_low_u8(w), vget_high_u8(w));
+
+	s = vpadd_u8(s, s);
+	s = vpadd_u8(s, s);
+	return ((uint64_t) vget_lane_u8(s, 0) |
+	    (uint64_t) vget_lane_u8(s, 1) << 8);
+}
+
+static inline uint64_t
+neon_eq(const uint8x16_t *v, uint8_t c)
+{
+	uint8x16_t k = vdupq_n_u8(c);
+	uint64_t   m = 0;
+
+	for (int i = 0; i < 4; i++) {
+		m |= neon_bits(vceqq_u8(v[i], k)) << (16 * i);
+	}
+	return (m);
+}
+
+static void
+kernel_neon(const uint8_t *p, topic_masks *m)
+{
+	uint8x16_t v[4];
+	uint8x16_t high  = vdupq_n_u8(0x80);
+	uint8x16_t space = vdupq_n_u8(0x20);
+
+	m->high = 0;
+	m->ctrl = 0;
+	for (int i = 0; i < 4; i++) {
+		v[i] = vld1q_u8(p + 16 * i);
+		m->high |= neon_bits(vcgeq_u8(v[i], high)) << (16 * i);
+		m->ctrl |= neon_bits(vcltq_u8(v[i], space)) << (16 * i);
+	}
+	m->ctrl |= neon_eq(v, 0x7f);
+	m->slash = neon_eq(v, '/');
+	m->plus  = neon_eq(v, '+');
+	m->hash  = neon_eq(v, '#');
+}
+#endif
+
+static const struct {
+	const char * name;
+	topic_kernel fn;
+} kernels[] = {
+#ifdef TOPIC_AVX2
+	{ "avx2", kernel_avx2 },
+#endif
+#ifdef TOPIC_SSE2
+	{ "sse2", kernel_sse2 },
+#endif
+#ifdef TOPIC_NEON
+	{ "neon", kernel_neon },
+#endif
+	{ "scalar", kernel_scalar },
+};
+
+#define NUM_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+// Index in kernels[] plus one, 0 until the first scan.
+static nni_atomic_int kernel_sel;
+
+static bool
+kernel_runs(size_t i)
+{
+#ifdef TOPIC_AVX2
+	if (kernels[i].fn == kernel_avx2) {
+		return (have_avx2());
+	}
+#else
+	NNI_ARG_UNUSED(i);
+#endif
+	return (true);
+}
+
+static size_t
+kernel_index(void)
+{
+	int    sel;
+	size_t i;
+
+	if ((sel = nni_atomic_get(&kernel_sel)) > 0) {
+		return ((size_t) sel - 1);
+	}
+	for (i = 0; !kernel_runs(i); i++) {
+		// the scalar one, last, always does
+	}
+	nni_atomic_set(&kernel_sel, (int) i + 1);
+	return (i);
+}
+
+const char *
+mqtt_topic_kernel(void)
+{
+	return (kernels[kernel_index()].name);
+}
+
+int
+mqtt_topic_kernel_set(const char *name)
+{
+	for (size_t i = 0; i < NUM_KERNELS; i++) {
+		if (strcmp(kernels[i].name, name) == 0) {
+			if (!kernel_runs(i)) {
+				break;
+			}
+			nni_atomic_set(&kernel_sel, (int) i + 1);
+			return (0);
+		}
+	}
+	return (NNG_ENOTSUP);
+}
+
+static inline int
+lowest_bit(uint64_t m)
+{
+#if defined(__GNUC__)
+	return (__builtin_ctzll(m));
+#else
+	int i = 0;
+
+	while ((m & 1) == 0) {
+		m >>= 1;
+		i++;
+	}
+	return (i);
+#endif
+}
+
+// The bits below bit n.
+static inline uint64_t
+bits_below(size_t n)
+{
+	return (n >= 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << n) - 1);
+}
+
+// Checks the multi-byte UTF-8 sequence at p, of at most len bytes, and
+// returns its length; 0 if it is malformed, a surrogate, a non-character
+// or a C1 control character, none of which MQTT allows.
+static size_t
+utf8_seq(const uint8_t *p, size_t len)
+{
+	uint32_t cp;
+	size_t   n;
+
+	if (p[0] >= 0xc2 && p[0] <= 0xdf) {
+		n  = 2;
+		cp = p[0] & 0x1f;
+	} else if ((p[0] & 0xf0) == 0xe0) {
+		n  = 3;
+		cp = p[0] & 0x0f;
+	} else if (p[0] >= 0xf0 && p[0] <= 0xf4) {
+		n  = 4;
+		cp = p[0] & 0x07;
+	} else {
+		// overlong lead, continuation byte or beyond U+10FFFF
+		return (0);
+	}
+	if (len < n) {
+		return (0);
+	}
+	for (size_t i = 1; i < n; i++) {
+		if ((p[i] & 0xc0) != 0x80) {
+			return (0);
+		}
+		cp = (cp << 6) | (p[i] & 0x3f);
+	}
+
+	if ((n == 3 && cp < 0x800) || (n == 4 && cp < 0x10000) ||
+	    cp > 0x10ffff) {
+		return (0); // overlong
+	}
+	if ((cp >= 0xd800 && cp <= 0xdfff) || (cp >= 0xfdd0 && cp <= 0xfdef) ||
+	    (cp & 0xfffe) == 0xfffe || cp <= 0x9f) {
+		return (0);
+	}
+	return (n);
+}
+
+void
+mqtt_topic_scan(const uint8_t *topic, size_t len, uint16_t *sep,
+    size_t nsep, mqtt_topic_info *info)
+{
+	topic_kernel kernel = kernels[kernel_index()].fn;
+	topic_masks  m;
+	uint8_t      tail[64];
+	size_t       utf8_end  = 0; // end of the last multi-byte sequence
+	uint64_t     level_end = 1; // the byte before the block ended a level
+	uint64_t     after_plus = 0, after_hash = 0;
+	uint64_t     bad_wild   = 0;
+	uint32_t     nslash     = 0;
+
+	info->flags = 0;
+	for (size_t off = 0; off < len; off += 64) {
+		uint64_t valid = bits_below(len - off);
+
+		if (len - off >= 64) {
+			kernel(topic + off, &m);
+		} else {
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, topic + off, len - off);
+			kernel(tail, &m);
+			m.ctrl &= valid;
+		}
+
+		if (m.ctrl != 0) {
+			info->flags |= MQTT_TOPIC_BADUTF8;
+			break;
+		}
+		// skip what the previous block's last sequence ran into
+		if (utf8_end > off) {
+			m.high &= ~bits_below(utf8_end - off);
+		}
+		while (m.high != 0) {
+			size_t i = off + lowest_bit(m.high);
+			size_t n = utf8_seq(topic + i, len - i);
+
+			if (n == 0) {
+				info->flags |= MQTT_TOPIC_BADUTF8;
+				goto done;
+			}
+			utf8_end = i + n;
+			m.high &= ~bits_below(utf8_end - off);
+		}
+
+		for (uint64_t s = m.slash; s != 0; s &= s - 1) {
+			if (nslash < nsep) {
+				sep[nslash] = (uint16_t) (off + lowest_bit(s));
+			}
+			nslash++;
+		}
+
+		// A wildcard must fill its level, and '#' must be the last.
+		if ((m.plus | m.hash) != 0 || (after_plus | after_hash) != 0) {
+			uint64_t starts = (m.slash << 1) | level_end;
+
+			bad_wild |= (m.plus | m.hash) & ~starts;
+			bad_wild |= ((m.plus << 1) | after_plus) & ~m.slash & valid;
+			bad_wild |= ((m.hash << 1) | after_hash) & valid;
+			info->flags |= (m.plus ? MQTT_TOPIC_PLUS : 0) |
+			    (m.hash ? MQTT_TOPIC_HASH : 0);
+		}
+		level_end  = m.slash >> 63;
+		after_plus = m.plus >> 63;
+		after_hash = m.hash >> 63;
+	}
+	if (bad_wild != 0) {
+		info->flags |= MQTT_TOPIC_BADWILD;
+	}
+done:
+	info->levels = nslash + 1;
+}
@@ -0,0 +1,277 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <stdlib.h>
+
+#include "core/nng_impl.h"
+#include "nng/protocol/mqtt/nano_tcp.h"
+
+// Client side of nano_tcp, for MQTT clients living in the broker process
+// (mqtt+inproc://).  Like pair0 it talks to a single broker pipe, messages
+// are passed through untouched in both directions so the MQTT fields set by
+// the sender (cmd type, remaining length, conn_param) reach the other end.
+
+typedef struct nano_client_pipe nano_client_pipe;
+typedef struct nano_client_sock nano_client_sock;
+
+static void nano_client_send_cb(void *);
+static void nano_client_recv_cb(void *);
+static void nano_client_getq_cb(void *);
+static void nano_client_putq_cb(void *);
+
+struct nano_client_sock {
+	nano_client_pipe *ppipe;
+	nni_msgq *        uwq;
+	nni_msgq *        urq;
+	nni_mtx           mtx;
+};
+
+struct nano_client_pipe {
+	nni_pipe *        npipe;
+	nano_client_sock *psock;
+	nni_aio           aio_send;
+	nni_aio           aio_recv;
+	nni_aio           aio_getq;
+	nni_aio           aio_putq;
+};
+
+static int
+nano_client_sock_init(void *arg, nni_sock *nsock)
+{
+	nano_client_sock *s = arg;
+
+	nni_mtx_init(&s->mtx);
+	s->ppipe = NULL;
+	s->uwq   = nni_sock_sendq(nsock);
+	s->urq   = nni_sock_recvq(nsock);
+	return (0);
+}
+
+static void
+nano_client_sock_fini(void *arg)
+{
+	nano_client_sock *s = arg;
+
+	nni_mtx_fini(&s->mtx);
+}
+
+static void
+nano_client_pipe_stop(void *arg)
+{
+	nano_client_pipe *p = arg;
+
+	nni_aio_stop(&p->aio_send);
+	nni_aio_stop(&p->aio_recv);
+	nni_aio_stop(&p->aio_putq);
+	nni_aio_stop(&p->aio_getq);
+}
+
+static void
+nano_client_pipe_fini(void *arg)
+{
+	nano_client_pipe *p = arg;
+
+	nni_aio_fini(&p->aio_send);
+	nni_aio_fini(&p->aio_recv);
+	nni_aio_fini(&p->aio_putq);
+	nni_aio_fini(&p->aio_getq);
+}
+
+static int
+nano_client_pipe_init(void *arg, nni_pipe *npipe, void *psock)
+{
+	nano_client_pipe *p = arg;
+
+	nni_aio_init(&p->aio_send, nano_client_send_cb, p);
+	nni_aio_init(&p->aio_recv, nano_client_recv_cb, p);
+	nni_aio_init(&p->aio_getq, nano_client_getq_cb, p);
+	nni_aio_init(&p->aio_putq, nano_client_putq_cb, p);
+
+	p->npipe = npipe;
+	p->psock = psock;
+	return (0);
+}
+
+static int
+nano_client_pipe_start(void *arg)
+{
+	nano_client_pipe *p = arg;
+	nano_client_sock *s = p->psock;
+
+	if (nni_pipe_peer(p->npipe) != NNG_NANO_TCP_SELF) {
+		// Peer protocol mismatch.
+		return (NNG_EPROTO);
+	}
+
+	nni_mtx_lock(&s->mtx);
+	if (s->ppipe != NULL) {
+		nni_mtx_unlock(&s->mtx);
+		return (NNG_EBUSY); // Already connected to a broker.
+	}
+	s->ppipe = p;
+	nni_mtx_unlock(&s->mtx);
+
+	nni_msgq_aio_get(s->uwq, &p->aio_getq);
+	nni_pipe_recv(p->npipe, &p->aio_recv);
+
+	return (0);
+}
+
+static void
+nano_client_pipe_close(void *arg)
+{
+	nano_client_pipe *p = arg;
+	nano_client_sock *s = p->psock;
+
+	nni_aio_close(&p->aio_send);
+	nni_aio_close(&p->aio_recv);
+	nni_aio_close(&p->aio_putq);
+	nni_aio_close(&p->aio_getq);
+
+	nni_mtx_lock(&s->mtx);
+	if (s->ppipe == p) {
+		s->ppipe = NULL;
+	}
+	nni_mtx_unlock(&s->mtx);
+}
+
+static void
+nano_client_recv_cb(void *arg)
+{
+	nano_client_pipe *p = arg;
+	nano_client_sock *s = p->psock;
+	nni_msg *         msg;
+
+	if (nni_aio_result(&p->aio_recv) != 0) {
+		nni_pipe_close(p->npipe);
+		return;
+	}
+
+	msg = nni_aio_get_msg(&p->aio_recv);
+	nni_aio_set_msg(&p->aio_putq, msg);
+	nni_aio_set_msg(&p->aio_recv, NULL);
+
+	nni_msg_set_pipe(msg, nni_pipe_id(p->npipe));
+	nni_msgq_aio_put(s->urq, &p->aio_putq);
+}
+
+static void
+nano_client_putq_cb(void *arg)
+{
+	nano_client_pipe *p = arg;
+
+	if (nni_aio_result(&p->aio_putq) != 0) {
+		nni_msg_free(nni_aio_get_msg(&p->aio_putq));
+		nni_aio_set_msg(&p->aio_putq, NULL);
+		nni_pipe_close(p->npipe);
+		return;
+	}
+	nni_pipe_recv(p->npipe, &p->aio_recv);
+}
+
+static void
+nano_client_getq_cb(void *arg)
+{
+	nano_client_pipe *p = arg;
+
+	if (nni_aio_result(&p->aio_getq) != 0) {
+		nni_pipe_close(p->npipe);
+		return;
+	}
+
+	nni_aio_set_msg(&p->aio_send, nni_aio_get_msg(&p->aio_getq));
+	nni_aio_set_msg(&p->aio_getq, NULL);
+	nni_pipe_send(p->npipe, &p->aio_send);
+}
+
+static void
+nano_client_send_cb(void *arg)
+{
+	nano_client_pipe *p = arg;
+	nano_client_sock *s = p->psock;
+
+	if (nni_aio_result(&p->aio_send) != 0) {
+		nni_msg_free(nni_aio_get_msg(&p->aio_send));
+		nni_aio_set_msg(&p->aio_send, NULL);
+		nni_pipe_close(p->npipe);
+		return;
+	}
+
+	nni_msgq_aio_get(s->uwq, &p->aio_getq);
+}
+
+static void
+nano_client_sock_open(void *arg)
+{
+	NNI_ARG_UNUSED(arg);
+}
+
+static void
+nano_client_sock_close(void *arg)
+{
+	NNI_ARG_UNUSED(arg);
+}
+
+static void
+nano_client_sock_send(void *arg, nni_aio *aio)
+{
+	nano_client_sock *s = arg;
+
+	nni_msgq_aio_put(s->uwq, aio);
+}
+
+static void
+nano_client_sock_recv(void *arg, nni_aio *aio)
+{
+	nano_client_sock *s = arg;
+
+	nni_msgq_aio_get(s->urq, aio);
+}
+
+static nni_proto_pipe_ops nano_client_pipe_ops = {
+	.pipe_size  = sizeof(nano_client_pipe),
+	.pipe_init  = nano_client_pipe_init,
+	.pipe_fini  = nano_client_pipe_fini,
+	.pipe_start = nano_client_pipe_start,
+	.pipe_close = nano_client_pipe_close,
+	.pipe_stop  = nano_client_pipe_stop,
+};
+
+static nni_option nano_client_sock_options[] = {
+	// terminate list
+	{
+	    .o_name = NULL,
+	},
+};
+
+static nni_proto_sock_ops nano_client_sock_ops = {
+	.sock_size    = sizeof(nano_client_sock),
+	.sock_init    = nano_client_sock_init,
+	.sock_fini    = nano_client_sock_fini,
+	.sock_open    = nano_client_sock_open,
+	.sock_close   = nano_client_sock_close,
+	.sock_send    = nano_client_sock_send,
+	.sock_recv    = nano_client_sock_recv,
+	.sock_options = nano_client_sock_options,
+};
+
+static nni_proto nano_client_proto = {
+	.proto_version  = NNI_PROTOCOL_VERSION,
+	.proto_self     = { NNG_NANO_TCP_PEER, NNG_NANO_TCP_PEER_NAME },
+	.proto_peer     = { NNG_NANO_TCP_SELF, NNG_NANO_TCP_SELF_NAME },
+	.proto_flags    = NNI_PROTO_FLAG_SNDRCV,
+	.proto_sock_ops = &nano_client_sock_ops,
+	.proto_pipe_ops = &nano_client_pipe_ops,
+};
+
+int
+nng_nano_client0_open(nng_socket *sidp)
+{
+	return (nni_proto_open(sidp, &nano_client_proto));
+}
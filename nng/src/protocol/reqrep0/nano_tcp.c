@@ -7,6 +7,7 @@
 // found online at https://opensource.org/licenses/MIT.
 //
 
+#include <stdlib.h>
 #include <string.h>
 #include <mqtt_db.h>
 
@@ -14,6 +15,8 @@
 #include "nng/protocol/mqtt/nano_tcp.h"
 #include "include/nng_debug.h"
 #include "nng/protocol/mqtt/mqtt.h"
+#include "nng/supplemental/util/metrics.h"
+#include "nng/supplemental/util/probe.h"
 //TODO rewrite as nano_mq protocol with RPC support
 
 typedef struct nano_pipe nano_pipe;
@@ -24,49 +27,123 @@ static void nano_pipe_send_cb(void *);
 static void nano_pipe_recv_cb(void *);
 static void nano_pipe_fini(void *);
 
+#define BUMP_STAT(x) nni_stat_inc(x, 1)
+
+// Per-pipe send queue defaults, see NANO_OPT_SQ_*.
+#define NANO_SQ_MAX_MSGS 1024
+#define NANO_SQ_MAX_BYTES (4 * 1024 * 1024)
+#define NANO_SQ_GRACE 10000 // msec
+
+// Outbound QoS 1/2 defaults, see NANO_OPT_INFLIGHT and NANO_OPT_RETRY_TIME.
+#define NANO_INFLIGHT 32
+#define NANO_RETRY_TIME 10000 // msec
+#define NANO_RETRY_TICK 1000  // msec, how often we look
+#define NANO_ID_WORDS(n) (((size_t) (n) + 63) / 64)
+
+// The pipe id map is split in shards, each with its own lock, so that
+// contexts fanning out to different subscribers do not meet on one mutex.
+#define NANO_PIPE_SHARDS 16
+
 //huge context/ dynamic context?
 struct nano_ctx {
 	nano_sock *   sock;
 	uint32_t      pipe_id;
 	//uint32_t      resend_count;
 	//uint32_t      pipe_len;	//record total length of pipe_id queue when resending
-	nano_pipe *   spipe; // send pipe
-	nni_aio *     saio;  // send aio
 	nni_aio *     raio;  // recv aio
 	//uint32_t*     rspipes;// pub resend pipe queue Qos 1/2
-	//nni_list      send_queue; // contexts waiting to send.
-	nni_list_node sqnode;
 	nni_list_node rqnode;
-	nni_msg *     rmsg;
 	//size_t        pp_len;			//property Header
 	//uint32_t      pp[NNI_EMQ_MAX_PROPERTY_SIZE + 1];
 };
 
+typedef struct nano_inflight {
+	nni_msg *msg;  // the PUBLISH, or its PUBREL once PUBREC is in
+	nni_time sent;
+	bool     rel;
+} nano_inflight;
+
+typedef struct nano_pipe_shard {
+	nni_mtx    lk;
+	nni_id_map pipes;
+} nano_pipe_shard;
+
 // nano_sock is our per-socket protocol private structure.
+//
+// Locking: s->lk only covers the receive handoff between pipes and
+// waiting contexts (recvq, recvpipes, ctx->raio, p->closed) and the send
+// queue limits.  Each pipe's send state is under its own p->lk, and the
+// pipe id map under the lock of its shard.  Lock order is s->lk, then a
+// shard lock, then p->lk; none of them is held across a callback.
+// rtlk guards the list of pipes with messages in flight and is taken
+// before p->lk by the retransmit timer, after it by everybody else.
 struct nano_sock {
-	nni_mtx        lk;
-	nni_atomic_int ttl;
-	nni_id_map     pipes;
-	nni_list       recvpipes; // list of pipes with data to receive
-	nni_list       recvq;
-	nano_ctx       ctx;		//base socket
-	nni_pollable   readable;
-	nni_pollable   writable;
+	nni_mtx         lk;
+	nni_atomic_int  ttl;
+	nano_pipe_shard shards[NANO_PIPE_SHARDS];
+	nni_list        recvpipes; // list of pipes with data to receive
+	nni_list        recvq;
+	nano_ctx        ctx;		//base socket
+	nni_atomic_int  ctx_pipe; // ctx.pipe_id, read without s->lk
+	nni_pollable    readable;
+	nni_pollable    writable;
+	int             sqmax;    // send queue limits for new pipes
+	size_t          sqbytes;
+	nni_atomic_int  sqpolicy; // NANO_SQ_*, when a queue is full
+	nni_atomic_int  sqgrace;  // msec, NANO_SQ_DISCONNECT only
+	nni_atomic_bool fast_pubrel; // answer PUBREL here, see nano_hooks
+	nni_msg *       pingresp;    // shared by every PINGRESP we send
+	int             inflight;    // QoS 1/2 window for new pipes
+	nni_atomic_int  retry;       // msec, 0 never retransmits
+	nni_mtx         rtlk;
+	nni_list        rtpipes;     // pipes with messages in flight
+	nni_aio         rtaio;
+	nni_stat_item   stat_fast;
+	nni_stat_item   stat_retry;
+	nni_stat_item   stat_sq_drop;
+	nni_stat_item   stat_sq_conflate;
+	nni_stat_item   stat_sq_slow;
 };
 
 // nano_pipe is our per-pipe protocol private structure.
 struct nano_pipe {
-	nni_pipe *    pipe;
-	nano_sock *   rep;
-	uint32_t      id;
+	nni_pipe *     pipe;
+	nano_sock *    rep;
+	uint32_t       id;
 	//uint8_t       retry;
-	void *        tree;	//mqtt_db tree root
-	nni_aio       aio_send;
-	nni_aio       aio_recv;
-	nni_list_node rnode; // receivable list linkage
-	nni_list      sendq; // contexts waiting to send
-	bool          busy;
-	bool          closed;
+	void *         tree;	//mqtt_db tree root
+	nni_aio        aio_send;
+	nni_aio        aio_recv;
+	nni_list_node  rnode; // receivable list linkage
+	nni_mtx        lk;    // send state, up to and including busy
+	nni_lmq        sendq; // messages waiting behind aio_send
+	int            sqmax;
+	size_t         sqmaxbytes;
+	size_t         sqbytes; // queued, headers included
+	nni_time       sqfull;  // since when the queue is full, or 0
+	bool           busy;
+	nano_inflight *inflight; // by packet id - 1
+	uint64_t *     idmap;    // packet ids in use
+	uint16_t       wmax;     // packet ids 1..wmax, 0 if not tracking
+	uint16_t       window;   // at most wmax, and the Receive Maximum
+	uint16_t       ninflight;
+	uint16_t       idnext;
+	nni_lmq        waitq;   // QoS 1/2 waiting for room in the window
+	size_t         wqbytes; // in waitq, headers included
+	bool           rtarm;   // to be put on s->rtpipes
+	bool           rtgone;  // under s->rtlk, never again
+	nni_list_node  rtnode;
+	bool           cparam;  // Receive Maximum applied, recv_cb only
+	bool           closed; // under s->lk
+	bool           counted; // in NANO_METRIC_CONNECTIONS
+	size_t         msqlen;   // send queue as last added to the metrics
+	size_t         msqbytes;
+	uint16_t       minflight;
+	nni_stat_item  stat_inflight;
+	nni_stat_item  stat_sq_depth;
+	nni_stat_item  stat_sq_bytes;
+	nni_stat_item   stat_sq_drop;
+	nni_stat_item   stat_sq_conflate;
 };
 
 static void
@@ -78,14 +155,6 @@ nano_ctx_close(void *arg)
 
 	debug_msg("nano_ctx_close");
 	nni_mtx_lock(&s->lk);
-	if ((aio = ctx->saio) != NULL) {
-		nano_pipe *pipe = ctx->spipe;
-		ctx->saio       = NULL;
-		ctx->spipe      = NULL;
-		ctx->rmsg	= NULL;
-		nni_list_remove(&pipe->sendq, ctx);
-		nni_aio_finish_error(aio, NNG_ECLOSED);
-	}
 	if ((aio = ctx->raio) != NULL) {
 		nni_list_remove(&s->recvq, ctx);
 		ctx->raio = NULL;
@@ -109,7 +178,6 @@ nano_ctx_init(void *carg, void *sarg)
 	nano_ctx * ctx = carg;
 
 	debug_msg("&&&&&&&& nano_ctx_init &&&&&&&&&");
-	NNI_LIST_NODE_INIT(&ctx->sqnode);
 	NNI_LIST_NODE_INIT(&ctx->rqnode);
 	//TODO send list??
 	//ctx->pp_len = 0;
@@ -120,22 +188,660 @@ nano_ctx_init(void *carg, void *sarg)
 }
 
 static void
-nano_ctx_cancel_send(nni_aio *aio, void *arg, int rv)
+nano_ctx_set_pipe(nano_ctx *ctx, uint32_t id)
 {
-	nano_ctx * ctx = arg;
-	nano_sock *s   = ctx->sock;
+	nano_sock *s = ctx->sock;
 
-	nni_mtx_lock(&s->lk);
-	if (ctx->saio != aio) {
-		nni_mtx_unlock(&s->lk);
+	ctx->pipe_id = id;
+	if (ctx == &s->ctx) {
+		nni_atomic_set(&s->ctx_pipe, (int) id);
+	}
+}
+
+static nano_pipe_shard *
+nano_pipe_shard_of(nano_sock *s, uint32_t id)
+{
+	return (&s->shards[id % NANO_PIPE_SHARDS]);
+}
+
+// Look up a pipe by id and return it with p->lk held, or NULL.  Holding
+// the shard lock until p->lk is taken keeps nano_pipe_close from flushing
+// the pipe between the two.
+static nano_pipe *
+nano_pipe_lock_id(nano_sock *s, uint32_t id)
+{
+	nano_pipe_shard *sh = nano_pipe_shard_of(s, id);
+	nano_pipe *      p;
+
+	nni_mtx_lock(&sh->lk);
+	if ((p = nni_id_get(&sh->pipes, id)) != NULL) {
+		nni_mtx_lock(&p->lk);
+	}
+	nni_mtx_unlock(&sh->lk);
+	return (p);
+}
+
+// Outbound queueing.  A pipe sends one message at a time; whatever the
+// broker hands us meanwhile waits in the pipe's own sendq, so a slow
+// subscriber never holds up the ctx fanning out to it.  The queue is
+// bounded by message count and bytes, together with the QoS 1/2 waiting
+// for the inflight window (waitq, below).  What happens beyond that is the
+// socket's NANO_SQ_* policy, which in the sendq only ever discards QoS 0
+// PUBLISHes; anything else (acks, QoS 1/2 in the window) is queued
+// regardless.
+
+static size_t
+nano_msg_size(nni_msg *msg)
+{
+	return (nni_msg_header_len(msg) + nni_msg_len(msg) +
+	    nni_msg_tail_len(msg));
+}
+
+static bool
+nano_msg_droppable(nni_msg *msg)
+{
+	uint8_t *hdr = nni_msg_header(msg);
+
+	return ((nni_msg_header_len(msg) > 0) &&
+	    ((hdr[0] & 0xF0) == CMD_PUBLISH) && ((hdr[0] & 0x06) == 0));
+}
+
+static bool
+nano_msg_same_topic(nni_msg *m1, nni_msg *m2)
+{
+	uint8_t *b1 = nni_msg_body(m1);
+	uint8_t *b2 = nni_msg_body(m2);
+	uint16_t l1, l2;
+
+	if ((nni_msg_len(m1) < 2) || (nni_msg_len(m2) < 2)) {
+		return (false);
+	}
+	NNI_GET16(b1, l1);
+	NNI_GET16(b2, l2);
+	return ((l1 == l2) && (nni_msg_len(m1) >= 2 + (size_t) l1) &&
+	    (nni_msg_len(m2) >= 2 + (size_t) l2) &&
+	    (memcmp(b1 + 2, b2 + 2, l1) == 0));
+}
+
+static void
+nano_pipe_sq_update(nano_pipe *p)
+{
+	size_t len   = nni_lmq_len(&p->sendq) + nni_lmq_len(&p->waitq);
+	size_t bytes = p->sqbytes + p->wqbytes;
+
+	nni_stat_set_value(&p->stat_sq_depth, len);
+	nni_stat_set_value(&p->stat_sq_bytes, bytes);
+	nano_metric_add(NANO_METRIC_SQ_MSGS, (int64_t) len - (int64_t) p->msqlen);
+	nano_metric_add(
+	    NANO_METRIC_SQ_BYTES, (int64_t) bytes - (int64_t) p->msqbytes);
+	p->msqlen   = len;
+	p->msqbytes = bytes;
+}
+
+static void
+nano_pipe_inflight_update(nano_pipe *p)
+{
+	nni_stat_set_value(&p->stat_inflight, p->ninflight);
+	nano_metric_add(NANO_METRIC_INFLIGHT,
+	    (int64_t) p->ninflight - (int64_t) p->minflight);
+	p->minflight = p->ninflight;
+}
+
+// Hand msg to the transport, counting it as sent.  With p->lk held.
+static void
+nano_pipe_tx(nano_pipe *p, nni_msg *msg)
+{
+	// What the broker sends is encoded already; the type is in the header.
+	if (nni_msg_header_len(msg) > 0) {
+		nano_metric_add(NANO_METRIC_PACKETS_OUT +
+		        (*(uint8_t *) nni_msg_header(msg) >> 4),
+		    1);
+	}
+	nano_metric_add(NANO_METRIC_BYTES_OUT, nano_msg_size(msg));
+	nni_aio_set_msg(&p->aio_send, msg);
+	nni_pipe_send(p->pipe, &p->aio_send);
+}
+
+static bool
+nano_pipe_sq_full(nano_pipe *p, size_t size)
+{
+	size_t len = nni_lmq_len(&p->sendq) + nni_lmq_len(&p->waitq);
+
+	return (((int) len >= p->sqmax) ||
+	    ((p->sqbytes + p->wqbytes + size > p->sqmaxbytes) && (len > 0)));
+}
+
+// Whether a pipe that has been full since p->sqfull has had its grace.
+static bool
+nano_pipe_sq_slow(nano_pipe *p)
+{
+	nano_sock *s = p->rep;
+
+	if (nni_clock() - p->sqfull < (nni_time) nni_atomic_get(&s->sqgrace)) {
+		return (false);
+	}
+	debug_msg("pipe %d too slow, closing", p->id);
+	BUMP_STAT(&s->stat_sq_slow);
+	nano_metric_add(NANO_METRIC_SLOW_CLOSED, 1);
+	return (true);
+}
+
+static void
+nano_pipe_sq_dropped(nano_pipe *p)
+{
+	BUMP_STAT(&p->stat_sq_drop);
+	BUMP_STAT(&p->rep->stat_sq_drop);
+	nano_metric_add(NANO_METRIC_DROP_SQ_FULL, 1);
+}
+
+// Drop the oldest droppable message to make room.  False if none.
+// Usually that is the head, which costs no more than a dequeue.
+static bool
+nano_pipe_sq_evict(nano_pipe *p)
+{
+	nni_lmq *q   = &p->sendq;
+	size_t   len = nni_lmq_len(q);
+	nni_msg *msg;
+	size_t   i;
+
+	for (i = 0; i < len; i++) {
+		if (nano_msg_droppable(nni_lmq_peek(q, i))) {
+			break;
+		}
+	}
+	if (i == len) {
+		return (false);
+	}
+	if (i == 0) {
+		(void) nni_lmq_getq(q, &msg);
+	} else {
+		msg = nni_lmq_remove(q, i);
+	}
+	p->sqbytes -= nano_msg_size(msg);
+	nni_msg_free(msg);
+	return (true);
+}
+
+// Replace a queued message for the same topic with this newer one.
+static bool
+nano_pipe_sq_conflate(nano_pipe *p, nni_msg *msg)
+{
+	nni_lmq *q = &p->sendq;
+	nni_msg *old;
+
+	for (size_t i = 0; i < nni_lmq_len(q); i++) {
+		old = nni_lmq_peek(q, i);
+		if (nano_msg_droppable(old) && nano_msg_same_topic(old, msg)) {
+			p->sqbytes -= nano_msg_size(old);
+			p->sqbytes += nano_msg_size(msg);
+			nni_msg_free(nni_lmq_set(q, i, msg));
+			return (true);
+		}
+	}
+	return (false);
+}
+
+// Queue msg behind the message in flight, or dispose of it as the policy
+// says.  Called with the pipe lock held; msg is consumed either way.
+// Returns false if the pipe has been slow for too long and must be closed,
+// which the caller does once it has dropped the lock.
+static bool
+nano_pipe_sq_put(nano_pipe *p, nni_msg *msg)
+{
+	nano_sock *s    = p->rep;
+	size_t     size = nano_msg_size(msg);
+	bool       drop = nano_msg_droppable(msg);
+
+	if (nano_pipe_sq_full(p, size)) {
+		if (p->sqfull == 0) {
+			p->sqfull = nni_clock();
+		}
+		switch (nni_atomic_get(&s->sqpolicy)) {
+		case NANO_SQ_DISCONNECT:
+			if (nano_pipe_sq_slow(p)) {
+				nni_msg_free(msg);
+				return (false);
+			}
+			break;
+		case NANO_SQ_CONFLATE:
+			if (drop && nano_pipe_sq_conflate(p, msg)) {
+				BUMP_STAT(&p->stat_sq_conflate);
+				BUMP_STAT(&s->stat_sq_conflate);
+				nano_metric_add(NANO_METRIC_DROP_CONFLATED, 1);
+				nano_pipe_sq_update(p);
+				return (true);
+			}
+			// FALLTHROUGH
+		case NANO_SQ_DROP_OLDEST:
+			while (drop && nano_pipe_sq_full(p, size) &&
+			    nano_pipe_sq_evict(p)) {
+				nano_pipe_sq_dropped(p);
+			}
+			break;
+		default:
+			break;
+		}
+		if (drop && nano_pipe_sq_full(p, size)) {
+			nano_pipe_sq_dropped(p);
+			nni_msg_free(msg);
+			nano_pipe_sq_update(p);
+			return (true);
+		}
+	}
+
+	if (nni_lmq_full(&p->sendq) &&
+	    (nni_lmq_resize(&p->sendq, nni_lmq_cap(&p->sendq) * 2) != 0)) {
+		debug_msg("pipe %d send queue out of memory", p->id);
+		nni_msg_free(msg);
+		return (false);
+	}
+	(void) nni_lmq_putq(&p->sendq, msg);
+	p->sqbytes += size;
+	nano_pipe_sq_update(p);
+	return (true);
+}
+
+// Hand msg (our reference) to the transport, or queue it.  Called with
+// p->lk held.  False if the pipe has to be closed for being too slow.
+static bool
+nano_pipe_xmit(nano_pipe *p, nni_msg *msg)
+{
+	if (!p->busy) {
+		p->busy = true;
+		nano_pipe_tx(p, msg);
+		return (true);
+	}
+	return (nano_pipe_sq_put(p, msg));
+}
+
+// Outbound QoS 1/2.  A pipe keeps each PUBLISH it sends until the client
+// has acknowledged it, under a packet id of its own from 1..wmax, so no
+// more than the window are in flight; the window is also bounded by the
+// client's Receive Maximum.  Later messages wait in waitq.  What is not
+// acknowledged in NANO_OPT_RETRY_TIME is sent again, with DUP set.
+
+static uint8_t
+nano_msg_qos(nni_msg *msg)
+{
+	uint8_t *hdr = nni_msg_header(msg);
+
+	if ((nni_msg_header_len(msg) == 0) || ((hdr[0] & 0xF0) != CMD_PUBLISH)) {
+		return (0);
+	}
+	return ((hdr[0] >> 1) & 0x03);
+}
+
+// Where the packet id of a QoS 1/2 PUBLISH is, 0 if there is none.
+static size_t
+nano_msg_id_pos(nni_msg *msg)
+{
+	uint16_t tlen;
+
+	if (nni_msg_len(msg) < 2) {
+		return (0);
+	}
+	NNI_GET16((uint8_t *) nni_msg_body(msg), tlen);
+	if (nni_msg_len(msg) < (size_t) tlen + 4) {
+		return (0);
+	}
+	return (2 + (size_t) tlen);
+}
+
+static uint16_t
+nano_pipe_id_alloc(nano_pipe *p)
+{
+	size_t nwords = NANO_ID_WORDS(p->wmax);
+	size_t w      = p->idnext / 64;
+
+	for (size_t k = 0; k < nwords; k++, w = (w + 1) % nwords) {
+		if (p->idmap[w] == UINT64_MAX) {
+			continue;
+		}
+		for (unsigned b = 0; b < 64; b++) {
+			if ((p->idmap[w] & ((uint64_t) 1 << b)) == 0) {
+				p->idmap[w] |= (uint64_t) 1 << b;
+				p->idnext = (uint16_t) ((w * 64 + b + 1) % p->wmax);
+				return ((uint16_t) (w * 64 + b + 1));
+			}
+		}
+	}
+	return (0);
+}
+
+static nano_inflight *
+nano_pipe_inflight(nano_pipe *p, uint16_t id)
+{
+	if ((id == 0) || (id > p->wmax) || (p->inflight[id - 1].msg == NULL)) {
+		return (NULL);
+	}
+	return (&p->inflight[id - 1]);
+}
+
+// Queue a QoS 1/2 PUBLISH until the window has room.  It counts against
+// the send queue limits, and a full queue is dealt with by the socket's
+// policy: the newest or the oldest waiting message is dropped, or with
+// NANO_SQ_DISCONNECT the newest until the pipe has been full for the
+// grace period, and then the pipe is closed.  Consumes msg; false if the
+// pipe has to be closed.
+static bool
+nano_pipe_wq_put(nano_pipe *p, nni_msg *msg)
+{
+	nano_sock *s    = p->rep;
+	size_t     size = nano_msg_size(msg);
+	nni_msg *  old;
+
+	if (nano_pipe_sq_full(p, size)) {
+		if (p->sqfull == 0) {
+			p->sqfull = nni_clock();
+		}
+		switch (nni_atomic_get(&s->sqpolicy)) {
+		case NANO_SQ_DISCONNECT:
+			if (nano_pipe_sq_slow(p)) {
+				nni_msg_free(msg);
+				return (false);
+			}
+			break;
+		case NANO_SQ_CONFLATE:
+		case NANO_SQ_DROP_OLDEST:
+			while (nano_pipe_sq_full(p, size) &&
+			    (nni_lmq_getq(&p->waitq, &old) == 0)) {
+				p->wqbytes -= nano_msg_size(old);
+				nni_msg_free(old);
+				nano_pipe_sq_dropped(p);
+			}
+			break;
+		default:
+			break;
+		}
+		if (nano_pipe_sq_full(p, size)) {
+			nano_pipe_sq_dropped(p);
+			nni_msg_free(msg);
+			nano_pipe_sq_update(p);
+			return (true);
+		}
+	}
+	if (nni_lmq_full(&p->waitq) &&
+	    (nni_lmq_resize(&p->waitq, nni_lmq_cap(&p->waitq) * 2) != 0)) {
+		nni_msg_free(msg);
+		return (false);
+	}
+	(void) nni_lmq_putq(&p->waitq, msg);
+	p->wqbytes += size;
+	nano_pipe_sq_update(p);
+	return (true);
+}
+
+// Give a QoS 1/2 PUBLISH a packet id and a slot in the window, which must
+// have room.  Consumes msg; returns what to send now, NULL if out of
+// memory.
+static nni_msg *
+nano_pipe_inflight_put(nano_pipe *p, nni_msg *msg)
+{
+	nano_inflight *slot;
+	uint16_t       id;
+	size_t         pos;
+
+	if ((pos = nano_msg_id_pos(msg)) == 0) {
+		return (msg);
+	}
+	// A multicast shares the message; the packet id is ours alone, but
+	// the payload after it can stay shared.
+	if ((msg = nni_msg_unique_head(msg, pos + 2)) == NULL) {
+		return (NULL);
+	}
+	id = nano_pipe_id_alloc(p);
+	NNI_PUT16((uint8_t *) nni_msg_body(msg) + pos, id);
+	slot       = &p->inflight[id - 1];
+	slot->msg  = msg;
+	slot->sent = nni_clock();
+	slot->rel  = false;
+	nni_msg_clone(msg);
+	if (p->ninflight++ == 0) {
+		p->rtarm = true;
+	}
+	nano_pipe_inflight_update(p);
+	return (msg);
+}
+
+// The client is done with id: free the slot and let waiting messages in.
+static bool
+nano_pipe_inflight_ack(nano_pipe *p, uint16_t id)
+{
+	nano_inflight *slot = &p->inflight[id - 1];
+	nni_msg *      msg;
+
+	nni_msg_free(slot->msg);
+	slot->msg = NULL;
+	p->idmap[(id - 1) / 64] &= ~((uint64_t) 1 << ((id - 1) % 64));
+	p->ninflight--;
+	nano_pipe_inflight_update(p);
+
+	while ((p->ninflight < p->window) &&
+	    (nni_lmq_getq(&p->waitq, &msg) == 0)) {
+		p->wqbytes -= nano_msg_size(msg);
+		if (!nano_pipe_sq_full(p, 0)) {
+			p->sqfull = 0;
+		}
+		nano_pipe_sq_update(p);
+		if (((msg = nano_pipe_inflight_put(p, msg)) != NULL) &&
+		    !nano_pipe_xmit(p, msg)) {
+			return (false);
+		}
+	}
+	return (true);
+}
+
+static void
+nano_pipe_inflight_flush(nano_pipe *p)
+{
+	for (uint16_t i = 0; i < p->wmax; i++) {
+		nni_msg_free(p->inflight[i].msg);
+		p->inflight[i].msg = NULL;
+	}
+	for (uint16_t i = 0; i < NANO_ID_WORDS(p->wmax); i++) {
+		p->idmap[i] = 0;
+	}
+	if (p->wmax % 64 != 0) {
+		p->idmap[p->wmax / 64] = UINT64_MAX << (p->wmax % 64);
+	}
+	p->ninflight = 0;
+	nni_lmq_flush(&p->waitq);
+	p->wqbytes = 0;
+	nano_pipe_inflight_update(p);
+}
+
+// Retransmissions skip the queue policy: they are owed to the client.
+static void
+nano_pipe_requeue(nano_pipe *p, nni_msg *msg)
+{
+	if (!p->busy) {
+		(void) nano_pipe_xmit(p, msg);
 		return;
 	}
-	nni_list_node_remove(&ctx->sqnode);
-	ctx->saio = NULL;
-	nni_mtx_unlock(&s->lk);
+	if (nni_lmq_full(&p->sendq) &&
+	    (nni_lmq_resize(&p->sendq, nni_lmq_cap(&p->sendq) * 2) != 0)) {
+		nni_msg_free(msg);
+		return;
+	}
+	(void) nni_lmq_putq(&p->sendq, msg);
+	p->sqbytes += nano_msg_size(msg);
+	nano_pipe_sq_update(p);
+}
+
+// Send again what has not been acknowledged in time, however busy the
+// pipe is.  A message still referenced by the sendq or the transport has
+// not been written out yet, so its time only starts once it has been;
+// one the window alone holds can have DUP set without racing its first
+// transmission, and goes to the back of the queue.
+static void
+nano_pipe_retry(nano_pipe *p, nni_time now, nni_duration retry)
+{
+	nano_sock *s = p->rep;
+
+	for (uint16_t i = 0; i < p->wmax; i++) {
+		nano_inflight *slot = &p->inflight[i];
+
+		if (slot->msg == NULL) {
+			continue;
+		}
+		if (nni_msg_shared(slot->msg)) {
+			slot->sent = now;
+			continue;
+		}
+		if (now - slot->sent < (nni_time) retry) {
+			continue;
+		}
+		if (!slot->rel) {
+			((uint8_t *) nni_msg_header(slot->msg))[0] |= 0x08;
+		}
+		// Its latency was recorded when it was first written.
+		nni_msg_set_timestamp(slot->msg, 0);
+		slot->sent = now;
+		nni_msg_clone(slot->msg);
+		nano_pipe_requeue(p, slot->msg);
+		BUMP_STAT(&s->stat_retry);
+		nano_metric_add(NANO_METRIC_RETRIES, 1);
+	}
+}
 
-	nni_msg_header_clear(nni_aio_get_msg(aio)); // reset the headers
-	nni_aio_finish_error(aio, rv);
+static void
+nano_sock_retry_cb(void *arg)
+{
+	nano_sock *  s     = arg;
+	nni_duration retry = nni_atomic_get(&s->retry);
+	nni_time     now   = nni_clock();
+	nano_pipe *  p;
+	nano_pipe *  next;
+
+	if (nni_aio_result(&s->rtaio) != 0) {
+		return;
+	}
+	nni_mtx_lock(&s->rtlk);
+	for (p = nni_list_first(&s->rtpipes); p != NULL; p = next) {
+		next = nni_list_next(&s->rtpipes, p);
+		nni_mtx_lock(&p->lk);
+		if (p->ninflight == 0) {
+			nni_list_remove(&s->rtpipes, p);
+		} else if (retry > 0) {
+			nano_pipe_retry(p, now, retry);
+		}
+		nni_mtx_unlock(&p->lk);
+	}
+	nni_mtx_unlock(&s->rtlk);
+	nni_sleep_aio(NANO_RETRY_TICK, &s->rtaio);
+}
+
+// Hand msg (our reference) to the pipe, called with p->lk held.  False
+// if the pipe has to be closed for being too slow.
+static bool
+nano_pipe_send_locked(nano_pipe *p, nni_msg *msg)
+{
+	if ((p->wmax > 0) && (nano_msg_qos(msg) > 0)) {
+		if ((p->ninflight >= p->window) || !nni_lmq_empty(&p->waitq)) {
+			return (nano_pipe_wq_put(p, msg));
+		}
+		if ((msg = nano_pipe_inflight_put(p, msg)) == NULL) {
+			return (true);
+		}
+	}
+	return (nano_pipe_xmit(p, msg));
+}
+
+// Drop p->lk, and if the pipe now has messages in flight, make sure the
+// retransmit timer knows about it.
+static void
+nano_pipe_unlock(nano_pipe *p)
+{
+	nano_sock *s   = p->rep;
+	bool       arm = p->rtarm;
+
+	p->rtarm = false;
+	nni_mtx_unlock(&p->lk);
+	if (arm) {
+		nni_mtx_lock(&s->rtlk);
+		if (!p->rtgone && !nni_list_node_active(&p->rtnode)) {
+			nni_list_append(&s->rtpipes, p);
+		}
+		nni_mtx_unlock(&s->rtlk);
+	}
+}
+
+static void
+nano_pipe_close_id(uint32_t id)
+{
+	nni_pipe *npipe;
+
+	if (nni_pipe_find(&npipe, id) == 0) {
+		nni_pipe_close(npipe);
+		nni_pipe_rele(npipe);
+	}
+}
+
+static int
+nano_pipe_shard_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+
+	if (x % NANO_PIPE_SHARDS != y % NANO_PIPE_SHARDS) {
+		return ((x % NANO_PIPE_SHARDS) < (y % NANO_PIPE_SHARDS) ? -1 : 1);
+	}
+	return ((x < y) ? -1 : (x > y));
+}
+
+// Multicast: every pipe in the vector gets a reference to the same msg.
+// Sorting the ids by shard lets one shard lock cover all of its pipes;
+// pipes already gone are skipped, as for a single send.  The vector is
+// reused to collect the pipes that turned out too slow.
+static void
+nano_ctx_send_pipes(
+    nano_sock *s, nni_msg *msg, void *tree, uint32_t *pipes, size_t n)
+{
+	nano_pipe_shard *sh = NULL;
+	nano_pipe *      p;
+	size_t           nslow = 0;
+
+	qsort(pipes, n, sizeof(uint32_t), nano_pipe_shard_cmp);
+	for (size_t i = 0; i < n; i++) {
+		if (nano_pipe_shard_of(s, pipes[i]) != sh) {
+			if (sh != NULL) {
+				nni_mtx_unlock(&sh->lk);
+			}
+			sh = nano_pipe_shard_of(s, pipes[i]);
+			nni_mtx_lock(&sh->lk);
+		}
+		if ((p = nni_id_get(&sh->pipes, pipes[i])) == NULL) {
+			continue;
+		}
+		nni_mtx_lock(&p->lk);
+		p->tree = tree;
+		nni_msg_clone(msg);
+		if (!nano_pipe_send_locked(p, msg)) {
+			pipes[nslow++] = p->id;
+		}
+		nano_pipe_unlock(p);
+	}
+	if (sh != NULL) {
+		nni_mtx_unlock(&sh->lk);
+	}
+	nni_msg_free(msg);
+
+	for (size_t i = 0; i < nslow; i++) {
+		nano_pipe_close_id(pipes[i]);
+	}
+}
+
+static void
+nano_pipe_send_msg(nano_pipe *p, nni_msg *msg)
+{
+	bool slow;
+
+	nni_mtx_lock(&p->lk);
+	slow = !nano_pipe_send_locked(p, msg);
+	nano_pipe_unlock(p);
+	if (slow) {
+		nano_pipe_close_id(p->id);
+	}
 }
 
 static void
@@ -145,9 +851,10 @@ nano_ctx_send(void *arg, nni_aio *aio)
 	nano_sock *s   = ctx->sock;
 	nano_pipe *p;
 	nni_msg *  msg;
-	int        rv;
 	size_t     len;
-	//uint32_t * pipes; // pipes id
+	bool       slow;
+	uint32_t * pipes; // pipes id
+	size_t     npipes;
 	uint32_t   pipe;
 	uint32_t   p_id[2],i = 0,fail_count = 0, need_resend = 0;
 
@@ -158,10 +865,11 @@ nano_ctx_send(void *arg, nni_aio *aio)
 	}
 
 	debug_msg("############### nano_ctx_send with ctx %p ###############", ctx);
-	nni_mtx_lock(&s->lk);
 	//len  = ctx->pp_len;
-	//if ((pipes = nni_aio_get_pipeline(aio)) != NULL){
-	if ((pipe = nni_aio_get_pipeline(aio)) != 0){
+	if ((pipes = nni_aio_get_pipes(aio, &npipes)) != NULL) {
+		nni_aio_set_pipes(aio, NULL, 0);
+		pipe = 0;
+	} else if ((pipe = nni_aio_get_pipeline(aio)) != 0){
 		nni_aio_set_pipeline(aio, 0);
 	} else {
 		//p_id[0] = ctx->pipe_id;
@@ -171,7 +879,7 @@ nano_ctx_send(void *arg, nni_aio *aio)
 	}
 
 	//ctx->pp_len = 0;
-	ctx->pipe_id    = 0;		//ensure PING/DISCONNECT/PUBACK only sends once
+	nano_ctx_set_pipe(ctx, 0);	//ensure PING/DISCONNECT/PUBACK only sends once
 
 	if (ctx == &s->ctx) {
 		//in prototype, we only send once in each sock.
@@ -265,41 +973,38 @@ exit:
 	nni_msg_free(msg);
 	return;*/
 
+	if (pipes != NULL) {
+		len = nni_msg_len(msg);
+		nano_ctx_send_pipes(
+		    s, msg, nni_aio_get_dbtree(aio), pipes, npipes);
+		// Every pipe has taken its reference or dropped it.
+		nni_aio_set_msg(aio, NULL);
+		nni_aio_finish(aio, 0, len);
+		return;
+	}
+
 	debug_msg("***************************working with pipe id : %d***************************", pipe);
-	if ((p = nni_id_get(&s->pipes, pipe)) == NULL) {
+	if ((p = nano_pipe_lock_id(s, pipe)) == NULL) {
 		// Pipe is gone.  Make this look like a good send to avoid
 		// disrupting the state machine.  We don't care if the peer
 		// lost interest in our reply.
-		nni_mtx_unlock(&s->lk);
 		nni_aio_set_msg(aio, NULL);
 		nni_aio_finish(aio, 0, nni_msg_len(msg));
 		nni_msg_free(msg);
 		return;
 	}
 	p->tree = nni_aio_get_dbtree(aio);
-	if (!p->busy) {
-		p->busy = true;
-		len     = nni_msg_len(msg);
-		nni_aio_set_msg(&p->aio_send, msg);
-		nni_pipe_send(p->pipe, &p->aio_send);
-		nni_mtx_unlock(&s->lk);
+	len     = nni_msg_len(msg);
+	slow    = !nano_pipe_send_locked(p, msg);
+	nano_pipe_unlock(p);
 
-		nni_aio_set_msg(aio, NULL);
-		nni_aio_finish(aio, 0, len);
-		return;
-	}
+	// Either way the ctx is free to go on with the next subscriber.
+	nni_aio_set_msg(aio, NULL);
+	nni_aio_finish(aio, 0, len);
 
-	if ((rv = nni_aio_schedule(aio, nano_ctx_cancel_send, ctx)) != 0) {
-		nni_mtx_unlock(&s->lk);
-		nni_aio_finish_error(aio, rv);
-		return;
+	if (slow) {
+		nano_pipe_close_id(pipe);
 	}
-	debug_msg("pipe %p jamed! resending in cb!", pipe);
-	ctx->saio  = aio;
-	ctx->spipe = p;
-	ctx->rmsg  = msg;
-	nni_list_append(&p->sendq, ctx);
-	nni_mtx_unlock(&s->lk);
 }
 
 static void
@@ -307,8 +1012,15 @@ nano_sock_fini(void *arg)
 {
 	nano_sock *s = arg;
 
-	nni_id_map_fini(&s->pipes);
+	for (int i = 0; i < NANO_PIPE_SHARDS; i++) {
+		nni_id_map_fini(&s->shards[i].pipes);
+		nni_mtx_fini(&s->shards[i].lk);
+	}
 	nano_ctx_fini(&s->ctx);
+	nni_aio_stop(&s->rtaio);
+	nni_aio_fini(&s->rtaio);
+	nni_mtx_fini(&s->rtlk);
+	nni_msg_free(s->pingresp);
 	nni_pollable_fini(&s->writable);
 	nni_pollable_fini(&s->readable);
 	nni_mtx_fini(&s->lk);
@@ -317,13 +1029,38 @@ nano_sock_fini(void *arg)
 static int
 nano_sock_init(void *arg, nni_sock *sock)
 {
-	nano_sock *s = arg;
+	nano_sock *s      = arg;
+	uint8_t    resp[2] = { CMD_PINGRESP, 0x00 };
+	int        rv;
 
-	NNI_ARG_UNUSED(sock);
+	if ((rv = nni_msg_alloc(&s->pingresp, 0)) != 0) {
+		return (rv);
+	}
+	(void) nni_msg_header_append(s->pingresp, resp, sizeof(resp));
+	nni_msg_set_cmd_type(s->pingresp, CMD_PINGRESP);
+	nni_msg_set_remaining_len(s->pingresp, 0);
+	nni_atomic_init_bool(&s->fast_pubrel);
+	nni_atomic_set_bool(&s->fast_pubrel, true);
 
 	nni_mtx_init(&s->lk);
-
-	nni_id_map_init(&s->pipes, 0, 0, false);
+	s->sqmax   = NANO_SQ_MAX_MSGS;
+	s->sqbytes = NANO_SQ_MAX_BYTES;
+	nni_atomic_init(&s->sqpolicy);
+	nni_atomic_set(&s->sqpolicy, NANO_SQ_DROP_OLDEST);
+	nni_atomic_init(&s->sqgrace);
+	nni_atomic_set(&s->sqgrace, NANO_SQ_GRACE);
+	nni_atomic_init(&s->ctx_pipe);
+	s->inflight = NANO_INFLIGHT;
+	nni_atomic_init(&s->retry);
+	nni_atomic_set(&s->retry, NANO_RETRY_TIME);
+	nni_mtx_init(&s->rtlk);
+	NNI_LIST_INIT(&s->rtpipes, nano_pipe, rtnode);
+	nni_aio_init(&s->rtaio, nano_sock_retry_cb, s);
+
+	for (int i = 0; i < NANO_PIPE_SHARDS; i++) {
+		nni_mtx_init(&s->shards[i].lk);
+		nni_id_map_init(&s->shards[i].pipes, 0, 0, false);
+	}
 	NNI_LIST_INIT(&s->recvq, nano_ctx, rqnode);
 	NNI_LIST_INIT(&s->recvpipes, nano_pipe, rnode);
 	nni_atomic_init(&s->ttl);
@@ -336,6 +1073,51 @@ nano_sock_init(void *arg, nni_sock *sock)
 	nni_pollable_init(&s->writable);
 	nni_pollable_init(&s->readable);
 
+	static const nni_stat_info fast_info = {
+		.si_name   = "fast_acks",
+		.si_desc   = "PINGREQ, PUBREL and acks handled by the protocol",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_unit   = NNG_UNIT_MESSAGES,
+		.si_atomic = true,
+	};
+	static const nni_stat_info retry_info = {
+		.si_name   = "retransmits",
+		.si_desc   = "QoS 1/2 messages sent again, not acknowledged",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_unit   = NNG_UNIT_MESSAGES,
+		.si_atomic = true,
+	};
+	static const nni_stat_info sq_drop_info = {
+		.si_name   = "sq_drop",
+		.si_desc   = "QoS 0 messages dropped, send queue full",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_unit   = NNG_UNIT_MESSAGES,
+		.si_atomic = true,
+	};
+	static const nni_stat_info sq_conflate_info = {
+		.si_name   = "sq_conflate",
+		.si_desc   = "queued messages replaced by a newer one",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_unit   = NNG_UNIT_MESSAGES,
+		.si_atomic = true,
+	};
+	static const nni_stat_info sq_slow_info = {
+		.si_name   = "sq_slow",
+		.si_desc   = "pipes closed for being too slow",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_atomic = true,
+	};
+	nni_stat_init(&s->stat_fast, &fast_info);
+	nni_stat_init(&s->stat_retry, &retry_info);
+	nni_stat_init(&s->stat_sq_drop, &sq_drop_info);
+	nni_stat_init(&s->stat_sq_conflate, &sq_conflate_info);
+	nni_stat_init(&s->stat_sq_slow, &sq_slow_info);
+	nni_sock_add_stat(sock, &s->stat_fast);
+	nni_sock_add_stat(sock, &s->stat_retry);
+	nni_sock_add_stat(sock, &s->stat_sq_drop);
+	nni_sock_add_stat(sock, &s->stat_sq_conflate);
+	nni_sock_add_stat(sock, &s->stat_sq_slow);
+
 	debug_msg("&&&&&&&&&&&&nano_sock_init&&&&&&&&&&&&&");
 	return (0);
 }
@@ -343,7 +1125,9 @@ nano_sock_init(void *arg, nni_sock *sock)
 static void
 nano_sock_open(void *arg)
 {
-	NNI_ARG_UNUSED(arg);
+	nano_sock *s = arg;
+
+	nni_sleep_aio(NANO_RETRY_TICK, &s->rtaio);
 }
 
 static void
@@ -352,6 +1136,7 @@ nano_sock_close(void *arg)
 	nano_sock *s = arg;
 
 	nano_ctx_close(&s->ctx);
+	nni_aio_close(&s->rtaio);
 }
 
 static void
@@ -381,17 +1166,99 @@ nano_pipe_fini(void *arg)
 
 	nni_aio_fini(&p->aio_send);
 	nni_aio_fini(&p->aio_recv);
+	nni_lmq_fini(&p->sendq);
+	nni_lmq_fini(&p->waitq);
+	if (p->inflight != NULL) {
+		NNI_FREE_STRUCTS(p->inflight, p->wmax);
+	}
+	if (p->idmap != NULL) {
+		NNI_FREE_STRUCTS(p->idmap, NANO_ID_WORDS(p->wmax));
+	}
+	nni_mtx_fini(&p->lk);
 }
 
 static int
 nano_pipe_init(void *arg, nni_pipe *pipe, void *s)
 {
-	nano_pipe *p = arg;
+	nano_pipe *p    = arg;
+	nano_sock *sock = s;
+	int        rv;
 
+	static const nni_stat_info sq_depth_info = {
+		.si_name = "sq_depth",
+		.si_desc = "messages waiting in the send queue",
+		.si_type = NNG_STAT_LEVEL,
+		.si_unit = NNG_UNIT_MESSAGES,
+	};
+	static const nni_stat_info sq_bytes_info = {
+		.si_name = "sq_bytes",
+		.si_desc = "bytes waiting in the send queue",
+		.si_type = NNG_STAT_LEVEL,
+		.si_unit = NNG_UNIT_BYTES,
+	};
+	static const nni_stat_info sq_drop_info = {
+		.si_name   = "sq_drop",
+		.si_desc   = "QoS 0 messages dropped, send queue full",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_unit   = NNG_UNIT_MESSAGES,
+		.si_atomic = true,
+	};
+	static const nni_stat_info sq_conflate_info = {
+		.si_name   = "sq_conflate",
+		.si_desc   = "queued messages replaced by a newer one",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_unit   = NNG_UNIT_MESSAGES,
+		.si_atomic = true,
+	};
+
+	nni_mtx_init(&p->lk);
 	nni_aio_init(&p->aio_send, nano_pipe_send_cb, p);
 	nni_aio_init(&p->aio_recv, nano_pipe_recv_cb, p);
 
-	NNI_LIST_INIT(&p->sendq, nano_ctx, sqnode);
+	static const nni_stat_info inflight_info = {
+		.si_name = "inflight",
+		.si_desc = "QoS 1/2 messages not yet acknowledged",
+		.si_type = NNG_STAT_LEVEL,
+		.si_unit = NNG_UNIT_MESSAGES,
+	};
+
+	nni_mtx_lock(&sock->lk);
+	p->sqmax      = sock->sqmax;
+	p->sqmaxbytes = sock->sqbytes;
+	p->wmax       = (uint16_t) sock->inflight;
+	nni_mtx_unlock(&sock->lk);
+	p->window = p->wmax;
+	NNI_LIST_NODE_INIT(&p->rtnode);
+	if ((rv = nni_lmq_init(&p->waitq, 16)) != 0) {
+		return (rv);
+	}
+	if ((p->wmax > 0) &&
+	    (((p->inflight = NNI_ALLOC_STRUCTS(p->inflight, p->wmax)) ==
+	         NULL) ||
+	        ((p->idmap = NNI_ALLOC_STRUCTS(
+	              p->idmap, NANO_ID_WORDS(p->wmax))) == NULL))) {
+		return (NNG_ENOMEM);
+	}
+	// Start with a modest ring, it grows as the queue does.
+	if ((rv = nni_lmq_init(&p->sendq, p->sqmax < 64 ? p->sqmax : 64)) !=
+	    0) {
+		return (rv);
+	}
+	p->sqbytes = 0;
+	p->wqbytes = 0;
+	p->sqfull  = 0;
+
+	nni_stat_init(&p->stat_inflight, &inflight_info);
+	nni_stat_init(&p->stat_sq_depth, &sq_depth_info);
+	nni_stat_init(&p->stat_sq_bytes, &sq_bytes_info);
+	nni_stat_init(&p->stat_sq_drop, &sq_drop_info);
+	nni_stat_init(&p->stat_sq_conflate, &sq_conflate_info);
+	nni_pipe_add_stat(pipe, &p->stat_inflight);
+	nni_pipe_add_stat(pipe, &p->stat_sq_depth);
+	nni_pipe_add_stat(pipe, &p->stat_sq_bytes);
+	nni_pipe_add_stat(pipe, &p->stat_sq_drop);
+	nni_pipe_add_stat(pipe, &p->stat_sq_conflate);
+	nano_pipe_inflight_flush(p); // reserves the ids past wmax
 
 	p->id   = nni_pipe_id(pipe);
 	p->pipe = pipe;
@@ -402,9 +1269,10 @@ nano_pipe_init(void *arg, nni_pipe *pipe, void *s)
 static int
 nano_pipe_start(void *arg)
 {
-	nano_pipe *p = arg;
-	nano_sock *s = p->rep;
-	int        rv;
+	nano_pipe *      p  = arg;
+	nano_sock *      s  = p->rep;
+	nano_pipe_shard *sh = nano_pipe_shard_of(s, p->id);
+	int              rv;
 	//TODO check MQTT protocol version here
 	debug_msg("##########nano_pipe_start################");
 	/*
@@ -416,12 +1284,15 @@ nano_pipe_start(void *arg)
 	*/
 
 	//debug_msg("nano_pipe_start peep ver: %s", p->pipe);
-        nni_mtx_lock(&s->lk);
-        rv = nni_id_set(&s->pipes, nni_pipe_id(p->pipe), p);
-        nni_mtx_unlock(&s->lk);
-        if (rv != 0) {
+	nni_mtx_lock(&sh->lk);
+	rv = nni_id_set(&sh->pipes, p->id, p);
+	nni_mtx_unlock(&sh->lk);
+	if (rv != 0) {
 		return (rv);
 	}
+	p->counted = true;
+	nano_metric_add(NANO_METRIC_CONNECTIONS, 1);
+	NANO_PROBE1(pipe_open, p->id);
 	// By definition, we have not received a request yet on this pipe,
 	// so it cannot cause us to become writable.
 	nni_pipe_recv(p->pipe, &p->aio_recv);
@@ -431,13 +1302,11 @@ nano_pipe_start(void *arg)
 static void
 nano_pipe_close(void *arg)
 {
-	nano_pipe *p = arg;
-	nano_sock *s = p->rep;
-	nano_ctx * ctx;
-	void *     tree;
+	nano_pipe *      p  = arg;
+	nano_sock *      s  = p->rep;
+	nano_pipe_shard *sh = nano_pipe_shard_of(s, p->id);
 
 	debug_msg("#################nano_pipe_close!!##############");
-	nni_mtx_lock(&s->lk);
 	debug_msg("deleting %d", p->id);
 	debug_msg("tree : %p", p->tree);
 
@@ -449,32 +1318,47 @@ nano_pipe_close(void *arg)
 	nni_aio_close(&p->aio_send);
 	nni_aio_close(&p->aio_recv);
 
-	//nni_mtx_lock(&s->lk);
+	if (p->counted) {
+		p->counted = false;
+		nano_metric_add(NANO_METRIC_CONNECTIONS, -1);
+		NANO_PROBE1(pipe_close, p->id);
+	}
+
+	nni_mtx_lock(&s->lk);
 	p->closed = true;
 	if (nni_list_active(&s->recvpipes, p)) {
 		// We are no longer "receivable".
 		nni_list_remove(&s->recvpipes, p);
 	}
-	while ((ctx = nni_list_first(&p->sendq)) != NULL) {
-		nni_aio *aio;
-		nni_msg *msg;
-		// Pipe was closed.  To avoid pushing an error back to the
-		// entire socket, we pretend we completed this successfully.
-		nni_list_remove(&p->sendq, ctx);
-		aio       = ctx->saio;
-		ctx->saio = NULL;
-		msg       = nni_aio_get_msg(aio);
-		nni_aio_set_msg(aio, NULL);
-		nni_aio_finish(aio, 0, nni_msg_len(msg));
-		nni_msg_free(msg);
+	nni_mtx_unlock(&s->lk);
+
+	// Once out of the map no sender can reach the pipe, and one that
+	// found it before holds p->lk, so the flush below comes last.
+	nni_mtx_lock(&sh->lk);
+	nni_id_remove(&sh->pipes, p->id);
+	nni_mtx_unlock(&sh->lk);
+
+	nni_mtx_lock(&s->rtlk);
+	p->rtgone = true;
+	if (nni_list_node_active(&p->rtnode)) {
+		nni_list_remove(&s->rtpipes, p);
 	}
-	if (p->id == s->ctx.pipe_id) {
+	nni_mtx_unlock(&s->rtlk);
+
+	nni_mtx_lock(&p->lk);
+	// Whatever the peer had not been sent yet is lost with it, and with
+	// no session to keep, so is what it had not acknowledged.
+	nni_lmq_flush(&p->sendq);
+	p->sqbytes = 0;
+	nano_pipe_inflight_flush(p);
+	nano_pipe_sq_update(p);
+	nni_mtx_unlock(&p->lk);
+
+	if (p->id == (uint32_t) nni_atomic_get(&s->ctx_pipe)) {
 		// We "can" send.  (Well, not really, but we will happily
 		// accept a message and discard it.)
 		nni_pollable_raise(&s->writable);
 	}
-	nni_id_remove(&s->pipes, nni_pipe_id(p->pipe));
-	nni_mtx_unlock(&s->lk);
 }
 
 static void
@@ -482,10 +1366,7 @@ nano_pipe_send_cb(void *arg)
 {
 	nano_pipe *p = arg;
 	nano_sock *s = p->rep;
-	nano_ctx * ctx;
-	nni_aio *  aio;
 	nni_msg *  msg;
-	size_t     len;
 	//uint32_t   index = 0;
 	//uint32_t * pipes;
 
@@ -497,33 +1378,30 @@ nano_pipe_send_cb(void *arg)
 		nni_pipe_close(p->pipe);
 		return;
 	}
-	nni_mtx_lock(&s->lk);
+	nni_mtx_lock(&p->lk);
 	p->busy = false;
-	if ((ctx = nni_list_first(&p->sendq)) == NULL) {
+	if (nni_lmq_getq(&p->sendq, &msg) != 0) {
 		// Nothing else to send.
-		if (p->id == s->ctx.pipe_id) {
+		if (!nano_pipe_sq_full(p, 0)) {
+			p->sqfull = 0;
+		}
+		nni_mtx_unlock(&p->lk);
+		if (p->id == (uint32_t) nni_atomic_get(&s->ctx_pipe)) {
 			// Mark us ready for the other side to send!
 			nni_pollable_raise(&s->writable);
 		}
-		nni_mtx_unlock(&s->lk);
 		return;
 	}
+	p->sqbytes -= nano_msg_size(msg);
+	if (!nano_pipe_sq_full(p, 0)) {
+		p->sqfull = 0;
+	}
+	nano_pipe_sq_update(p);
 
-	nni_list_remove(&p->sendq, ctx);
-	aio        = ctx->saio;
-	ctx->saio  = NULL;
-	p          = ctx->spipe;  //should be as same as orignal p?
-	ctx->spipe = NULL;
-	p->busy    = true;
-	msg        = ctx->rmsg;
-	len        = nni_msg_len(msg);
-	nni_aio_set_msg(aio, NULL);
-	nni_aio_set_msg(&p->aio_send, msg);
-	nni_pipe_send(p->pipe, &p->aio_send);
-
-	nni_mtx_unlock(&s->lk);
+	p->busy = true;
+	nano_pipe_tx(p, msg);
 
-	nni_aio_finish_sync(aio, 0, len);
+	nni_mtx_unlock(&p->lk);
 	/*
 	// pub to mulitple clients/pipes within single aio/ctx
 	aio   = ctx->saio;
@@ -587,6 +1465,17 @@ drop:
 	*/
 }
 
+static bool
+nano_pipe_idle(nano_pipe *p)
+{
+	bool idle;
+
+	nni_mtx_lock(&p->lk);
+	idle = !p->busy;
+	nni_mtx_unlock(&p->lk);
+	return (idle);
+}
+
 static void
 nano_cancel_recv(nni_aio *aio, void *arg, int rv)
 {
@@ -643,23 +1532,131 @@ nano_ctx_recv(void *arg, nni_aio *aio)
 	if (nni_list_empty(&s->recvpipes)) {
 		nni_pollable_clear(&s->readable);
 	}
-	nni_pipe_recv(p->pipe, &p->aio_recv);
-	if ((ctx == &s->ctx) && !p->busy) {
+	if ((ctx == &s->ctx) && nano_pipe_idle(p)) {
 		nni_pollable_raise(&s->writable);
 	}
 
 	//TODO MQTT 5 property
 
-	ctx->pipe_id    = nni_pipe_id(p->pipe);
+	nano_ctx_set_pipe(ctx, p->id);
 	debug_msg("nano_ctx_recv ends %p pipe: %p pipe_id: %d", ctx, p, ctx->pipe_id);
+	// Still under s->lk: being on recvpipes is all that keeps the pipe
+	// from being closed and reaped under us.
+	nni_pipe_recv(p->pipe, &p->aio_recv);
 	nni_mtx_unlock(&s->lk);
 
 	//nni_msg_header_clear(msg);
+	NANO_PROBE4(handoff, p->id, nni_msg_cmd_type(msg), nano_msg_size(msg), 1);
 	nni_aio_set_msg(aio, msg);
 	nni_aio_finish(aio, 0, nni_msg_len(msg));
 	//nni_mtx_unlock(&s->lk);
 }
 
+// Fast path.  Packets whose answer needs no broker state are answered
+// from the receive callback, without queueing for a work context.  A
+// hook that returns true has consumed msg.
+typedef bool (*nano_hook)(nano_pipe *, nni_msg *);
+
+static bool
+nano_hook_pingreq(nano_pipe *p, nni_msg *msg)
+{
+	nano_sock *s = p->rep;
+
+	nni_msg_free(msg);
+	// PINGRESP never changes, so every pipe gets the same message.
+	nni_msg_clone(s->pingresp);
+	nano_pipe_send_msg(p, s->pingresp);
+	return (true);
+}
+
+static bool
+nano_hook_pubrel(nano_pipe *p, nni_msg *msg)
+{
+	uint8_t hdr[2] = { CMD_PUBCOMP, 0x02 };
+
+	if (!nni_atomic_get_bool(&p->rep->fast_pubrel) ||
+	    (nni_msg_len(msg) < 2)) {
+		return (false);
+	}
+	// The PUBREL turns into its PUBCOMP: same packet id, any v5 reason
+	// code or properties dropped, which reads as success.
+	nni_msg_header_clear(msg);
+	if (nni_msg_header_append(msg, hdr, sizeof(hdr)) != 0) {
+		return (false);
+	}
+	nni_msg_chop(msg, nni_msg_len(msg) - 2);
+	nni_msg_set_cmd_type(msg, CMD_PUBCOMP);
+	nni_msg_set_remaining_len(msg, 2);
+	nano_pipe_send_msg(p, msg);
+	return (true);
+}
+
+// Acknowledgements of what we sent: look the packet id up in the window.
+// A PUBREC, tracked or not, is answered with PUBREL, which for a tracked
+// id takes the place of the PUBLISH until PUBCOMP comes in.
+static bool
+nano_hook_ack(nano_pipe *p, nni_msg *msg)
+{
+	uint8_t        cmd = nni_msg_cmd_type(msg);
+	uint8_t        hdr[2] = { CMD_PUBREL | 0x02, 0x02 };
+	nano_inflight *slot;
+	uint16_t       id;
+	bool           ok = true;
+
+	if ((nni_msg_len(msg) < 2) || ((p->wmax == 0) && (cmd != CMD_PUBREC))) {
+		return (false);
+	}
+	NNI_GET16((uint8_t *) nni_msg_body(msg), id);
+
+	nni_mtx_lock(&p->lk);
+	slot = nano_pipe_inflight(p, id);
+	switch (cmd) {
+		case CMD_PUBACK:
+			if ((slot != NULL) && !slot->rel) {
+				ok = nano_pipe_inflight_ack(p, id);
+			}
+			nni_msg_free(msg);
+			break;
+		case CMD_PUBCOMP:
+			if ((slot != NULL) && slot->rel) {
+				ok = nano_pipe_inflight_ack(p, id);
+			}
+			nni_msg_free(msg);
+			break;
+		default: // CMD_PUBREC
+			nni_msg_header_clear(msg);
+			if (nni_msg_header_append(msg, hdr, sizeof(hdr)) != 0) {
+				nni_msg_free(msg);
+				break;
+			}
+			nni_msg_chop(msg, nni_msg_len(msg) - 2);
+			nni_msg_set_cmd_type(msg, CMD_PUBREL);
+			nni_msg_set_remaining_len(msg, 2);
+			if ((slot != NULL) && !slot->rel) {
+				nni_msg_free(slot->msg);
+				nni_msg_clone(msg);
+				slot->msg  = msg;
+				slot->sent = nni_clock();
+				slot->rel  = true;
+			}
+			ok = nano_pipe_xmit(p, msg);
+			break;
+	}
+	nano_pipe_unlock(p);
+	if (!ok) {
+		nano_pipe_close_id(p->id);
+	}
+	return (true);
+}
+
+static const nano_hook nano_hooks[16] = {
+	[CMD_PINGREQ >> 4] = nano_hook_pingreq,
+	[CMD_PUBREL >> 4]  = nano_hook_pubrel,
+	[CMD_PUBACK >> 4]  = nano_hook_ack,
+	[CMD_PUBREC >> 4]  = nano_hook_ack,
+	[CMD_PUBCOMP >> 4] = nano_hook_ack,
+};
+
 static void
 nano_pipe_recv_cb(void *arg)
 {
@@ -669,6 +1666,7 @@ nano_pipe_recv_cb(void *arg)
 	nni_msg   *    msg;
 	uint8_t   *    header;
 	nni_aio   *    aio;
+	nano_hook      hook;
 	//size_t         len;
 	//int        hops;
 	//int        ttl;
@@ -684,14 +1682,39 @@ nano_pipe_recv_cb(void *arg)
 		goto drop;
 	}
 
+	nano_metric_add(
+	    NANO_METRIC_PACKETS_IN + ((nng_msg_cmd_type(msg) >> 4) & 0x0F), 1);
+	nano_metric_add(NANO_METRIC_BYTES_IN, nano_msg_size(msg));
+
 	header = nng_msg_header(msg);
-	debug_msg("start nano_pipe_recv_cb pipe: %p p_id %d TYPE: %x ===== header: %x %x header len: %d\n",p ,p->id, nng_msg_cmd_type(msg), *header, *(header+1), nng_msg_header_len(msg));
+	debug_msg("start nano_pipe_recv_cb pipe: %p p_id %d TYPE: %x ===== header: %x %x header len: %zu\n",p ,p->id, nng_msg_cmd_type(msg), *header, *(header+1), nng_msg_header_len(msg));
 	//ttl = nni_atomic_get(&s->ttl);
 	nni_msg_set_pipe(msg, p->id);
 
-	nni_mtx_lock(&s->lk);
+	if (!p->cparam) {
+		conn_param *cparam = nni_msg_get_conn_param(msg);
+
+		// The Receive Maximum is the client's say on our window.
+		p->cparam = true;
+		if ((cparam != NULL) &&
+		    (cparam->pro_ver == PROTOCOL_VERSION_v5) &&
+		    (cparam->rx_max > 0) && (cparam->rx_max < p->window)) {
+			nni_mtx_lock(&p->lk);
+			p->window = cparam->rx_max;
+			nni_mtx_unlock(&p->lk);
+		}
+	}
+
+	if ((hook = nano_hooks[(nng_msg_cmd_type(msg) >> 4) & 0x0F]) != NULL) {
+		nni_aio_set_msg(&p->aio_recv, NULL);
+		if (hook(p, msg)) {
+			BUMP_STAT(&s->stat_fast);
+			nni_pipe_recv(p->pipe, &p->aio_recv);
+			return;
+		}
+		nni_aio_set_msg(&p->aio_recv, msg);
+	}
 
-	//TODO HOOK
 	switch (nng_msg_cmd_type(msg)) {
 		case CMD_SUBSCRIBE:
 			break;
@@ -703,10 +1726,14 @@ nano_pipe_recv_cb(void *arg)
 			break;
 		case CMD_PINGREQ:
 			break;
+		case CMD_PUBREL:
+			break;
 		default:
 			goto drop;
 	}
 
+	nni_mtx_lock(&s->lk);
+
 	/*
 	if (nng_msg_cmd_type(msg) == CMD_DISCONNECT && (ctx = nni_list_first(&s->recvq)) != NULL)
 	{
@@ -742,19 +1769,21 @@ nano_pipe_recv_cb(void *arg)
 	aio       = ctx->raio;
 	ctx->raio = NULL;
 	nni_aio_set_msg(&p->aio_recv, NULL);
-	if ((ctx == &s->ctx) && !p->busy) {
+	if ((ctx == &s->ctx) && nano_pipe_idle(p)) {
 		nni_pollable_raise(&s->writable);
 	}
 
-	// schedule another receive
-	nni_pipe_recv(p->pipe, &p->aio_recv);
-
 	//ctx->pp_len = len;		//TODO Rewrite mqtt header length
-	ctx->pipe_id = p->id;			//use pipe id to identify which client
+	nano_ctx_set_pipe(ctx, p->id);	//use pipe id to identify which client
 	debug_msg("pipe_id: %d", p->id);
 
 	nni_mtx_unlock(&s->lk);
 
+	// schedule another receive, outside the lock: we run as the
+	// receive callback, so the pipe cannot be stopped under us.
+	nni_pipe_recv(p->pipe, &p->aio_recv);
+
+	NANO_PROBE4(handoff, p->id, nni_msg_cmd_type(msg), nano_msg_size(msg), 0);
 	nni_aio_set_msg(aio, msg);
 	//trigger application level
 	nni_aio_finish_sync(aio, 0, nni_msg_len(msg));
@@ -789,6 +1818,186 @@ nano_sock_get_max_ttl(void *arg, void *buf, size_t *szp, nni_opt_type t)
 	return (nni_copyout_int(nni_atomic_get(&s->ttl), buf, szp, t));
 }
 
+// Send queue limits and policy.  Limits apply to pipes connected after
+// they are set, the policy and grace period to all pipes at once.
+static int
+nano_sock_set_sq_max_msgs(void *arg, const void *buf, size_t sz, nni_opt_type t)
+{
+	nano_sock *s = arg;
+	int        val;
+	int        rv;
+
+	if ((rv = nni_copyin_int(&val, buf, sz, 1, 1 << 20, t)) == 0) {
+		nni_mtx_lock(&s->lk);
+		s->sqmax = val;
+		nni_mtx_unlock(&s->lk);
+	}
+	return (rv);
+}
+
+static int
+nano_sock_get_sq_max_msgs(void *arg, void *buf, size_t *szp, nni_opt_type t)
+{
+	nano_sock *s = arg;
+	int        val;
+
+	nni_mtx_lock(&s->lk);
+	val = s->sqmax;
+	nni_mtx_unlock(&s->lk);
+	return (nni_copyout_int(val, buf, szp, t));
+}
+
+static int
+nano_sock_set_sq_max_bytes(
+    void *arg, const void *buf, size_t sz, nni_opt_type t)
+{
+	nano_sock *s = arg;
+	size_t     val;
+	int        rv;
+
+	if ((rv = nni_copyin_size(&val, buf, sz, 1, NNI_MAXSZ, t)) == 0) {
+		nni_mtx_lock(&s->lk);
+		s->sqbytes = val;
+		nni_mtx_unlock(&s->lk);
+	}
+	return (rv);
+}
+
+static int
+nano_sock_get_sq_max_bytes(void *arg, void *buf, size_t *szp, nni_opt_type t)
+{
+	nano_sock *s = arg;
+	size_t     val;
+
+	nni_mtx_lock(&s->lk);
+	val = s->sqbytes;
+	nni_mtx_unlock(&s->lk);
+	return (nni_copyout_size(val, buf, szp, t));
+}
+
+static int
+nano_sock_set_sq_policy(void *arg, const void *buf, size_t sz, nni_opt_type t)
+{
+	nano_sock *s = arg;
+	int        val;
+	int        rv;
+
+	if ((rv = nni_copyin_int(&val, buf, sz, NANO_SQ_DROP_NEWEST,
+	         NANO_SQ_CONFLATE, t)) == 0) {
+		nni_atomic_set(&s->sqpolicy, val);
+	}
+	return (rv);
+}
+
+static int
+nano_sock_get_sq_policy(void *arg, void *buf, size_t *szp, nni_opt_type t)
+{
+	nano_sock *s = arg;
+
+	return (nni_copyout_int(nni_atomic_get(&s->sqpolicy), buf, szp, t));
+}
+
+static int
+nano_sock_set_sq_grace(void *arg, const void *buf, size_t sz, nni_opt_type t)
+{
+	nano_sock *  s = arg;
+	nni_duration val;
+	int          rv;
+
+	if ((rv = nni_copyin_ms(&val, buf, sz, t)) == 0) {
+		if (val < 0) {
+			return (NNG_EINVAL);
+		}
+		nni_atomic_set(&s->sqgrace, val);
+	}
+	return (rv);
+}
+
+static int
+nano_sock_get_sq_grace(void *arg, void *buf, size_t *szp, nni_opt_type t)
+{
+	nano_sock *s = arg;
+
+	return (nni_copyout_ms(nni_atomic_get(&s->sqgrace), buf, szp, t));
+}
+
+static int
+nano_sock_set_fast_pubrel(
+    void *arg, const void *buf, size_t sz, nni_opt_type t)
+{
+	nano_sock *s = arg;
+	bool       val;
+	int        rv;
+
+	if ((rv = nni_copyin_bool(&val, buf, sz, t)) == 0) {
+		nni_atomic_set_bool(&s->fast_pubrel, val);
+	}
+	return (rv);
+}
+
+static int
+nano_sock_get_fast_pubrel(void *arg, void *buf, size_t *szp, nni_opt_type t)
+{
+	nano_sock *s = arg;
+
+	return (nni_copyout_bool(
+	    nni_atomic_get_bool(&s->fast_pubrel), buf, szp, t));
+}
+
+// The window applies to pipes connected after it is set, the retry time
+// to all of them.
+static int
+nano_sock_set_inflight(void *arg, const void *buf, size_t sz, nni_opt_type t)
+{
+	nano_sock *s = arg;
+	int        val;
+	int        rv;
+
+	if ((rv = nni_copyin_int(&val, buf, sz, 0, 65535, t)) == 0) {
+		nni_mtx_lock(&s->lk);
+		s->inflight = val;
+		nni_mtx_unlock(&s->lk);
+	}
+	return (rv);
+}
+
+static int
+nano_sock_get_inflight(void *arg, void *buf, size_t *szp, nni_opt_type t)
+{
+	nano_sock *s = arg;
+	int        val;
+
+	nni_mtx_lock(&s->lk);
+	val = s->inflight;
+	nni_mtx_unlock(&s->lk);
+	return (nni_copyout_int(val, buf, szp, t));
+}
+
+static int
+nano_sock_set_retry_time(
+    void *arg, const void *buf, size_t sz, nni_opt_type t)
+{
+	nano_sock *  s = arg;
+	nni_duration val;
+	int          rv;
+
+	if ((rv = nni_copyin_ms(&val, buf, sz, t)) == 0) {
+		if (val < 0) {
+			return (NNG_EINVAL);
+		}
+		nni_atomic_set(&s->retry, val);
+	}
+	return (rv);
+}
+
+static int
+nano_sock_get_retry_time(void *arg, void *buf, size_t *szp, nni_opt_type t)
+{
+	nano_sock *s = arg;
+
+	return (nni_copyout_ms(nni_atomic_get(&s->retry), buf, szp, t));
+}
+
 static int
 nano_sock_get_sendfd(void *arg, void *buf, size_t *szp, nni_opt_type t)
 {
@@ -865,6 +2074,41 @@ static nni_option nano_sock_options[] = {
 	    .o_name = NNG_OPT_SENDFD,
 	    .o_get  = nano_sock_get_sendfd,
 	},
+	{
+	    .o_name = NANO_OPT_SQ_MAX_MSGS,
+	    .o_get  = nano_sock_get_sq_max_msgs,
+	    .o_set  = nano_sock_set_sq_max_msgs,
+	},
+	{
+	    .o_name = NANO_OPT_SQ_MAX_BYTES,
+	    .o_get  = nano_sock_get_sq_max_bytes,
+	    .o_set  = nano_sock_set_sq_max_bytes,
+	},
+	{
+	    .o_name = NANO_OPT_SQ_POLICY,
+	    .o_get  = nano_sock_get_sq_policy,
+	    .o_set  = nano_sock_set_sq_policy,
+	},
+	{
+	    .o_name = NANO_OPT_SQ_GRACE,
+	    .o_get  = nano_sock_get_sq_grace,
+	    .o_set  = nano_sock_set_sq_grace,
+	},
+	{
+	    .o_name = NANO_OPT_FAST_PUBREL,
+	    .o_get  = nano_sock_get_fast_pubrel,
+	    .o_set  = nano_sock_set_fast_pubrel,
+	},
+	{
+	    .o_name = NANO_OPT_INFLIGHT,
+	    .o_get  = nano_sock_get_inflight,
+	    .o_set  = nano_sock_set_inflight,
+	},
+	{
+	    .o_name = NANO_OPT_RETRY_TIME,
+	    .o_get  = nano_sock_get_retry_time,
+	    .o_set  = nano_sock_set_retry_time,
+	},
 	//{
 	//    .o_name = NNG_OPT_REQ_RESENDTIME,
 	//    .o_get  = req0_ctx_get_resend_time,
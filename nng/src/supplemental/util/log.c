@@ -0,0 +1,969 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// Every thread that logs gets a ring buffer of its own, which only that
+// thread writes and only the writer thread reads, so neither needs a lock.
+// A record holds the call site and the arguments; the format string stays
+// in the site.  Arguments are copied by walking the format the way printf
+// would, strings by value since they may be gone by the time the writer
+// gets to them.  The writer walks it again to format each argument.
+//
+// A full ring drops the message and counts it, so a thread that logs
+// never waits for the writer.
+//
+// Logging may start before nng is initialised, so only what works
+// without nni_init is set up on first use: mutexes, atomics and the
+// rings.  The writer thread is started by nni_init; until then, and after
+// nni_fini, the rings fill up and are written out by nano_log_flush or
+// at exit.
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef NNG_PLATFORM_POSIX
+#include <syslog.h>
+#endif
+
+#include "core/nng_impl.h"
+#include "nng/supplemental/util/log.h"
+
+#define LOG_RING_SIZE (64 * 1024) // bytes per thread, a power of two
+#define LOG_MAX_ARGS 1024         // argument bytes per message
+#define LOG_MAX_STR 512           // bytes of a string argument
+#define LOG_ARG_ROOM 64           // kept for arguments after a string
+#define LOG_MODULES 64
+#define LOG_MODULE_LEN 32
+#define LOG_SITES 1024          // buckets of the call site table
+#define LOG_SITE_CACHE 256      // call sites cached per thread
+#define LOG_DEFAULT_RATE 1000   // messages per second per call site
+#define LOG_PERIOD 10           // msec, the writer wakes up this often
+#define LOG_PAD 0xff            // record level: skip to the ring's start
+
+typedef struct log_ring {
+	uint8_t *        buf;
+	nni_atomic_u64   head;    // written up to, by the owning thread
+	nni_atomic_u64   tail;    // read up to, by the writer
+	nni_atomic_u64   dropped; // messages that did not fit
+	nni_atomic_bool  dead;    // the owning thread has exited
+	int              id;
+	struct log_ring *next;
+} log_ring;
+
+// What the logger keeps for a call site, found by its address.
+typedef struct log_site {
+	const nano_log_site *site;
+	int                  module;
+	nni_atomic_int       second;  // rate limit window
+	nni_atomic_int       count;   // messages in this window
+	nni_atomic_int       dropped; // over the limit since the last one
+	struct log_site *    next;
+} log_site;
+
+typedef struct {
+	uint32_t             size; // of the record, a multiple of 8
+	uint8_t              level;
+	uint32_t             suppressed; // over the rate limit before this one
+	const nano_log_site *site;
+	nni_time             time; // msec, nni_clock
+} log_rec;
+
+typedef struct {
+	char flags[8];
+	int  width; // -1 if none
+	int  prec;  // -1 if none
+	bool width_arg;
+	bool prec_arg;
+	char len; // 'H' hh, 'h', 'l', 'q' ll, 'z', 'j', 't', 'L', or 0
+	char conv;
+} log_spec;
+
+static struct {
+	char           name[LOG_MODULE_LEN];
+	nni_atomic_int level;
+} modules[LOG_MODULES];
+
+static int nmodules;
+static int default_level = NANO_LOG_WARN;
+static int rate          = LOG_DEFAULT_RATE;
+
+// 0 until log_init is done, then one more than the highest level of any
+// module, so that a message no module wants costs a single load.
+static nni_atomic_int log_max;
+static nni_atomic_int log_state; // 0, LOG_STARTING, LOG_READY
+#define LOG_STARTING 1
+#define LOG_READY 2
+
+static nni_mtx         log_mtx;   // modules, sites, the list of rings
+static nni_mtx         drain_mtx; // whoever is writing the rings out
+static nni_thr         writer;
+static bool            writer_running;
+static nni_atomic_bool writer_stop;
+static log_site *      sites[LOG_SITES];
+static log_ring *      rings;
+static int             nrings;
+static FILE *          log_file;
+static bool            log_syslog;
+static uint64_t        log_epoch; // msec since the epoch at nni_clock 0
+
+static NNI_THREAD_LOCAL log_ring *my_ring;
+static NNI_THREAD_LOCAL log_site *site_cache[LOG_SITE_CACHE];
+
+static const char *level_names[] = { "OFF", "ERROR", "WARN", "INFO", "DEBUG",
+	"TRACE" };
+
+static int configure(const char *);
+
+// Module 0 is the catch all, for modules past LOG_MODULES.
+static int
+module_find(const char *name, size_t len, bool add)
+{
+	int i;
+
+	if (len >= LOG_MODULE_LEN) {
+		len = LOG_MODULE_LEN - 1;
+	}
+	for (i = 1; i < nmodules; i++) {
+		if (strncmp(modules[i].name, name, len) == 0 &&
+		    modules[i].name[len] == '\0') {
+			return (i);
+		}
+	}
+	if (!add || nmodules == LOG_MODULES) {
+		return (0);
+	}
+	memcpy(modules[i].name, name, len);
+	modules[i].name[len] = '\0';
+	nni_atomic_init(&modules[i].level);
+	nni_atomic_set(&modules[i].level, default_level);
+	nmodules++;
+	return (i);
+}
+
+static void
+log_init(void)
+{
+	const char *env;
+
+	nni_mtx_init(&log_mtx);
+	nni_mtx_init(&drain_mtx);
+	nni_atomic_init_bool(&writer_stop);
+	log_epoch = (uint64_t) time(NULL) * 1000 - nni_clock();
+
+	strcpy(modules[0].name, "*");
+	nni_atomic_init(&modules[0].level);
+	nni_atomic_set(&modules[0].level, default_level);
+	nmodules = 1;
+	nni_atomic_set(&log_max, default_level + 1);
+
+	if ((env = getenv("NANOMQ_LOG")) != NULL) {
+		configure(env);
+	}
+	if ((env = getenv("NANOMQ_LOG_RATE")) != NULL) {
+		rate = atoi(env);
+	}
+	if ((env = getenv("NANOMQ_LOG_FILE")) != NULL && *env != '\0') {
+		log_file = fopen(env, "a");
+	}
+#ifdef NNG_PLATFORM_POSIX
+	if ((env = getenv("NANOMQ_LOG_SYSLOG")) != NULL && atoi(env) != 0) {
+		openlog("nanomq", LOG_PID, LOG_DAEMON);
+		log_syslog = true;
+	}
+#endif
+}
+
+static void log_stop(void);
+
+static void
+log_once(void)
+{
+	if (nni_atomic_get(&log_state) == LOG_READY) {
+		return;
+	}
+	if (nni_atomic_cas(&log_state, 0, LOG_STARTING)) {
+		log_init();
+		atexit(log_stop);
+		nni_atomic_set(&log_state, LOG_READY);
+		return;
+	}
+	while (nni_atomic_get(&log_state) != LOG_READY) {
+		nni_msleep(1);
+	}
+}
+
+// Sites are looked up by address, in the thread's cache and failing that
+// in the table, where they are added the first time they log.
+static log_site *
+site_get(const nano_log_site *site)
+{
+	uintptr_t   h = (uintptr_t) site / sizeof(void *);
+	log_site ** cp = &site_cache[h & (LOG_SITE_CACHE - 1)];
+	log_site *  s;
+	const char *name;
+	const char *ext;
+
+	if ((s = *cp) != NULL && s->site == site) {
+		return (s);
+	}
+	nni_mtx_lock(&log_mtx);
+	for (s = sites[h & (LOG_SITES - 1)]; s != NULL; s = s->next) {
+		if (s->site == site) {
+			break;
+		}
+	}
+	if (s == NULL && (s = nni_zalloc(sizeof(*s))) != NULL) {
+		name = strrchr(site->file, '/');
+		name = name != NULL ? name + 1 : site->file;
+		ext  = strchr(name, '.');
+
+		s->site   = site;
+		s->module = module_find(
+		    name, ext != NULL ? (size_t) (ext - name) : strlen(name), true);
+		nni_atomic_init(&s->second);
+		nni_atomic_init(&s->count);
+		nni_atomic_init(&s->dropped);
+		s->next                    = sites[h & (LOG_SITES - 1)];
+		sites[h & (LOG_SITES - 1)] = s;
+	}
+	nni_mtx_unlock(&log_mtx);
+	*cp = s;
+	return (s);
+}
+
+bool
+nano_log_enabled(const nano_log_site *site)
+{
+	log_site *s;
+	int       max;
+
+	if ((max = nni_atomic_get(&log_max)) == 0) {
+		log_once();
+		max = nni_atomic_get(&log_max);
+	}
+	if (site->level >= max || (s = site_get(site)) == NULL) {
+		return (false);
+	}
+	return (site->level <= nni_atomic_get(&modules[s->module].level));
+}
+
+int
+nano_log_parse_level(const char *name, nano_log_level *level)
+{
+	for (int i = 0; i < (int) (sizeof(level_names) / sizeof(char *));
+	     i++) {
+		if (nni_strcasecmp(name, level_names[i]) == 0) {
+			*level = i;
+			return (0);
+		}
+	}
+	return (NNG_EINVAL);
+}
+
+static void
+level_set(const char *module, nano_log_level level)
+{
+	int max;
+
+	nni_mtx_lock(&log_mtx);
+	if (module == NULL || strcmp(module, "*") == 0) {
+		default_level = level;
+		for (int i = 0; i < nmodules; i++) {
+			nni_atomic_set(&modules[i].level, level);
+		}
+	} else {
+		int m = module_find(module, strlen(module), true);
+		nni_atomic_set(&modules[m].level, level);
+	}
+	max = default_level;
+	for (int i = 0; i < nmodules; i++) {
+		if (nni_atomic_get(&modules[i].level) > max) {
+			max = nni_atomic_get(&modules[i].level);
+		}
+	}
+	nni_atomic_set(&log_max, max + 1);
+	nni_mtx_unlock(&log_mtx);
+}
+
+void
+nano_log_set_level(const char *module, nano_log_level level)
+{
+	log_once();
+	level_set(module, level);
+}
+
+nano_log_level
+nano_log_get_level(const char *module)
+{
+	int level;
+
+	log_once();
+	nni_mtx_lock(&log_mtx);
+	level = nni_atomic_get(&modules[module == NULL
+	        ? 0
+	        : module_find(module, strlen(module), false)]
+	                            .level);
+	nni_mtx_unlock(&log_mtx);
+	return (level);
+}
+
+static int
+configure(const char *spec)
+{
+	char           item[LOG_MODULE_LEN + 16];
+	const char *   end;
+	char *         eq;
+	size_t         len;
+	nano_log_level level;
+	int            rv = 0;
+
+	for (; *spec != '\0'; spec = *end != '\0' ? end + 1 : end) {
+		if ((end = strchr(spec, ',')) == NULL) {
+			end = spec + strlen(spec);
+		}
+		if ((len = end - spec) == 0) {
+			continue;
+		}
+		if (len >= sizeof(item)) {
+			rv = NNG_EINVAL;
+			continue;
+		}
+		memcpy(item, spec, len);
+		item[len] = '\0';
+		if ((eq = strchr(item, '=')) != NULL) {
+			*eq++ = '\0';
+		}
+		if (nano_log_parse_level(eq != NULL ? eq : item, &level) != 0) {
+			rv = NNG_EINVAL;
+			continue;
+		}
+		// the default first, so that modules listed after keep theirs
+		level_set(eq != NULL ? item : NULL, level);
+	}
+	return (rv);
+}
+
+int
+nano_log_configure(const char *spec)
+{
+	log_once();
+	return (configure(spec));
+}
+
+// Finds the next conversion in *fmt, skipping "%%", and moves past it.
+// False at the end of the format or at a conversion we do not copy.
+static bool
+next_spec(const char **fmt, log_spec *sp)
+{
+	const char *p = *fmt;
+	size_t      nflags;
+
+	for (;;) {
+		if ((p = strchr(p, '%')) == NULL) {
+			return (false);
+		}
+		if (p[1] != '%') {
+			break;
+		}
+		p += 2;
+	}
+	p++;
+
+	for (nflags = 0; strchr("-+ #0", *p) != NULL && *p != '\0'; p++) {
+		if (nflags < sizeof(sp->flags) - 1) {
+			sp->flags[nflags++] = *p;
+		}
+	}
+	sp->flags[nflags] = '\0';
+	sp->width_arg     = false;
+	sp->prec_arg      = false;
+	sp->width         = -1;
+	sp->prec          = -1;
+	if (*p == '*') {
+		sp->width_arg = true;
+		p++;
+	} else if (*p >= '0' && *p <= '9') {
+		sp->width = (int) strtol(p, (char **) &p, 10);
+	}
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			sp->prec_arg = true;
+			p++;
+		} else {
+			sp->prec = (int) strtol(p, (char **) &p, 10);
+		}
+	}
+
+	sp->len = 0;
+	if (p[0] == 'h' && p[1] == 'h') {
+		sp->len = 'H';
+		p += 2;
+	} else if (p[0] == 'l' && p[1] == 'l') {
+		sp->len = 'q';
+		p += 2;
+	} else if (*p != '\0' && strchr("hlzjtL", *p) != NULL) {
+		sp->len = *p++;
+	}
+
+	if (*p == '\0' || strchr("diouxXcfFeEgGaAps", *p) == NULL) {
+		return (false); // %n, wide strings and anything else
+	}
+	sp->conv = *p++;
+	*fmt     = p;
+	return (true);
+}
+
+typedef struct {
+	uint8_t *buf;
+	size_t   len;
+	size_t   pos;
+} log_args;
+
+static void
+put_u64(log_args *a, uint64_t v)
+{
+	if (a->len - a->pos >= sizeof(v)) {
+		memcpy(a->buf + a->pos, &v, sizeof(v));
+		a->pos += sizeof(v);
+	}
+}
+
+// Strings go in as a length, the bytes and a NUL, padded to 8.  Longer
+// than LOG_MAX_STR, or than what leaves room for another argument or
+// two, they are cut short.
+static void
+put_str(log_args *a, const char *s, int prec)
+{
+	size_t room = a->len - a->pos;
+	size_t n;
+
+	if (room < 2 * sizeof(uint64_t)) {
+		return;
+	}
+	if (s == NULL) {
+		s = "(null)";
+	}
+	n = nni_strnlen(s, prec >= 0 && prec < LOG_MAX_STR ? prec : LOG_MAX_STR);
+	room -= sizeof(uint64_t) + 1;
+	if (n > room) {
+		n = room;
+	} else if (n > room / 2 && room > LOG_ARG_ROOM) {
+		n = n < room - LOG_ARG_ROOM ? n : room - LOG_ARG_ROOM;
+	}
+	put_u64(a, n);
+	memcpy(a->buf + a->pos, s, n);
+	a->buf[a->pos + n] = '\0';
+	a->pos += (n + 1 + 7) & ~(size_t) 7;
+	if (a->pos > a->len) {
+		a->pos = a->len;
+	}
+}
+
+static void
+copy_args(const char *fmt, va_list ap, log_args *a)
+{
+	log_spec sp;
+	int      prec;
+
+	while (next_spec(&fmt, &sp)) {
+		prec = sp.prec;
+		if (sp.width_arg) {
+			put_u64(a, (uint64_t) (int64_t) va_arg(ap, int));
+		}
+		if (sp.prec_arg) {
+			prec = va_arg(ap, int);
+			put_u64(a, (uint64_t) (int64_t) prec);
+		}
+		switch (sp.conv) {
+		case 'd':
+		case 'i':
+		case 'o':
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'c':
+			switch (sp.len) {
+			case 'l':
+				put_u64(a, (uint64_t) va_arg(ap, long));
+				break;
+			case 'q':
+				put_u64(a, (uint64_t) va_arg(ap, long long));
+				break;
+			case 'z':
+				put_u64(a, (uint64_t) va_arg(ap, size_t));
+				break;
+			case 'j':
+				put_u64(a, (uint64_t) va_arg(ap, intmax_t));
+				break;
+			case 't':
+				put_u64(a, (uint64_t) va_arg(ap, ptrdiff_t));
+				break;
+			default:
+				put_u64(a,
+				    strchr("di", sp.conv) != NULL
+				        ? (uint64_t) (int64_t) va_arg(ap, int)
+				        : (uint64_t) va_arg(ap, unsigned));
+				break;
+			}
+			break;
+		case 'p':
+			put_u64(a, (uint64_t) (uintptr_t) va_arg(ap, void *));
+			break;
+		case 's':
+			put_str(a, va_arg(ap, const char *), prec);
+			break;
+		default: {
+			double d = sp.len == 'L' ? (double) va_arg(ap, long double)
+			                         : va_arg(ap, double);
+			uint64_t v;
+			memcpy(&v, &d, sizeof(v));
+			put_u64(a, v);
+			break;
+		}
+		}
+	}
+}
+
+static log_ring *
+ring_get(void)
+{
+	log_ring *r;
+
+	if ((r = my_ring) != NULL) {
+		return (r);
+	}
+	if ((r = nni_zalloc(sizeof(*r))) == NULL) {
+		return (NULL);
+	}
+	if ((r->buf = nni_alloc(LOG_RING_SIZE)) == NULL) {
+		nni_free(r, sizeof(*r));
+		return (NULL);
+	}
+	nni_atomic_init64(&r->head);
+	nni_atomic_init64(&r->tail);
+	nni_atomic_init64(&r->dropped);
+	nni_atomic_init_bool(&r->dead);
+	nni_mtx_lock(&log_mtx);
+	r->id   = ++nrings;
+	r->next = rings;
+	rings   = r;
+	nni_mtx_unlock(&log_mtx);
+	my_ring = r;
+	return (r);
+}
+
+// Anything the thread logs later gets a new ring.
+void
+nano_log_thr_fini(void)
+{
+	if (my_ring != NULL) {
+		nni_atomic_set_bool(&my_ring->dead, true);
+		my_ring = NULL;
+	}
+}
+
+void
+nano_log_write(const nano_log_site *site, ...)
+{
+	uint8_t   args[LOG_MAX_ARGS];
+	log_args  a = { args, sizeof(args), 0 };
+	log_site *s;
+	log_ring *r;
+	log_rec   rec;
+	nni_time  now;
+	uint64_t  head, tail;
+	uint32_t  off, pad;
+	int       sec;
+	va_list   ap;
+
+	if ((s = site_get(site)) == NULL) {
+		return;
+	}
+	now = nni_clock();
+	if (rate > 0) {
+		sec = (int) (now / 1000);
+		if (nni_atomic_get(&s->second) != sec) {
+			nni_atomic_set(&s->second, sec);
+			nni_atomic_set(&s->count, 0);
+		}
+		nni_atomic_inc(&s->count);
+		if (nni_atomic_get(&s->count) > rate) {
+			nni_atomic_inc(&s->dropped);
+			return;
+		}
+	}
+	if ((r = ring_get()) == NULL) {
+		return;
+	}
+
+	va_start(ap, site);
+	copy_args(site->fmt, ap, &a);
+	va_end(ap);
+
+	rec.size  = (uint32_t) ((sizeof(rec) + a.pos + 7) & ~(size_t) 7);
+	rec.level = (uint8_t) site->level;
+	rec.site  = site;
+	rec.time  = now;
+
+	// A record is never split: past the end of the ring goes padding.
+	head = nni_atomic_get64(&r->head);
+	tail = nni_atomic_get64(&r->tail);
+	off  = (uint32_t) (head & (LOG_RING_SIZE - 1));
+	pad  = LOG_RING_SIZE - off < rec.size ? LOG_RING_SIZE - off : 0;
+	if (head + pad + rec.size - tail > LOG_RING_SIZE) {
+		nni_atomic_inc64(&r->dropped);
+		return;
+	}
+	rec.suppressed = (uint32_t) nni_atomic_swap(&s->dropped, 0);
+	if (pad > 0) {
+		// only size and level of a padding record are read
+		memcpy(r->buf + off, &pad, sizeof(pad));
+		r->buf[off + offsetof(log_rec, level)] = LOG_PAD;
+		head += pad;
+		off = 0;
+	}
+	memcpy(r->buf + off, &rec, sizeof(rec));
+	memcpy(r->buf + off + sizeof(rec), args, a.pos);
+	nni_atomic_set64(&r->head, head + rec.size);
+}
+
+static uint64_t
+get_u64(const uint8_t **p)
+{
+	uint64_t v;
+
+	memcpy(&v, *p, sizeof(v));
+	*p += sizeof(v);
+	return (v);
+}
+
+// Formats one record into buf, the way printf would have.
+static size_t
+format_rec(const log_rec *rec, char *buf, size_t size)
+{
+	const nano_log_site *site = rec->site;
+	const uint8_t *      p    = (const uint8_t *) (rec + 1);
+	const uint8_t *      end  = (const uint8_t *) rec + rec->size;
+	const char *         fmt  = site->fmt;
+	const char *         lit;
+	char                 spec[48];
+	log_spec             sp;
+	size_t               n = 0;
+	int                  k;
+
+#define LOG_PUT(...)                                                  \
+	do {                                                          \
+		k = snprintf(buf + n, size - n, __VA_ARGS__);         \
+		n = k < 0 ? n : (n + k < size ? n + k : size - 1);    \
+	} while (0)
+
+	for (lit = fmt; next_spec(&fmt, &sp); lit = fmt) {
+		int width = sp.width, prec = sp.prec;
+
+		// the literal text up to this conversion, "%%" included
+		for (const char *c = lit; *c != '\0' && c < fmt; c++) {
+			if (*c == '%') {
+				if (c[1] != '%') {
+					break;
+				}
+				c++;
+			}
+			LOG_PUT("%c", *c);
+		}
+
+		if (sp.width_arg) {
+			width = p + 8 <= end ? (int) get_u64(&p) : 0;
+		}
+		if (sp.prec_arg) {
+			prec = p + 8 <= end ? (int) get_u64(&p) : -1;
+		}
+		if (p + 8 > end) {
+			LOG_PUT("<?>");
+			continue;
+		}
+		snprintf(spec, sizeof(spec), "%%%s%s", sp.flags,
+		    width < 0 && sp.width_arg ? "-" : "");
+		if (width != -1 || sp.width_arg) {
+			snprintf(spec + strlen(spec), sizeof(spec) - strlen(spec),
+			    "%d", width < 0 ? -width : width);
+		}
+		if (prec >= 0) {
+			snprintf(spec + strlen(spec), sizeof(spec) - strlen(spec),
+			    ".%d", prec);
+		}
+
+		switch (sp.conv) {
+		case 's': {
+			uint64_t    len = get_u64(&p);
+			const char *s   = (const char *) p;
+
+			p += (len + 1 + 7) & ~(uint64_t) 7;
+			strcat(spec, "s");
+			LOG_PUT(spec, p <= end ? s : "<?>");
+			break;
+		}
+		case 'p':
+			strcat(spec, "p");
+			LOG_PUT(spec, (void *) (uintptr_t) get_u64(&p));
+			break;
+		case 'c':
+			strcat(spec, "c");
+			LOG_PUT(spec, (int) get_u64(&p));
+			break;
+		case 'd':
+		case 'i':
+		case 'o':
+		case 'u':
+		case 'x':
+		case 'X': {
+			uint64_t v = get_u64(&p);
+			size_t   l = strlen(spec);
+
+			spec[l]     = 'l';
+			spec[l + 1] = 'l';
+			spec[l + 2] = sp.conv;
+			spec[l + 3] = '\0';
+			// narrower types print as they were passed
+			if (sp.len == 0 || sp.len == 'h' || sp.len == 'H') {
+				if (strchr("di", sp.conv) != NULL) {
+					v = (uint64_t) (int64_t) (int32_t) v;
+				} else {
+					v = (uint32_t) v;
+				}
+				if (sp.len == 'h') {
+					v = strchr("di", sp.conv) != NULL
+					    ? (uint64_t) (int64_t) (int16_t) v
+					    : (uint16_t) v;
+				} else if (sp.len == 'H') {
+					v = strchr("di", sp.conv) != NULL
+					    ? (uint64_t) (int64_t) (int8_t) v
+					    : (uint8_t) v;
+				}
+			}
+			LOG_PUT(spec, (long long) v);
+			break;
+		}
+		default: {
+			double   d;
+			uint64_t v = get_u64(&p);
+			size_t   l = strlen(spec);
+
+			memcpy(&d, &v, sizeof(d));
+			spec[l]     = sp.conv;
+			spec[l + 1] = '\0';
+			LOG_PUT(spec, d);
+			break;
+		}
+		}
+	}
+	// and the text after the last one
+	for (const char *c = lit; *c != '\0'; c++) {
+		if (c[0] == '%' && c[1] == '%') {
+			c++;
+		}
+		LOG_PUT("%c", *c);
+	}
+#undef LOG_PUT
+	return (n);
+}
+
+static void
+log_emit(const char *line, size_t len, int level)
+{
+	fwrite(line, 1, len, stderr);
+	if (log_file != NULL) {
+		fwrite(line, 1, len, log_file);
+	}
+#ifdef NNG_PLATFORM_POSIX
+	if (log_syslog) {
+		static const int prio[] = { LOG_DEBUG, LOG_ERR, LOG_WARNING,
+			LOG_INFO, LOG_DEBUG, LOG_DEBUG };
+		syslog(prio[level], "%.*s", (int) len - 1, line);
+	}
+#else
+	NNI_ARG_UNUSED(level);
+#endif
+}
+
+// The wall clock time of an nni_clock reading.  Only called with
+// drain_mtx held.
+static const char *
+stamp(nni_time ms)
+{
+	static time_t last = -1;
+	static char   buf[32];
+	time_t        sec = (time_t) ((log_epoch + ms) / 1000);
+	struct tm     tm;
+
+	if (sec != last) {
+#ifdef NNG_PLATFORM_WINDOWS
+		localtime_s(&tm, &sec);
+#else
+		localtime_r(&sec, &tm);
+#endif
+		strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+		last = sec;
+	}
+	return (buf);
+}
+
+// Writes out what the ring holds.  Only called with drain_mtx held.
+static void
+ring_drain(log_ring *r)
+{
+	char     line[2048];
+	uint64_t tail = nni_atomic_get64(&r->tail);
+	uint64_t head = nni_atomic_get64(&r->head);
+	uint64_t lost;
+	nni_time now;
+	size_t   n;
+
+	while (tail < head) {
+		const log_rec *rec =
+		    (const log_rec *) (r->buf + (tail & (LOG_RING_SIZE - 1)));
+
+		if (rec->level == LOG_PAD) {
+			tail += rec->size;
+			continue;
+		}
+		n = snprintf(line, sizeof(line), "%s.%03u %-5s [%d] %s: ",
+		    stamp(rec->time), (unsigned) ((log_epoch + rec->time) % 1000),
+		    level_names[rec->level], r->id, rec->site->func);
+		if (n > sizeof(line) / 2) {
+			n = sizeof(line) / 2;
+		}
+		n += format_rec(rec, line + n, sizeof(line) - n - 48);
+		if (n > 0 && line[n - 1] == '\n') {
+			n--;
+		}
+		if (rec->suppressed > 0) {
+			n += snprintf(line + n, sizeof(line) - n,
+			    " (%u more suppressed)", rec->suppressed);
+		}
+		line[n++] = '\n';
+		log_emit(line, n, rec->level);
+		tail += rec->size;
+	}
+	nni_atomic_set64(&r->tail, tail);
+
+	if ((lost = nni_atomic_swap64(&r->dropped, 0)) > 0) {
+		now = nni_clock();
+		n   = snprintf(line, sizeof(line),
+                    "%s.%03u WARN  [%d] log: %llu messages lost, buffer full\n",
+                    stamp(now), (unsigned) ((log_epoch + now) % 1000), r->id,
+                    (unsigned long long) lost);
+		log_emit(line, n, NANO_LOG_WARN);
+	}
+}
+
+// Rings are only added at the head of the list and only removed with
+// drain_mtx held, so the list can be walked without log_mtx.
+static void
+log_drain(void)
+{
+	log_ring **rp;
+	log_ring * r;
+
+	nni_mtx_lock(&drain_mtx);
+	nni_mtx_lock(&log_mtx);
+	r = rings;
+	nni_mtx_unlock(&log_mtx);
+
+	for (; r != NULL; r = r->next) {
+		ring_drain(r);
+	}
+	fflush(stderr);
+	if (log_file != NULL) {
+		fflush(log_file);
+	}
+
+	nni_mtx_lock(&log_mtx);
+	for (rp = &rings; (r = *rp) != NULL;) {
+		if (nni_atomic_get_bool(&r->dead) &&
+		    nni_atomic_get64(&r->tail) == nni_atomic_get64(&r->head)) {
+			*rp = r->next;
+			nni_free(r->buf, LOG_RING_SIZE);
+			nni_free(r, sizeof(*r));
+			continue;
+		}
+		rp = &r->next;
+	}
+	nni_mtx_unlock(&log_mtx);
+	nni_mtx_unlock(&drain_mtx);
+}
+
+static void
+log_writer(void *arg)
+{
+	NNI_ARG_UNUSED(arg);
+
+	while (!nni_atomic_get_bool(&writer_stop)) {
+		log_drain();
+		nni_msleep(LOG_PERIOD);
+	}
+	log_drain();
+}
+
+static void
+writer_halt(void)
+{
+	bool running;
+
+	nni_mtx_lock(&log_mtx);
+	running        = writer_running;
+	writer_running = false;
+	nni_mtx_unlock(&log_mtx);
+	if (running) {
+		nni_atomic_set_bool(&writer_stop, true);
+		nni_thr_fini(&writer);
+	}
+}
+
+static void
+log_stop(void)
+{
+	writer_halt();
+	log_drain();
+}
+
+// Called from nni_init, which leaves the platform ready for threads.
+int
+nano_log_sys_init(void)
+{
+	int rv = 0;
+
+	log_once();
+	nni_mtx_lock(&log_mtx);
+	if (!writer_running &&
+	    (rv = nni_thr_init(&writer, log_writer, NULL)) == 0) {
+		nni_thr_set_name(&writer, "nng:log");
+		nni_atomic_set_bool(&writer_stop, false);
+		writer_running = true;
+		nni_thr_run(&writer);
+	}
+	nni_mtx_unlock(&log_mtx);
+	return (rv);
+}
+
+void
+nano_log_sys_fini(void)
+{
+	writer_halt();
+	log_drain();
+}
+
+void
+nano_log_flush(void)
+{
+	log_once();
+	log_drain();
+}
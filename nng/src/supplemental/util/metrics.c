@@ -0,0 +1,575 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef NNG_PLATFORM_POSIX
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "core/nng_impl.h"
+#include "nng/supplemental/util/metrics.h"
+
+#define METRIC_BUCKETS 24 // 0, base << 0 .. base << 21, and the rest
+
+// Fine buckets: 0 to 7 one each, then eight to a power of two up to
+// 2^41, and the rest in the last.
+#define METRIC_FINE_BITS 3
+#define METRIC_FINE_TOP 40
+#define METRIC_FINE \
+	((METRIC_FINE_TOP - METRIC_FINE_BITS + 2) << METRIC_FINE_BITS)
+
+#define METRIC_SAMPLE 16 // PUBLISHes per one timed
+
+typedef struct {
+	uint64_t bucket[METRIC_BUCKETS];
+	uint64_t fine[METRIC_FINE];
+	uint64_t count;
+	uint64_t sum;
+} metric_hist;
+
+typedef struct {
+	int64_t     v[NANO_METRIC_COUNT];
+	metric_hist h[NANO_HIST_COUNT];
+} metric_total;
+
+// Only the owning thread writes a shard; readers take what is there.
+typedef struct metric_shard {
+	nni_atomic_u64 v[NANO_METRIC_COUNT];
+	struct {
+		nni_atomic_u64 bucket[METRIC_BUCKETS];
+		nni_atomic_u64 fine[METRIC_FINE];
+		nni_atomic_u64 count;
+		nni_atomic_u64 sum;
+	} h[NANO_HIST_COUNT];
+	struct metric_shard *next;
+} metric_shard;
+
+static nni_atomic_int metric_state; // 0, METRIC_STARTING, METRIC_READY
+#define METRIC_STARTING 1
+#define METRIC_READY 2
+
+static nni_mtx       metric_mtx;
+static metric_shard *shards;
+static metric_total  retired; // what exited threads counted
+
+static NNI_THREAD_LOCAL metric_shard *my_shard;
+static NNI_THREAD_LOCAL uint32_t      my_sample; // calls until the next sample
+static uint32_t                       sample_every = METRIC_SAMPLE;
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static const struct {
+	const char *name;
+	const char *help;
+	uint64_t    base;
+	double      scale; // of a value, to the unit in the name
+} hists[NANO_HIST_COUNT] = {
+	[NANO_HIST_FANOUT] = { "nanomq_publish_fanout",
+	    "Subscribers a PUBLISH is sent to.", 1, 1 },
+	[NANO_HIST_LAT_DISPATCH] = { "nanomq_publish_dispatch_seconds",
+	    "Time from receiving a PUBLISH to the broker taking it up.", 1000,
+	    1e-9 },
+	[NANO_HIST_LAT_MATCH] = { "nanomq_publish_match_seconds",
+	    "Time from receiving a PUBLISH to its subscribers found.", 1000,
+	    1e-9 },
+	[NANO_HIST_LAT_DELIVER] = { "nanomq_publish_delivery_seconds",
+	    "Time from receiving a PUBLISH to writing it to a subscriber.",
+	    1000, 1e-9 },
+};
+
+typedef struct {
+	const char *name;
+	const char *type;
+	const char *help;
+	nano_metric metric;
+	const char *label; // name="value", or NULL
+} metric_row;
+
+// Rows of one name follow each other, they share the HELP and TYPE.
+static const metric_row rows[] = {
+	{ "nanomq_connections", "gauge", "Client connections open.",
+	    NANO_METRIC_CONNECTIONS, NULL },
+	{ "nanomq_connects_total", "counter", "CONNECTs accepted.",
+	    NANO_METRIC_CONNECTS, NULL },
+	{ "nanomq_connects_refused_total", "counter", "CONNECTs refused.",
+	    NANO_METRIC_REFUSED_BUSY, "reason=\"busy\"" },
+	{ "nanomq_connects_refused_total", "counter", NULL,
+	    NANO_METRIC_REFUSED_BAD, "reason=\"malformed\"" },
+	{ "nanomq_received_bytes_total", "counter",
+	    "Bytes of MQTT packets received.", NANO_METRIC_BYTES_IN, NULL },
+	{ "nanomq_sent_bytes_total", "counter", "Bytes of MQTT packets sent.",
+	    NANO_METRIC_BYTES_OUT, NULL },
+	{ "nanomq_subscriptions", "gauge",
+	    "Topic filters subscribed to, per client.",
+	    NANO_METRIC_SUBSCRIPTIONS, NULL },
+	{ "nanomq_retained_messages", "gauge", "Retained messages.",
+	    NANO_METRIC_RETAINED, NULL },
+	{ "nanomq_send_queue_messages", "gauge",
+	    "Messages waiting in subscriber send queues.",
+	    NANO_METRIC_SQ_MSGS, NULL },
+	{ "nanomq_send_queue_bytes", "gauge",
+	    "Bytes waiting in subscriber send queues.", NANO_METRIC_SQ_BYTES,
+	    NULL },
+	{ "nanomq_inflight_messages", "gauge",
+	    "QoS 1 and 2 messages sent and not yet acknowledged.",
+	    NANO_METRIC_INFLIGHT, NULL },
+	{ "nanomq_messages_dropped_total", "counter",
+	    "QoS 0 messages not sent to a subscriber.",
+	    NANO_METRIC_DROP_SQ_FULL, "reason=\"queue_full\"" },
+	{ "nanomq_messages_dropped_total", "counter", NULL,
+	    NANO_METRIC_DROP_CONFLATED, "reason=\"conflated\"" },
+	{ "nanomq_slow_subscribers_closed_total", "counter",
+	    "Subscribers disconnected for a send queue full too long.",
+	    NANO_METRIC_SLOW_CLOSED, NULL },
+	{ "nanomq_retransmits_total", "counter",
+	    "QoS 1 and 2 messages sent again for want of an acknowledgement.",
+	    NANO_METRIC_RETRIES, NULL },
+	{ "nanomq_memory_bytes", "gauge", "Memory in use, by what for.",
+	    NANO_METRIC_MEM_MSG, "category=\"messages\"" },
+	{ "nanomq_memory_bytes", "gauge", NULL, NANO_METRIC_MEM_POOL,
+	    "category=\"message_pool\"" },
+	{ "nanomq_memory_bytes", "gauge", NULL, NANO_METRIC_MEM_RETAINED,
+	    "category=\"retained\"" },
+};
+
+static const char *packet_types[16] = { NULL, "connect", "connack",
+	"publish", "puback", "pubrec", "pubrel", "pubcomp", "subscribe",
+	"suback", "unsubscribe", "unsuback", "pingreq", "pingresp",
+	"disconnect", "auth" };
+
+static void
+hist_add(metric_total *d, metric_shard *s, int i)
+{
+	metric_hist *h = &d->h[i];
+
+	for (int b = 0; b < METRIC_BUCKETS; b++) {
+		h->bucket[b] += nni_atomic_get64(&s->h[i].bucket[b]);
+	}
+	for (int b = 0; b < METRIC_FINE; b++) {
+		h->fine[b] += nni_atomic_get64(&s->h[i].fine[b]);
+	}
+	h->count += nni_atomic_get64(&s->h[i].count);
+	h->sum += nni_atomic_get64(&s->h[i].sum);
+}
+
+static void
+shard_add(metric_total *dst, metric_shard *src)
+{
+	for (int i = 0; i < NANO_METRIC_COUNT; i++) {
+		dst->v[i] += (int64_t) nni_atomic_get64(&src->v[i]);
+	}
+	for (int i = 0; i < NANO_HIST_COUNT; i++) {
+		hist_add(dst, src, i);
+	}
+}
+
+// The calling thread's counts go to retired and its shard away.
+void
+nano_metric_thr_fini(void)
+{
+	metric_shard * s = my_shard;
+	metric_shard **sp;
+
+	if (s == NULL) {
+		return;
+	}
+	my_shard = NULL;
+	nni_mtx_lock(&metric_mtx);
+	for (sp = &shards; *sp != s; sp = &(*sp)->next) {
+		;
+	}
+	*sp = s->next;
+	shard_add(&retired, s);
+	nni_mtx_unlock(&metric_mtx);
+	nni_free(s, sizeof(*s));
+}
+
+static void
+metric_init(void)
+{
+	const char *env;
+
+	nni_mtx_init(&metric_mtx);
+	if ((env = getenv("NANOMQ_LATENCY_SAMPLE")) != NULL) {
+		sample_every = (uint32_t) atoi(env);
+	}
+}
+
+// Counting may start before nni_init, so this cannot wait for it.
+static void
+metric_once(void)
+{
+	if (nni_atomic_get(&metric_state) == METRIC_READY) {
+		return;
+	}
+	if (nni_atomic_cas(&metric_state, 0, METRIC_STARTING)) {
+		metric_init();
+		nni_atomic_set(&metric_state, METRIC_READY);
+		return;
+	}
+	while (nni_atomic_get(&metric_state) != METRIC_READY) {
+		nni_msleep(1);
+	}
+}
+
+static metric_shard *
+shard_get(void)
+{
+	metric_shard *s;
+
+	if ((s = my_shard) != NULL) {
+		return (s);
+	}
+	if ((s = nni_zalloc(sizeof(*s))) == NULL) {
+		return (NULL);
+	}
+	for (int i = 0; i < NANO_METRIC_COUNT; i++) {
+		nni_atomic_init64(&s->v[i]);
+	}
+	for (int i = 0; i < NANO_HIST_COUNT; i++) {
+		for (int b = 0; b < METRIC_BUCKETS; b++) {
+			nni_atomic_init64(&s->h[i].bucket[b]);
+		}
+		for (int b = 0; b < METRIC_FINE; b++) {
+			nni_atomic_init64(&s->h[i].fine[b]);
+		}
+		nni_atomic_init64(&s->h[i].count);
+		nni_atomic_init64(&s->h[i].sum);
+	}
+	metric_once();
+	nni_mtx_lock(&metric_mtx);
+	s->next = shards;
+	shards  = s;
+	nni_mtx_unlock(&metric_mtx);
+	my_shard = s;
+	return (s);
+}
+
+void
+nano_metric_add(nano_metric m, int64_t delta)
+{
+	metric_shard *s;
+
+	if ((s = shard_get()) != NULL) {
+		nni_atomic_add64(&s->v[m], (uint64_t) delta);
+	}
+}
+
+// The number of the highest bit set in v, which is not 0.
+static int
+metric_log2(uint64_t v)
+{
+	int n = 0;
+
+	for (int shift = 32; shift > 0; shift >>= 1) {
+		if ((v >> shift) != 0) {
+			v >>= shift;
+			n += shift;
+		}
+	}
+	return (n);
+}
+
+static int
+fine_index(uint64_t v)
+{
+	int e;
+
+	if (v < (1 << METRIC_FINE_BITS)) {
+		return ((int) v);
+	}
+	if ((e = metric_log2(v)) > METRIC_FINE_TOP) {
+		return (METRIC_FINE - 1);
+	}
+	return (((e - METRIC_FINE_BITS + 1) << METRIC_FINE_BITS) +
+	    (int) ((v >> (e - METRIC_FINE_BITS)) &
+	        ((1 << METRIC_FINE_BITS) - 1)));
+}
+
+// The lowest value of fine bucket i, and how many values it has.
+static void
+fine_range(int i, uint64_t *lo, uint64_t *width)
+{
+	int e   = (i >> METRIC_FINE_BITS) + METRIC_FINE_BITS - 1;
+	int sub = i & ((1 << METRIC_FINE_BITS) - 1);
+
+	if (i < (1 << METRIC_FINE_BITS)) {
+		*lo    = (uint64_t) i;
+		*width = 1;
+		return;
+	}
+	*lo    = (uint64_t) ((1 << METRIC_FINE_BITS) + sub)
+	    << (e - METRIC_FINE_BITS);
+	*width = (uint64_t) 1 << (e - METRIC_FINE_BITS);
+}
+
+void
+nano_metric_observe(nano_histogram which, uint64_t v)
+{
+	metric_shard *s;
+	uint64_t      q = (v + hists[which].base - 1) / hists[which].base;
+	int           b;
+
+	if ((s = shard_get()) == NULL) {
+		return;
+	}
+	if (v == 0) {
+		b = 0;
+	} else {
+		b = 1 + (q <= 1 ? 0 : metric_log2(q - 1) + 1);
+		if (b >= METRIC_BUCKETS) {
+			b = METRIC_BUCKETS - 1;
+		}
+	}
+	nni_atomic_inc64(&s->h[which].bucket[b]);
+	nni_atomic_inc64(&s->h[which].fine[fine_index(v)]);
+	nni_atomic_inc64(&s->h[which].count);
+	nni_atomic_add64(&s->h[which].sum, v);
+}
+
+static void
+metric_sum(metric_total *total)
+{
+	metric_once();
+	nni_mtx_lock(&metric_mtx);
+	*total = retired;
+	for (metric_shard *s = shards; s != NULL; s = s->next) {
+		shard_add(total, s);
+	}
+	nni_mtx_unlock(&metric_mtx);
+}
+
+int64_t
+nano_metric_get(nano_metric m)
+{
+	int64_t v;
+
+	metric_once();
+	nni_mtx_lock(&metric_mtx);
+	v = retired.v[m];
+	for (metric_shard *s = shards; s != NULL; s = s->next) {
+		v += (int64_t) nni_atomic_get64(&s->v[m]);
+	}
+	nni_mtx_unlock(&metric_mtx);
+	return (v);
+}
+
+// Where the rank ceil(q * count) observation falls, taking the
+// observations of a fine bucket to be spread evenly across it.
+static uint64_t
+hist_quantile(const metric_hist *h, double q)
+{
+	uint64_t rank, cum = 0, lo, width;
+
+	if (h->count == 0) {
+		return (0);
+	}
+	rank = (uint64_t) (q * (double) h->count + 0.999999);
+	if (rank < 1) {
+		rank = 1;
+	} else if (rank > h->count) {
+		rank = h->count;
+	}
+	for (int i = 0; i < METRIC_FINE; i++) {
+		if (cum + h->fine[i] >= rank) {
+			fine_range(i, &lo, &width);
+			return (lo + (width * (rank - cum) - 1) / h->fine[i]);
+		}
+		cum += h->fine[i];
+	}
+	return (h->sum / h->count); // readers raced the writers
+}
+
+uint64_t
+nano_metric_quantile(nano_histogram which, double q)
+{
+	metric_total t;
+
+	metric_once();
+	nni_mtx_lock(&metric_mtx);
+	t.h[which] = retired.h[which];
+	for (metric_shard *s = shards; s != NULL; s = s->next) {
+		hist_add(&t, s, which);
+	}
+	nni_mtx_unlock(&metric_mtx);
+	return (hist_quantile(&t.h[which], q));
+}
+
+bool
+nano_metric_sample(void)
+{
+	if (my_sample > 0) {
+		my_sample--;
+		return (false);
+	}
+	metric_once();
+	if (sample_every == 0) {
+		my_sample = UINT32_MAX;
+		return (false);
+	}
+	my_sample = sample_every - 1;
+	return (true);
+}
+
+// nni_clock only has milliseconds, too coarse for a PUBLISH going
+// through; where there is no finer clock, that is what there is.
+uint64_t
+nano_metric_clock(void)
+{
+#ifdef NNG_PLATFORM_POSIX
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec + 1);
+#else
+	return ((uint64_t) nni_clock() * 1000000 + 1);
+#endif
+}
+
+typedef struct {
+	char * buf;
+	size_t size;
+	size_t len; // as if buf were big enough
+} metric_out;
+
+static void
+out_put(metric_out *o, const char *fmt, ...)
+{
+	va_list ap;
+	int     n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(o->buf + (o->len < o->size ? o->len : o->size),
+	    o->len < o->size ? o->size - o->len : 0, fmt, ap);
+	va_end(ap);
+	if (n > 0) {
+		o->len += (size_t) n;
+	}
+}
+
+static void
+out_head(metric_out *o, const char *name, const char *type, const char *help)
+{
+	out_put(o, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void
+out_hist(metric_out *o, int which, const metric_hist *h)
+{
+	const char *name  = hists[which].name;
+	double      scale = hists[which].scale;
+	uint64_t    cum   = 0;
+
+	out_head(o, name, "histogram", hists[which].help);
+	for (int b = 0; b < METRIC_BUCKETS - 1; b++) {
+		double le = b == 0 ? 0 : (double) (hists[which].base << (b - 1));
+
+		cum += h->bucket[b];
+		out_put(o, "%s_bucket{le=\"%.10g\"} %llu\n", name, le * scale,
+		    (unsigned long long) cum);
+	}
+	cum += h->bucket[METRIC_BUCKETS - 1];
+	out_put(o, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+	    (unsigned long long) cum);
+	out_put(o, "%s_sum %.17g\n%s_count %llu\n", name,
+	    (double) h->sum * scale, name, (unsigned long long) h->count);
+}
+
+// Quantiles go in a gauge of their own: a histogram may not have them.
+static void
+out_quantiles(metric_out *o, int which, const metric_hist *h)
+{
+	const char *name  = hists[which].name;
+	double      scale = hists[which].scale;
+
+	out_put(o, "# HELP %s_quantile %s Quantiles.\n", name,
+	    hists[which].help);
+	out_put(o, "# TYPE %s_quantile gauge\n", name);
+	for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+		out_put(o, "%s_quantile{quantile=\"%g\"} %.10g\n", name,
+		    quantiles[i], (double) hist_quantile(h, quantiles[i]) * scale);
+	}
+}
+
+// Resident set size, where /proc has it.
+static void
+out_rss(metric_out *o)
+{
+#ifdef NNG_PLATFORM_LINUX
+	FILE *             f;
+	unsigned long long size, rss;
+
+	if ((f = fopen("/proc/self/statm", "r")) == NULL) {
+		return;
+	}
+	if (fscanf(f, "%llu %llu", &size, &rss) == 2) {
+		out_head(o, "process_resident_memory_bytes", "gauge",
+		    "Resident memory size in bytes.");
+		out_put(o, "process_resident_memory_bytes %llu\n",
+		    rss * (unsigned long long) sysconf(_SC_PAGESIZE));
+	}
+	fclose(f);
+#else
+	NNI_ARG_UNUSED(o);
+#endif
+}
+
+size_t
+nano_metrics_format(char *buf, size_t size)
+{
+	metric_out   o = { buf, size, 0 };
+	metric_total total;
+
+	metric_sum(&total);
+	if (size > 0) {
+		buf[0] = '\0';
+	}
+
+	for (size_t i = 0; i < sizeof(rows) / sizeof(rows[0]); i++) {
+		const metric_row *r = &rows[i];
+
+		if (r->help != NULL) {
+			out_head(&o, r->name, r->type, r->help);
+		}
+		if (r->label != NULL) {
+			out_put(&o, "%s{%s} %lld\n", r->name, r->label,
+			    (long long) total.v[r->metric]);
+		} else {
+			out_put(&o, "%s %lld\n", r->name,
+			    (long long) total.v[r->metric]);
+		}
+	}
+
+	out_head(&o, "nanomq_packets_received_total", "counter",
+	    "MQTT packets received, by type.");
+	for (int t = 1; t < 16; t++) {
+		out_put(&o, "nanomq_packets_received_total{type=\"%s\"} %lld\n",
+		    packet_types[t],
+		    (long long) total.v[NANO_METRIC_PACKETS_IN + t]);
+	}
+	out_head(&o, "nanomq_packets_sent_total", "counter",
+	    "MQTT packets sent, by type.");
+	for (int t = 1; t < 16; t++) {
+		out_put(&o, "nanomq_packets_sent_total{type=\"%s\"} %lld\n",
+		    packet_types[t],
+		    (long long) total.v[NANO_METRIC_PACKETS_OUT + t]);
+	}
+
+	for (int i = 0; i < NANO_HIST_COUNT; i++) {
+		out_hist(&o, i, &total.h[i]);
+		out_quantiles(&o, i, &total.h[i]);
+	}
+	out_rss(&o);
+	return (o.len);
+}
@@ -664,7 +664,11 @@ ws_write_cb(void *arg)
 	}
 
 	if (aio != NULL) {
-		nni_aio_iov_advance(aio, frame->len);
+		// Stream senders advance their own iov from the count, as
+		// with the read side; only message mode consumes it here.
+		if (!ws->isstream) {
+			nni_aio_iov_advance(aio, frame->len);
+		}
 		nni_aio_bump_count(aio, frame->len);
 		if (frame->final) {
 			frame->aio = NULL;
@@ -829,6 +833,7 @@ ws_read_finish_str(nni_ws *ws)
 	for (;;) {
 		nni_aio * aio;
 		nni_iov * iov;
+		nni_iov   iovs[8];
 		unsigned  niov;
 		ws_frame *frame;
 
@@ -851,6 +856,14 @@ ws_read_finish_str(nni_ws *ws)
 		nni_aio_list_remove(aio);
 		nni_aio_get_iov(aio, &niov, &iov);
 
+		// Walk a private copy of the iov, leaving the aio's own
+		// vector untouched.  Like any other nng_stream, callers
+		// advance it themselves from the returned count; consuming
+		// it here too would advance it twice.
+		NNI_ASSERT(niov <= NNI_NUM_ELEMENTS(iovs));
+		memcpy(iovs, iov, niov * sizeof(nni_iov));
+		iov = iovs;
+
 		while ((frame != NULL) && (niov != 0)) {
 			size_t n;
 
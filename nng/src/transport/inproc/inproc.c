@@ -42,6 +42,7 @@ struct inproc_queue {
 	nni_list writers;
 	nni_mtx  lock;
 	bool     closed;
+	bool     mqtt;
 };
 
 // inproc_pair represents a pair of pipes.  Because we control both
@@ -54,6 +55,7 @@ struct inproc_pair {
 struct inproc_ep {
 	const char *  addr;
 	bool          listener;
+	bool          mqtt;
 	nni_list_node node;
 	uint16_t      proto;
 	nni_cv        cv;
@@ -176,11 +178,18 @@ inproc_queue_run(inproc_queue *queue)
 		// Now the receive side.  We need to ensure that we have
 		// an exclusive copy of the message, and pull the header
 		// up into the body to match protocol expectations.
-		if ((pu = nni_msg_pull_up(msg)) == NULL) {
-			nni_msg_free(msg);
+		// MQTT peers keep the fixed header apart from the body,
+		// along with the decoded packet fields, so the message is
+		// handed over as is, only copied if a fan-out shares it.
+		if (!queue->mqtt) {
+			if ((pu = nni_msg_pull_up(msg)) == NULL) {
+				nni_msg_free(msg);
+				continue;
+			}
+			msg = pu;
+		} else if ((msg = nni_msg_unique(msg)) == NULL) {
 			continue;
 		}
-		msg = pu;
 
 		nni_aio_list_remove(rd);
 		nni_aio_set_msg(rd, msg);
@@ -298,6 +307,7 @@ inproc_dialer_init(void **epp, nni_url *url, nni_dialer *ndialer)
 	nni_aio_list_init(&ep->aios);
 
 	ep->addr = url->u_rawurl; // we match on the full URL.
+	ep->mqtt = (strcmp(url->u_scheme, "mqtt+inproc") == 0);
 
 	*epp = ep;
 	return (0);
@@ -321,6 +331,7 @@ inproc_listener_init(void **epp, nni_url *url, nni_listener *nlistener)
 	nni_aio_list_init(&ep->aios);
 
 	ep->addr = url->u_rawurl; // we match on the full URL.
+	ep->mqtt = (strcmp(url->u_scheme, "mqtt+inproc") == 0);
 
 	*epp = ep;
 	return (0);
@@ -409,6 +420,7 @@ inproc_accept_clients(inproc_ep *srv)
 				nni_aio_list_init(&pair->queues[i].readers);
 				nni_aio_list_init(&pair->queues[i].writers);
 				nni_mtx_init(&pair->queues[i].lock);
+				pair->queues[i].mqtt = srv->mqtt;
 			}
 			nni_atomic_init(&pair->ref);
 			nni_atomic_set(&pair->ref, 2);
@@ -716,8 +728,39 @@ struct nni_tran nni_inproc_tran = {
 	.tran_checkopt = inproc_checkopt,
 };
 
+static int
+mqtt_inproc_init(void)
+{
+	// Shares the global rendezvous state set up by inproc_init.
+	return (0);
+}
+
+static void
+mqtt_inproc_fini(void)
+{
+}
+
+// mqtt+inproc:// -- in-process MQTT clients of an embedded broker.  Same
+// rendezvous and queues as inproc://, but messages keep their MQTT layout
+// (fixed header, body and decoded packet fields) from end to end.
+static struct nni_tran mqtt_inproc_tran = {
+	.tran_version  = NNI_TRANSPORT_VERSION,
+	.tran_scheme   = "mqtt+inproc",
+	.tran_dialer   = &inproc_dialer_ops,
+	.tran_listener = &inproc_listener_ops,
+	.tran_pipe     = &inproc_pipe_ops,
+	.tran_init     = mqtt_inproc_init,
+	.tran_fini     = mqtt_inproc_fini,
+	.tran_checkopt = inproc_checkopt,
+};
+
 int
 nng_inproc_register(void)
 {
-	return (nni_tran_register(&nni_inproc_tran));
+	int rv;
+	if (((rv = nni_tran_register(&nni_inproc_tran)) != 0) ||
+	    ((rv = nni_tran_register(&mqtt_inproc_tran)) != 0)) {
+		return (rv);
+	}
+	return (0);
 }
@@ -11,6 +11,11 @@
 #include "core/nng_impl.h"
 #include "nng/protocol/mqtt/mqtt_parser.h"
 #include "nng/protocol/mqtt/mqtt.h"
+#include "nng/supplemental/util/metrics.h"
+#include "nng/supplemental/util/probe.h"
+#ifdef NNG_TRANSPORT_WS
+#include "supplemental/websocket/websocket.h"
+#endif
 
 
 // TCP transport.   Platform specific TCP operations must be
@@ -19,10 +24,39 @@
 typedef struct tcptran_pipe tcptran_pipe;
 typedef struct tcptran_ep   tcptran_ep;
 
+// Keepalive.  Each pipe stamps the time of its last read, and a pipe silent
+// for 1.5 times its CONNECT keepalive is closed.  Rather than a timer per
+// connection, pipes sit in a coarse timing wheel (one slot per tick) keyed
+// by their deadline.  A tick only walks the slot that just came due, so its
+// cost follows the pipes that may have expired, not the connection count.
+#define NANO_KA_TICK 1000       // msec per wheel slot
+#define NANO_KA_WHEEL_SLOTS 128 // one revolution ~2 min; longer waits re-file
+
+// Admission control.  Connections over NANO_OPT_CONN_RATE, or arriving while
+// NANO_OPT_NEGO_MAX are already negotiating, still get their CONNECT read,
+// but are answered with a refusing CONNACK and closed instead of joining
+// the socket.  Past twice the negotiation bound they are dropped unread.
+#define NANO_NEGO_TIMEOUT 15000  // msec, abide with emqx
+#define NANO_REJECT_TIMEOUT 2000 // msec, to read the CONNECT we refuse
+
+// Packets larger than this are read in pieces, the buffer doubling as data
+// arrives, so a peer is only ever holding memory for bytes it has sent and
+// not for whatever remaining length it announced.
+#ifndef NNG_TCP_RECV_CHUNK
+#define NNG_TCP_RECV_CHUNK 65536
+#endif
+
+// The CONNECT packet is read whole before there is a pipe to hand it to.
+// One that does not fit in rxlen gets a buffer of its own, up to this size;
+// longer ones are refused.
+#ifndef NNG_TCP_CONNECT_MAX
+#define NNG_TCP_CONNECT_MAX 65536
+#endif
+
 // tcp_pipe is one end of a TCP connection.
 struct tcptran_pipe {
 	nng_stream *    conn;
-	//nni_pipe *      npipe;	// for statitical
+	nni_pipe *      npipe;
 	//uint16_t        peer;		//reserved for MQTT sdk version
 	//uint16_t        proto;
 	size_t          rcvmax;
@@ -33,6 +67,8 @@ struct tcptran_pipe {
 	nni_reap_item   reap;
 	uint8_t         txlen[NANO_MIN_PACKET_LEN];
 	uint8_t         rxlen[NANO_MAX_PACKET_LEN];
+	uint8_t *       rxconn;   // CONNECT too long for rxlen
+	size_t          rxconnsz;
 	size_t          gottxhead;
 	size_t          gotrxhead;
 	size_t          wanttxhead;
@@ -46,6 +82,11 @@ struct tcptran_pipe {
 	nni_mtx         mtx;
 	//uint32_t      remain_len;
 	conn_param *    tcp_cparam;
+	nni_list_node   kanode;  // keepalive wheel slot
+	nni_time        karecv;  // last time anything was read
+	nni_duration    kaidle;  // max silence allowed, 0 for none
+	bool            kaexpired;
+	uint8_t         reject; // MQTT v5 reason code to refuse CONNECT with
 	//uint8_t       sli_win[5];	//use aio multiple times instead of seperating 2 packets manually
 };
 
@@ -69,6 +110,16 @@ struct tcptran_ep {
 	nni_reap_item        reap;
 	//nng_stream_dialer *  dialer;
 	nng_stream_listener *listener;
+	nni_aio *            kaaio;   // keepalive wheel tick
+	nni_list             kawheel[NANO_KA_WHEEL_SLOTS];
+	uint64_t             katick;  // next tick to sweep
+	int                  kacount; // pipes in the wheel
+	bool                 karunning;
+	int                  nnego;    // pipes in negopipes
+	int                  negomax;  // 0 for unbounded
+	int                  connrate; // per second, 0 for unlimited
+	uint64_t             ratecredit; // token bucket, 1000 per connection
+	nni_time             ratetime;
 #ifdef NNG_ENABLE_STATS
        nni_stat_item 	     st_rcv_max;
 #endif
@@ -80,6 +131,7 @@ static void tcptran_pipe_send_cb(void *);
 static void tcptran_pipe_recv_cb(void *);
 static void tcptran_pipe_nego_cb(void *);
 static void tcptran_ep_fini(void *);
+static void tcptran_ka_cb(void *);
 
 static int
 tcptran_init(void)
@@ -106,7 +158,7 @@ tcptran_pipe_close(void *arg)
 	nni_aio_close(p->negoaio);
 
 	nng_stream_close(p->conn);
-	debug_syslog("tcptran_pipe_close\n");
+	debug_msg("tcptran_pipe_close\n");
 }
 
 static void
@@ -123,7 +175,7 @@ static int
 tcptran_pipe_init(void *arg, nni_pipe *npipe)
 {
 	tcptran_pipe *p = arg;
-	//p->npipe        = npipe;
+	p->npipe        = npipe;
 
 	return (0);
 }
@@ -138,6 +190,10 @@ tcptran_pipe_fini(void *arg)
 	if ((ep = p->ep) != NULL) {
 		nni_mtx_lock(&ep->mtx);
 		nni_list_node_remove(&p->node);
+		if (nni_list_node_active(&p->kanode)) {
+			nni_list_node_remove(&p->kanode);
+			ep->kacount--;
+		}
 		ep->refcnt--;
 		if (ep->fini && (ep->refcnt == 0)) {
 			nni_reap(&ep->reap, tcptran_ep_fini, ep);
@@ -150,6 +206,9 @@ tcptran_pipe_fini(void *arg)
 	nni_aio_free(p->negoaio);
 	nng_stream_free(p->conn);
 	nni_msg_free(p->rxmsg);
+	if (p->rxconn != NULL) {
+		nni_free(p->rxconn, p->rxconnsz);
+	}
 	nni_mtx_fini(&p->mtx);
 	NNI_FREE_STRUCT(p);
 }
@@ -191,6 +250,102 @@ tcptran_pipe_alloc(tcptran_pipe **pipep)
 	return (0);
 }
 
+// Called with ep->mtx held.
+static void
+tcptran_ka_file(tcptran_ep *ep, tcptran_pipe *p, nni_time deadline)
+{
+	uint64_t tick = deadline / NANO_KA_TICK;
+
+	// Never file into a slot already swept this revolution.
+	if (tick < ep->katick) {
+		tick = ep->katick;
+	}
+	nni_list_append(&ep->kawheel[tick % NANO_KA_WHEEL_SLOTS], p);
+}
+
+// Called with ep->mtx held, once the pipe has completed CONNECT.
+static void
+tcptran_ka_start(tcptran_ep *ep, tcptran_pipe *p)
+{
+	uint16_t keepalive = p->tcp_cparam->keepalive_mqtt;
+
+	if (keepalive == 0) {
+		return; // MQTT: zero turns the keepalive mechanism off
+	}
+	p->kaidle = (nni_duration) keepalive * 1500;
+	p->karecv = nni_clock();
+	ep->kacount++;
+	if (!ep->karunning) {
+		ep->karunning = true;
+		ep->katick    = p->karecv / NANO_KA_TICK;
+		nni_sleep_aio(NANO_KA_TICK, ep->kaaio);
+	}
+	tcptran_ka_file(ep, p, p->karecv + p->kaidle);
+}
+
+// Sweep the slots that came due since the last tick.  Pipes heard from in
+// the meantime move on to the slot of their new deadline; the rest are
+// closed, see tcptran_pipe_recv_cb for the DISCONNECT handed up for them.
+static void
+tcptran_ka_cb(void *arg)
+{
+	tcptran_ep *  ep = arg;
+	tcptran_pipe *p;
+	nni_list      due;
+	nni_time      now, deadline;
+	uint64_t      tick;
+	int           n;
+
+	if (nni_aio_result(ep->kaaio) != 0) {
+		return;
+	}
+	NNI_LIST_INIT(&due, tcptran_pipe, kanode);
+	now  = nni_clock();
+	tick = now / NANO_KA_TICK;
+
+	nni_mtx_lock(&ep->mtx);
+	if (ep->closed) {
+		nni_mtx_unlock(&ep->mtx);
+		return;
+	}
+	// After a stall longer than a revolution every slot is due once.
+	for (n = 0; (ep->katick <= tick) && (n < NANO_KA_WHEEL_SLOTS); n++) {
+		nni_list *slot = &ep->kawheel[ep->katick % NANO_KA_WHEEL_SLOTS];
+
+		while ((p = nni_list_first(slot)) != NULL) {
+			nni_list_remove(slot, p);
+			nni_list_append(&due, p);
+		}
+		ep->katick++;
+	}
+	ep->katick = tick + 1;
+
+	while ((p = nni_list_first(&due)) != NULL) {
+		nni_list_remove(&due, p);
+		nni_mtx_lock(&p->mtx);
+		deadline = p->karecv + p->kaidle;
+		if (deadline > now) {
+			nni_mtx_unlock(&p->mtx);
+			tcptran_ka_file(ep, p, deadline);
+			continue;
+		}
+		debug_msg("keepalive expired pipe %p idle %d ms", p,
+		    (int) (now - p->karecv));
+		ep->kacount--;
+		p->kaexpired = true;
+		nni_mtx_unlock(&p->mtx);
+		// Fails the pending read, or the next one if a packet
+		// just completed.
+		nng_stream_close(p->conn);
+	}
+	if (ep->kacount > 0) {
+		nni_sleep_aio(NANO_KA_TICK, ep->kaaio);
+	} else {
+		ep->karunning = false;
+	}
+	nni_mtx_unlock(&ep->mtx);
+}
+
 static void
 tcptran_ep_match(tcptran_ep *ep)
 {
@@ -205,6 +360,7 @@ tcptran_ep_match(tcptran_ep *ep)
 	nni_list_append(&ep->busypipes, p);
 	ep->useraio = NULL;
 	p->rcvmax   = ep->rcvmax;
+	tcptran_ka_start(ep, p);
 	nni_aio_set_output(aio, 0, p);
 	nni_aio_finish(aio, 0, 0);
 }
@@ -227,7 +383,7 @@ tcptran_pipe_nego_cb(void *arg)
 	uint32_t      len;
 	int           rv,pos;
 
-	debug_msg("start tcptran_pipe_nego_cb max len %d pipe_addr %p\n",
+	debug_msg("start tcptran_pipe_nego_cb max len %lu pipe_addr %p\n",
 		  NANO_CONNECT_PACKET_LEN, p);
 	nni_mtx_lock(&ep->mtx);
 
@@ -249,28 +405,42 @@ tcptran_pipe_nego_cb(void *arg)
 		return;
 	}*/
 
-	debug_msg("current header : gottx %d gotrx %d needrx %d needtx %d\n",p->gottxhead, p->gotrxhead, p->wantrxhead, p->wanttxhead);
+	debug_msg("current header : gottx %zu gotrx %zu needrx %zu needtx %zu\n",p->gottxhead, p->gotrxhead, p->wantrxhead, p->wanttxhead);
 	if (p->gotrxhead >= EMQ_MAX_FIXED_HEADER_LEN && p->gottxhead < p->wanttxhead) {
 		pos = 1;
 		if (p->rxlen[0] != CMD_CONNECT) {
 			debug_msg("CMD TYPE %x", p->rxlen[0]);
+			nano_metric_add(NANO_METRIC_REFUSED_BAD, 1);
 			rv = NNG_EPROTO;		//in nng error return value must be defined. TODO inject EMQ error enum into NNG? 
 			goto error;
 		}
 		len = get_var_integer(p->rxlen, &pos);
 		debug_msg("CMD TYPE %x REMAINING LENGTH %d", p->rxlen[0], len);
-		p->wantrxhead = len + 2;
+		if (len > (uint32_t) (NNG_TCP_CONNECT_MAX - pos)) {
+			nano_metric_add(NANO_METRIC_REFUSED_BAD, 1);
+			rv = NNG_EMSGSIZE;
+			goto error;
+		}
+		p->wantrxhead = len + pos;
+		if (p->wantrxhead > sizeof(p->rxlen) && p->rxconn == NULL) {
+			if ((p->rxconn = nni_alloc(p->wantrxhead)) == NULL) {
+				rv = NNG_ENOMEM;
+				goto error;
+			}
+			p->rxconnsz = p->wantrxhead;
+			memcpy(p->rxconn, p->rxlen, p->gotrxhead);
+		}
 	}
 
 	//after fixed header but not receive complete Header. continue receving variable header; in case wantrxhead set less than EMQ_FIXED_HEADER_LEN(BUG)
 	if (p->gotrxhead < p->wantrxhead || p->gotrxhead < EMQ_MAX_FIXED_HEADER_LEN) {
 		nni_iov iov;
 		iov.iov_len = p->wantrxhead - p->gotrxhead;
-		iov.iov_buf = &p->rxlen[p->gotrxhead];
+		iov.iov_buf = (p->rxconn != NULL ? p->rxconn : p->rxlen) + p->gotrxhead;
 		nni_aio_set_iov(aio, 1, &iov);
 		nng_stream_recv(p->conn, aio);
 		nni_mtx_unlock(&ep->mtx);
-		debug_msg("fixed header : gottx %d gotrx %d needrx %d needtx %d CONNECT Need more bytes msg: str: %s hex: %x %x\n", p->gottxhead, p->gotrxhead, p->wantrxhead, p->wanttxhead, &p->rxlen, p->rxlen[0], p->rxlen[1]);
+		debug_msg("fixed header : gottx %zu gotrx %zu needrx %zu needtx %zu CONNECT Need more bytes msg: hex: %x %x\n", p->gottxhead, p->gotrxhead, p->wantrxhead, p->wanttxhead, p->rxlen[0], p->rxlen[1]);
 		return;
 	}
 
@@ -279,20 +449,38 @@ tcptran_pipe_nego_cb(void *arg)
 // 	}
 
 	// We have both sent and received the CONNECT headers.  Lets check TODO CONNECT packet serialization
-	debug_msg("******** %d %d %d %d nego msg: %s ----- %x\n",p->gottxhead, p->gotrxhead, p->wantrxhead, p->wanttxhead, p->rxlen, p->rxlen[0]);
+	debug_msg("******** %zu %zu %zu %zu nego msg: %x\n",p->gottxhead, p->gotrxhead, p->wantrxhead, p->wanttxhead, p->rxlen[0]);
 	//header_adaptor();
 
 	//reply error/CONNECT ACK
 	if (p->gottxhead < p->wanttxhead && p->gotrxhead >= p->wantrxhead) {
 		nni_iov iov;
-		p->tcp_cparam = nng_alloc(sizeof(struct conn_param));
-		if (conn_handler(p->rxlen, p->tcp_cparam) > 0) {
+		if ((p->tcp_cparam = nng_alloc(sizeof(struct conn_param))) == NULL) {
+			rv = NNG_ENOMEM;
+			goto error;
+		}
+		rv = conn_handler(p->rxconn != NULL ? p->rxconn : p->rxlen, p->tcp_cparam);
+		if (p->rxconn != NULL) {
+			nni_free(p->rxconn, p->rxconnsz);
+			p->rxconn = NULL;
+		}
+		if (rv > 0) {
 			if (p->tcp_cparam->pro_ver == PROTOCOL_VERSION_v5) {
 				p->wanttxhead += 1;
 				// p->gottxhead += 1;
 				p->txlen[1] = 3; // setting remainlen
+				p->txlen[3] = p->reject;
 				p->txlen[4] = 0x00; // property len
+			} else if (p->reject != 0) {
+				p->txlen[3] = 0x03; // server unavailable
 			}
+			nano_metric_add(NANO_METRIC_PACKETS_IN + (CMD_CONNECT >> 4), 1);
+			nano_metric_add(NANO_METRIC_BYTES_IN, p->wantrxhead);
+			nano_metric_add(NANO_METRIC_PACKETS_OUT + (CMD_CONNACK >> 4), 1);
+			nano_metric_add(NANO_METRIC_BYTES_OUT, p->wanttxhead);
+			nano_metric_add(p->reject != 0 ? NANO_METRIC_REFUSED_BUSY
+			                               : NANO_METRIC_CONNECTS,
+			    1);
 			iov.iov_len = p->wanttxhead - p->gottxhead;
 			iov.iov_buf = &p->txlen[p->gottxhead];
 			debug_msg("[%ld] body [%x %x %x %x %x]", iov.iov_len,
@@ -306,6 +494,9 @@ tcptran_pipe_nego_cb(void *arg)
 			return;
 		} else {
 			debug_msg("%d", rv);
+			nano_metric_add(NANO_METRIC_REFUSED_BAD, 1);
+			destroy_conn_param(p->tcp_cparam);
+			p->tcp_cparam = NULL;
 			rv = NNG_EPROTO;
 			goto error;
 		}
@@ -314,9 +505,23 @@ tcptran_pipe_nego_cb(void *arg)
 	//TODO:  define what version of MQTT
 	//NNI_GET16(&p->rxlen[4], p->peer);
 
+	if (p->reject != 0) {
+		// The refusing CONNACK is out, nothing more to say.
+		debug_msg("refused CONNECT, reason %x", p->reject);
+		nni_list_remove(&ep->negopipes, p);
+		ep->nnego--;
+		nng_stream_close(p->conn);
+		nni_mtx_unlock(&ep->mtx);
+		destroy_conn_param(p->tcp_cparam);
+		p->tcp_cparam = NULL;
+		tcptran_pipe_reap(p);
+		return;
+	}
+
 	// We are all ready now.  We put this in the wait list, and
 	// then try to run the matcher.
 	nni_list_remove(&ep->negopipes, p);
+	ep->nnego--;
 	nni_list_append(&ep->waitpipes, p);
 
 	tcptran_ep_match(ep);
@@ -326,8 +531,13 @@ tcptran_pipe_nego_cb(void *arg)
 
 error:
 	nng_stream_close(p->conn);
+	if (nni_list_node_active(&p->node)) {
+		nni_list_remove(&ep->negopipes, p);
+		ep->nnego--;
+	}
 
-	if ((uaio = ep->useraio) != NULL) {
+	// Refused connections are none of the socket's business.
+	if (((uaio = ep->useraio) != NULL) && (p->reject == 0)) {
 		ep->useraio = NULL;
 		nni_aio_finish_error(uaio, rv);
 	}
@@ -337,6 +547,18 @@ error:
 	return;
 }
 
+#ifdef NNG_HAVE_USDT
+// Packet type of an encoded message, for the probes.
+static uint8_t
+tcptran_msg_type(nni_msg *msg)
+{
+	if (nni_msg_header_len(msg) == 0) {
+		return (0);
+	}
+	return (*(uint8_t *) nni_msg_header(msg) & 0xf0);
+}
+#endif
+
 static void
 tcptran_pipe_send_cb(void *arg)
 {
@@ -346,6 +568,7 @@ tcptran_pipe_send_cb(void *arg)
 	size_t        n;
 	nni_msg *     msg;
 	nni_aio *     txaio = p->txaio;
+	uint64_t      ts;
 
 	nni_mtx_lock(&p->mtx);
 	aio = nni_list_first(&p->sendq);
@@ -361,6 +584,8 @@ tcptran_pipe_send_cb(void *arg)
 
 	if ((rv = nni_aio_result(txaio)) != 0) {
 		//nni_pipe_bump_error(p->npipe, rv);
+		NANO_PROBE4(send_done, nni_pipe_id(p->npipe),
+		    tcptran_msg_type(nni_aio_get_msg(aio)), 0, rv);
 		// Intentionally we do not queue up another transfer.
 		// There's an excellent chance that the pipe is no longer
 		// usable, with a partial transfer.
@@ -374,7 +599,7 @@ tcptran_pipe_send_cb(void *arg)
 
 	n = nni_aio_count(txaio);
 	nni_aio_iov_advance(txaio, n);
-	debug_msg("tcp socket sent %d bytes iov %d", n, nni_aio_iov_count(txaio));
+	debug_msg("tcp socket sent %zu bytes iov %zu", n, nni_aio_iov_count(txaio));
 
 	if (nni_aio_iov_count(txaio) > 0) {
 		nng_stream_send(p->conn, txaio);
@@ -388,6 +613,13 @@ tcptran_pipe_send_cb(void *arg)
 	//nni_pipe_bump_tx(p->npipe, n);
 	nni_mtx_unlock(&p->mtx);
 
+	NANO_PROBE4(send_done, nni_pipe_id(p->npipe), tcptran_msg_type(msg),
+	    nni_msg_header_len(msg) + n + nni_msg_tail_len(msg), 0);
+	if ((ts = nni_msg_timestamp(msg)) != 0) {
+		nano_metric_observe(
+		    NANO_HIST_LAT_DELIVER, nano_metric_clock() - ts);
+	}
+
 	nni_aio_set_msg(aio, NULL);
 	nni_msg_free(msg);
 	nni_aio_finish_sync(aio, 0, n);
@@ -422,25 +654,33 @@ tcptran_pipe_recv_cb(void *arg)
 
 	if ((rv = nni_aio_result(rxaio)) != 0) {
 		debug_msg("nni aio error!! %d\n", rv);
+		if (p->kaexpired) {
+			// Let the broker drop the session as for DISCONNECT.
+			p->kaexpired = false;
+			goto close;
+		}
 		goto recv_error;
 	}
 
 	n = nni_aio_count(rxaio);
 	p->gotrxhead += n;
+	p->karecv = nni_clock();
 
 	nni_aio_iov_advance(rxaio, n);
 	//not receive enough bytes, deal with remaining length
 	len = get_var_integer(p->rxlen, &pos);
-	debug_msg("new %d recevied %d header %x %d pos: %d len : %d",
+	debug_msg("new %zu recevied %zu header %x %d pos: %d len : %d",
 		  n, p->gotrxhead,p->rxlen[0], p->rxlen[1], pos, len);
-	debug_msg("still need byte count:%d > 0\n", nni_aio_iov_count(rxaio));
+	debug_msg("still need byte count:%zu > 0\n", nni_aio_iov_count(rxaio));
 
 	if (nni_aio_iov_count(rxaio) > 0) {
-		debug_msg("got: %x %x, %d!!\n", p->rxlen[0],p->rxlen[1], strlen(p->rxlen));
+		debug_msg("got: %x %x!!\n", p->rxlen[0], p->rxlen[1]);
 		nng_stream_recv(p->conn, rxaio);
 		nni_mtx_unlock(&p->mtx);
 		return;
-	} else if (p->rxlen[p->gotrxhead - 1] > 0x7f && p->gotrxhead <= EMQ_MAX_FIXED_HEADER_LEN) {
+	} else if ((p->rxmsg == NULL) &&
+	    (p->gotrxhead <= EMQ_MAX_FIXED_HEADER_LEN) &&
+	    (p->rxlen[p->gotrxhead - 1] > 0x7f)) {
 		//length error
 		if (p->gotrxhead == EMQ_MAX_FIXED_HEADER_LEN) {
 			rv = NNG_EMSGSIZE;
@@ -487,7 +727,7 @@ tcptran_pipe_recv_cb(void *arg)
 		// We should have gotten a message header. len -> remaining length to define how many bytes left
 		//NNI_GET64(p->rxlen, len);	
 		//p->remain_len = len;
-		debug_msg("header got: %x %x %x %x %x, %d!!\n",
+		debug_msg("header got: %x %x %x %x %x, %zu!!\n",
 			  p->rxlen[0],p->rxlen[1], p->rxlen[2], p->rxlen[3], p->rxlen[4], p->wantrxhead);
 		// Make sure the message payload is not too big.  If it is
 		// the caller will shut down the pipe.
@@ -497,8 +737,10 @@ tcptran_pipe_recv_cb(void *arg)
 			goto recv_error;
 		}
 
-		if ((rv = nni_msg_alloc(&p->rxmsg, (size_t) len)) != 0) {
-			debug_msg("mem error %d\n", (size_t)len);
+		if ((rv = nni_msg_alloc(&p->rxmsg,
+		         len > NNG_TCP_RECV_CHUNK ? NNG_TCP_RECV_CHUNK
+		                                  : (size_t) len)) != 0) {
+			debug_msg("mem error %zu\n", (size_t)len);
 			goto recv_error;
 		}
 
@@ -506,7 +748,7 @@ tcptran_pipe_recv_cb(void *arg)
 		//  we want to read the entire message now.
 		if (len != 0) {
 			iov.iov_buf = nni_msg_body(p->rxmsg);
-			iov.iov_len = len;
+			iov.iov_len = nni_msg_len(p->rxmsg);
 
 			nni_aio_set_iov(rxaio, 1, &iov);
 			debug_msg("second recv action+++++++++++");
@@ -514,6 +756,20 @@ tcptran_pipe_recv_cb(void *arg)
 			nni_mtx_unlock(&p->mtx);
 			return;
 		}
+	} else if (nni_msg_len(p->rxmsg) < len) {
+		// Next piece of a large packet, as much again as we have.
+		size_t got  = nni_msg_len(p->rxmsg);
+		size_t more = got < len - got ? got : len - got;
+
+		if ((rv = nni_msg_realloc(p->rxmsg, got + more)) != 0) {
+			goto recv_error;
+		}
+		iov.iov_buf = (uint8_t *) nni_msg_body(p->rxmsg) + got;
+		iov.iov_len = more;
+		nni_aio_set_iov(rxaio, 1, &iov);
+		nng_stream_recv(p->conn, rxaio);
+		nni_mtx_unlock(&p->mtx);
+		return;
 	}
 
 	//TODO reply ACK?
@@ -525,13 +781,17 @@ tcptran_pipe_recv_cb(void *arg)
 	n        = nni_msg_len(msg);
 	type	 = p->rxlen[0]&0xf0;
 
+	if (type == CMD_PUBLISH && nano_metric_sample()) {
+		nni_msg_set_timestamp(msg, nano_metric_clock());
+	}
+	NANO_PROBE3(recv, nni_pipe_id(p->npipe), type, p->gotrxhead);
 	fixed_header_adaptor(p->rxlen, msg);
 //	cparam = (conn_param *)nng_alloc(sizeof(struct conn_param));
 //	copy_conn_param(cparam, &p->tcp_cparam);
 	nni_msg_set_conn_param(msg, cparam);
 	nni_msg_set_remaining_len(msg, len);
 	nni_msg_set_cmd_type(msg, type);
-	debug_msg("remain_len %d cparam %p clientid %s username %s proto %d\n", len, cparam, &cparam->clientid.body, &cparam->username.body, cparam->pro_ver);
+	debug_msg("remain_len %d cparam %p clientid %s username %s proto %d\n", len, cparam, cparam->clientid.body, cparam->username.body, cparam->pro_ver);
 	//header_ptr = nni_msg_header(msg);
 	variable_ptr = nni_msg_variable_ptr(msg);
 	int len_of_varint = 0;
@@ -594,13 +854,15 @@ quit:
 	nni_aio_finish_error(aio, 0);
 	return;
 close:
-	nni_aio_list_remove(aio);
-		if ((rv = nni_msg_alloc(&p->rxmsg, 2)) != 0) {
-			debug_msg("mem error %d\n", 2);
-			goto recv_error;
-		}
-	msg      = p->rxmsg;
+	// Drop any partial packet, the stream is gone.  The next read fails
+	// and closes the pipe once the DISCONNECT has been delivered.
+	nni_msg_free(p->rxmsg);
 	p->rxmsg = NULL;
+	if ((rv = nni_msg_alloc(&msg, 0)) != 0) {
+		debug_msg("mem error\n");
+		goto recv_error;
+	}
+	nni_aio_list_remove(aio);
 	n        = nni_msg_len(msg);
 	uint8_t  hh[2];
 	type = CMD_DISCONNECT;
@@ -687,7 +949,16 @@ tcptran_pipe_send_start(tcptran_pipe *p)
 		iov[niov].iov_len = nni_msg_len(msg);
 		niov++;
 	}
+	// A shared payload goes out straight from the message it lives in.
+	if (nni_msg_tail_len(msg) > 0) {
+		iov[niov].iov_buf = nni_msg_tail(msg);
+		iov[niov].iov_len = nni_msg_tail_len(msg);
+		niov++;
+	}
 	nni_aio_set_iov(txaio, niov, iov);
+	NANO_PROBE3(send_start, nni_pipe_id(p->npipe), tcptran_msg_type(msg),
+	    nni_msg_header_len(msg) + nni_msg_len(msg) +
+	        nni_msg_tail_len(msg));
 	nng_stream_send(p->conn, txaio);
 }
 
@@ -852,11 +1123,13 @@ tcptran_pipe_start(tcptran_pipe *p, nng_stream *conn, tcptran_ep *ep)
 
 	nni_aio_set_iov(p->negoaio, 1, &iov);			//maybe not necessary? delete?
 	nni_list_append(&ep->negopipes, p);
+	ep->nnego++;
 
 	//reply to client immediately if needed otherwise just trigger next IO
 	//nng_stream_send(p->conn, p->negoaio);
 
-	nni_aio_set_timeout(p->negoaio, 15000); // 15 sec timeout to negotiate abide with emqx
+	nni_aio_set_timeout(p->negoaio,
+	    p->reject != 0 ? NANO_REJECT_TIMEOUT : NANO_NEGO_TIMEOUT);
 	nni_aio_finish(p->negoaio, 0, 0);
 }
 
@@ -874,10 +1147,12 @@ tcptran_ep_fini(void *arg)
 	nni_mtx_unlock(&ep->mtx);
 	nni_aio_stop(ep->timeaio);
 	nni_aio_stop(ep->connaio);
+	nni_aio_stop(ep->kaaio);
 	//nng_stream_dialer_free(ep->dialer);
 	nng_stream_listener_free(ep->listener);
 	nni_aio_free(ep->timeaio);
 	nni_aio_free(ep->connaio);
+	nni_aio_free(ep->kaaio);
 
 	nni_mtx_fini(&ep->mtx);
 	NNI_FREE_STRUCT(ep);
@@ -891,9 +1166,10 @@ tcptran_ep_close(void *arg)
 
 	nni_mtx_lock(&ep->mtx);
 
-	debug_syslog("tcptran_ep_close");
+	debug_msg("tcptran_ep_close");
 	ep->closed = true;
 	nni_aio_close(ep->timeaio);
+	nni_aio_close(ep->kaaio);
 	/*
 	if (ep->dialer != NULL) {
 		nng_stream_dialer_close(ep->dialer);
@@ -987,6 +1263,40 @@ tcptran_timer_cb(void *arg)
 	}
 }
 
+// Decide what becomes of a fresh connection, called with ep->mtx held.
+// Returns 0 to admit it, the reason code to refuse its CONNECT with, or
+// UNSPECIFIED_ERROR when it should be dropped right away.
+static uint8_t
+tcptran_ep_admit(tcptran_ep *ep)
+{
+	nni_time now;
+	uint64_t cap;
+
+	if (ep->negomax > 0) {
+		if (ep->nnego >= 2 * ep->negomax) {
+			return (UNSPECIFIED_ERROR);
+		}
+		if (ep->nnego >= ep->negomax) {
+			return (SERVER_BUSY);
+		}
+	}
+	if (ep->connrate > 0) {
+		// Token bucket holding up to one second worth of connections.
+		now = nni_clock();
+		cap = (uint64_t) ep->connrate * 1000;
+		ep->ratecredit += (now - ep->ratetime) * ep->connrate;
+		ep->ratetime = now;
+		if (ep->ratecredit > cap) {
+			ep->ratecredit = cap;
+		}
+		if (ep->ratecredit < 1000) {
+			return (CONNECTION_RATE_EXCEEDED);
+		}
+		ep->ratecredit -= 1000;
+	}
+	return (0);
+}
+
 // TCP accpet trigger
 static void
 tcptran_accept_cb(void *arg)
@@ -1015,6 +1325,14 @@ tcptran_accept_cb(void *arg)
 		rv = NNG_ECLOSED;
 		goto error;
 	}
+	if ((p->reject = tcptran_ep_admit(ep)) == UNSPECIFIED_ERROR) {
+		debug_msg("negotiation queue overflow, dropping connection");
+		tcptran_pipe_fini(p);
+		nng_stream_free(conn);
+		nng_stream_listener_accept(ep->listener, ep->connaio);
+		nni_mtx_unlock(&ep->mtx);
+		return;
+	}
 	tcptran_pipe_start(p, conn, ep);
 	nng_stream_listener_accept(ep->listener, ep->connaio);
 	nni_mtx_unlock(&ep->mtx);
@@ -1090,6 +1408,7 @@ static int
 tcptran_ep_init(tcptran_ep **epp, nng_url *url, nni_sock *sock)
 {
 	tcptran_ep *ep;
+	int         i, rv;
 
 	if ((ep = NNI_ALLOC_STRUCT(ep)) == NULL) {
 		return (NNG_ENOMEM);
@@ -1098,6 +1417,14 @@ tcptran_ep_init(tcptran_ep **epp, nng_url *url, nni_sock *sock)
 	NNI_LIST_INIT(&ep->busypipes, tcptran_pipe, node);
 	NNI_LIST_INIT(&ep->waitpipes, tcptran_pipe, node);
 	NNI_LIST_INIT(&ep->negopipes, tcptran_pipe, node);
+	for (i = 0; i < NANO_KA_WHEEL_SLOTS; i++) {
+		NNI_LIST_INIT(&ep->kawheel[i], tcptran_pipe, kanode);
+	}
+	if ((rv = nni_aio_alloc(&ep->kaaio, tcptran_ka_cb, ep)) != 0) {
+		nni_mtx_fini(&ep->mtx);
+		NNI_FREE_STRUCT(ep);
+		return (rv);
+	}
 
 	//ep->proto = nni_sock_proto_id(sock);
 	ep->url   = url;
@@ -1157,6 +1484,118 @@ tcptran_listener_init(void **lp, nng_url *url, nni_listener *nlistener)
 	return (0);
 }
 
+// Alternate MQTT transports (ws, ipc) share the TCP transport's pipes and
+// packet framing, only the stream listener underneath differs.  The stream
+// drivers only know their own scheme, so they get a copy of the URL.
+static int
+tcptran_url_rescheme(nng_url **dst, const nng_url *url, const char *scheme)
+{
+	nng_url *su;
+	int      rv;
+
+	if ((rv = nng_url_clone(&su, url)) != 0) {
+		return (rv);
+	}
+	nni_strfree(su->u_scheme);
+	if ((su->u_scheme = nni_strdup(scheme)) == NULL) {
+		nng_url_free(su);
+		return (NNG_ENOMEM);
+	}
+	*dst = su;
+	return (0);
+}
+
+#ifdef NNG_TRANSPORT_WS
+// MQTT over WebSocket.  The ws listener runs in stream mode, so MQTT packets
+// split across frames, or several packets packed into one frame, come out
+// of nng_stream_recv exactly like bytes from a TCP socket, and are copied
+// straight from the frame buffer into our iov with no extra staging.
+#define NANO_WS_SUBPROTOCOL "mqtt, mqttv3.1"
+
+static int
+tcptran_ws_listener_init(void **lp, nng_url *url, nni_listener *nlistener)
+{
+	tcptran_ep *ep;
+	nng_url *   wsurl;
+	int         rv;
+	nni_sock *  sock = nni_listener_sock(nlistener);
+
+	if ((url->u_fragment != NULL) || (url->u_userinfo != NULL) ||
+	    (url->u_query != NULL)) {
+		return (NNG_EADDRINVAL);
+	}
+
+	if ((rv = tcptran_url_rescheme(&wsurl, url, "ws")) != 0) {
+		return (rv);
+	}
+
+	if ((rv = tcptran_ep_init(&ep, url, sock)) != 0) {
+		nng_url_free(wsurl);
+		return (rv);
+	}
+
+	if (((rv = nni_aio_alloc(&ep->connaio, tcptran_accept_cb, ep)) != 0) ||
+	    ((rv = nni_aio_alloc(&ep->timeaio, tcptran_timer_cb, ep)) != 0) ||
+	    ((rv = nng_stream_listener_alloc_url(&ep->listener, wsurl)) != 0) ||
+	    ((rv = nng_stream_listener_set_bool(
+	          ep->listener, NNI_OPT_WS_MSGMODE, false)) != 0) ||
+	    ((rv = nng_stream_listener_set_string(ep->listener,
+	          NNG_OPT_WS_PROTOCOL, NANO_WS_SUBPROTOCOL)) != 0)) {
+		nng_url_free(wsurl);
+		tcptran_ep_fini(ep);
+		return (rv);
+	}
+	nng_url_free(wsurl);
+
+#ifdef NNG_ENABLE_STATS
+        nni_listener_add_stat(nlistener, &ep->st_rcv_max);
+#endif
+	*lp = ep;
+	return (0);
+}
+#endif
+
+// MQTT over a Unix domain socket (named pipe on Windows), for publishers
+// co-located with the broker.  Same framing as TCP, minus the loopback
+// TCP stack.  The URL carries a path like ipc://, mqtt+ipc:///tmp/mqtt.
+static int
+tcptran_ipc_listener_init(void **lp, nng_url *url, nni_listener *nlistener)
+{
+	tcptran_ep *ep;
+	nng_url *   ipcurl;
+	int         rv;
+	nni_sock *  sock = nni_listener_sock(nlistener);
+
+	if ((url->u_path == NULL) || (strlen(url->u_path) == 0)) {
+		return (NNG_EADDRINVAL);
+	}
+
+	if ((rv = tcptran_url_rescheme(&ipcurl, url, "ipc")) != 0) {
+		return (rv);
+	}
+
+	if ((rv = tcptran_ep_init(&ep, url, sock)) != 0) {
+		nng_url_free(ipcurl);
+		return (rv);
+	}
+
+	if (((rv = nni_aio_alloc(&ep->connaio, tcptran_accept_cb, ep)) != 0) ||
+	    ((rv = nni_aio_alloc(&ep->timeaio, tcptran_timer_cb, ep)) != 0) ||
+	    ((rv = nng_stream_listener_alloc_url(&ep->listener, ipcurl)) !=
+	        0)) {
+		nng_url_free(ipcurl);
+		tcptran_ep_fini(ep);
+		return (rv);
+	}
+	nng_url_free(ipcurl);
+
+#ifdef NNG_ENABLE_STATS
+        nni_listener_add_stat(nlistener, &ep->st_rcv_max);
+#endif
+	*lp = ep;
+	return (0);
+}
+
 static void
 tcptran_ep_cancel(nni_aio *aio, void *arg, int rv)
 {
@@ -1263,6 +1702,62 @@ tcptran_ep_set_recvmaxsz(void *arg, const void *v, size_t sz, nni_opt_type t)
 	return (rv);
 }
 
+static int
+tcptran_ep_get_connrate(void *arg, void *v, size_t *szp, nni_opt_type t)
+{
+	tcptran_ep *ep = arg;
+	int         rv;
+
+	nni_mtx_lock(&ep->mtx);
+	rv = nni_copyout_int(ep->connrate, v, szp, t);
+	nni_mtx_unlock(&ep->mtx);
+	return (rv);
+}
+
+static int
+tcptran_ep_set_connrate(void *arg, const void *v, size_t sz, nni_opt_type t)
+{
+	tcptran_ep *ep = arg;
+	int         val;
+	int         rv;
+
+	if ((rv = nni_copyin_int(&val, v, sz, 0, NNI_MAXINT, t)) == 0) {
+		nni_mtx_lock(&ep->mtx);
+		ep->connrate   = val;
+		ep->ratecredit = (uint64_t) val * 1000;
+		ep->ratetime   = nni_clock();
+		nni_mtx_unlock(&ep->mtx);
+	}
+	return (rv);
+}
+
+static int
+tcptran_ep_get_negomax(void *arg, void *v, size_t *szp, nni_opt_type t)
+{
+	tcptran_ep *ep = arg;
+	int         rv;
+
+	nni_mtx_lock(&ep->mtx);
+	rv = nni_copyout_int(ep->negomax, v, szp, t);
+	nni_mtx_unlock(&ep->mtx);
+	return (rv);
+}
+
+static int
+tcptran_ep_set_negomax(void *arg, const void *v, size_t sz, nni_opt_type t)
+{
+	tcptran_ep *ep = arg;
+	int         val;
+	int         rv;
+
+	if ((rv = nni_copyin_int(&val, v, sz, 0, NNI_MAXINT, t)) == 0) {
+		nni_mtx_lock(&ep->mtx);
+		ep->negomax = val;
+		nni_mtx_unlock(&ep->mtx);
+	}
+	return (rv);
+}
+
 static int
 tcptran_ep_bind(void *arg)
 {
@@ -1312,14 +1807,15 @@ tcptran_ep_accept(void *arg, nni_aio *aio)
 }
 
 static nni_tran_pipe_ops tcptran_pipe_ops = {
-	.p_init   = tcptran_pipe_init,
-	.p_fini   = tcptran_pipe_fini,
-	.p_stop   = tcptran_pipe_stop,
-	.p_send   = tcptran_pipe_send,
-	.p_recv   = tcptran_pipe_recv,
-	.p_close  = tcptran_pipe_close,
-	//.p_peer   = tcptran_pipe_peer,
-	.p_getopt = tcptran_pipe_getopt,
+	.p_init     = tcptran_pipe_init,
+	.p_fini     = tcptran_pipe_fini,
+	.p_stop     = tcptran_pipe_stop,
+	.p_send     = tcptran_pipe_send,
+	.p_recv     = tcptran_pipe_recv,
+	.p_close    = tcptran_pipe_close,
+	//.p_peer     = tcptran_pipe_peer,
+	.p_getopt   = tcptran_pipe_getopt,
+	.p_msg_tail = true,
 };
 
 static const nni_option tcptran_ep_opts[] = {
@@ -1332,6 +1828,16 @@ static const nni_option tcptran_ep_opts[] = {
 	    .o_name = NNG_OPT_URL,
 	    .o_get  = tcptran_ep_get_url,
 	},
+	{
+	    .o_name = NANO_OPT_CONN_RATE,
+	    .o_get  = tcptran_ep_get_connrate,
+	    .o_set  = tcptran_ep_set_connrate,
+	},
+	{
+	    .o_name = NANO_OPT_NEGO_MAX,
+	    .o_get  = tcptran_ep_get_negomax,
+	    .o_set  = tcptran_ep_set_negomax,
+	},
 	// terminate list
 	{
 	    .o_name = NULL,
@@ -1404,11 +1910,25 @@ tcptran_check_recvmaxsz(const void *v, size_t sz, nni_type t)
 	return (nni_copyin_size(NULL, v, sz, 0, NNI_MAXSZ, t));
 }
 
+static int
+tcptran_check_nonneg_int(const void *v, size_t sz, nni_type t)
+{
+	return (nni_copyin_int(NULL, v, sz, 0, NNI_MAXINT, t));
+}
+
 static nni_chkoption tcptran_checkopts[] = {
 	{
 	    .o_name  = NNG_OPT_RECVMAXSZ,
 	    .o_check = tcptran_check_recvmaxsz,
 	},
+	{
+	    .o_name  = NANO_OPT_CONN_RATE,
+	    .o_check = tcptran_check_nonneg_int,
+	},
+	{
+	    .o_name  = NANO_OPT_NEGO_MAX,
+	    .o_check = tcptran_check_nonneg_int,
+	},
 	{
 	    .o_name = NULL,
 	},
@@ -1425,6 +1945,30 @@ tcptran_checkopt(const char *name, const void *buf, size_t sz, nni_type t)
 	return (rv);
 }
 
+static int
+tcptran_ipc_checkopt(const char *name, const void *buf, size_t sz, nni_type t)
+{
+	int rv;
+	rv = nni_chkopt(tcptran_checkopts, name, buf, sz, t);
+	if (rv == NNG_ENOTSUP) {
+		rv = nni_stream_checkopt("ipc", name, buf, sz, t);
+	}
+	return (rv);
+}
+
+#ifdef NNG_TRANSPORT_WS
+static int
+tcptran_ws_checkopt(const char *name, const void *buf, size_t sz, nni_type t)
+{
+	int rv;
+	rv = nni_chkopt(tcptran_checkopts, name, buf, sz, t);
+	if (rv == NNG_ENOTSUP) {
+		rv = nni_stream_checkopt("ws", name, buf, sz, t);
+	}
+	return (rv);
+}
+#endif
+
 static nni_tran_dialer_ops tcptran_dialer_ops = {
 /*	.d_init    = tcptran_dialer_init,
 	.d_fini    = tcptran_ep_fini,
@@ -1444,6 +1988,28 @@ static nni_tran_listener_ops tcptran_listener_ops = {
 	.l_setopt = tcptran_listener_setopt,
 };
 
+static nni_tran_listener_ops tcptran_ipc_listener_ops = {
+	.l_init   = tcptran_ipc_listener_init,
+	.l_fini   = tcptran_ep_fini,
+	.l_bind   = tcptran_ep_bind,
+	.l_accept = tcptran_ep_accept,
+	.l_close  = tcptran_ep_close,
+	.l_getopt = tcptran_listener_getopt,
+	.l_setopt = tcptran_listener_setopt,
+};
+
+#ifdef NNG_TRANSPORT_WS
+static nni_tran_listener_ops tcptran_ws_listener_ops = {
+	.l_init   = tcptran_ws_listener_init,
+	.l_fini   = tcptran_ep_fini,
+	.l_bind   = tcptran_ep_bind,
+	.l_accept = tcptran_ep_accept,
+	.l_close  = tcptran_ep_close,
+	.l_getopt = tcptran_listener_getopt,
+	.l_setopt = tcptran_listener_setopt,
+};
+#endif
+
 static nni_tran tcp_tran = {
 	.tran_version  = NNI_TRANSPORT_VERSION,
 	.tran_scheme   = "tcp",
@@ -1493,14 +2059,47 @@ static nni_tran tcp6_tran = {
 	.tran_checkopt = tcptran_checkopt,
 };
 
+// mqtt+ipc:// -- local publishers on the broker host.
+static nni_tran mqtt_ipc_tran = {
+	.tran_version  = NNI_TRANSPORT_VERSION,
+	.tran_scheme   = "mqtt+ipc",
+	.tran_dialer   = &tcptran_dialer_ops,
+	.tran_listener = &tcptran_ipc_listener_ops,
+	.tran_pipe     = &tcptran_pipe_ops,
+	.tran_init     = tcptran_init,
+	.tran_fini     = tcptran_fini,
+	.tran_checkopt = tcptran_ipc_checkopt,
+};
+
+#ifdef NNG_TRANSPORT_WS
+// mqtt+ws:// -- browser dashboards and gateways speaking MQTT over
+// WebSocket (Sec-WebSocket-Protocol: mqtt), served by the same pipes.
+static nni_tran mqtt_ws_tran = {
+	.tran_version  = NNI_TRANSPORT_VERSION,
+	.tran_scheme   = "mqtt+ws",
+	.tran_dialer   = &tcptran_dialer_ops,
+	.tran_listener = &tcptran_ws_listener_ops,
+	.tran_pipe     = &tcptran_pipe_ops,
+	.tran_init     = tcptran_init,
+	.tran_fini     = tcptran_fini,
+	.tran_checkopt = tcptran_ws_checkopt,
+};
+#endif
+
 int
 nng_tcp_register(void)
 {
 	int rv;
 	if (((rv = nni_tran_register(&tcp_tran)) != 0) ||
 	    ((rv = nni_tran_register(&tcp4_tran)) != 0) ||
-	    ((rv = nni_tran_register(&tcp6_tran)) != 0)) {
+	    ((rv = nni_tran_register(&tcp6_tran)) != 0) ||
+	    ((rv = nni_tran_register(&mqtt_ipc_tran)) != 0)) {
+		return (rv);
+	}
+#ifdef NNG_TRANSPORT_WS
+	if ((rv = nni_tran_register(&mqtt_ws_tran)) != 0) {
 		return (rv);
 	}
+#endif
 	return (0);
 }